@@ -0,0 +1,304 @@
+#include "dwplugin.h"
+#include "strutils.h"
+#include <cstdio>
+#include <ctime>
+#include <fstream>
+
+
+// takes the tables of a batch one after the other with a connection of the pool
+class DwBatchWorker : public DwThread {
+public:
+	DwBatchWorker(DwBatch* batch, DbConnect* conn) : batch(batch), conn(conn) {
+		this->Start();
+	}
+	~DwBatchWorker() {
+		this->Join();
+	}
+	void Run() {
+		this->batch->Work(this->conn);
+	}
+private:
+	DwBatch* batch;
+	DbConnect* conn;
+};
+
+
+// words separated by spaces, a quoted part stays in one word with its quotes like in a plugin call
+vector<string> SplitJobLine(string line) {
+	vector<string> words;
+	string word;
+	bool isQuoted = false;
+	line = replaceAll(line, "`", "\"");
+	for(size_t i = 0; i < line.size(); i++) {
+		char c = line[i];
+		if( c == '"' )
+			isQuoted = !isQuoted;
+		if( !isQuoted && (c == ' ' || c == '\t') ) {
+			if( word != "" )
+				words.push_back(word);
+			word = "";
+		} else {
+			word += c;
+		}
+	}
+	if( word != "" )
+		words.push_back(word);
+	return words;
+}
+
+
+DwBatch::DwBatch(DwUseOptions* options) {
+	this->options = options;
+	this->started = 0;
+	this->connectSeconds = 0;
+	this->nextJob = 0;
+	this->running = 0;
+	this->stopping = false;
+	// dd Mon yyyy hh:mm in the header of the files, localtime is not safe to call on the workers
+	char stamp[18];
+	time_t now = time(NULL);
+	strftime(stamp, sizeof(stamp), "%d %b %Y %H:%M", localtime(&now));
+	this->timeStamp = stamp;
+}
+
+
+DwBatch::~DwBatch(void) {
+	// the workers finish the tables they are on
+	this->Stop();
+	for(size_t i = 0; i < this->workers.size(); i++)
+		delete this->workers[i];
+	for(size_t i = 0; i < this->connections.size(); i++)
+		delete this->connections[i];
+	for(size_t i = 0; i < this->jobs.size(); i++) {
+		if( this->jobs[i]->options != NULL )
+			delete this->jobs[i]->options;
+		delete this->jobs[i];
+	}
+}
+
+
+void DwBatch::ReadJobs(string fileName) {
+	ifstream in(fileName.c_str());
+	if( !in )
+		throw DwUseException( "Could not open the job file " + fileName + "." );
+	set<string> files;
+	string line;
+	int number = 0;
+	while( getline(in, line) ) {
+		number++;
+		line = replaceAll(line, "\r", "");
+		vector<string> words = SplitJobLine(line);
+		if( words.size() == 0 || words[0][0] == '*' || words[0].substr(0, 2) == "//" )
+			continue;
+		string where = fileName + " line " + toString(number) + ": ";
+		DwBatchJob* job = new DwBatchJob();
+		job->line = line;
+		job->options = NULL;
+		job->done = false;
+		job->failed = false;
+		job->rows = 0;
+		job->bytes = 0;
+		job->describeSeconds = 0;
+		job->fetchSeconds = 0;
+		job->writeSeconds = 0;
+		job->seconds = 0;
+		this->jobs.push_back(job);
+		try {
+			DwUseOptionParser parser;
+			job->options = parser.Parse(words);
+		} catch( const DwUseException& ex ) {
+			throw DwUseException( where + ex.what() );
+		}
+		// the connections are opened once for the whole batch
+		const map<string,string>& given = job->options->Options();
+		if( given.find("username") != given.end() || given.find("password") != given.end()
+			|| given.find("database") != given.end() || given.find("backend") != given.end() )
+			throw DwUseException( where + "Give the credentials to BATCH, the tables share its connections." );
+		// there is no dataset to match or label
+		if( given.find("keys") != given.end() || given.find("nulldata") != given.end() )
+			throw DwUseException( where + "keys and nulldata need the dataset in STATA, use CREATE and LOAD for them." );
+		job->options->AddDefaults(this->options);
+		try {
+			job->options->Validate();
+		} catch( const DwUseException& ex ) {
+			throw DwUseException( where + ex.what() );
+		}
+		job->table = job->options->Table();
+		if( job->table == "" )
+			throw DwUseException( where + "Could not parse the table name, write the line like the options of CREATE." );
+		job->file = job->options->Saving();
+		if( files.find(job->file) != files.end() )
+			throw DwUseException( where + "Another table is saved into " + job->file + " already." );
+		files.insert(job->file);
+	}
+	if( this->jobs.size() == 0 )
+		throw DwUseException( "There are no tables in the job file " + fileName + "." );
+}
+
+
+int DwBatch::JobCount() {
+	return this->jobs.size();
+}
+
+
+// the connections are opened here so that wrong credentials fail before any table is started
+int DwBatch::Start() {
+	this->started = DwStats::Now();
+	size_t parallel = this->options->Parallel();
+	if( parallel > this->jobs.size() )
+		parallel = this->jobs.size();
+	try {
+		for(size_t i = 0; i < parallel; i++)
+			this->connections.push_back( DbConnect::Open( this->options->Backend(),
+														  this->options->Username(),
+														  this->options->Password(),
+														  this->options->Database(),
+														  this->options->Daemon() ) );
+	} catch( const DbException& ex ) {
+		throw DwUseException( "Error connecting to the database with "
+								+ this->options->Username() + "@" + this->options->Database() + ": \n"
+								+ ex.getMessage() );
+	}
+	// the tables run at the same time, so they share the fetch budget
+	for(size_t i = 0; i < this->connections.size(); i++)
+		this->connections[i]->SetFetchBudget(this->options->FetchBytes() / this->connections.size());
+	this->connectSeconds = DwStats::Now() - this->started;
+	for(size_t i = 0; i < this->connections.size(); i++) {
+		{
+			DwLocked locked(&this->monitor);
+			this->running++;
+		}
+		try {
+			this->workers.push_back( new DwBatchWorker(this, this->connections[i]) );
+		} catch( ... ) {
+			DwLocked locked(&this->monitor);
+			this->running--;
+			this->monitor.WakeAll();
+			if( this->workers.size() == 0 )
+				throw;
+			break; // the ones started do the work
+		}
+	}
+	return this->workers.size();
+}
+
+
+// on a worker
+void DwBatch::Work(DbConnect* conn) {
+	while( true ) {
+		DwBatchJob* job;
+		{
+			DwLocked locked(&this->monitor);
+			if( this->stopping || this->nextJob == this->jobs.size() ) {
+				this->running--;
+				this->monitor.WakeAll();
+				return;
+			}
+			job = this->jobs[this->nextJob++];
+		}
+		this->RunJob(job, conn);
+		DwLocked locked(&this->monitor);
+		this->finished.push_back(job);
+		this->monitor.WakeAll();
+	}
+}
+
+
+// on a worker: errors are kept for the summary, a half written file is removed
+void DwBatch::RunJob(DwBatchJob* job, DbConnect* conn) {
+	double start = DwStats::Now();
+	DwUseQuery* query = NULL;
+	bool isWriting = false; // the file of the last run is kept if this one fails before replacing it
+	try {
+		DwUseOptions* options = job->options;
+		query = new DwUseQuery(options, NULL, conn);
+		job->options = NULL; // freed by the query
+		// the estimates can't be shown from here, but the limits still apply
+		if( options->IsExplain() )
+			query->Preflight();
+		if( options->IsEncode() )
+			query->Encode();
+		DwDtaFile file(job->file, query->Columns(), job->table, this->timeStamp, query->SortVariables());
+		isWriting = true;
+		try {
+			query->QueryData( WriteDataSet(&file, query->Stats()) );
+		} catch( const DbException& ex ) {
+			throw DwUseException( "Error querying data with \n"
+									+ query->QuerySQL()+ ": \n" + ex.getMessage() );
+		}
+		file.Close();
+		job->rows = file.Rows();
+	} catch( const DwUseException& ex ) {
+		job->failed = true;
+		job->error = ex.what();
+	} catch( const DbException& ex ) {
+		job->failed = true;
+		job->error = ex.getMessage();
+	} catch( ... ) {
+		job->failed = true;
+		job->error = "An unexcpected error occured.";
+	}
+	if( job->failed && isWriting )
+		remove(job->file.c_str());
+	if( query != NULL ) {
+		DwStats* stats = query->Stats();
+		job->bytes = stats->bytes;
+		job->describeSeconds = stats->Seconds(PHASE_DESCRIBE) + stats->Seconds(PHASE_LABELS);
+		job->fetchSeconds = stats->Seconds(PHASE_FETCH);
+		job->writeSeconds = stats->Seconds(PHASE_STORE);
+		delete query;
+	}
+	job->done = true;
+	job->seconds = DwStats::Now() - start;
+}
+
+
+DwBatchJob* DwBatch::Next() {
+	DwLocked locked(&this->monitor);
+	while( this->finished.size() == 0 && this->running > 0 )
+		this->monitor.Wait();
+	if( this->finished.size() == 0 )
+		return NULL;
+	DwBatchJob* job = this->finished.front();
+	this->finished.pop_front();
+	return job;
+}
+
+
+void DwBatch::Stop() {
+	DwLocked locked(&this->monitor);
+	this->stopping = true;
+}
+
+
+// the tables in the order of the job file, then the totals
+vector<string> DwBatch::Summary() {
+	vector<string> lines;
+	lines.push_back(Cell("table", 33) + Cell("rows", 12) + Cell("bytes", 14) + Cell("describe s", 12)
+					+ Cell("fetch s", 12) + Cell("write s", 12) + Cell("total s", 12) + "file");
+	double rows = 0, seconds = 0;
+	int failed = 0, skipped = 0;
+	for(size_t i = 0; i < this->jobs.size(); i++) {
+		DwBatchJob* job = this->jobs[i];
+		string line = Cell(job->table, 33);
+		if( !job->done ) {
+			skipped++;
+			lines.push_back(line + "skipped");
+			continue;
+		}
+		line += Cell(job->failed ? "" : toString((long)job->rows), 12) + Cell(toString((long)job->bytes), 14)
+				+ Cell(toString(job->describeSeconds), 12) + Cell(toString(job->fetchSeconds), 12)
+				+ Cell(toString(job->writeSeconds), 12) + Cell(toString(job->seconds), 12);
+		// the whole error was shown when the table finished, the message of the database is the last line
+		lines.push_back(line + (job->failed ? "failed: " + job->error.substr(job->error.rfind('\n') + 1) : job->file));
+		rows += job->rows;
+		seconds += job->seconds;
+		if( job->failed )
+			failed++;
+	}
+	lines.push_back(toString(this->jobs.size()) + " tables, " + toString(failed) + " failed, " + toString(skipped) + " skipped, "
+					+ toString((long)rows) + " rows in " + toString(DwStats::Now() - this->started) + " s on "
+					+ toString(this->connections.size()) + " connections (connecting " + toString(this->connectSeconds)
+					+ " s, the tables took " + toString(seconds) + " s together)");
+	return lines;
+}
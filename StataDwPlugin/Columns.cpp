@@ -1,5 +1,6 @@
 #include "dwplugin.h"
 #include "strutils.h" 
+#include <cstdlib>
 
 
 // class representing what we know about a column in the query
@@ -7,14 +8,19 @@ DwColumn::DwColumn(	  DbColumnMetaData metaData,
 					  int position,
 					  VariableCasing variableCasing,
 					  Translator* variableTranslator, 
-					  Translator* valueTranslator ) {
+					  Translator* valueTranslator,
+					  string tableAlias ) {
 	this->metaData = metaData;
+	this->tableAlias = tableAlias;
 	this->position = position;
 	this->variableCasing = variableCasing;
-	this->translateContents = false; // we don't translate variable content in the dataset, we use STATA labeling
+	this->translateContents = false; // by default we don't translate variable content in the dataset, we use STATA labeling
 	this->variableTranslator = variableTranslator;
 	// pass NULL if we don't want any translation
 	this->valueTranslator = valueTranslator;
+	this->encoder = NULL;
+	this->labelTable = NULL;
+	this->isConverted = false;
 	// whether the column is numeric will be checked for each row
 	string stype = this->StataDataType();
 	this->isNumeric = stype.substr(0,3) != "str"; // STATA only has string and double macro setters
@@ -29,13 +35,29 @@ DwColumn::~DwColumn(void) {
 		delete this->valueTranslator;
 		this->valueTranslator = NULL;
 	}
+	if(this->encoder) {
+		delete this->encoder;
+		this->encoder = NULL;
+	}
+	if(this->labelTable) {
+		delete this->labelTable;
+		this->labelTable = NULL;
+	}
 }
 
 // the column name in the database that can be used in SQL
 string DwColumn::ColumnName() {
+	string name = this->ResultName();
+	if( this->tableAlias != "" )
+		return this->tableAlias + "." + name;
+	return name;
+}
+
+string DwColumn::ResultName() {
+	string name = this->metaData.name;
 	if( this->metaData.isQuoted ) // in the test tables there are columns like "Szuletesi_ido" which only work with double quotes and exact casing
-		return "\"" + this->metaData.name + "\"";
-	return this->metaData.name;
+		name = "\"" + name + "\"";
+	return name;
 }
 
 // the column label appear in STATA
@@ -73,7 +95,13 @@ string DwColumn::StataDataType() {
 	// MetaData gives the underlying data type which may be translated to string
 	if( this->translateContents && this->valueTranslator != NULL ) {
 		// varchar2 or int dictionary value will be translated to string
-		return "str100"; // the size of MEGNEVEZES
+		return "str" + toString(this->TranslatedWidth());
+	}
+	// the smallest type that holds the codes, see help data_types
+	if( this->encoder != NULL ) {
+		if( this->encoder->MaxCode() <= 100 ) return "byte";
+		if( this->encoder->MaxCode() <= 32740 ) return "int";
+		return "long";
 	}
 	// no translation
 	string type   = this->metaData.type;
@@ -103,11 +131,42 @@ string DwColumn::StataDataType() {
 }
 
 
+// bytes of a value in the dataset, see help data_types
+int DwColumn::StataWidth() {
+	string type = this->StataDataType();
+	if( type == "byte" ) return 1;
+	if( type == "int" ) return 2;
+	if( type == "long" || type == "float" ) return 4;
+	if( type == "double" ) return 8;
+	return atoi(type.substr(3).c_str()); // str#
+}
+
+// the reverse of the above for creating tables from STATA
+string DwColumn::OracleDataType(string stataType) {
+	string type = lowerCase(stataType);
+	if( type == "byte" ) return "NUMBER(3)";
+	if( type == "int" ) return "NUMBER(5)";
+	if( type == "long" ) return "NUMBER(10)";
+	if( type == "float" || type == "double" ) return "NUMBER";
+	if( type == "date" ) return "DATE";
+	if( type == "datetime" ) return "TIMESTAMP(3)";
+	if( type.substr(0,3) == "str" && type != "strl" ) {
+		int size = atoi(type.substr(3).c_str());
+		if( size > 0 )
+			return "VARCHAR2(" + toString(size) + ")";
+	}
+	throw DwUseException( "Cannot save variables of type " + stataType + ", use byte, int, long, float, double, str#, date or datetime." );
+}
+
+
 // the appropriate STATA format 
 // for now these are the same values as Stata assigns by default copied after using "describe"
 string DwColumn::StataFormat() {
 	if( this->translateContents && this->valueTranslator != NULL ) {
-		return "%100s"; 
+		return "%" + toString(this->TranslatedWidth()) + "s"; 
+	}
+	if( this->encoder != NULL ) {
+		return "%8.0g";
 	}
 	// http://www.stata.com/help.cgi?format
 	string type   = this->metaData.type;
@@ -127,6 +186,8 @@ string DwColumn::StataFormat() {
 			if( precision <= 4 ) return "%8.0g";
 			if( precision <= 9 ) return "%12.0g";
 			return "%"+toString(precision)+".0g";
+		} else if( scale < 0 || precision > 38 ) {
+			return "%10.0g"; // FLOAT, binary precision
 		} else {
 			return "%"+toString(precision)+"."+toString(scale)+"f";
 		}
@@ -141,55 +202,113 @@ bool DwColumn::IsNumeric() {
 	return this->isNumeric;
 }
 
-bool DwColumn::IsNull(ResultSet* rs) {
-	return rs->isNull(this->position);
+bool DwColumn::IsDateTime() {
+	return this->isDate || this->isTime;
+}
+
+// integers that fit in a long come as int, other numbers as binary double
+// dates, strings and translated values are left to the default conversion
+DbFetchType DwColumn::FetchType() {
+	if( this->isConverted )
+		return this->isDate ? FETCH_INT : FETCH_DOUBLE;
+	// numeric codes are looked up in the array of labels without making a string of them
+	if( this->translateContents && this->labelTable->IsDense() && this->metaData.type == "NUMBER" )
+		return FETCH_DOUBLE;
+	if( !this->isNumeric || this->isDate || this->isTime || this->metaData.type != "NUMBER" )
+		return FETCH_DEFAULT;
+	// unconstrained NUMBER has no precision and could overflow an int
+	if( this->metaData.scale == 0 && this->metaData.precision > 0 && this->metaData.precision <= 9 )
+		return FETCH_INT;
+	return FETCH_DOUBLE;
+}
+
+bool DwColumn::IsNull(DbRow* row) {
+	return row->IsNull(this->position);
 }
 
 // retrieve the column value from a record as number
-double DwColumn::AsNumber(ResultSet* rs) {
-	if(this->isDate) {
-		// return a double but we have to create that
-		oracle::occi::Date date = rs->getDate(this->position);
-		// https://www.stanford.edu/group/ssds/cgi-bin/drupal/files/Guides/Working%20with%20Dates%20and%20Times%20in%20Stata.pdf
-		// according to them dates are integers: days since 1960, jan 1
-		// create the epoch by first making a copy of our date, because occi dates need environment
-		oracle::occi::Date base(date); 
-		base.setDate(1960,1,1);
-		oracle::occi::IntervalDS dt = date.daysBetween(base); 
-		return dt.getDay();
-	} else if( this->isTime ) {
-		oracle::occi::Timestamp ts = rs->getTimestamp(this->position);
-		// STATA wants milliseconds since the above data
-		oracle::occi::Timestamp base(ts);
-		base.setDate(1960,1,1);
-		base.setTime(0,0,0,0);
-		oracle::occi::IntervalDS dt = ts.subDS(base);
-		double seconds = ((double)dt.getDay()) * 24 * 60 * 60 +
-						 ((double)dt.getHour()) * 60 * 60 + 
-						 ((double)dt.getMinute()) * 60 + 
-						 ((double)dt.getSecond());
-		return seconds * 1000;
-	}
-	return rs->getDouble(this->position);
+// dates are days since 1960, jan 1 and timestamps milliseconds since then, converted by the backend
+double DwColumn::AsNumber(DbRow* row) {
+	if(this->encoder != NULL)
+		return this->encoder->Code(row->GetString(this->position));
+	if( this->isConverted )
+		return row->GetNumber(this->position);
+	if(this->isDate)
+		return row->GetDate(this->position);
+	else if( this->isTime )
+		return row->GetTimestamp(this->position);
+	return row->GetNumber(this->position);
 }
 
 // retrieve the column value from a record as a (translated) string
-string DwColumn::AsString(ResultSet* rs) {
-	string val = rs->getString(this->position);
-	if( this->translateContents && this->valueTranslator != NULL ) {
-		return this->valueTranslator->Translate(val);
+string DwColumn::AsString(DbRow* row) {
+	if( this->translateContents ) {
+		string buffer;
+		return this->AsLabel(row, buffer);
+	}
+	return row->GetString(this->position);
+}
+
+// the label of the value in a record
+// it only needs a string for keys that are strings and for values without a label
+const char* DwColumn::AsLabel(DbRow* row, string& buffer) {
+	const char* label;
+	bool isCode = this->labelTable->IsDense() && this->metaData.type == "NUMBER";
+	if( isCode ) {
+		label = this->labelTable->Find(row->GetNumber(this->position));
+	} else {
+		buffer = row->GetString(this->position);
+		label = this->labelTable->Find(buffer.c_str(), buffer.size());
 	}
-	return val;
+	if( label != NULL )
+		return label;
+	// the translator knows what to show for values without a label
+	buffer = this->valueTranslator->Translate( isCode ? row->GetString(this->position) : buffer );
+	return buffer.c_str();
+}
+
+// the values will be replaced by the labels from the label query
+void DwColumn::TranslateContents() {
+	if( this->valueTranslator == NULL )
+		return;
+	if( this->labelTable != NULL )
+		delete this->labelTable;
+	this->labelTable = new DwLabelTable(this->valueTranslator->Mapping());
+	this->translateContents = true;
+	this->isNumeric = false;
+	this->convertSql = "";
+	this->isConverted = false;
+}
+
+bool DwColumn::IsTranslated() {
+	return this->translateContents;
+}
+
+// wide enough for the labels and the values that have none, at most what STATA allows
+int DwColumn::TranslatedWidth() {
+	int width = this->metaData.type == "VARCHAR2" ? this->metaData.size : 20;
+	if( (int)this->labelTable->MaxLength() > width )
+		width = this->labelTable->MaxLength();
+	return width > 244 ? 244 : width;
 }
 
 // only show that we can label a variable if there are some translations as well
 bool DwColumn::IsLabelValues() {
+	if( this->encoder != NULL )
+		return true;
+	// the labels are in the data already
+	if( this->translateContents )
+		return false;
 	return this->valueTranslator != NULL 
 		&& this->ValueLabels().size() > 0;
 		// && this->IsNumeric(); // Stata says we cannot label strings, but leave it for now for testingd
 }
 
 const map<string,string>& DwColumn::ValueLabels() {
+	// the codes are labeled with the original strings
+	if( this->encoder != NULL ) {
+		return this->encoder->Labels();
+	}
 	if( this->valueTranslator != NULL ) {
 		return this->valueTranslator->Mapping();
 	}
@@ -197,3 +316,106 @@ const map<string,string>& DwColumn::ValueLabels() {
 	map<string,string> labels;
 	return labels;
 }
+
+
+// a column is read either as a number or as a string, see AsNumber and AsLabel
+void DwColumn::CopyValue(DbRow* row, DwSpoolBatch* batch) {
+	if( row->IsNull(this->position) ) {
+		batch->AddNull();
+	} else if( this->encoder != NULL || (this->translateContents && !(this->labelTable->IsDense() && this->metaData.type == "NUMBER")) 
+			   || (!this->isNumeric && !this->translateContents) ) {
+		batch->AddString(row->GetString(this->position));
+	} else if( this->isConverted ) {
+		batch->AddNumber(row->GetNumber(this->position));
+	} else if( this->isDate ) {
+		batch->AddNumber(row->GetDate(this->position));
+	} else if( this->isTime ) {
+		batch->AddNumber(row->GetTimestamp(this->position));
+	} else {
+		batch->AddNumber(row->GetNumber(this->position));
+	}
+}
+
+
+void DwColumn::SetEncoder(DwEncoder* encoder) {
+	if( this->encoder != NULL )
+		delete this->encoder;
+	this->encoder = encoder;
+	this->isNumeric = true;
+	// the codes are of the whole values
+	this->convertSql = "";
+}
+
+DwEncoder* DwColumn::Encoder() {
+	return this->encoder;
+}
+
+void DwColumn::SetPosition(int position) {
+	this->position = position;
+}
+
+
+DwEncoder::DwEncoder(const vector<string>& values, string variable) {
+	this->added = 0;
+	this->variable = variable;
+	// sorted so the codes follow the order of the values
+	set<string> sorted(values.begin(), values.end());
+	for(set<string>::const_iterator ii = sorted.begin(); ii != sorted.end(); ii++) {
+		if( *ii == "" ) // null
+			continue;
+		int code = this->codes.size() + 1;
+		this->codes[*ii] = code;
+		this->labels[toString(code)] = *ii;
+	}
+	// the type is in the do file already, so leave room for the values added to the table until LOAD
+	int headroom = this->codes.size() + this->codes.size() / 10 + 10;
+	this->maxCode = headroom <= 100 ? 100 : headroom <= 32740 ? 32740 : 2147483620;
+}
+
+int DwEncoder::Code(const string& value) {
+	map<string,int>::const_iterator ii = this->codes.find(value);
+	if( ii != this->codes.end() )
+		return ii->second;
+	// the table changed since CREATE, keep the value distinct even though it has no label
+	int code = this->codes.size() + 1;
+	if( code > this->maxCode )
+		throw DwUseException( "The values of " + this->variable + " have more codes since CREATE than its storage type holds (" 
+							  + toString(this->maxCode) + "), CREATE again." );
+	this->codes[value] = code;
+	this->added++;
+	return code;
+}
+
+int DwEncoder::Count() {
+	return this->codes.size();
+}
+
+const map<string,string>& DwEncoder::Labels() {
+	return this->labels;
+}
+
+int DwEncoder::MaxCode() {
+	return this->maxCode;
+}
+
+int DwEncoder::Added() {
+	return this->added;
+}
+
+// only the strings longer than STATA can hold are worth cutting
+void DwColumn::ConvertInDatabase(DbConnect* conn) {
+	this->convertSql = "";
+	this->isConverted = false;
+	if( this->translateContents || this->encoder != NULL )
+		return;
+	if( this->isDate || this->isTime ) {
+		this->convertSql = conn->DateTimeSQL(this->ColumnName(), this->isTime);
+		this->isConverted = this->convertSql != "";
+	} else if( this->metaData.type == "VARCHAR2" && this->metaData.size > 244 ) {
+		this->convertSql = conn->TruncateSQL(this->ColumnName(), 244);
+	}
+}
+
+string DwColumn::SelectSQL() {
+	return this->convertSql != "" ? this->convertSql + " " + this->ResultName() : this->ColumnName();
+}
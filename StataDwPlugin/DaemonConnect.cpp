@@ -0,0 +1,528 @@
+#include "dwuse.h"
+#include "strutils.h"
+
+#ifdef DW_WITH_DAEMON
+#include <cstdlib>
+#include <cstdio>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// a message bigger than this is taken for a broken stream
+const size_t WIRE_MAX_MESSAGE = 1 << 30;
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0 // SO_NOSIGPIPE is set on the socket instead
+#endif
+
+
+DbWire::DbWire(int type) : type(type), position(0) {
+}
+
+int DbWire::Type() {
+	return this->type;
+}
+
+void DbWire::PutByte(int value) {
+	this->data.push_back((char)value);
+}
+
+void DbWire::PutInt(int value) {
+	this->data.append((const char*)&value, sizeof(value));
+}
+
+void DbWire::PutDouble(double value) {
+	this->data.append((const char*)&value, sizeof(value));
+}
+
+void DbWire::PutString(const string& value) {
+	this->PutInt((int)value.size());
+	this->data.append(value);
+}
+
+void DbWire::PutColumns(const vector<DbColumnMetaData>& columns) {
+	this->PutInt((int)columns.size());
+	for(size_t i = 0; i < columns.size(); i++) {
+		this->PutString(columns[i].name);
+		this->PutByte(columns[i].isQuoted ? 1 : 0);
+		this->PutString(columns[i].type);
+		this->PutInt(columns[i].size);
+		this->PutInt(columns[i].precision);
+		this->PutInt(columns[i].scale);
+	}
+}
+
+void DbWire::PutParams(const vector<DbParam>& params) {
+	this->PutInt((int)params.size());
+	for(size_t i = 0; i < params.size(); i++) {
+		this->PutByte(params[i].isNumber ? 1 : 0);
+		if( params[i].isNumber )
+			this->PutDouble(params[i].number);
+		else
+			this->PutString(params[i].text);
+	}
+}
+
+void DbWire::PutPlan(const DbPlan& plan) {
+	this->PutByte(plan.isExplained ? 1 : 0);
+	this->PutDouble(plan.rows);
+	this->PutDouble(plan.bytes);
+	this->PutDouble(plan.cost);
+	this->PutInt((int)plan.fullScans.size());
+	for(size_t i = 0; i < plan.fullScans.size(); i++)
+		this->PutString(plan.fullScans[i]);
+}
+
+void DbWire::Need(size_t bytes) {
+	if( this->position + bytes > this->data.size() )
+		throw DbException( "The daemon sent a message that is cut short." );
+}
+
+int DbWire::GetByte() {
+	this->Need(1);
+	return (unsigned char)this->data[this->position++];
+}
+
+int DbWire::GetInt() {
+	int value;
+	this->Need(sizeof(value));
+	memcpy(&value, this->data.data() + this->position, sizeof(value));
+	this->position += sizeof(value);
+	return value;
+}
+
+double DbWire::GetDouble() {
+	double value;
+	this->Need(sizeof(value));
+	memcpy(&value, this->data.data() + this->position, sizeof(value));
+	this->position += sizeof(value);
+	return value;
+}
+
+const char* DbWire::GetBytes(size_t& length) {
+	int size = this->GetInt();
+	if( size < 0 )
+		throw DbException( "The daemon sent a message that is cut short." );
+	length = size;
+	this->Need(length);
+	const char* bytes = this->data.data() + this->position;
+	this->position += length;
+	return bytes;
+}
+
+string DbWire::GetString() {
+	size_t length;
+	const char* bytes = this->GetBytes(length);
+	return string(bytes, length);
+}
+
+vector<DbColumnMetaData> DbWire::GetColumns() {
+	vector<DbColumnMetaData> columns(this->GetInt());
+	for(size_t i = 0; i < columns.size(); i++) {
+		columns[i].name = this->GetString();
+		columns[i].isQuoted = this->GetByte() != 0;
+		columns[i].type = this->GetString();
+		columns[i].size = this->GetInt();
+		columns[i].precision = this->GetInt();
+		columns[i].scale = this->GetInt();
+	}
+	return columns;
+}
+
+vector<DbParam> DbWire::GetParams() {
+	vector<DbParam> params;
+	int count = this->GetInt();
+	for(int i = 0; i < count; i++) {
+		if( this->GetByte() != 0 )
+			params.push_back( DbParam(this->GetDouble()) );
+		else
+			params.push_back( DbParam(this->GetString()) );
+	}
+	return params;
+}
+
+DbPlan DbWire::GetPlan() {
+	DbPlan plan;
+	plan.isExplained = this->GetByte() != 0;
+	plan.rows = this->GetDouble();
+	plan.bytes = this->GetDouble();
+	plan.cost = this->GetDouble();
+	int count = this->GetInt();
+	for(int i = 0; i < count; i++)
+		plan.fullScans.push_back( this->GetString() );
+	return plan;
+}
+
+size_t DbWire::Size() {
+	return this->data.size();
+}
+
+void DbWire::Append(const DbWire& other) {
+	this->data.append(other.data);
+}
+
+
+// the length and the type, then the data
+void DbWire::Send(int socket) {
+	unsigned int header[2] = { (unsigned int)this->data.size(), (unsigned int)this->type };
+	string message((const char*)header, sizeof(header));
+	message.append(this->data);
+	size_t sent = 0;
+	while( sent < message.size() ) {
+		ssize_t n = send(socket, message.data() + sent, message.size() - sent, MSG_NOSIGNAL);
+		if( n < 0 && errno == EINTR )
+			continue;
+		if( n <= 0 )
+			throw DbException( string("Could not write to the daemon socket: ") + strerror(errno) );
+		sent += n;
+	}
+}
+
+// read exactly the bytes asked for, false if the stream ended before the first one
+bool WireRead(int socket, char* buffer, size_t size) {
+	size_t read = 0;
+	while( read < size ) {
+		ssize_t n = recv(socket, buffer + read, size - read, 0);
+		if( n < 0 && errno == EINTR )
+			continue;
+		if( n == 0 && read == 0 )
+			return false;
+		if( n <= 0 )
+			throw DbException( "The daemon socket was closed in the middle of a message." );
+		read += n;
+	}
+	return true;
+}
+
+bool DbWire::Receive(int socket) {
+	unsigned int header[2];
+	if( !WireRead(socket, (char*)header, sizeof(header)) )
+		return false;
+	if( header[0] > WIRE_MAX_MESSAGE )
+		throw DbException( "The daemon socket sent a message of " + toString(header[0]) + " bytes." );
+	this->type = header[1];
+	this->data.resize(header[0]);
+	this->position = 0;
+	if( header[0] > 0 && !WireRead(socket, &this->data[0], header[0]) )
+		throw DbException( "The daemon socket was closed in the middle of a message." );
+	return true;
+}
+
+void DbWire::Expect(int type) {
+	if( this->type == WIRE_ERROR ) {
+		string message = this->GetString();
+		int code = this->GetInt();
+		throw DbException( message, code );
+	}
+	if( this->type != type )
+		throw DbException( "The daemon answered with message " + toString(this->type) + " instead of " + toString(type) + "." );
+}
+
+
+// the current row of a ROWS message, the cells are found when the row is read
+class DaemonRow : public DbRow {
+public:
+	DaemonRow(int columns) : cells(columns), numbers(columns), strings(columns), lengths(columns) {}
+	void Read(DbWire& wire) {
+		for(size_t i = 0; i < this->cells.size(); i++) {
+			this->cells[i] = wire.GetByte();
+			if( this->cells[i] == CELL_NUMBER )
+				this->numbers[i] = wire.GetDouble();
+			else if( this->cells[i] == CELL_STRING )
+				this->strings[i] = wire.GetBytes(this->lengths[i]);
+		}
+	}
+	bool IsNull(int col) {
+		return this->cells[col-1] == CELL_NULL;
+	}
+	double GetNumber(int col) {
+		if( this->cells[col-1] == CELL_STRING )
+			return atof(this->GetString(col).c_str());
+		return this->numbers[col-1];
+	}
+	int GetInt(int col) {
+		return (int)this->GetNumber(col);
+	}
+	// numbers as the shortest text that reads back the same, labels and codes have to look alike
+	string GetString(int col) {
+		if( this->cells[col-1] == CELL_STRING )
+			return string(this->strings[col-1], this->lengths[col-1]);
+		if( this->cells[col-1] == CELL_NULL )
+			return "";
+		char text[32];
+		sprintf(text, "%.15g", this->numbers[col-1]);
+		return text;
+	}
+	double GetDate(int col) {
+		return this->GetNumber(col);
+	}
+	double GetTimestamp(int col) {
+		return this->GetNumber(col);
+	}
+private:
+	vector<int> cells;
+	vector<double> numbers;
+	vector<const char*> strings;
+	vector<size_t> lengths;
+};
+
+
+// the first connect tells the errors of the daemon or the database right away
+DaemonConnect::DaemonConnect(string socketPath, string backend, string user, string password, string db)
+	: socket(-1), session(0), isStateful(false), socketPath(socketPath), backend(backend), user(user), password(password), db(db) {
+	this->Connect();
+}
+
+
+DaemonConnect::~DaemonConnect(void) {
+	this->Disconnect();
+}
+
+
+int DaemonConnect::Open() {
+	struct sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if( this->socketPath.size() >= sizeof(address.sun_path) )
+		throw DbException( "The daemon socket path " + this->socketPath + " is too long." );
+	strcpy(address.sun_path, this->socketPath.c_str());
+	int s = ::socket(AF_UNIX, SOCK_STREAM, 0);
+	if( s < 0 )
+		throw DbException( string("Could not create a socket: ") + strerror(errno) );
+	if( connect(s, (struct sockaddr*)&address, sizeof(address)) != 0 ) {
+		string error = strerror(errno);
+		close(s);
+		throw DbException( "Could not connect to the daemon at " + this->socketPath + ": " + error + ". Is dwused running?" );
+	}
+#ifdef SO_NOSIGPIPE
+	int one = 1;
+	setsockopt(s, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+	return s;
+}
+
+
+void DaemonConnect::Connect() {
+	if( this->socket >= 0 )
+		return;
+	if( this->isStateful )
+		throw DbException( "The connection to the daemon was lost after the session wrote into the database, "
+						   "its uploaded keys and the rows not committed are gone. Run CREATE (or SAVE) again." );
+	this->socket = this->Open();
+	try {
+		DbWire hello(WIRE_HELLO);
+		hello.PutString(this->backend);
+		hello.PutString(this->user);
+		hello.PutString(this->password);
+		hello.PutString(this->db);
+		this->session = this->Call(hello, WIRE_OK).GetInt();
+	} catch( ... ) {
+		this->Disconnect();
+		throw;
+	}
+}
+
+
+void DaemonConnect::Disconnect() {
+	if( this->socket >= 0 )
+		close(this->socket);
+	this->socket = -1;
+}
+
+
+DbWire DaemonConnect::Call(DbWire& request, int answer) {
+	this->Connect();
+	DbWire response;
+	try {
+		request.Send(this->socket);
+		if( !response.Receive(this->socket) )
+			throw DbException( "The daemon closed the connection." );
+		this->roundTrips++;
+	} catch( ... ) {
+		// the stream is out of step, the next call starts a new session
+		this->Disconnect();
+		throw;
+	}
+	response.Expect(answer);
+	return response;
+}
+
+
+vector<DbColumnMetaData> DaemonConnect::Describe(string sql) {
+	DbWire request(WIRE_DESCRIBE);
+	request.PutString(sql);
+	return this->Call(request, WIRE_COLUMNS).GetColumns();
+}
+
+
+void DaemonConnect::Execute(string sql) {
+	DbWire request(WIRE_EXECUTE);
+	request.PutString(sql);
+	this->Connect();
+	this->isStateful = true;
+	this->Call(request, WIRE_OK);
+}
+
+
+void DaemonConnect::ExecuteArray(string sql, vector<DbArrayParam>& params, unsigned int rows) {
+	DbWire request(WIRE_EXECUTE_ARRAY);
+	request.PutString(sql);
+	request.PutInt(rows);
+	request.PutInt((int)params.size());
+	for(size_t i = 0; i < params.size(); i++) {
+		DbArrayParam& p = params[i];
+		request.PutByte(p.isNumber ? 1 : 0);
+		request.PutInt(p.width);
+		for(unsigned int r = 0; r < rows; r++) {
+			request.PutByte(p.indicators[r] == -1 ? CELL_NULL : p.isNumber ? CELL_NUMBER : CELL_STRING);
+			if( p.indicators[r] == -1 )
+				continue;
+			if( p.isNumber )
+				request.PutDouble(p.numbers[r]);
+			else
+				request.PutString(&p.strings[r * p.width]);
+		}
+	}
+	this->Connect();
+	this->isStateful = true;
+	this->Call(request, WIRE_OK);
+}
+
+
+void DaemonConnect::Commit() {
+	DbWire request(WIRE_COMMIT);
+	this->Call(request, WIRE_OK);
+}
+
+
+// the daemon knows the backend behind it
+string DaemonConnect::LimitSQL(string sql, string whereSql, int rows, string orderSql) {
+	DbWire request(WIRE_LIMIT);
+	request.PutString(sql);
+	request.PutString(whereSql);
+	request.PutInt(rows);
+	request.PutString(orderSql);
+	return this->Call(request, WIRE_TEXT).GetString();
+}
+
+
+string DaemonConnect::RowOrderSQL(string alias) {
+	DbWire request(WIRE_ROW_ORDER);
+	request.PutString(alias);
+	return this->Call(request, WIRE_TEXT).GetString();
+}
+
+
+string DaemonConnect::PercentileSQL(string column, double fraction) {
+	DbWire request(WIRE_PERCENTILE);
+	request.PutString(column);
+	request.PutDouble(fraction);
+	return this->Call(request, WIRE_TEXT).GetString();
+}
+
+
+string DaemonConnect::DateTimeSQL(string column, bool isTimestamp) {
+	DbWire request(WIRE_DATETIME);
+	request.PutString(column);
+	request.PutByte(isTimestamp);
+	return this->Call(request, WIRE_TEXT).GetString();
+}
+
+
+string DaemonConnect::DateTimeValueSQL(string value, bool isTimestamp) {
+	DbWire request(WIRE_DATETIME_VALUE);
+	request.PutString(value);
+	request.PutByte(isTimestamp);
+	return this->Call(request, WIRE_TEXT).GetString();
+}
+
+
+string DaemonConnect::TruncateSQL(string column, int bytes) {
+	DbWire request(WIRE_TRUNCATE);
+	request.PutString(column);
+	request.PutInt(bytes);
+	return this->Call(request, WIRE_TEXT).GetString();
+}
+
+
+string DaemonConnect::SortSQL(string column, bool isText, bool isNullFirst) {
+	DbWire request(WIRE_SORT);
+	request.PutString(column);
+	request.PutByte(isText);
+	request.PutByte(isNullFirst);
+	return this->Call(request, WIRE_TEXT).GetString();
+}
+
+
+// on the thread waiting for the rows the socket is busy, so the daemon is asked on another one
+// to cancel the statement of the session; the same credentials are needed for it
+void DaemonConnect::Cancel() {
+	if( this->session == 0 )
+		return;
+	int s = -1;
+	try {
+		s = this->Open();
+		DbWire request(WIRE_CANCEL);
+		request.PutString(this->backend);
+		request.PutString(this->user);
+		request.PutString(this->password);
+		request.PutString(this->db);
+		request.PutInt(this->session);
+		request.Send(s);
+		DbWire answer;
+		answer.Receive(s);
+	} catch( const DbException& ) {
+		// nothing to cancel if the daemon is gone
+	}
+	if( s >= 0 )
+		close(s);
+}
+
+
+DbPlan DaemonConnect::Explain(string sql, const vector<DbParam>& params) {
+	DbWire request(WIRE_EXPLAIN);
+	request.PutString(sql);
+	request.PutParams(params);
+	return this->Call(request, WIRE_PLAN).GetPlan();
+}
+
+
+// the rows come in messages of many rows, if the processor stops early the rest is not read,
+// so the session is closed and the daemon gives up the statement when it can't write any more
+// (after uploading keys the next call fails then, the new session would not see them)
+void DaemonConnect::Query(string sql, const vector<DbParam>& params, const vector<DbFetchType>& fetchTypes, DbRowProcessor* processor) {
+	DbWire request(WIRE_QUERY);
+	request.PutString(sql);
+	request.PutParams(params);
+	request.PutInt((int)fetchTypes.size());
+	for(size_t i = 0; i < fetchTypes.size(); i++)
+		request.PutByte(fetchTypes[i]);
+	DbWire message = this->Call(request, WIRE_COLUMNS);
+	try {
+		processor->Columns( message.GetColumns() );
+		while( true ) {
+			if( !message.Receive(this->socket) )
+				throw DbException( "The daemon closed the connection in the middle of the rows." );
+			if( message.Type() == WIRE_END )
+				break;
+			message.Expect(WIRE_ROWS);
+			this->roundTrips++;
+			int rows = message.GetInt();
+			DaemonRow row(message.GetInt());
+			for(int r = 0; r < rows; r++) {
+				row.Read(message);
+				processor->Process( &row );
+			}
+		}
+	} catch( const DbException& ex ) {
+		// an error of the database ends the rows in step, anything else leaves them half read
+		if( message.Type() != WIRE_ERROR )
+			this->Disconnect();
+		throw;
+	} catch( ... ) {
+		this->Disconnect();
+		throw;
+	}
+}
+#endif
@@ -1,92 +1,260 @@
 #include "dwuse.h"
 #include "strutils.h"
+#include <cmath>
+#include <cstdio>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/time.h>
+#endif
 
-DbConnect::DbConnect(string user, string password, string db) {
-	this->user = user;
-	this->password = password;
-	this->db = db;
-	// use the values from NLS_CHARACTERSET and NLS_NCHAR_CHARACTERSET to handle acute letters.
-	// can be that the do command will not recognize file encoding
-	this->env = Environment::createEnvironment("UTF8","UTF8",Environment::DEFAULT);
-	this->conn = NULL;
-	//try { 
-		this->conn = this->env->createConnection(user, password, db); 
-	//} 
-	//catch (SQLException& ex) { 
-	//	cout << ex.getMessage();
-	//	exit(EXIT_FAILURE); // TODO
-	//}
+
+DbConnect::DbConnect(void) {
+	this->roundTrips = 0;
+	this->fetchBudget = DEFAULT_FETCH_BUDGET;
+	this->isFetchSized = false;
 }
 
 
 DbConnect::~DbConnect(void) {
-	if( this->conn )
-		this->env->terminateConnection (this->conn);
-	Environment::terminateEnvironment (this->env); 
-}
-
-
-// http://docs.oracle.com/cd/B10500_01/appdev.920/a96583/cciaadem.htm
-string printType (int type) {
-	switch (type) {
-		case OCCI_SQLT_CHR : return "VARCHAR2"; break;
-		case OCCI_SQLT_NUM : return "NUMBER"; break;
-		case OCCIINT : return "INTEGER"; break;
-		case OCCIFLOAT : return "FLOAT"; break;
-		case OCCI_SQLT_STR : return "STRING"; break;
-		case OCCI_SQLT_VNU : return "VARNUM"; break;
-		case OCCI_SQLT_LNG : return "LONG"; break;
-		case OCCI_SQLT_VCS : return "VARCHAR"; break;
-		case OCCI_SQLT_RID : return "ROWID"; break;
-		case OCCI_SQLT_TIMESTAMP : return "TIMESTAMP"; break;
-		case OCCI_SQLT_DAT : return "DATE"; break;
-		case OCCI_SQLT_VBI : return "VARRAW"; break;
-		case OCCI_SQLT_BIN : return "RAW"; break;
-		case OCCI_SQLT_LBI : return "LONG RAW"; break;
-		case OCCIUNSIGNED_INT : return "UNSIGNED INT"; break;
-		case OCCI_SQLT_LVC : return "LONG VARCHAR"; break;
-		case OCCI_SQLT_LVB : return "LONG VARRAW"; break;
-		case OCCI_SQLT_AFC : return "CHAR"; break;
-		case OCCI_SQLT_AVC : return "CHARZ"; break;
-		case OCCI_SQLT_RDD : return "ROWID"; break;
-		case OCCI_SQLT_NTY : return "NAMED DATA TYPE"; break;
-		case OCCI_SQLT_REF : return "REF"; break;
-		case OCCI_SQLT_CLOB: return "CLOB"; break;
-		case OCCI_SQLT_BLOB: return "BLOB"; break;
-		case OCCI_SQLT_FILE: return "BFILE"; break;
-		default: 
-			throw exception( "Unknown Oracle column type " + type ); // maybe timestamp is missing from the list			
+}
+
+
+DbConnect* DbConnect::Open(string backend, string user, string password, string db, string daemon) {
+	if( daemon != "" ) {
+#ifdef DW_WITH_DAEMON
+		return new DaemonConnect(daemon, backend, user, password, db);
+#else
+		throw DbException( "The daemon client is not built into this plugin." );
+#endif
 	}
-} // End of printType (int)
-
-vector<DbColumnMetaData> DbConnect::Describe(string sql) {
-	Statement *stmt = NULL; 
-	ResultSet *rs = NULL; 
-	vector<DbColumnMetaData> cols;
-	stmt = this->conn->createStatement(sql); 
-	if (stmt) { 
-		// execute
-		rs = stmt->executeQuery(); 
-		vector<MetaData> meta = rs->getColumnListMetaData();
-		// we must do this while it is open
-		for(size_t i=0; i<meta.size(); i++) {
-			// create a record with the most relevant features from  http://docs.oracle.com/cd/B10500_01/appdev.920/a96583/cciaadem.htm
-			DbColumnMetaData md;
-			md.name	= meta[i].getString(MetaData::ATTR_NAME);
-			md.isQuoted = md.name != upperCase(md.name); // I don't know how else to look this up. quoted column name need to go into SQL with " around them
-			md.type	= printType(meta[i].getInt(MetaData::ATTR_DATA_TYPE));
-			md.size = meta[i].getInt(MetaData::ATTR_DATA_SIZE);
-			md.precision = meta[i].getInt(MetaData::ATTR_PRECISION);
-			md.scale = meta[i].getInt(MetaData::ATTR_SCALE);
-			// add it to the result vector
-			cols.push_back(md);
+	backend = lowerCase(backend);
+	if( backend == "" || backend == "oracle" ) {
+#ifndef DW_NO_OCCI
+		return new OcciConnect(user, password, db);
+#endif
+	} else if( backend == "odbc" ) {
+#ifdef DW_WITH_ODBC
+		return new OdbcConnect(user, password, db);
+#endif
+	} else if( backend == "sqlite" ) {
+#ifdef DW_WITH_SQLITE
+		return new SqliteConnect(db);
+#endif
+	} else {
+		throw DbException( "Unknown backend " + backend + ", use oracle, odbc or sqlite." );
+	}
+	throw DbException( "The " + backend + " backend is not built into this plugin." );
+}
+
+
+void DbConnect::SelectRows(DbRowProcessor* processor, string sql, const vector<DbParam>& params, const vector<DbFetchType>& fetchTypes) {
+	this->Query(sql, params, fetchTypes, processor);
+}
+
+
+// Oracle has no limit clause (before 12c), so the rows are counted in the where clause
+// rownum is given before the rows are ordered, so an ordered select is limited from outside
+string DbConnect::LimitSQL(string sql, string whereSql, int rows, string orderSql) {
+	if( orderSql != "" && rows > 0 )
+		return "select * from (" + sql + (whereSql != "" ? " where " + whereSql : "") + " order by " + orderSql + ") "
+			   + "where rownum <= " + toString(rows);
+	if( whereSql != "" )
+		whereSql = "(" + whereSql + ") and ";
+	whereSql += rows > 0 ? "rownum <= " + toString(rows) : "rownum = 0";
+	return sql + " where " + whereSql;
+}
+
+
+// the address of the row, in SQLite too
+string DbConnect::RowOrderSQL(string alias) {
+	return alias != "" ? alias + ".rowid" : "rowid";
+}
+
+
+// interpolated between the two values around it
+string DbConnect::PercentileSQL(string column, double fraction) {
+	return "percentile_cont(" + toString(fraction) + ") within group (order by " + column + ")";
+}
+
+
+// days are counted from midnight like GetDate, the fraction of the seconds is kept in the milliseconds
+// extract gives the UTC fields of a timestamp with time zone, the cast keeps the local ones GetTimestamp reads
+string DbConnect::DateTimeSQL(string column, bool isTimestamp) {
+	if( !isTimestamp )
+		return "(trunc(" + column + ") - DATE '1960-01-01')";
+	string local = "cast(" + column + " as timestamp)";
+	return "((trunc(cast(" + local + " as date)) - DATE '1960-01-01') * 86400000 + round((extract(hour from " + local 
+		+ ") * 3600 + extract(minute from " + local + ") * 60 + extract(second from " + local + ")) * 1000))";
+}
+
+
+// a STATA timestamp has no time zone, it is taken as the session's like the reading does
+string DbConnect::DateTimeValueSQL(string value, bool isTimestamp) {
+	if( !isTimestamp )
+		return "(DATE '1960-01-01' + " + value + ")";
+	return "(TIMESTAMP '1960-01-01 00:00:00' + NUMTODSINTERVAL(" + value + " / 1000, 'SECOND'))";
+}
+
+
+string DbConnect::TruncateSQL(string column, int bytes) {
+	return "substrb(" + column + ", 1, " + toString(bytes) + ")";
+}
+
+
+// the session may sort text by the rules of its language
+string DbConnect::SortSQL(string column, bool isText, bool isNullFirst) {
+	return (isText ? "nlssort(" + column + ", 'NLS_SORT=BINARY')" : column) + (isNullFirst ? " nulls first" : " nulls last");
+}
+
+
+// there is no standard way, so the backends that have one override it
+DbPlan DbConnect::Explain(string sql, const vector<DbParam>& params) {
+	DbPlan plan;
+	plan.isExplained = false;
+	plan.rows = -1;
+	plan.bytes = -1;
+	plan.cost = -1;
+	return plan;
+}
+
+
+void DbConnect::Cancel() {
+}
+
+
+int DbConnect::RoundTrips() {
+	return this->roundTrips;
+}
+
+
+void DbConnect::SetFetchBudget(size_t bytes) {
+	this->fetchBudget = bytes;
+}
+
+string DbConnect::FetchReport() {
+	return this->isFetchSized ? this->lastFetch.Report() : "";
+}
+
+unsigned int DbConnect::FetchRows() {
+	return this->isFetchSized ? this->lastFetch.Rows() : 0;
+}
+
+
+// a round trip over this is long enough to make the progress messages and Break lag
+const double FETCH_SLOW_SECONDS = 1.0;
+
+DbFetchSizer::DbFetchSizer(size_t budget, size_t rowBytes) : budget(budget), rowBytes(rowBytes) {
+	size_t fit = rowBytes > 0 ? budget / rowBytes : FETCH_MAX_ROWS;
+	this->maxRows = fit < FETCH_MIN_ROWS ? FETCH_MIN_ROWS : fit > FETCH_MAX_ROWS ? FETCH_MAX_ROWS : (unsigned int)fit;
+	this->rows = this->maxRows < FETCH_START_ROWS ? this->maxRows : FETCH_START_ROWS;
+	this->firstRows = this->rows;
+	this->smallest = this->rows;
+	this->largest = this->rows;
+	this->roundTrips = 0;
+	this->changes = 0;
+	this->isGrowing = true;
+	this->lastRate = -1;
+	this->settledRate = -1;
+}
+
+unsigned int DbFetchSizer::Rows() {
+	return this->rows;
+}
+
+unsigned int DbFetchSizer::MaxRows() {
+	return this->maxRows;
+}
+
+// bigger round trips hide the latency until the server or the network is the limit, so it grows while
+// that pays off by a tenth, then stays unless the rows come much slower, when it tries growing again
+void DbFetchSizer::Measure(unsigned int rows, double seconds) {
+	this->roundTrips++;
+	double rate = rows / (seconds > 1e-6 ? seconds : 1e-6);
+	unsigned int next = this->rows;
+	if( seconds > FETCH_SLOW_SECONDS && this->rows > FETCH_MIN_ROWS ) {
+		next = this->rows / 2 < FETCH_MIN_ROWS ? FETCH_MIN_ROWS : this->rows / 2;
+		this->isGrowing = false;
+		this->settledRate = -1;
+	} else if( this->isGrowing ) {
+		if( (this->lastRate < 0 || rate > this->lastRate * 1.1) && this->rows < this->maxRows ) {
+			next = this->rows * 2 > this->maxRows ? this->maxRows : this->rows * 2;
+		} else {
+			this->isGrowing = false;
+			this->settledRate = rate;
 		}
-		// close the statement
-		this->conn->terminateStatement(stmt); 
-	} 	
-	return cols;
+	} else if( this->settledRate < 0 ) {
+		this->settledRate = rate;
+	} else if( rate < this->settledRate * 0.5 && this->rows < this->maxRows ) {
+		next = this->rows * 2 > this->maxRows ? this->maxRows : this->rows * 2;
+		this->isGrowing = true;
+	}
+	this->lastRate = rate;
+	if( next != this->rows ) {
+		this->changes++;
+		this->rows = next;
+		if( next < this->smallest )
+			this->smallest = next;
+		if( next > this->largest )
+			this->largest = next;
+	}
+}
+
+string DbFetchSizer::Report() {
+	return "fetch: rows of " + toString((long)this->rowBytes) + " bytes, budget " + toString((double)this->budget / 1048576) 
+			+ " MB for " + toString((long)this->maxRows) + " rows, " + toString((long)this->firstRows) + " rows per round trip at first, "
+			+ toString((long)this->rows) + " at the end (" + toString((long)this->smallest) + " to " + toString((long)this->largest) 
+			+ ", " + toString(this->changes) + " changes in " + toString(this->roundTrips) + " round trips)";
+}
+
+
+// http://howardhinnant.github.io/date_algorithms.html
+int DbDays(int year, int month, int day) {
+	// count the years from March so the leap day is the last day of the year
+	int y = year - (month <= 2 ? 1 : 0);
+	int era = (y >= 0 ? y : y - 399) / 400;
+	int yoe = y - era * 400;
+	int doy = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+	int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	return era * 146097 + doe - 719468 + 3653; // from 1970-01-01, which is 3653 days after 1960-01-01
 }
 
 
+// the days back to a calendar date the same way
+string DbDateTimeText(double value, bool isTimestamp) {
+	long long ms = isTimestamp ? (long long)floor(value + 0.5) : (long long)floor(value) * 86400000;
+	long long days = ms >= 0 ? ms / 86400000 : -((-ms + 86399999) / 86400000);
+	int time = (int)(ms - days * 86400000);
+	long long z = days - 3653 + 719468; // from 0000-03-01
+	long long era = (z >= 0 ? z : z - 146096) / 146097;
+	int doe = (int)(z - era * 146097);
+	int yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+	int doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+	int mp = (5 * doy + 2) / 153;
+	int day = doy - (153 * mp + 2) / 5 + 1;
+	int month = mp < 10 ? mp + 3 : mp - 9;
+	int year = (int)(yoe + era * 400) + (month <= 2 ? 1 : 0);
+	char text[32];
+	if( isTimestamp )
+		sprintf(text, "%04d-%02d-%02d %02d:%02d:%02d.%03d", year, month, day, time / 3600000, time / 60000 % 60, time / 1000 % 60, time % 1000);
+	else
+		sprintf(text, "%04d-%02d-%02d", year, month, day);
+	return text;
+}
 
 
+// sub-millisecond resolution
+double DbClock() {
+#ifdef _WIN32
+	static LARGE_INTEGER frequency;
+	if( frequency.QuadPart == 0 )
+		QueryPerformanceFrequency(&frequency);
+	LARGE_INTEGER counter;
+	QueryPerformanceCounter(&counter);
+	return (double)counter.QuadPart / (double)frequency.QuadPart;
+#else
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+#endif
+}
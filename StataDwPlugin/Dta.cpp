@@ -0,0 +1,258 @@
+#include "dwplugin.h"
+#include "strutils.h"
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+// the .dta format 115 is described in help dta_115
+const int DTA_FORMAT = 115;
+const int DTA_BYTE = 251;
+const int DTA_INT = 252;
+const int DTA_LONG = 253;
+const int DTA_FLOAT = 254;
+const int DTA_DOUBLE = 255;
+const int DTA_NAME_SIZE = 33; // names of variables and value labels
+const int DTA_FORMAT_SIZE = 49;
+const int DTA_LABEL_SIZE = 81; // the dataset and variable labels
+const int DTA_NOBS_OFFSET = 6; // after the format, byte order, file type, padding and number of variables
+const size_t DTA_BUFFER_SIZE = 1 << 20;
+// . is the smallest of the reserved values, 2^127 and 2^1023
+const float DTA_FLOAT_MISSING = (float)ldexp(1.0, 127);
+const double DTA_DOUBLE_MISSING = ldexp(1.0, 1023);
+
+
+// the type code of a STATA storage type
+int DtaType(string stataType) {
+	if( stataType == "byte" ) return DTA_BYTE;
+	if( stataType == "int" ) return DTA_INT;
+	if( stataType == "long" ) return DTA_LONG;
+	if( stataType == "float" ) return DTA_FLOAT;
+	if( stataType == "double" ) return DTA_DOUBLE;
+	return atoi(stataType.substr(3).c_str()); // str#
+}
+
+// the size of a value in the record
+size_t DtaSize(int type) {
+	switch( type ) {
+		case DTA_BYTE: return 1;
+		case DTA_INT: return 2;
+		case DTA_LONG: return 4;
+		case DTA_FLOAT: return 4;
+		case DTA_DOUBLE: return 8;
+	}
+	return type;
+}
+
+
+// value labels have the names used in the do file if they fit
+string DtaLabelName(DwColumn* column) {
+	if( !column->IsNumeric() || !column->IsLabelValues() )
+		return "";
+	string name = column->VariableName() + "_label";
+	return name.size() < (size_t)DTA_NAME_SIZE ? name : column->VariableName();
+}
+
+
+// the numbers are written as they are in memory, the header says which end comes first
+DwDtaFile::DwDtaFile(string fileName, const vector<DwColumn*>& columns, string dataLabel, string timeStamp,
+					 const vector<int>& sortedBy)
+	: fileName(fileName), columns(columns) {
+	this->rows = 0;
+	if( columns.size() > 32767 )
+		throw DwUseException( "A .dta file can't have more than 32767 variables." );
+	size_t recordSize = 0;
+	for(size_t i = 0; i < columns.size(); i++) {
+		this->types.push_back( DtaType(columns[i]->StataDataType()) );
+		recordSize += DtaSize(this->types[i]);
+	}
+	this->record.assign(recordSize, 0);
+	this->file = fopen(fileName.c_str(), "wb");
+	if( this->file == NULL )
+		throw DwUseException( "Could not create " + fileName + "." );
+	setvbuf(this->file, NULL, _IOFBF, DTA_BUFFER_SIZE);
+	try {
+		int one = 1;
+		unsigned char header[4] = { DTA_FORMAT, (unsigned char)(*(char*)&one == 1 ? 2 : 1), 1, 0 }; // LOHI or HILO, dataset
+		this->Put(header, sizeof(header));
+		short nvar = (short)columns.size();
+		int nobs = 0; // until Close
+		this->Put(&nvar, sizeof(nvar));
+		this->Put(&nobs, sizeof(nobs));
+		this->PutText(dataLabel, DTA_LABEL_SIZE);
+		this->PutText(timeStamp, 18);
+		for(size_t i = 0; i < columns.size(); i++) {
+			unsigned char type = (unsigned char)this->types[i];
+			this->Put(&type, 1);
+		}
+		for(size_t i = 0; i < columns.size(); i++)
+			this->PutText(columns[i]->VariableName(), DTA_NAME_SIZE);
+		// the variables the data are sorted by from 1, ended by 0, so STATA knows the order without sorting
+		vector<short> sortList(columns.size() + 1, 0);
+		for(size_t i = 0; i < sortedBy.size(); i++)
+			sortList[i] = (short)sortedBy[i];
+		this->Put(&sortList[0], sortList.size() * sizeof(short));
+		for(size_t i = 0; i < columns.size(); i++)
+			this->PutText(columns[i]->StataFormat(), DTA_FORMAT_SIZE);
+		// the value labels themselves are written after the data
+		for(size_t i = 0; i < columns.size(); i++)
+			this->PutText(DtaLabelName(columns[i]), DTA_NAME_SIZE);
+		for(size_t i = 0; i < columns.size(); i++)
+			this->PutText(columns[i]->IsLabelVariable() ? columns[i]->ColumnLabel() : "", DTA_LABEL_SIZE);
+		// no characteristics, just the end of the expansion fields
+		char end[5] = { 0, 0, 0, 0, 0 };
+		this->Put(end, sizeof(end));
+	} catch( ... ) {
+		fclose(this->file);
+		remove(fileName.c_str());
+		throw;
+	}
+}
+
+
+DwDtaFile::~DwDtaFile(void) {
+	if( this->file != NULL )
+		fclose(this->file);
+}
+
+
+void DwDtaFile::Put(const void* data, size_t size) {
+	if( fwrite(data, 1, size, this->file) != size )
+		throw DwUseException( "Could not write " + this->fileName + "." );
+}
+
+
+// zero padded to the width, the last byte is always zero
+void DwDtaFile::PutText(const string& text, size_t width) {
+	vector<char> field(width, 0);
+	memcpy(&field[0], text.c_str(), text.size() < width ? text.size() : width - 1);
+	this->Put(&field[0], width);
+}
+
+
+// missing values are the first of the reserved ones, numbers out of the range of the type are missing too
+size_t DwDtaFile::Write(DbRow* row) {
+	char* cell = this->record.size() > 0 ? &this->record[0] : NULL;
+	size_t bytes = 0;
+	for(size_t i = 0; i < this->columns.size(); i++) {
+		int type = this->types[i];
+		bool isNull = this->columns[i]->IsNull(row);
+		if( type >= DTA_BYTE ) {
+			double value = isNull ? 0 : this->columns[i]->AsNumber(row);
+			if( !isNull )
+				bytes += sizeof(double);
+			if( type == DTA_BYTE ) {
+				signed char v = isNull || value < -127 || value > 100 ? 101 : (signed char)value;
+				memcpy(cell, &v, 1);
+			} else if( type == DTA_INT ) {
+				short v = isNull || value < -32767 || value > 32740 ? 32741 : (short)value;
+				memcpy(cell, &v, 2);
+			} else if( type == DTA_LONG ) {
+				int v = isNull || value < -2147483647.0 || value > 2147483620.0 ? 2147483621 : (int)value;
+				memcpy(cell, &v, 4);
+			} else if( type == DTA_FLOAT ) {
+				float v = isNull ? DTA_FLOAT_MISSING : (float)value;
+				memcpy(cell, &v, 4);
+			} else {
+				double v = isNull ? DTA_DOUBLE_MISSING : value;
+				memcpy(cell, &v, 8);
+			}
+		} else {
+			// STATA has no missing strings, nulls are empty
+			const char* value = "";
+			size_t length = 0;
+			if( !isNull ) {
+				if( this->columns[i]->IsTranslated() ) {
+					value = this->columns[i]->AsLabel(row, this->text);
+				} else {
+					this->text = this->columns[i]->AsString(row);
+					value = this->text.c_str();
+				}
+				length = strlen(value);
+				bytes += length;
+			}
+			memset(cell, 0, type);
+			memcpy(cell, value, length < (size_t)type ? length : type);
+		}
+		cell += DtaSize(type);
+	}
+	if( this->record.size() > 0 )
+		this->Put(&this->record[0], this->record.size());
+	this->rows++;
+	return bytes;
+}
+
+
+// a value label table: its length, the name, 3 bytes of padding, then the count,
+// the length of the text, the offsets of the labels, the values and the text
+void DwDtaFile::PutLabels(string name, const map<string,string>& labels) {
+	vector<int> offsets, values;
+	string text;
+	for(map<string,string>::const_iterator ii = labels.begin(); ii != labels.end(); ii++) {
+		// only integers can be labeled
+		char* end;
+		long value = strtol(ii->first.c_str(), &end, 10);
+		if( ii->first == "" || *end != '\0' )
+			continue;
+		offsets.push_back(text.size());
+		values.push_back((int)value);
+		text += ii->second;
+		text.push_back('\0');
+	}
+	if( values.size() == 0 )
+		return;
+	int n = values.size();
+	int textLength = text.size();
+	int length = 8 + 8 * n + textLength;
+	this->Put(&length, 4);
+	this->PutText(name, DTA_NAME_SIZE);
+	char padding[3] = { 0, 0, 0 };
+	this->Put(padding, sizeof(padding));
+	this->Put(&n, 4);
+	this->Put(&textLength, 4);
+	this->Put(&offsets[0], 4 * n);
+	this->Put(&values[0], 4 * n);
+	this->Put(text.c_str(), textLength);
+}
+
+
+void DwDtaFile::Close() {
+	for(size_t i = 0; i < this->columns.size(); i++) {
+		string name = DtaLabelName(this->columns[i]);
+		if( name != "" )
+			this->PutLabels(name, this->columns[i]->ValueLabels());
+	}
+	if( fseek(this->file, DTA_NOBS_OFFSET, SEEK_SET) != 0 )
+		throw DwUseException( "Could not write " + this->fileName + "." );
+	this->Put(&this->rows, sizeof(this->rows));
+	int rc = fclose(this->file);
+	this->file = NULL;
+	if( rc != 0 )
+		throw DwUseException( "Could not write " + this->fileName + "." );
+}
+
+
+int DwDtaFile::Rows() {
+	return this->rows;
+}
+
+
+int DwDtaFile::Variables() {
+	return this->columns.size();
+}
+
+
+WriteDataSet::WriteDataSet(DwDtaFile* file, DwStats* stats) : file(file), stats(stats) {
+	this->lastReturn = DwStats::Now();
+}
+
+
+// the same timings as loading into STATA, writing the file counts as storing
+void WriteDataSet::operator()( DbRow* record ) {
+	double start = DwStats::Now();
+	this->stats->Add(PHASE_FETCH, start - this->lastReturn);
+	this->stats->bytes += this->file->Write(record);
+	this->stats->rows++;
+	this->stats->cells += this->file->Variables();
+	this->lastReturn = DwStats::Now();
+	this->stats->Add(PHASE_STORE, this->lastReturn - start);
+}
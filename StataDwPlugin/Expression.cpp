@@ -0,0 +1,591 @@
+#include "dwplugin.h"
+#include "strutils.h"
+#include <cctype>
+#include <cstdlib>
+
+const string MISSING_NUMBER_SQL = "9.99e125"; // a missing number where the expression can't be repeated, about the largest Oracle NUMBER
+
+// the pieces of a STATA expression
+enum TokenType { TOK_END, TOK_NAME, TOK_NUMBER, TOK_STRING, TOK_QUOTED, TOK_MISSING,
+				 TOK_OPERATOR, TOK_LPAREN, TOK_RPAREN, TOK_COMMA, TOK_PARAM };
+
+struct Token {
+	TokenType type;
+	string text;
+	size_t pos; // where it started in the expression, for error messages
+};
+
+
+// split the if expression into tokens one at a time
+class ExpressionTokenizer {
+public:
+	ExpressionTokenizer(string expr) : expr(expr), pos(0) {
+		this->Advance();
+	}
+	const Token& Peek() {
+		return this->current;
+	}
+	Token Next() {
+		Token t = this->current;
+		this->Advance();
+		return t;
+	}
+	// date literals like td(01jan2020) are not expressions, so take the raw text until the closing parenthesis
+	string RawUntilParen() {
+		if( this->current.type != TOK_LPAREN )
+			throw DwUseException( "Expected ( at position " + toString(this->current.pos) + " of the if expression." );
+		size_t close = this->expr.find(')', this->pos);
+		if( close == string::npos )
+			throw DwUseException( "Missing ) after position " + toString(this->pos) + " of the if expression." );
+		string raw = this->expr.substr(this->pos, close - this->pos);
+		this->pos = close + 1;
+		this->Advance();
+		return raw;
+	}
+private:
+	string expr;
+	size_t pos;
+	Token current;
+
+	bool IsNameChar(char c) {
+		return isalnum((unsigned char)c) || c == '_' || c == '$' || c == '#';
+	}
+
+	void Advance() {
+		while( this->pos < this->expr.size() && isspace((unsigned char)this->expr[this->pos]) )
+			this->pos++;
+		this->current.pos = this->pos;
+		this->current.text = "";
+		if( this->pos >= this->expr.size() ) {
+			this->current.type = TOK_END;
+			return;
+		}
+		char c = this->expr[this->pos];
+		char n = this->pos + 1 < this->expr.size() ? this->expr[this->pos + 1] : '\0';
+		size_t start = this->pos;
+		if( isdigit((unsigned char)c) || (c == '.' && isdigit((unsigned char)n)) ) {
+			// number with optional fraction and exponent
+			while( this->pos < this->expr.size() && (isdigit((unsigned char)this->expr[this->pos]) || this->expr[this->pos] == '.') )
+				this->pos++;
+			if( this->pos < this->expr.size() && (this->expr[this->pos] == 'e' || this->expr[this->pos] == 'E') ) {
+				this->pos++;
+				if( this->pos < this->expr.size() && (this->expr[this->pos] == '+' || this->expr[this->pos] == '-') )
+					this->pos++;
+				while( this->pos < this->expr.size() && isdigit((unsigned char)this->expr[this->pos]) )
+					this->pos++;
+			}
+			this->current.type = TOK_NUMBER;
+		} else if( c == '.' ) {
+			// system missing . or extended missing .a - .z
+			this->pos++;
+			if( isalpha((unsigned char)n) && (this->pos + 1 >= this->expr.size() || !this->IsNameChar(this->expr[this->pos + 1])) )
+				this->pos++;
+			this->current.type = TOK_MISSING;
+		} else if( isalpha((unsigned char)c) || c == '_' ) {
+			// a name can be qualified with the table it comes from, like dim.col
+			while( this->pos < this->expr.size() && 
+				   (this->IsNameChar(this->expr[this->pos]) || 
+				    (this->expr[this->pos] == '.' && this->pos + 1 < this->expr.size() && isalpha((unsigned char)this->expr[this->pos + 1]))) )
+				this->pos++;
+			this->current.type = TOK_NAME;
+		} else if( c == '"' || c == '\'' ) {
+			// "..." can be a quoted column name or a STATA string, '...' is always a string
+			this->pos++;
+			string text;
+			while( true ) {
+				if( this->pos >= this->expr.size() )
+					throw DwUseException( "Unterminated string starting at position " + toString(start) + " of the if expression." );
+				if( this->expr[this->pos] == c ) {
+					// SQL style doubled quote inside the string
+					if( this->pos + 1 < this->expr.size() && this->expr[this->pos + 1] == c ) {
+						text += c;
+						this->pos += 2;
+						continue;
+					}
+					this->pos++;
+					break;
+				}
+				text += this->expr[this->pos++];
+			}
+			this->current.type = c == '"' ? TOK_QUOTED : TOK_STRING;
+			this->current.text = text;
+			return;
+		} else if( c == ':' && (isalpha((unsigned char)n) || n == '_') ) {
+			// :name placeholder, its value comes from a STATA scalar or macro
+			this->pos++;
+			while( this->pos < this->expr.size() && this->IsNameChar(this->expr[this->pos]) )
+				this->pos++;
+			this->current.type = TOK_PARAM;
+			this->current.text = this->expr.substr(start + 1, this->pos - start - 1);
+			return;
+		} else if( c == '(' ) {
+			this->pos++;
+			this->current.type = TOK_LPAREN;
+		} else if( c == ')' ) {
+			this->pos++;
+			this->current.type = TOK_RPAREN;
+		} else if( c == ',' ) {
+			this->pos++;
+			this->current.type = TOK_COMMA;
+		} else {
+			// two character operators first
+			string two = this->expr.substr(this->pos, 2);
+			if( two == "==" || two == "!=" || two == "~=" || two == "<=" || two == ">=" ) {
+				this->pos += 2;
+			} else if( string("<>=!~&|+-*/^").find(c) != string::npos ) {
+				this->pos++;
+			} else {
+				throw DwUseException( "Unexpected character '" + string(1, c) + "' at position "
+										+ toString(start) + " of the if expression." );
+			}
+			this->current.type = TOK_OPERATOR;
+		}
+		this->current.text = this->expr.substr(start, this->pos - start);
+	}
+};
+
+
+// what a compiled sub-expression evaluates to
+enum ExprKind { KIND_CONDITION, KIND_NUMBER, KIND_STRING, KIND_MISSING };
+
+struct CompiledExpr {
+	CompiledExpr() : kind(KIND_NUMBER), isEmpty(false), isNotNull(false) {}
+	CompiledExpr(string sql, ExprKind kind, bool isNotNull = false) : sql(sql), kind(kind), isEmpty(false), isNotNull(isNotNull) {}
+	string sql;
+	ExprKind kind;
+	bool isEmpty; // the "" literal, Oracle keeps empty strings as null
+	bool isNotNull; // a literal, a placeholder or a condition as 0/1
+};
+
+
+// recursive descent parser following the STATA operator precedence
+class ExpressionParser {
+public:
+	ExpressionParser(string expr,
+					 const map<string,FilterColumn>& columns,
+					 ParameterResolver* resolver,
+					 vector<DbParam>& params) : tokens(expr), columns(columns), resolver(resolver), params(params) {
+	}
+
+	string Parse() {
+		CompiledExpr e = this->ParseOr();
+		if( this->tokens.Peek().type != TOK_END )
+			this->Fail("Unexpected '" + this->tokens.Peek().text + "'");
+		return this->Condition(e);
+	}
+
+private:
+	ExpressionTokenizer tokens;
+	const map<string,FilterColumn>& columns;
+	ParameterResolver* resolver;
+	vector<DbParam>& params;
+
+	void Fail(string msg) {
+		throw DwUseException( msg + " at position " + toString(this->tokens.Peek().pos) + " of the if expression." );
+	}
+
+	bool IsOperator(string op) {
+		return this->tokens.Peek().type == TOK_OPERATOR && this->tokens.Peek().text == op;
+	}
+
+	void Expect(TokenType type, string what) {
+		if( this->tokens.Peek().type != type )
+			this->Fail("Expected " + what);
+		this->tokens.Next();
+	}
+
+	// add a bind variable and return its placeholder
+	string Bind(DbParam param) {
+		this->params.push_back(param);
+		return ":p" + toString(this->params.size());
+	}
+
+	// STATA treats any non-zero value as true, missing too
+	// coalesce keeps the bind variables of the expression from being repeated
+	string Condition(const CompiledExpr& e) {
+		if( e.kind == KIND_CONDITION )
+			return e.sql;
+		if( e.kind == KIND_NUMBER )
+			return "(coalesce(" + e.sql + ", 1) <> 0)";
+		this->Fail("A string or missing value cannot be used as a condition");
+		return "";
+	}
+
+	// a condition used as a value is 1 if true and 0 otherwise like in STATA, e.g. !x == 1 or (x > 1) + (y > 1)
+	CompiledExpr Value(const CompiledExpr& e) {
+		if( e.kind == KIND_CONDITION )
+			return CompiledExpr("(case when " + e.sql + " then 1 else 0 end)", KIND_NUMBER, true);
+		return e;
+	}
+
+	CompiledExpr ParseOr() {
+		CompiledExpr left = this->ParseAnd();
+		while( this->IsOperator("|") ) {
+			this->tokens.Next();
+			CompiledExpr right = this->ParseAnd();
+			left = CompiledExpr("(" + this->Condition(left) + " or " + this->Condition(right) + ")", KIND_CONDITION);
+		}
+		return left;
+	}
+
+	CompiledExpr ParseAnd() {
+		CompiledExpr left = this->ParseComparison();
+		while( this->IsOperator("&") ) {
+			this->tokens.Next();
+			CompiledExpr right = this->ParseComparison();
+			left = CompiledExpr("(" + this->Condition(left) + " and " + this->Condition(right) + ")", KIND_CONDITION);
+		}
+		return left;
+	}
+
+	CompiledExpr ParseComparison() {
+		size_t paramsBefore = this->params.size();
+		CompiledExpr left = this->ParseAdditive();
+		const Token& t = this->tokens.Peek();
+		if( t.type == TOK_OPERATOR &&
+			(t.text == "==" || t.text == "=" || t.text == "!=" || t.text == "~=" ||
+			 t.text == "<" || t.text == "<=" || t.text == ">" || t.text == ">=") ) {
+			size_t leftParams = this->params.size();
+			string op = this->tokens.Next().text;
+			CompiledExpr right = this->ParseAdditive();
+			return this->Compare(left, op, right, leftParams > paramsBefore, this->params.size() > leftParams);
+		}
+		return left;
+	}
+
+	// isLeftBound and isRightBound tell if the sides have bind variables, those can't be repeated
+	CompiledExpr Compare(CompiledExpr left, string op, CompiledExpr right, bool isLeftBound, bool isRightBound) {
+		left = this->Value(left);
+		right = this->Value(right);
+		if( op == "=" || op == "==" ) op = "=";
+		if( op == "!=" || op == "~=" ) op = "<>";
+		// put the missing value on the right hand side
+		if( left.kind == KIND_MISSING && right.kind != KIND_MISSING ) {
+			swap(left, right);
+			if( op == "<" ) op = ">"; else if( op == ">" ) op = "<";
+			else if( op == "<=" ) op = ">="; else if( op == ">=" ) op = "<=";
+		}
+		// s == "" and s != "" are the STATA tests of empty strings, a bound '' would be null and match nothing
+		if( left.isEmpty && !right.isEmpty ) {
+			swap(left, right);
+			if( op == "<" ) op = ">"; else if( op == ">" ) op = "<";
+			else if( op == "<=" ) op = ">="; else if( op == ">=" ) op = "<=";
+		}
+		if( right.isEmpty && !left.isEmpty ) {
+			// nothing sorts before the empty string
+			if( op == "=" || op == "<=" ) return CompiledExpr(left.sql + " is null", KIND_CONDITION);
+			if( op == "<>" || op == ">" ) return CompiledExpr(left.sql + " is not null", KIND_CONDITION);
+			if( op == "<" ) return CompiledExpr("1=0", KIND_CONDITION);
+			return CompiledExpr("1=1", KIND_CONDITION);
+		}
+		if( right.kind == KIND_MISSING ) {
+			if( left.kind == KIND_MISSING )
+				this->Fail("Cannot compare two missing values");
+			// missing is larger than any number in STATA, so x < . is the usual way to say not missing
+			if( op == "=" || op == ">=" ) return CompiledExpr(left.sql + " is null", KIND_CONDITION);
+			if( op == "<>" || op == "<" ) return CompiledExpr(left.sql + " is not null", KIND_CONDITION);
+			if( op == ">" ) return CompiledExpr("1=0", KIND_CONDITION);
+			return CompiledExpr("1=1", KIND_CONDITION);
+		}
+		return this->CompareNulls(left, op, right, isLeftBound, isRightBound);
+	}
+
+	// a null side would make the comparison unknown in SQL, but in STATA a missing number is larger than any
+	// other and the empty string (null in Oracle) is smaller, so x > 1 and x != 1 hold for a missing x
+	CompiledExpr CompareNulls(const CompiledExpr& left, string op, const CompiledExpr& right, bool isLeftBound, bool isRightBound) {
+		string sql = left.sql + " " + op + " " + right.sql;
+		bool canLeft = !left.isNotNull;
+		bool canRight = !right.isNotNull;
+		if( !canLeft && !canRight )
+			return CompiledExpr(sql, KIND_CONDITION);
+		bool isNumber = left.kind != KIND_STRING;
+		bool isGreater = op == ">" || op == ">=";
+		bool isLess = op == "<" || op == "<=";
+		// whether it holds with only the left, only the right or both sides null
+		bool leftNull = op == "<>" || (isNumber ? isGreater : isLess);
+		bool rightNull = op == "<>" || (isNumber ? isLess : isGreater);
+		bool bothNull = op == "=" || op == "<=" || op == ">=";
+		if( (canLeft && isLeftBound) || (canRight && isRightBound) ) {
+			// concatenating a null is the other string in Oracle, so only numbers are left here
+			if( !isNumber )
+				return CompiledExpr(sql, KIND_CONDITION);
+			string l = canLeft ? "coalesce(" + left.sql + ", " + MISSING_NUMBER_SQL + ")" : left.sql;
+			string r = canRight ? "coalesce(" + right.sql + ", " + MISSING_NUMBER_SQL + ")" : right.sql;
+			return CompiledExpr(l + " " + op + " " + r, KIND_CONDITION);
+		}
+		// the sides are columns (or computed from them), they can be repeated to keep the indexes usable
+		string compared = sql;
+		if( canLeft && leftNull )
+			sql += " or " + (canRight && !bothNull ? "(" + left.sql + " is null and " + right.sql + " is not null)" : left.sql + " is null");
+		if( canRight && rightNull )
+			sql += " or " + (canLeft && !bothNull ? "(" + right.sql + " is null and " + left.sql + " is not null)" : right.sql + " is null");
+		if( canLeft && canRight && bothNull && !leftNull && !rightNull )
+			sql += " or (" + left.sql + " is null and " + right.sql + " is null)";
+		return CompiledExpr(sql == compared ? sql : "(" + sql + ")", KIND_CONDITION);
+	}
+
+	CompiledExpr ParseAdditive() {
+		CompiledExpr left = this->ParseMultiplicative();
+		while( this->IsOperator("+") || this->IsOperator("-") ) {
+			string op = this->tokens.Next().text;
+			CompiledExpr right = this->Value(this->ParseMultiplicative());
+			left = this->Value(left);
+			if( left.kind == KIND_STRING || right.kind == KIND_STRING ) {
+				if( op == "-" )
+					this->Fail("Strings cannot be subtracted");
+				left = CompiledExpr(left.sql + " || " + right.sql, KIND_STRING); // + concatenates strings in STATA
+			} else {
+				left = CompiledExpr(left.sql + " " + op + " " + right.sql, KIND_NUMBER);
+			}
+		}
+		return left;
+	}
+
+	CompiledExpr ParseMultiplicative() {
+		CompiledExpr left = this->ParseUnary();
+		while( this->IsOperator("*") || this->IsOperator("/") ) {
+			string op = this->tokens.Next().text;
+			CompiledExpr right = this->Value(this->ParseUnary());
+			left = this->Value(left);
+			left = CompiledExpr(left.sql + " " + op + " " + right.sql, KIND_NUMBER);
+		}
+		return left;
+	}
+
+	CompiledExpr ParseUnary() {
+		if( this->IsOperator("!") || this->IsOperator("~") ) {
+			this->tokens.Next();
+			CompiledExpr e = this->ParseUnary();
+			return CompiledExpr("not (" + this->Condition(e) + ")", KIND_CONDITION);
+		}
+		if( this->IsOperator("-") ) {
+			this->tokens.Next();
+			CompiledExpr e = this->Value(this->ParseUnary());
+			// -(...) so that two minus signs never make an SQL comment
+			return CompiledExpr("-(" + e.sql + ")", KIND_NUMBER);
+		}
+		CompiledExpr base = this->ParsePrimary();
+		if( this->IsOperator("^") ) {
+			this->tokens.Next();
+			CompiledExpr exponent = this->Value(this->ParseUnary());
+			base = this->Value(base);
+			return CompiledExpr("power(" + base.sql + ", " + exponent.sql + ")", KIND_NUMBER);
+		}
+		return base;
+	}
+
+public:
+	// find a column by its database or STATA variable name
+	bool FindColumn(string name, bool exact, CompiledExpr& e) {
+		map<string,FilterColumn>::const_iterator ii = this->columns.find(upperCase(name));
+		if( ii == this->columns.end() )
+			return false;
+		const DbColumnMetaData& md = ii->second.metaData;
+		if( exact && md.name != name && replaceAll(md.name, " ", "_") != name )
+			return false;
+		e.sql = md.isQuoted ? "\"" + md.name + "\"" : md.name;
+		if( ii->second.alias != "" )
+			e.sql = ii->second.alias + "." + e.sql;
+		e.kind = ExpressionCompiler::IsStringType(md.type) ? KIND_STRING : KIND_NUMBER;
+		return true;
+	}
+
+private:
+	CompiledExpr ParsePrimary() {
+		Token t = this->tokens.Peek();
+		CompiledExpr e;
+		switch( t.type ) {
+			case TOK_NUMBER:
+				this->tokens.Next();
+				return CompiledExpr(this->Bind(atof(t.text.c_str())), KIND_NUMBER, true);
+			case TOK_STRING:
+			case TOK_QUOTED:
+				this->tokens.Next();
+				// column names with mixed casing have to be quoted, an upper case text is always a string
+				// so that name == "CITY" does not compare two columns
+				if( t.type == TOK_QUOTED && t.text != upperCase(t.text) && this->FindColumn(t.text, true, e) )
+					return e;
+				// the empty string is not bound, comparisons with it don't use it
+				e = CompiledExpr(t.text == "" ? "''" : this->Bind(t.text), KIND_STRING, true);
+				e.isEmpty = t.text == "";
+				return e;
+			case TOK_MISSING:
+				this->tokens.Next();
+				return CompiledExpr("null", KIND_MISSING);
+			case TOK_PARAM: {
+				// the value changes between runs but the statement text does not
+				this->tokens.Next();
+				if( this->resolver == NULL )
+					throw DwUseException( "There are no values available for the placeholder :" + t.text + " in the if expression." );
+				DbParam value = this->resolver->Resolve(t.text);
+				return CompiledExpr(this->Bind(value), value.isNumber ? KIND_NUMBER : KIND_STRING, true);
+			}
+			case TOK_LPAREN: {
+				this->tokens.Next();
+				e = this->ParseOr();
+				this->Expect(TOK_RPAREN, ")");
+				e.sql = "(" + e.sql + ")";
+				return e;
+			}
+			case TOK_NAME:
+				this->tokens.Next();
+				if( this->tokens.Peek().type == TOK_LPAREN )
+					return this->ParseFunction(t);
+				if( !this->FindColumn(t.text, false, e) )
+					throw DwUseException( "Unknown variable '" + t.text + "' in the if expression." );
+				return e;
+			default:
+				this->Fail("Unexpected '" + t.text + "'");
+				return e;
+		}
+	}
+
+	// comma separated list of values inside the parentheses of a function call
+	vector<CompiledExpr> ParseArguments() {
+		vector<CompiledExpr> args;
+		this->Expect(TOK_LPAREN, "(");
+		if( this->tokens.Peek().type != TOK_RPAREN ) {
+			while( true ) {
+				CompiledExpr arg = this->Value(this->ParseOr());
+				args.push_back(arg);
+				if( this->tokens.Peek().type != TOK_COMMA )
+					break;
+				this->tokens.Next();
+			}
+		}
+		this->Expect(TOK_RPAREN, ")");
+		return args;
+	}
+
+	CompiledExpr ParseFunction(const Token& name) {
+		string fn = lowerCase(name.text);
+		if( fn == "td" || fn == "d" ) {
+			string date = this->ParseDateLiteral(this->tokens.RawUntilParen(), false);
+			return CompiledExpr("to_date(" + this->Bind(date) + ", 'YYYY-MM-DD')", KIND_NUMBER);
+		}
+		if( fn == "tc" ) {
+			string time = this->ParseDateLiteral(this->tokens.RawUntilParen(), true);
+			return CompiledExpr("to_timestamp(" + this->Bind(time) + ", 'YYYY-MM-DD HH24:MI:SS.FF3')", KIND_NUMBER);
+		}
+		vector<CompiledExpr> args = this->ParseArguments();
+		if( fn == "missing" || fn == "mi" ) {
+			if( args.size() == 0 )
+				throw DwUseException( "missing() needs at least one argument in the if expression." );
+			string sql;
+			for( size_t i = 0; i < args.size(); i++ )
+				sql += (i > 0 ? " or " : "") + args[i].sql + " is null";
+			return CompiledExpr("(" + sql + ")", KIND_CONDITION);
+		}
+		if( fn == "inlist" ) {
+			if( args.size() < 2 )
+				throw DwUseException( "inlist() needs at least two arguments in the if expression." );
+			string list;
+			bool hasMissing = false;
+			for( size_t i = 1; i < args.size(); i++ ) {
+				if( args[i].kind == KIND_MISSING ) {
+					hasMissing = true;
+					continue;
+				}
+				list += (list != "" ? ", " : "") + args[i].sql;
+			}
+			string sql = list != "" ? args[0].sql + " in (" + list + ")" : "1=0";
+			if( hasMissing )
+				sql = "(" + sql + " or " + args[0].sql + " is null)";
+			return CompiledExpr(sql, KIND_CONDITION);
+		}
+		if( fn == "inrange" ) {
+			if( args.size() != 3 )
+				throw DwUseException( "inrange() needs three arguments in the if expression." );
+			// a missing bound means unbounded on that side
+			bool noLower = args[1].kind == KIND_MISSING, noUpper = args[2].kind == KIND_MISSING;
+			if( noLower && noUpper ) return CompiledExpr(args[0].sql + " is not null", KIND_CONDITION);
+			if( noLower ) return CompiledExpr(args[0].sql + " <= " + args[2].sql, KIND_CONDITION);
+			if( noUpper ) return CompiledExpr(args[0].sql + " >= " + args[1].sql, KIND_CONDITION);
+			return CompiledExpr(args[0].sql + " between " + args[1].sql + " and " + args[2].sql, KIND_CONDITION);
+		}
+		throw DwUseException( "Unsupported function '" + name.text + "' in the if expression." );
+	}
+
+	// turn the STATA day-month-year literal, e.g. 01jan2020 or 1 jan 2020 10:30:00 into ISO format for to_date
+	string ParseDateLiteral(string raw, bool withTime) {
+		// collect runs of letters and digits ignoring separators
+		vector<string> parts;
+		string part;
+		for( size_t i = 0; i <= raw.size(); i++ ) {
+			char c = i < raw.size() ? raw[i] : ' ';
+			bool sameRun = part != "" && ( (isdigit((unsigned char)c) && isdigit((unsigned char)part[0])) ||
+										   (isalpha((unsigned char)c) && isalpha((unsigned char)part[0])) );
+			if( !sameRun && part != "" ) {
+				parts.push_back(part);
+				part = "";
+			}
+			if( isalnum((unsigned char)c) )
+				part += c;
+		}
+		const string months[] = {"jan","feb","mar","apr","may","jun","jul","aug","sep","oct","nov","dec"};
+		int month = 0;
+		if( parts.size() >= 3 ) {
+			string m = lowerCase(parts[1]);
+			if( isdigit((unsigned char)m[0]) )
+				month = atoi(m.c_str());
+			else for( int i = 0; i < 12; i++ )
+				if( m.substr(0, 3) == months[i] ) month = i + 1;
+		}
+		int day = parts.size() >= 3 ? atoi(parts[0].c_str()) : 0;
+		if( month < 1 || month > 12 || day < 1 || day > 31 || parts[2].size() != 4 || (!withTime && parts.size() != 3) || parts.size() > 7 )
+			throw DwUseException( "Cannot read the date '" + raw + "' in the if expression, use a format like 01jan2020." );
+		string iso = parts[2] + "-" + (month < 10 ? "0" : "") + toString(month) + "-" + (day < 10 ? "0" : "") + toString(day);
+		if( withTime ) {
+			// hours, minutes, seconds and milliseconds are optional
+			const char* defaults[] = {"00", "00", "00", "000"};
+			string hms[4];
+			for( size_t i = 0; i < 4; i++ )
+				hms[i] = parts.size() > i + 3 ? parts[i + 3] : defaults[i];
+			iso += " " + hms[0] + ":" + hms[1] + ":" + hms[2] + "." + hms[3];
+		}
+		return iso;
+	}
+};
+
+
+bool ExpressionCompiler::IsStringType(string type) {
+	return type == "VARCHAR2" || type == "VARCHAR" || type == "CHAR" || type == "CHARZ"
+		|| type == "STRING" || type == "LONG" || type == "LONG VARCHAR" || type == "CLOB";
+}
+
+ExpressionCompiler::ExpressionCompiler(ParameterResolver* resolver) {
+	this->resolver = resolver;
+}
+
+void ExpressionCompiler::AddColumns(const vector<DbColumnMetaData>& columns, string table, string alias) {
+	// look columns up case insensitive, both by their database name and the STATA variable name
+	// unqualified names belong to the first table that has them, so the main table has to be added first
+	for( size_t i = 0; i < columns.size(); i++ ) {
+		FilterColumn fc;
+		fc.metaData = columns[i];
+		fc.alias = alias;
+		string names[] = { upperCase(columns[i].name), upperCase(replaceAll(columns[i].name, " ", "_")) };
+		for( size_t j = 0; j < 2; j++ ) {
+			if( this->columns.find(names[j]) == this->columns.end() )
+				this->columns[names[j]] = fc;
+			this->columns[upperCase(table) + "." + names[j]] = fc;
+			if( alias != "" )
+				this->columns[upperCase(alias) + "." + names[j]] = fc;
+		}
+	}
+}
+
+string ExpressionCompiler::Compile(string expr, vector<DbParam>& params) {
+	ExpressionParser parser(expr, this->columns, this->resolver, params);
+	return parser.Parse();
+}
+
+string ExpressionCompiler::ColumnSQL(string name, bool& isString) {
+	vector<DbParam> params;
+	ExpressionParser parser("", this->columns, this->resolver, params);
+	CompiledExpr e;
+	if( !parser.FindColumn(name, false, e) )
+		throw DwUseException( "Unknown column " + name + "." );
+	isString = e.kind == KIND_STRING;
+	return e.sql;
+}
@@ -0,0 +1,236 @@
+#include "dwplugin.h"
+#include "strutils.h"
+#include <cstdlib>
+#include <cstring>
+#ifdef DW_WITH_ZLIB
+#include <zlib.h>
+#endif
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+
+// the header and the lines go into the buffer, it is written when full
+DwExtractFile::DwExtractFile(string fileName, const vector<DwColumn*>& columns, char separator, bool isCompressed, size_t bufferSize)
+	: fileName(fileName), columns(columns), separator(separator) {
+	this->file = NULL;
+	this->gz = NULL;
+	this->used = 0;
+	this->rows = 0;
+	this->bytes = 0;
+	this->buffer.assign(bufferSize > 4096 ? bufferSize : 4096, 0);
+	bool isStdout = fileName == "-";
+	if( isStdout ) {
+		this->fileName = "the standard output";
+#ifdef _WIN32
+		_setmode(_fileno(stdout), _O_BINARY); // no \r added to the lines or into the compressed data
+#endif
+	}
+	if( isCompressed ) {
+#ifdef DW_WITH_ZLIB
+		this->gz = isStdout ? gzdopen(fileno(stdout), "wb") : gzopen(fileName.c_str(), "wb");
+		if( this->gz == NULL )
+			throw DwUseException( "Could not create " + this->fileName + "." );
+#else
+		throw DwUseException( "Compression needs the extractor built with zlib (DW_WITH_ZLIB)." );
+#endif
+	} else {
+		this->file = isStdout ? stdout : fopen(fileName.c_str(), "wb");
+		if( this->file == NULL )
+			throw DwUseException( "Could not create " + this->fileName + "." );
+		// the blocks are as large as the buffer, so the stream does not need one
+		setvbuf(this->file, NULL, _IONBF, 0);
+	}
+	for(size_t i = 0; i < columns.size(); i++) {
+		if( i > 0 )
+			this->Put(&this->separator, 1);
+		string name = columns[i]->VariableName();
+		this->PutText(name.c_str(), name.size());
+	}
+	this->Put("\n", 1);
+}
+
+
+DwExtractFile::~DwExtractFile(void) {
+#ifdef DW_WITH_ZLIB
+	if( this->gz != NULL )
+		gzclose((gzFile)this->gz);
+#endif
+	if( this->file != NULL && this->file != stdout )
+		fclose(this->file);
+}
+
+
+void DwExtractFile::Put(const char* data, size_t size) {
+	if( this->used + size > this->buffer.size() ) {
+		this->Flush();
+		// a value longer than the buffer goes on its own
+		if( size > this->buffer.size() ) {
+			this->WriteBlock(data, size);
+			return;
+		}
+	}
+	memcpy(&this->buffer[this->used], data, size);
+	this->used += size;
+}
+
+
+void DwExtractFile::Flush() {
+	if( this->used == 0 )
+		return;
+	this->WriteBlock(&this->buffer[0], this->used);
+	this->used = 0;
+}
+
+
+void DwExtractFile::WriteBlock(const char* data, size_t size) {
+	bool isWritten;
+#ifdef DW_WITH_ZLIB
+	if( this->gz != NULL )
+		isWritten = gzwrite((gzFile)this->gz, data, (unsigned)size) == (int)size;
+	else
+#endif
+	isWritten = fwrite(data, 1, size, this->file) == size;
+	if( !isWritten )
+		throw DwUseException( "Could not write " + this->fileName + "." );
+	this->bytes += size;
+}
+
+
+// CSV quotes the values with the separator, quotes or line breaks in them, TSV has no quoting
+// so those characters become spaces
+void DwExtractFile::PutText(const char* value, size_t length) {
+	bool isPlain = true;
+	for(size_t i = 0; i < length && isPlain; i++)
+		isPlain = value[i] != this->separator && value[i] != '"' && value[i] != '\n' && value[i] != '\r';
+	if( isPlain ) {
+		this->Put(value, length);
+	} else if( this->separator == '\t' ) {
+		this->cleaned.assign(value, length);
+		for(size_t i = 0; i < this->cleaned.size(); i++)
+			if( this->cleaned[i] == '\t' || this->cleaned[i] == '\n' || this->cleaned[i] == '\r' )
+				this->cleaned[i] = ' ';
+		this->Put(this->cleaned.c_str(), this->cleaned.size());
+	} else {
+		this->Put("\"", 1);
+		const char* start = value;
+		for(const char* c = value; c < value + length; c++) {
+			if( *c == '"' ) {
+				this->Put(start, c - start + 1);
+				start = c; // the quote is written again
+			}
+		}
+		this->Put(start, value + length - start);
+		this->Put("\"", 1);
+	}
+}
+
+
+// whole numbers (codes, dates, counts) are written without printf, the others with the fewest
+// digits that give the same double back
+void DwExtractFile::PutNumber(double value) {
+	char number[32];
+	int length;
+	if( value > -1e15 && value < 1e15 && value == (double)(long long)value ) {
+		char* end = number + sizeof(number);
+		char* c = end;
+		long long n = (long long)value;
+		unsigned long long digits = n < 0 ? -n : n;
+		do {
+			*--c = (char)('0' + digits % 10);
+			digits /= 10;
+		} while( digits > 0 );
+		if( n < 0 )
+			*--c = '-';
+		this->Put(c, end - c);
+		return;
+	}
+	length = sprintf(number, "%.15g", value);
+	if( strtod(number, NULL) != value ) {
+		length = sprintf(number, "%.16g", value);
+		if( strtod(number, NULL) != value )
+			length = sprintf(number, "%.17g", value);
+	}
+	this->Put(number, length);
+}
+
+
+// the values are the ones LOAD stores, nulls are empty
+size_t DwExtractFile::Write(DbRow* row) {
+	size_t bytes = 0;
+	for(size_t i = 0; i < this->columns.size(); i++) {
+		if( i > 0 )
+			this->Put(&this->separator, 1);
+		DwColumn* column = this->columns[i];
+		if( column->IsNull(row) )
+			continue;
+		if( column->IsNumeric() ) {
+			this->PutNumber(column->AsNumber(row));
+			bytes += sizeof(double);
+		} else {
+			const char* value;
+			string converted;
+			if( column->IsTranslated() ) {
+				value = column->AsLabel(row, this->text);
+			} else {
+				converted = column->AsString(row);
+				value = converted.c_str();
+			}
+			size_t length = strlen(value);
+			this->PutText(value, length);
+			bytes += length;
+		}
+	}
+	this->Put("\n", 1);
+	this->rows++;
+	return bytes;
+}
+
+
+void DwExtractFile::Close() {
+	this->Flush();
+	int rc = 0;
+#ifdef DW_WITH_ZLIB
+	if( this->gz != NULL )
+		rc = gzclose((gzFile)this->gz);
+	this->gz = NULL;
+#endif
+	if( this->file != NULL )
+		rc = this->file == stdout ? fflush(this->file) : fclose(this->file);
+	this->file = NULL;
+	if( rc != 0 )
+		throw DwUseException( "Could not write " + this->fileName + "." );
+}
+
+
+double DwExtractFile::Rows() {
+	return this->rows;
+}
+
+
+int DwExtractFile::Variables() {
+	return this->columns.size();
+}
+
+
+double DwExtractFile::Bytes() {
+	return this->bytes + this->used;
+}
+
+
+WriteExtract::WriteExtract(DwExtractFile* file, DwStats* stats) : file(file), stats(stats) {
+	this->lastReturn = DwStats::Now();
+}
+
+
+// the same timings as loading into STATA, writing the lines counts as storing
+void WriteExtract::operator()( DbRow* record ) {
+	double start = DwStats::Now();
+	this->stats->Add(PHASE_FETCH, start - this->lastReturn);
+	this->stats->bytes += this->file->Write(record);
+	this->stats->rows++;
+	this->stats->cells += this->file->Variables();
+	this->lastReturn = DwStats::Now();
+	this->stats->Add(PHASE_STORE, this->lastReturn - start);
+}
@@ -0,0 +1,102 @@
+#include "dwplugin.h"
+#include "strutils.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+// codes below this (and below a few times the number of labels) are looked up in an array
+const long DENSE_LABEL_LIMIT = 65536;
+
+
+// FNV-1a, good enough for short codes
+size_t DwLabelTable::Hash(const char* key, size_t length) {
+	size_t h = 2166136261u;
+	for(size_t i = 0; i < length; i++) {
+		h ^= (unsigned char)key[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+
+// the keys and labels are copied into one block, the slots only hold offsets into it
+DwLabelTable::DwLabelTable(const map<string,string>& labels) {
+	this->maxLength = 0;
+	// at most half full so probing stays short
+	size_t size = 16;
+	while( size < labels.size() * 2 )
+		size *= 2;
+	this->mask = size - 1;
+	Slot empty = { 0, 0, 0 };
+	this->slots.assign(size, empty);
+	// integer codes that are small enough can index an array instead
+	long maxCode = -1;
+	bool isDense = labels.size() > 0;
+	for(map<string,string>::const_iterator ii = labels.begin(); ii != labels.end() && isDense; ii++) {
+		long code = atol(ii->first.c_str());
+		isDense = code >= 0 && toString(code) == ii->first;
+		if( code > maxCode )
+			maxCode = code;
+	}
+	isDense = isDense && maxCode < DENSE_LABEL_LIMIT && maxCode < 4 * (long)labels.size() + 64;
+	if( isDense )
+		this->dense.assign(maxCode + 1, 0);
+	// offset 0 means no entry, so start with a zero byte
+	this->text.push_back('\0');
+	for(map<string,string>::const_iterator ii = labels.begin(); ii != labels.end(); ii++) {
+		Slot slot;
+		slot.key = this->text.size();
+		slot.keyLength = ii->first.size();
+		this->text.insert(this->text.end(), ii->first.begin(), ii->first.end());
+		this->text.push_back('\0');
+		slot.label = this->text.size();
+		this->text.insert(this->text.end(), ii->second.begin(), ii->second.end());
+		this->text.push_back('\0');
+		if( ii->second.size() > this->maxLength )
+			this->maxLength = ii->second.size();
+		// linear probing, the keys of a map are unique
+		size_t i = Hash(ii->first.c_str(), ii->first.size()) & this->mask;
+		while( this->slots[i].key != 0 )
+			i = (i + 1) & this->mask;
+		this->slots[i] = slot;
+		if( isDense )
+			this->dense[atol(ii->first.c_str())] = slot.label;
+	}
+}
+
+
+const char* DwLabelTable::Find(const char* key, size_t length) const {
+	size_t i = Hash(key, length) & this->mask;
+	while( this->slots[i].key != 0 ) {
+		const Slot& slot = this->slots[i];
+		if( slot.keyLength == length && memcmp(&this->text[slot.key], key, length) == 0 )
+			return &this->text[slot.label];
+		i = (i + 1) & this->mask;
+	}
+	return NULL;
+}
+
+
+const char* DwLabelTable::Find(double code) const {
+	if( this->dense.size() > 0 ) {
+		if( code < 0 || code >= this->dense.size() || code != (long)code || this->dense[(long)code] == 0 )
+			return NULL;
+		return &this->text[this->dense[(long)code]];
+	}
+	// format the code like the keys, without allocating
+	char key[32];
+	if( code != (long)code )
+		return NULL;
+	int length = sprintf(key, "%ld", (long)code);
+	return this->Find(key, length);
+}
+
+
+bool DwLabelTable::IsDense() const {
+	return this->dense.size() > 0;
+}
+
+
+size_t DwLabelTable::MaxLength() const {
+	return this->maxLength;
+}
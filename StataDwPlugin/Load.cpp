@@ -0,0 +1,121 @@
+#include "stplugin.h"
+#include "dwplugin.h"
+#include "strutils.h"
+
+
+const int POLL_ROWS = 1000; // rows between letting STATA check for Break
+
+
+// convert string to something STATA can print
+char* toStataString( string msg ) {
+	//return (char*) msg.c_str();
+
+	/*
+	vector<char> charr(msg.length() + 1);
+	copy(msg.begin(), msg.end(), charr.begin());
+	return &*charr.begin();
+	*/
+
+	// it seems the above calls lose their reference to the underlying string by the time 
+	// STATA can print the value, thus it only prints garbage. with this we should call delete[] charr;
+	char* charr = new char[msg.length()+1];
+	strcpy(charr, msg.c_str());
+	return charr;
+}
+
+
+// convert a string for STATA, print it, then free the array
+void stataDisplay( string msg ) {
+	char* charr = toStataString(msg);
+	SF_display(charr);
+	delete[] charr;
+}
+
+
+// with keys_inplace the observation is read from the result set and the loaded variables are the last ones
+FillDataSet::FillDataSet(const vector<DwColumn*>& cols, DwStats* stats, int obsPos, int expectedRows, int progressRows,
+						 const vector<int>& variables) 
+	: columns(cols), stats(stats), obsPosition(obsPos), expectedRows(expectedRows), progressRows(progressRows), variables(variables) {
+	row = 0;
+	loaded = 0;
+	started = DwStats::Now();
+	profileColumns = stats->IsProfileColumns();
+	if( this->variables.size() == 0 ) {
+		int varOffset = obsPos > 0 ? SF_nvars() - cols.size() : 0;
+		for(size_t i = 0; i < cols.size(); i++)
+			this->variables.push_back(varOffset + i + 1);
+	}
+	lastReturn = DwStats::Now();
+}
+
+
+// called with one row at a time
+void FillDataSet::operator()( DbRow* record ) {
+	// the time since the previous row was spent fetching this one
+	double start = DwStats::Now();
+	stats->Add(PHASE_FETCH, start - lastReturn);
+	stats->rows++;
+	stats->cells += columns.size();
+	row++; // from 1
+	if( obsPosition > 0 )
+		row = record->GetInt(obsPosition);
+	for(size_t i=0; i < columns.size(); i++) {
+		if( !columns[i]->IsNull(record) ) {
+			// timing every cell is costly, so only with profile_columns
+			double converted = 0, cellStart = profileColumns ? DwStats::Now() : 0;
+			size_t bytes;
+			// STATA has separate storing functions for numbers and strings
+			// the dataset has to be created with the appropriate number of 
+			// columns and rows in a STATA macro before load is called
+			if(columns[i]->IsNumeric()) {
+				double val = columns[i]->AsNumber(record);
+				if( profileColumns ) converted = DwStats::Now();
+				// this did not work with SD_SAFEMODE enabled in stplugin.h
+				SF_vstore(variables[i], row, val);
+				bytes = sizeof(double);
+			} else if(columns[i]->IsTranslated()) {
+				// the label comes from the label table of the column, the text buffer is reused
+				const char* val = columns[i]->AsLabel(record, text);
+				if( profileColumns ) converted = DwStats::Now();
+				SF_sstore(variables[i], row, (char*)val);
+				bytes = strlen(val);
+			} else {
+				string val = columns[i]->AsString(record);
+				if( profileColumns ) converted = DwStats::Now();
+				// STATA copies the value into the dataset
+				SF_sstore(variables[i], row, (char*)val.c_str());
+				bytes = val.size();
+			}
+			stats->bytes += bytes;
+			if( profileColumns )
+				stats->AddColumn(i, bytes, converted - cellStart, DwStats::Now() - converted);
+		}
+	}
+	lastReturn = DwStats::Now();
+	stats->Add(PHASE_STORE, lastReturn - start);
+	loaded++;
+	if( progressRows > 0 && loaded % progressRows == 0 )
+		PrintProgress();
+	// STATA only notices Break when polled, then the query is stopped by unwinding through Select
+	if( loaded % POLL_ROWS == 0 ) {
+		SF_poll();
+		if( SW_stopflag )
+			throw DwCancelled();
+	}
+}
+
+
+// rows done, speed and the estimated time left
+void FillDataSet::PrintProgress() {
+	double seconds = DwStats::Now() - started;
+	double speed = seconds > 0 ? loaded / seconds : 0;
+	string msg = "Loaded " + toString(loaded);
+	if( expectedRows > 0 ) 
+		msg += " of " + toString(expectedRows) + " rows (" + toString((int)(100.0 * loaded / expectedRows)) + "%)";
+	else
+		msg += " rows";
+	msg += ", " + toString((long)speed) + " rows/s";
+	if( expectedRows > loaded && speed > 0 )
+		msg += ", about " + toString((long)((expectedRows - loaded) / speed + 0.5)) + " s left";
+	stataDisplay(msg + ". \n");
+}
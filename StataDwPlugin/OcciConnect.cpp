@@ -0,0 +1,367 @@
+#include "dwuse.h"
+#include "strutils.h"
+
+#ifndef DW_NO_OCCI
+
+// a column fetched into a native buffer instead of the NUMBER of Oracle
+struct OcciBuffer {
+	DbFetchType type; // FETCH_DEFAULT if the column has no buffer
+	int intValue;
+	double doubleValue;
+	sb2 indicator; // -1 for null
+	ub2 length;
+	ub2 returnCode;
+};
+
+// the current row of a ResultSet
+class OcciRow : public DbRow {
+public:
+	OcciRow(ResultSet* rs, vector<OcciBuffer>& buffers) : rs(rs), buffers(buffers) {}
+	bool IsNull(int col) {
+		if( this->IsBuffered(col) )
+			return buffers[col-1].indicator == -1;
+		return rs->isNull(col);
+	}
+	double GetNumber(int col) {
+		if( this->IsBuffered(col) )
+			return buffers[col-1].type == FETCH_INT ? buffers[col-1].intValue : buffers[col-1].doubleValue;
+		return rs->getDouble(col);
+	}
+	int GetInt(int col) {
+		if( this->IsBuffered(col) )
+			return buffers[col-1].type == FETCH_INT ? buffers[col-1].intValue : (int)buffers[col-1].doubleValue;
+		return rs->getInt(col);
+	}
+	string GetString(int col) {
+		if( this->IsBuffered(col) )
+			return toString(this->GetNumber(col));
+		return rs->getString(col);
+	}
+	double GetDate(int col) {
+		// return a double but we have to create that
+		oracle::occi::Date date = rs->getDate(col);
+		// https://www.stanford.edu/group/ssds/cgi-bin/drupal/files/Guides/Working%20with%20Dates%20and%20Times%20in%20Stata.pdf
+		// according to them dates are integers: days since 1960, jan 1
+		// create the epoch by first making a copy of our date, because occi dates need environment
+		oracle::occi::Date base(date); 
+		base.setDate(1960,1,1);
+		oracle::occi::IntervalDS dt = date.daysBetween(base); 
+		return dt.getDay();
+	}
+	double GetTimestamp(int col) {
+		oracle::occi::Timestamp ts = rs->getTimestamp(col);
+		// STATA wants milliseconds since the above data
+		oracle::occi::Timestamp base(ts);
+		base.setDate(1960,1,1);
+		base.setTime(0,0,0,0);
+		oracle::occi::IntervalDS dt = ts.subDS(base);
+		double seconds = ((double)dt.getDay()) * 24 * 60 * 60 +
+						 ((double)dt.getHour()) * 60 * 60 + 
+						 ((double)dt.getMinute()) * 60 + 
+						 ((double)dt.getSecond());
+		return seconds * 1000;
+	}
+private:
+	bool IsBuffered(int col) {
+		return (size_t)col <= buffers.size() && buffers[col-1].type != FETCH_DEFAULT;
+	}
+	ResultSet* rs;
+	vector<OcciBuffer>& buffers;
+};
+
+
+OcciConnect::OcciConnect(string user, string password, string db) {
+	this->user = user;
+	this->password = password;
+	this->db = db;
+	// use the values from NLS_CHARACTERSET and NLS_NCHAR_CHARACTERSET to handle acute letters.
+	// can be that the do command will not recognize file encoding
+	// the prefetch option fetches on a thread, so OCCI has to protect its handles
+	this->env = Environment::createEnvironment("UTF8","UTF8",Environment::THREADED_MUTEXED);
+	this->conn = NULL;
+	try { 
+		this->conn = this->env->createConnection(user, password, db); 
+		this->conn->setStmtCacheSize(STATEMENT_CACHE_SIZE);
+	} 
+	catch (SQLException& ex) { 
+		if( this->conn )
+			this->env->terminateConnection(this->conn);
+		Environment::terminateEnvironment(this->env);
+		throw DbException(ex.getMessage(), ex.getErrorCode());
+	}
+}
+
+
+// the rest of the rows would still be produced on the server, so cancel the call before closing
+// errors are ignored here, the original one is rethrown by the caller
+void OcciConnect::Abandon(Statement* stmt, ResultSet* rs) {
+	try {
+		if( rs ) {
+			this->conn->cancel();
+			stmt->closeResultSet(rs);
+		}
+	} catch( ... ) {
+	}
+	try {
+		if( stmt )
+			this->conn->terminateStatement(stmt);
+	} catch( ... ) {
+	}
+}
+
+
+// OCCI breaks the call in progress on the connection, the fetch on the other thread gets ORA-01013
+void OcciConnect::Cancel() {
+	try {
+		this->conn->cancel();
+	} catch( ... ) {
+	}
+}
+
+
+OcciConnect::~OcciConnect(void) {
+	if( this->conn )
+		this->env->terminateConnection (this->conn);
+	Environment::terminateEnvironment (this->env); 
+}
+
+
+// http://docs.oracle.com/cd/B10500_01/appdev.920/a96583/cciaadem.htm
+string printType (int type) {
+	switch (type) {
+		case OCCI_SQLT_CHR : return "VARCHAR2"; break;
+		case OCCI_SQLT_NUM : return "NUMBER"; break;
+		case OCCIINT : return "INTEGER"; break;
+		case OCCIFLOAT : return "FLOAT"; break;
+		case OCCI_SQLT_STR : return "STRING"; break;
+		case OCCI_SQLT_VNU : return "VARNUM"; break;
+		case OCCI_SQLT_LNG : return "LONG"; break;
+		case OCCI_SQLT_VCS : return "VARCHAR"; break;
+		case OCCI_SQLT_RID : return "ROWID"; break;
+		case OCCI_SQLT_TIMESTAMP : return "TIMESTAMP"; break;
+		case OCCI_SQLT_DAT : return "DATE"; break;
+		case OCCI_SQLT_VBI : return "VARRAW"; break;
+		case OCCI_SQLT_BIN : return "RAW"; break;
+		case OCCI_SQLT_LBI : return "LONG RAW"; break;
+		case OCCIUNSIGNED_INT : return "UNSIGNED INT"; break;
+		case OCCI_SQLT_LVC : return "LONG VARCHAR"; break;
+		case OCCI_SQLT_LVB : return "LONG VARRAW"; break;
+		case OCCI_SQLT_AFC : return "CHAR"; break;
+		case OCCI_SQLT_AVC : return "CHARZ"; break;
+		case OCCI_SQLT_RDD : return "ROWID"; break;
+		case OCCI_SQLT_NTY : return "NAMED DATA TYPE"; break;
+		case OCCI_SQLT_REF : return "REF"; break;
+		case OCCI_SQLT_CLOB: return "CLOB"; break;
+		case OCCI_SQLT_BLOB: return "BLOB"; break;
+		case OCCI_SQLT_FILE: return "BFILE"; break;
+		default: 
+			throw DbException( "Unknown Oracle column type " + toString(type) ); // maybe timestamp is missing from the list			
+	}
+} // End of printType (int)
+
+// create a record with the most relevant features from  http://docs.oracle.com/cd/B10500_01/appdev.920/a96583/cciaadem.htm
+DbColumnMetaData OcciMetaData(MetaData& meta) {
+	DbColumnMetaData md;
+	md.name	= meta.getString(MetaData::ATTR_NAME);
+	md.isQuoted = md.name != upperCase(md.name); // I don't know how else to look this up. quoted column name need to go into SQL with " around them
+	md.type	= printType(meta.getInt(MetaData::ATTR_DATA_TYPE));
+	md.size = meta.getInt(MetaData::ATTR_DATA_SIZE);
+	md.precision = meta.getInt(MetaData::ATTR_PRECISION);
+	md.scale = meta.getInt(MetaData::ATTR_SCALE);
+	return md;
+}
+
+vector<DbColumnMetaData> OcciConnect::Describe(string sql) {
+	Statement *stmt = NULL; 
+	ResultSet *rs = NULL; 
+	vector<DbColumnMetaData> cols;
+	try {
+		stmt = this->conn->createStatement(sql); 
+		// execute
+		rs = stmt->executeQuery(); 
+		this->roundTrips++;
+		vector<MetaData> meta = rs->getColumnListMetaData();
+		// we must do this while it is open
+		for(size_t i=0; i<meta.size(); i++)
+			cols.push_back( OcciMetaData(meta[i]) );
+		// close the statement
+		stmt->closeResultSet(rs);
+		rs = NULL;
+		this->conn->terminateStatement(stmt); 
+	} catch( SQLException& ex ) {
+		this->Abandon(stmt, rs);
+		throw DbException(ex.getMessage(), ex.getErrorCode());
+	} catch( ... ) {
+		this->Abandon(stmt, rs);
+		throw;
+	}
+	return cols;
+}
+
+
+// numeric columns with a fetch type are defined as OCCIINT or OCCIBDOUBLE, so the server sends them converted
+// and the rows read them from the buffers, the other columns go through the get methods of the ResultSet
+void OcciConnect::Query(string sql, const vector<DbParam>& params, const vector<DbFetchType>& fetchTypes, DbRowProcessor* processor) {
+	Statement *stmt = NULL; 
+	ResultSet *rs = NULL; 
+	// the processor can throw to stop early (e.g. Break in STATA), then the statement must not stay open
+	try {		  
+		stmt = this->conn->createStatement(sql); 
+		// the first round trip comes with the execute, before the columns can be sized, so it is a small one
+		stmt->setPrefetchRowCount(FETCH_MIN_ROWS);
+		stmt->setPrefetchMemorySize((unsigned int)this->fetchBudget);
+		// set parameters with their own type
+		for(size_t i = 0; i < params.size(); i++) {
+			// even if we bound it by name it would only look at the position
+			if( params[i].isNumber )
+				stmt->setDouble(i+1, params[i].number);
+			else
+				stmt->setString(i+1, params[i].text);
+		}
+		// execute
+		rs = stmt->executeQuery(); 
+		this->roundTrips++;
+		// the buffers have to be set before the first fetch
+		vector<OcciBuffer> buffers(fetchTypes.size());
+		for(size_t i = 0; i < fetchTypes.size(); i++) {
+			OcciBuffer& b = buffers[i];
+			b.type = fetchTypes[i];
+			b.indicator = -1;
+			if( b.type == FETCH_INT ) {
+				b.length = sizeof(int);
+				rs->setDataBuffer(i+1, &b.intValue, OCCIINT, sizeof(int), &b.length, &b.indicator, &b.returnCode);
+			} else if( b.type == FETCH_DOUBLE ) {
+				b.length = sizeof(double);
+				rs->setDataBuffer(i+1, &b.doubleValue, OCCIBDOUBLE, sizeof(double), &b.length, &b.indicator, &b.returnCode);
+			}
+		}
+		// size the round trips by the bytes of a row as it comes: the binary numbers or the size of the column
+		vector<MetaData> meta = rs->getColumnListMetaData();
+		vector<DbColumnMetaData> cols;
+		size_t rowBytes = 0;
+		for(size_t i = 0; i < meta.size(); i++) {
+			cols.push_back( OcciMetaData(meta[i]) );
+			rowBytes += i < buffers.size() && buffers[i].type != FETCH_DEFAULT ? buffers[i].length : cols[i].size;
+		}
+		processor->Columns(cols);
+		DbFetchSizer sizer(this->fetchBudget, rowBytes);
+		unsigned int batch = FETCH_MIN_ROWS; // rows of the round trip being read
+		unsigned int left = batch;
+		stmt->setPrefetchRowCount(sizer.Rows());
+		// iterate resultset and return rows, the next after a whole batch waits for the next round trip
+		OcciRow row(rs, buffers);
+		while( true ) {
+			if( left > 0 ) {
+				if( !rs->next() )
+					break;
+			} else {
+				double start = DbClock();
+				if( !rs->next() )
+					break;
+				this->roundTrips++;
+				batch = sizer.Rows();
+				sizer.Measure(batch, DbClock() - start);
+				left = batch;
+				if( sizer.Rows() != batch )
+					stmt->setPrefetchRowCount(sizer.Rows());
+			}
+			left--;
+			processor->Process( &row );
+		}
+		this->lastFetch = sizer;
+		this->isFetchSized = true;
+		stmt->closeResultSet(rs); 
+		rs = NULL;
+		// close the statement
+		this->conn->terminateStatement(stmt); 
+	} catch( SQLException& ex ) { 
+		this->Abandon(stmt, rs);
+		throw DbException(ex.getMessage(), ex.getErrorCode());
+	} catch( ... ) { 
+		this->Abandon(stmt, rs);
+		throw;
+	}
+}
+
+
+void OcciConnect::Execute(string sql) {
+	Statement *stmt = NULL; 
+	try {
+		stmt = this->conn->createStatement(sql); 
+		stmt->executeUpdate();
+		this->roundTrips++;
+		this->conn->terminateStatement(stmt); 
+	} catch( SQLException& ex ) {
+		this->Abandon(stmt, NULL);
+		throw DbException(ex.getMessage(), ex.getErrorCode());
+	}
+}
+
+
+void OcciConnect::ExecuteArray(string sql, vector<DbArrayParam>& params, unsigned int rows) {
+	if( rows == 0 )
+		return;
+	Statement *stmt = NULL; 
+	try {
+		stmt = this->conn->createStatement(sql); 
+		// bind the whole arrays and let the client send them in one round trip
+		for(size_t i = 0; i < params.size(); i++) {
+			DbArrayParam& p = params[i];
+			if( p.isNumber )
+				stmt->setDataBuffer(i+1, &p.numbers[0], OCCIBDOUBLE, sizeof(double), &p.lengths[0], &p.indicators[0]);
+			else
+				stmt->setDataBuffer(i+1, &p.strings[0], OCCI_SQLT_STR, p.width, &p.lengths[0], &p.indicators[0]);
+		}
+		stmt->executeArrayUpdate(rows);
+		this->roundTrips++;
+		this->conn->terminateStatement(stmt); 
+	} catch( SQLException& ex ) {
+		this->Abandon(stmt, NULL);
+		throw DbException(ex.getMessage(), ex.getErrorCode());
+	}
+}
+
+
+// the rows of PLAN_TABLE in the order of the steps, the first one has the totals
+class OraclePlanReader {
+public:
+	OraclePlanReader(DbPlan& plan) : plan(plan) {}
+	void operator()( DbRow* row ) {
+		if( row->GetInt(1) == 0 ) {
+			this->plan.rows = row->IsNull(5) ? -1 : row->GetNumber(5);
+			this->plan.bytes = row->IsNull(6) ? -1 : row->GetNumber(6);
+			this->plan.cost = row->IsNull(7) ? -1 : row->GetNumber(7);
+		}
+		string operation = row->GetString(2);
+		if( (operation == "TABLE ACCESS" || operation == "MAT_VIEW ACCESS") && row->GetString(3).find("FULL") != string::npos )
+			this->plan.fullScans.push_back( row->GetString(4) );
+	}
+private:
+	DbPlan& plan;
+};
+
+
+// Oracle explains the bind variables without values, so they are not bound
+DbPlan OcciConnect::Explain(string sql, const vector<DbParam>& params) {
+	DbPlan plan = DbConnect::Explain(sql, params);
+	plan.isExplained = true;
+	// PLAN_TABLE is private to the session, only the rows of a previous call have to go
+	this->Execute("delete from PLAN_TABLE where STATEMENT_ID = 'DWUSE'");
+	this->Execute("explain plan set STATEMENT_ID = 'DWUSE' for " + sql);
+	OraclePlanReader reader(plan);
+	this->Select(reader, "select ID, OPERATION, OPTIONS, OBJECT_NAME, CARDINALITY, BYTES, COST "
+						 "from PLAN_TABLE where STATEMENT_ID = 'DWUSE' order by ID", vector<DbParam>());
+	return plan;
+}
+
+
+void OcciConnect::Commit() {
+	try {
+		this->conn->commit();
+		this->roundTrips++;
+	} catch( SQLException& ex ) {
+		throw DbException(ex.getMessage(), ex.getErrorCode());
+	}
+}
+
+#endif
@@ -0,0 +1,463 @@
+#include "dwuse.h"
+#include "strutils.h"
+
+#ifdef DW_WITH_ODBC
+#ifdef _WIN32
+#include <windows.h>
+#pragma comment(lib, "odbc32.lib")
+#endif
+#include <sql.h>
+#include <sqlext.h>
+#include <cctype>
+#include <cstring>
+#include <cstdlib>
+
+// longest string bound to a column, longer values are truncated
+const SQLULEN ODBC_MAX_STRING = 4000;
+
+
+// the diagnostic records of a handle as an exception, the code is the native error of the first one
+DbException OdbcError(SQLSMALLINT handleType, SQLHANDLE handle) {
+	string message;
+	SQLINTEGER code = 0;
+	SQLCHAR state[6];
+	SQLCHAR text[1024];
+	SQLINTEGER native;
+	SQLSMALLINT length;
+	for(SQLSMALLINT i = 1; SQLGetDiagRec(handleType, handle, i, state, &native, text, sizeof(text), &length) == SQL_SUCCESS; i++) {
+		if( i == 1 )
+			code = native;
+		else
+			message += "\n";
+		message += string((char*)state) + ": " + (char*)text;
+	}
+	return DbException( message != "" ? message : "ODBC call failed", code );
+}
+
+// throw the diagnostics if a call failed
+void OdbcCheck(SQLRETURN rc, SQLSMALLINT handleType, SQLHANDLE handle) {
+	if( rc != SQL_SUCCESS && rc != SQL_SUCCESS_WITH_INFO )
+		throw OdbcError(handleType, handle);
+}
+
+
+// ODBC takes ? for the parameters, the statements here have :name like in Oracle
+string OdbcSQL(string sql) {
+	string odbc;
+	char quote = 0;
+	for(size_t i = 0; i < sql.size(); i++) {
+		char c = sql[i];
+		if( quote != 0 ) {
+			if( c == quote )
+				quote = 0;
+		} else if( c == '\'' || c == '"' ) {
+			quote = c;
+		} else if( c == ':' && i + 1 < sql.size() && (isalnum((unsigned char)sql[i+1]) || sql[i+1] == '_') ) {
+			while( i + 1 < sql.size() && (isalnum((unsigned char)sql[i+1]) || sql[i+1] == '_') )
+				i++;
+			odbc += '?';
+			continue;
+		}
+		odbc += c;
+	}
+	return odbc;
+}
+
+
+// the SQL type of a column mapped to the Oracle names DwColumn uses
+DbColumnMetaData OdbcMetaData(string name, SQLSMALLINT type, SQLULEN size, SQLSMALLINT digits) {
+	DbColumnMetaData md;
+	md.name = name;
+	md.isQuoted = md.name != upperCase(md.name);
+	md.type = "NUMBER";
+	md.size = 0;
+	md.precision = 0;
+	md.scale = 0;
+	switch(type) {
+		case SQL_BIT: md.precision = 1; break;
+		case SQL_TINYINT: md.precision = 3; break;
+		case SQL_SMALLINT: md.precision = 5; break;
+		case SQL_INTEGER: md.precision = 10; break;
+		case SQL_BIGINT: md.precision = 19; break;
+		case SQL_DECIMAL:
+		case SQL_NUMERIC: md.precision = (int)size; md.scale = digits; break;
+		case SQL_REAL: md.precision = 7; md.scale = -127; break;
+		case SQL_FLOAT:
+		case SQL_DOUBLE: md.precision = 15; md.scale = -127; break;
+		case SQL_TYPE_DATE: md.type = "DATE"; break;
+		case SQL_TYPE_TIMESTAMP: md.type = "TIMESTAMP"; break;
+		default:
+			// characters and everything else comes as text
+			md.type = "VARCHAR2";
+			md.size = size > 0 && size < ODBC_MAX_STRING ? (int)size : (int)ODBC_MAX_STRING;
+			break;
+	}
+	return md;
+}
+
+// the columns of a prepared or executed statement
+vector<DbColumnMetaData> OdbcDescribe(SQLHSTMT stmt) {
+	vector<DbColumnMetaData> cols;
+	SQLSMALLINT count = 0;
+	OdbcCheck(SQLNumResultCols(stmt, &count), SQL_HANDLE_STMT, stmt);
+	for(SQLSMALLINT i = 1; i <= count; i++) {
+		SQLCHAR name[256];
+		SQLSMALLINT nameLength, type, digits, nullable;
+		SQLULEN size;
+		OdbcCheck(SQLDescribeCol(stmt, i, name, sizeof(name), &nameLength, &type, &size, &digits, &nullable), SQL_HANDLE_STMT, stmt);
+		cols.push_back( OdbcMetaData((char*)name, type, size, digits) );
+	}
+	return cols;
+}
+
+
+// the array a result column is fetched into
+struct OdbcColumn {
+	SQLSMALLINT cType; // SQL_C_DOUBLE, SQL_C_TYPE_DATE, SQL_C_TYPE_TIMESTAMP or SQL_C_CHAR
+	SQLLEN width; // bytes of one value
+	vector<char> data; // a value for each row of the array
+	vector<SQLLEN> indicators; // length or SQL_NULL_DATA
+};
+
+// one row of the fetched arrays
+class OdbcRow : public DbRow {
+public:
+	OdbcRow(vector<OdbcColumn>& columns) : columns(columns), current(0) {}
+	void SetCurrent(SQLULEN row) {
+		this->current = row;
+	}
+	bool IsNull(int col) {
+		return columns[col-1].indicators[current] == SQL_NULL_DATA;
+	}
+	double GetNumber(int col) {
+		OdbcColumn& c = columns[col-1];
+		if( c.cType != SQL_C_DOUBLE )
+			return atof(this->GetString(col).c_str());
+		double value;
+		memcpy(&value, this->Value(col), sizeof(double));
+		return value;
+	}
+	int GetInt(int col) {
+		return (int)this->GetNumber(col);
+	}
+	string GetString(int col) {
+		OdbcColumn& c = columns[col-1];
+		if( c.cType == SQL_C_DOUBLE )
+			return toString(this->GetNumber(col));
+		if( c.cType != SQL_C_CHAR )
+			return "";
+		// the indicator has the full length even if the value was truncated
+		SQLLEN length = c.indicators[current];
+		if( length < 0 || length > c.width - 1 )
+			length = strlen(this->Value(col));
+		return string(this->Value(col), length);
+	}
+	double GetDate(int col) {
+		if( columns[col-1].cType == SQL_C_TYPE_TIMESTAMP )
+			return (double)(long)(this->GetTimestamp(col) / 86400000);
+		SQL_DATE_STRUCT date;
+		memcpy(&date, this->Value(col), sizeof(date));
+		return DbDays(date.year, date.month, date.day);
+	}
+	double GetTimestamp(int col) {
+		SQL_TIMESTAMP_STRUCT ts;
+		memcpy(&ts, this->Value(col), sizeof(ts));
+		// the fraction is in nanoseconds
+		return DbDays(ts.year, ts.month, ts.day) * 86400000.0
+			   + (ts.hour * 3600 + ts.minute * 60 + ts.second) * 1000.0 + ts.fraction / 1000000;
+	}
+private:
+	const char* Value(int col) {
+		OdbcColumn& c = columns[col-1];
+		return &c.data[current * c.width];
+	}
+	vector<OdbcColumn>& columns;
+	SQLULEN current;
+};
+
+
+OdbcConnect::OdbcConnect(string user, string password, string db) {
+	SQLHENV env = SQL_NULL_HENV;
+	SQLHDBC dbc = SQL_NULL_HDBC;
+	if( !SQL_SUCCEEDED(SQLAllocHandle(SQL_HANDLE_ENV, SQL_NULL_HANDLE, &env)) )
+		throw DbException( "Cannot allocate an ODBC environment" );
+	try {
+		OdbcCheck(SQLSetEnvAttr(env, SQL_ATTR_ODBC_VERSION, (SQLPOINTER)SQL_OV_ODBC3, 0), SQL_HANDLE_ENV, env);
+		OdbcCheck(SQLAllocHandle(SQL_HANDLE_DBC, env, &dbc), SQL_HANDLE_ENV, env);
+		// a connection string has = in it, otherwise it is the name of a data source
+		if( db.find('=') != string::npos ) {
+			string connect = db;
+			if( user != "" )
+				connect += ";UID=" + user;
+			if( password != "" )
+				connect += ";PWD=" + password;
+			OdbcCheck(SQLDriverConnect(dbc, NULL, (SQLCHAR*)connect.c_str(), SQL_NTS, NULL, 0, NULL, SQL_DRIVER_NOPROMPT), SQL_HANDLE_DBC, dbc);
+		} else {
+			OdbcCheck(SQLConnect(dbc, (SQLCHAR*)db.c_str(), SQL_NTS,
+								 (SQLCHAR*)user.c_str(), SQL_NTS, (SQLCHAR*)password.c_str(), SQL_NTS), SQL_HANDLE_DBC, dbc);
+		}
+		// commit explicitly like with Oracle
+		OdbcCheck(SQLSetConnectAttr(dbc, SQL_ATTR_AUTOCOMMIT, (SQLPOINTER)SQL_AUTOCOMMIT_OFF, 0), SQL_HANDLE_DBC, dbc);
+	} catch( ... ) {
+		if( dbc != SQL_NULL_HDBC )
+			SQLFreeHandle(SQL_HANDLE_DBC, dbc);
+		SQLFreeHandle(SQL_HANDLE_ENV, env);
+		throw;
+	}
+	this->env = env;
+	this->dbc = dbc;
+	this->runningStmt = NULL;
+}
+
+
+OdbcConnect::~OdbcConnect(void) {
+	SQLDisconnect((SQLHDBC)this->dbc);
+	SQLFreeHandle(SQL_HANDLE_DBC, (SQLHDBC)this->dbc);
+	SQLFreeHandle(SQL_HANDLE_ENV, (SQLHENV)this->env);
+}
+
+
+// a new statement on the connection
+SQLHSTMT OdbcStatement(void* dbc) {
+	SQLHSTMT stmt = SQL_NULL_HSTMT;
+	OdbcCheck(SQLAllocHandle(SQL_HANDLE_STMT, (SQLHDBC)dbc, &stmt), SQL_HANDLE_DBC, (SQLHDBC)dbc);
+	return stmt;
+}
+
+
+// preparing is enough for the driver to tell the columns
+vector<DbColumnMetaData> OdbcConnect::Describe(string sql) {
+	SQLHSTMT stmt = OdbcStatement(this->dbc);
+	vector<DbColumnMetaData> cols;
+	try {
+		string odbcSql = OdbcSQL(sql);
+		OdbcCheck(SQLPrepare(stmt, (SQLCHAR*)odbcSql.c_str(), SQL_NTS), SQL_HANDLE_STMT, stmt);
+		this->roundTrips++;
+		cols = OdbcDescribe(stmt);
+	} catch( ... ) {
+		SQLFreeHandle(SQL_HANDLE_STMT, stmt);
+		throw;
+	}
+	SQLFreeHandle(SQL_HANDLE_STMT, stmt);
+	return cols;
+}
+
+
+// bind the arrays of the columns for the rows of a fetch, again when they have to grow
+void OdbcBind(SQLHSTMT stmt, vector<OdbcColumn>& columns, SQLULEN rows) {
+	for(size_t i = 0; i < columns.size(); i++) {
+		OdbcColumn& c = columns[i];
+		c.data.assign(rows * c.width, '\0');
+		c.indicators.assign(rows, SQL_NULL_DATA);
+		OdbcCheck(SQLBindCol(stmt, (SQLUSMALLINT)(i+1), c.cType, &c.data[0], c.width, &c.indicators[0]), SQL_HANDLE_STMT, stmt);
+	}
+}
+
+
+// the columns are bound to arrays so each SQLFetch brings as many rows as the fetch sizer asks for
+// numbers are always bound as doubles converted by the driver, which is what the fetch types ask for
+void OdbcConnect::Query(string sql, const vector<DbParam>& params, const vector<DbFetchType>& fetchTypes, DbRowProcessor* processor) {
+	SQLHSTMT stmt = OdbcStatement(this->dbc);
+	this->SetRunning(stmt);
+	try {
+		string odbcSql = OdbcSQL(sql);
+		OdbcCheck(SQLPrepare(stmt, (SQLCHAR*)odbcSql.c_str(), SQL_NTS), SQL_HANDLE_STMT, stmt);
+		// the bound values have to stay in place until the statement is executed
+		vector<double> numbers(params.size());
+		vector<SQLLEN> lengths(params.size());
+		for(size_t i = 0; i < params.size(); i++) {
+			if( params[i].isNumber ) {
+				numbers[i] = params[i].number;
+				lengths[i] = 0;
+				OdbcCheck(SQLBindParameter(stmt, (SQLUSMALLINT)(i+1), SQL_PARAM_INPUT, SQL_C_DOUBLE, SQL_DOUBLE, 0, 0,
+										   &numbers[i], 0, &lengths[i]), SQL_HANDLE_STMT, stmt);
+			} else {
+				lengths[i] = SQL_NTS;
+				SQLULEN size = params[i].text.size() > 0 ? params[i].text.size() : 1;
+				OdbcCheck(SQLBindParameter(stmt, (SQLUSMALLINT)(i+1), SQL_PARAM_INPUT, SQL_C_CHAR, SQL_VARCHAR, size, 0,
+										   (SQLPOINTER)params[i].text.c_str(), 0, &lengths[i]), SQL_HANDLE_STMT, stmt);
+			}
+		}
+		OdbcCheck(SQLExecute(stmt), SQL_HANDLE_STMT, stmt);
+		this->roundTrips++;
+		// bind an array to each column in the type DwColumn is going to ask for
+		vector<DbColumnMetaData> meta = OdbcDescribe(stmt);
+		vector<OdbcColumn> columns(meta.size());
+		size_t rowBytes = 0;
+		for(size_t i = 0; i < meta.size(); i++) {
+			OdbcColumn& c = columns[i];
+			if( meta[i].type == "DATE" ) {
+				c.cType = SQL_C_TYPE_DATE;
+				c.width = sizeof(SQL_DATE_STRUCT);
+			} else if( meta[i].type == "TIMESTAMP" ) {
+				c.cType = SQL_C_TYPE_TIMESTAMP;
+				c.width = sizeof(SQL_TIMESTAMP_STRUCT);
+			} else if( meta[i].type == "VARCHAR2" ) {
+				c.cType = SQL_C_CHAR;
+				c.width = meta[i].size + 1;
+			} else {
+				c.cType = SQL_C_DOUBLE;
+				c.width = sizeof(double);
+			}
+			rowBytes += c.width + sizeof(SQLLEN);
+		}
+		processor->Columns(meta);
+		// the arrays only grow as far as the sizer goes, a small select doesn't allocate the whole budget
+		DbFetchSizer sizer(this->fetchBudget, rowBytes);
+		SQLULEN bound = sizer.Rows();
+		OdbcBind(stmt, columns, bound);
+		SQLULEN fetched = 0;
+		OdbcCheck(SQLSetStmtAttr(stmt, SQL_ATTR_ROW_BIND_TYPE, (SQLPOINTER)SQL_BIND_BY_COLUMN, 0), SQL_HANDLE_STMT, stmt);
+		OdbcCheck(SQLSetStmtAttr(stmt, SQL_ATTR_ROWS_FETCHED_PTR, &fetched, 0), SQL_HANDLE_STMT, stmt);
+		OdbcRow row(columns);
+		while( true ) {
+			SQLULEN rows = sizer.Rows();
+			if( rows > bound ) {
+				bound = rows;
+				OdbcBind(stmt, columns, bound);
+			}
+			// the array size may change between fetches of the same cursor
+			OdbcCheck(SQLSetStmtAttr(stmt, SQL_ATTR_ROW_ARRAY_SIZE, (SQLPOINTER)rows, 0), SQL_HANDLE_STMT, stmt);
+			double start = DbClock();
+			SQLRETURN rc = SQLFetch(stmt);
+			if( rc == SQL_NO_DATA )
+				break;
+			OdbcCheck(rc, SQL_HANDLE_STMT, stmt);
+			this->roundTrips++;
+			// the last one is short, its time says nothing about the size
+			if( fetched == rows )
+				sizer.Measure((unsigned int)rows, DbClock() - start);
+			for(SQLULEN r = 0; r < fetched; r++) {
+				row.SetCurrent(r);
+				processor->Process( &row );
+			}
+		}
+		this->lastFetch = sizer;
+		this->isFetchSized = true;
+	} catch( ... ) {
+		// stop the rest of the rows on the server
+		this->SetRunning(NULL);
+		SQLCancel(stmt);
+		SQLFreeHandle(SQL_HANDLE_STMT, stmt);
+		throw;
+	}
+	this->SetRunning(NULL);
+	SQLFreeHandle(SQL_HANDLE_STMT, stmt);
+}
+
+
+void OdbcConnect::SetRunning(void* stmt) {
+	DwLocked locked(&this->running);
+	this->runningStmt = stmt;
+}
+
+
+// SQLCancel may be called from another thread, the execute or fetch in progress fails with SQLSTATE HY008
+void OdbcConnect::Cancel() {
+	DwLocked locked(&this->running);
+	if( this->runningStmt != NULL )
+		SQLCancel((SQLHSTMT)this->runningStmt);
+}
+
+
+void OdbcConnect::Execute(string sql) {
+	SQLHSTMT stmt = OdbcStatement(this->dbc);
+	string odbcSql = OdbcSQL(sql);
+	SQLRETURN rc = SQLExecDirect(stmt, (SQLCHAR*)odbcSql.c_str(), SQL_NTS);
+	if( rc != SQL_NO_DATA && !SQL_SUCCEEDED(rc) ) {
+		DbException ex = OdbcError(SQL_HANDLE_STMT, stmt);
+		SQLFreeHandle(SQL_HANDLE_STMT, stmt);
+		throw ex;
+	}
+	this->roundTrips++;
+	SQLFreeHandle(SQL_HANDLE_STMT, stmt);
+}
+
+
+// the arrays are bound column-wise and sent with one execute
+void OdbcConnect::ExecuteArray(string sql, vector<DbArrayParam>& params, unsigned int rows) {
+	if( rows == 0 )
+		return;
+	SQLHSTMT stmt = OdbcStatement(this->dbc);
+	try {
+		OdbcCheck(SQLSetStmtAttr(stmt, SQL_ATTR_PARAM_BIND_TYPE, (SQLPOINTER)SQL_PARAM_BIND_BY_COLUMN, 0), SQL_HANDLE_STMT, stmt);
+		OdbcCheck(SQLSetStmtAttr(stmt, SQL_ATTR_PARAMSET_SIZE, (SQLPOINTER)(SQLULEN)rows, 0), SQL_HANDLE_STMT, stmt);
+		// ODBC wants its own length type
+		vector< vector<SQLLEN> > lengths(params.size());
+		for(size_t i = 0; i < params.size(); i++) {
+			DbArrayParam& p = params[i];
+			lengths[i].resize(rows);
+			for(unsigned int r = 0; r < rows; r++)
+				lengths[i][r] = p.indicators[r] == -1 ? SQL_NULL_DATA : p.isNumber ? 0 : SQL_NTS;
+			if( p.isNumber )
+				OdbcCheck(SQLBindParameter(stmt, (SQLUSMALLINT)(i+1), SQL_PARAM_INPUT, SQL_C_DOUBLE, SQL_DOUBLE, 0, 0,
+										   &p.numbers[0], sizeof(double), &lengths[i][0]), SQL_HANDLE_STMT, stmt);
+			else
+				OdbcCheck(SQLBindParameter(stmt, (SQLUSMALLINT)(i+1), SQL_PARAM_INPUT, SQL_C_CHAR, SQL_VARCHAR, p.width - 1, 0,
+										   &p.strings[0], p.width, &lengths[i][0]), SQL_HANDLE_STMT, stmt);
+		}
+		string odbcSql = OdbcSQL(sql);
+		OdbcCheck(SQLExecDirect(stmt, (SQLCHAR*)odbcSql.c_str(), SQL_NTS), SQL_HANDLE_STMT, stmt);
+		this->roundTrips++;
+	} catch( ... ) {
+		SQLFreeHandle(SQL_HANDLE_STMT, stmt);
+		throw;
+	}
+	SQLFreeHandle(SQL_HANDLE_STMT, stmt);
+}
+
+
+void OdbcConnect::Commit() {
+	OdbcCheck(SQLEndTran(SQL_HANDLE_DBC, (SQLHDBC)this->dbc, SQL_COMMIT), SQL_HANDLE_DBC, (SQLHDBC)this->dbc);
+	this->roundTrips++;
+}
+
+
+// FETCH FIRST of SQL:2008, which most databases understand by now
+string OdbcConnect::LimitSQL(string sql, string whereSql, int rows, string orderSql) {
+	if( rows == 0 )
+		whereSql = whereSql != "" ? "(" + whereSql + ") and 1=0" : "1=0";
+	if( whereSql != "" )
+		sql += " where " + whereSql;
+	if( orderSql != "" )
+		sql += " order by " + orderSql;
+	return rows > 0 ? sql + " fetch first " + toString(rows) + " rows only" : sql;
+}
+
+
+// there is no row address in standard SQL
+string OdbcConnect::RowOrderSQL(string alias) {
+	return "";
+}
+
+
+// date arithmetic differs between databases and the escape for it can overflow, so the client converts them
+string OdbcConnect::DateTimeSQL(string column, bool isTimestamp) {
+	return "";
+}
+
+
+// the scalar function escape is translated by the driver, it counts characters
+string OdbcConnect::TruncateSQL(string column, int bytes) {
+	return "{fn SUBSTRING(" + column + ", 1, " + toString(bytes) + ")}";
+}
+
+
+// the escapes can't add milliseconds, the driver converts the text of the value to the type of the column
+string OdbcConnect::DateTimeValueSQL(string value, bool isTimestamp) {
+	return "";
+}
+
+
+// there is no percentile aggregate in ODBC's escapes and the drivers don't agree on one, the summary computes it
+string OdbcConnect::PercentileSQL(string column, double fraction) {
+	return "";
+}
+
+
+// where the nulls go differs between databases, and text is sorted by the collation of the column
+string OdbcConnect::SortSQL(string column, bool isText, bool isNullFirst) {
+	return "case when " + column + " is null then " + (isNullFirst ? "0 else 1" : "1 else 0") + " end, " + column;
+}
+
+#endif
@@ -3,6 +3,12 @@
 #include <algorithm> 
 
 bool ALWAYS_LOG_COMMANDS = true;
+const int DEFAULT_BATCH_SIZE = 10000; // rows in one array insert
+const int DEFAULT_PROGRESS_ROWS = 100000; // rows between progress messages when progress has no number
+const int DEFAULT_ENCODE_MAX = 1000; // most distinct values of a column to encode
+const int DEFAULT_PREFETCH_MB = 256; // memory for the rows fetched before LOAD
+const int DEFAULT_PARALLEL = 4; // tables extracted at once by BATCH
+const int DEFAULT_FETCH_MB = 16; // rows of a select on the client, shared by the connections of a BATCH
 
 OptionParser::OptionParser(set<string> keys) {
 	// keys are assumed to be lowercase and casing will be ignored
@@ -14,9 +20,17 @@ map<string,string> OptionParser::Parse(vector<string> words) {
 	map<string,string> options;	
 	// parse words into dictionary: if the current word is not a keyword add it to the already parsed part, if it is, add a new entry	
 	string currentKey;
+	// the if expression goes until using, so its columns and words can be named like options
+	size_t lastUsing = words.size();
+	for( size_t i=0; i < words.size(); i++ ) {
+		if( lowerCase(words[i]) == "using" )
+			lastUsing = i;
+	}
 	for( size_t i=0; i < words.size(); i++ ) {
 		// if the current word is a keyword, use it from now
 		bool isKeyword = this->keys.find(lowerCase(words[i])) != this->keys.end();
+		if( currentKey == "if" && i < lastUsing )
+			isKeyword = lowerCase(words[i]) == "using";
 		if( isKeyword ) {
 			currentKey = lowerCase(words[i]);
 			// take note in the map that the option was there, so it is at least a flag
@@ -43,16 +57,40 @@ bool hasKeyword(vector<string> words, string word) {
 }
 
 // parse a STATA command 
-DwUseOptions* DwUseOptionParser::Parse(vector<string> words) {	
+DwUseOptions* DwUseOptionParser::Parse(vector<string> words, bool isSummary) {	
 
 	// there are 10 keywords we expect to see
 	string keys[] = {"variables", "if", "using", "limit",
 					 "nulldata", "lowercase", "uppercase", 
 					 "label_variable", "label_values", 
-					 "username", "password", "database"};
+					 "username", "password", "database",
+					 "keys", "keys_inplace",
+					 "types", "create_table", "append", "batch_size",
+					 "profile", "profile_columns", "progress", "backend",
+					 "encode", "encode_max", "translate", "prefetch",
+					 "parallel", "saving",
+					 "explain", "max_rows", "max_mb", "max_cost", "max_full_scans", "force",
+					 "footprint", "memory", "fetch_mb", "daemon", "sort",
+					 "db_convert"};
 	size_t nkeys(sizeof(keys) / sizeof(string));
+	set<string> keywords(keys, keys + nkeys);
+	// the options of SUMMARIZE and TABULATE are common words, elsewhere they can be variables
+	if( isSummary ) {
+		keywords.insert("detail");
+		keywords.insert("missing");
+	}
 	// create parser that accepts these keywords
-	OptionParser* parser = new OptionParser( set<string>(keys, keys + nkeys) );
+	OptionParser* parser = new OptionParser( keywords );
+
+	// STATA keeps sort(id date) together with the first variable, the keyword has to be a word of its own
+	for( size_t i=0; i < words.size(); i++ ) {
+		if( lowerCase(words[i].substr(0, 5)) == "sort(" ) {
+			string rest = words[i].substr(5);
+			words[i] = "sort";
+			if( rest != "" )
+				words.insert(words.begin() + i + 1, rest);
+		}
+	}
 
 	// prepare another vector where we can search 
 
@@ -85,6 +123,27 @@ void DwUseOptions::Validate() {
 	ThrowIfHasValue("lowercase");
 	ThrowIfHasValue("uppercase");
 	ThrowIfHasValue("nulldata");
+	ThrowIfHasValue("keys_inplace");
+	ThrowIfHasValue("create_table");
+	ThrowIfHasValue("append");
+	ThrowIfHasValue("profile");
+	ThrowIfHasValue("profile_columns");
+	ThrowIfHasValue("explain");
+	ThrowIfHasValue("force");
+	ThrowIfHasValue("footprint");
+	ThrowIfHasValue("detail");
+	ThrowIfHasValue("missing");
+	ThrowIfHasValue("db_convert");
+	if( this->HasOption("keys") && this->Keys().find(" ") != string::npos )
+		throw DwUseException( "Only one key column can be given: " + this->Keys() ); 
+	if( this->IsKeysInPlace() && this->Keys() == "" )
+		throw DwUseException( "keys_inplace needs the key column given with keys <column>" ); 
+	if( this->IsKeysInPlace() && this->Sort().size() > 0 )
+		throw DwUseException( "sort can't be used with keys_inplace, the rows go to the observations of their keys" ); 
+	if( this->HasOption("sort") && this->Sort().size() == 0 )
+		throw DwUseException( "List the variables to sort by with sort(<varlist>)" ); 
+	// parse the joins to see that they are well formed
+	this->Joins();
 }
 
 
@@ -132,18 +191,48 @@ vector<string> DwUseOptions::Variables() {
 	return this->GetOptionAsList("variables");
 }
 
+// the first word after using is the main table, the rest are joins
 string DwUseOptions::Table() {
-	return this->GetOption("using"); 
+	vector<string> words = split(this->GetOption("using"), ' ');
+	return words.size() > 0 ? words[0] : ""; 
+}
+
+vector<DwJoin> DwUseOptions::Joins() {
+	// separate the parentheses so that on(k1), on (k1) and on( k1 ) all look the same
+	string clause = this->GetOption("using");
+	clause = replaceAll(clause, "(", " ( ");
+	clause = replaceAll(clause, ")", " ) ");
+	clause = replaceAll(clause, ",", " ");
+	vector<string> parts = split(clause, ' ');
+	vector<string> words;
+	for( size_t i = 0; i < parts.size(); i++ ) {
+		if( parts[i] != "" ) 
+			words.push_back(parts[i]);
+	}
+	vector<DwJoin> joins;
+	size_t i = 1; // after the main table
+	while( i < words.size() ) {
+		if( lowerCase(words[i]) != "join" || i + 3 >= words.size() 
+			|| lowerCase(words[i+2]) != "on" || words[i+3] != "(" ) {
+			throw DwUseException( "Could not parse the table name (found \"" + this->GetOption("using") 
+									+ "\"). Are you missing a using keyword or mis-typed the one after the table name? Joins are written as join <table> on(<keys>)." ); 
+		}
+		DwJoin join;
+		join.table = words[i+1];
+		for( i += 4; i < words.size() && words[i] != ")"; i++ ) {
+			join.keys.push_back(words[i]);
+		}
+		if( i >= words.size() || join.keys.size() == 0 )
+			throw DwUseException( "Missing join keys for " + join.table + ", use join <table> on(<keys>)." ); 
+		joins.push_back(join);
+		i++; // closing parenthesis
+	}
+	return joins;
 }
 
-// parse the if expression and translate it to SQL
-string DwUseOptions::WhereSQL() {
-	string filter = this->GetOption("if");
-	filter = replaceAll(filter, "|", " or ");
-	filter = replaceAll(filter, "&", " and ");
-	filter = replaceAll(filter, "==", "=");
-	//filter = replaceAll(filter, "\"", "'"); // command lines don't pass ", but some variables can contain them in their names
-	return filter;
+// the if expression as it was typed, the query compiles it once the columns are known
+string DwUseOptions::Filter() {
+	return this->GetOption("if");
 }
 
 bool DwUseOptions::IsNullData() {
@@ -176,6 +265,132 @@ set<string> DwUseOptions::LabelValues() {
 	return set<string>(lst.begin(), lst.end());
 }
 
+bool DwUseOptions::IsTranslate() {
+	return this->HasOption("translate"); 
+}
+
+set<string> DwUseOptions::Translate() {
+	vector<string> lst = this->GetOptionAsList("translate", true);
+	return set<string>(lst.begin(), lst.end());
+}
+
+bool DwUseOptions::IsPrefetch() {
+	return this->HasOption("prefetch");
+}
+
+// prefetch <MB>
+size_t DwUseOptions::PrefetchBytes() {
+	int mb = atoi(this->GetOption("prefetch").c_str());
+	return (size_t)(mb > 0 ? mb : DEFAULT_PREFETCH_MB) * 1024 * 1024;
+}
+
+// daemon <socket>, empty to connect directly
+string DwUseOptions::Daemon() {
+	return this->GetOption("daemon");
+}
+
+// fetch_mb <MB>
+size_t DwUseOptions::FetchBytes() {
+	int mb = atoi(this->GetOption("fetch_mb").c_str());
+	return (size_t)(mb > 0 ? mb : DEFAULT_FETCH_MB) * 1024 * 1024;
+}
+
+// parallel <n>
+int DwUseOptions::Parallel() {
+	int n = atoi(this->GetOption("parallel").c_str());
+	return n > 0 ? n : DEFAULT_PARALLEL;
+}
+
+// the .dta file of a BATCH job, the table name if not given
+string DwUseOptions::Saving() {
+	string file = this->GetOption("saving");
+	if( file == "" )
+		file = this->Table() + ".dta";
+	return replaceAll(file, "\"", "");
+}
+
+// explain on its own only reports, a threshold checks as well
+bool DwUseOptions::IsExplain() {
+	return this->HasOption("explain") || this->MaxRows() >= 0 || this->MaxBytes() >= 0 
+		|| this->MaxCost() >= 0 || this->MaxFullScans() >= 0;
+}
+
+double DwUseOptions::GetOptionAsLimit(string name) {
+	if( !this->HasOption(name) || this->GetOption(name) == "" )
+		return -1;
+	return atof(this->GetOption(name).c_str());
+}
+
+double DwUseOptions::MaxRows() {
+	return this->GetOptionAsLimit("max_rows");
+}
+
+// max_mb <n>
+double DwUseOptions::MaxBytes() {
+	double mb = this->GetOptionAsLimit("max_mb");
+	return mb >= 0 ? mb * 1024 * 1024 : -1;
+}
+
+double DwUseOptions::MaxCost() {
+	return this->GetOptionAsLimit("max_cost");
+}
+
+int DwUseOptions::MaxFullScans() {
+	return (int)this->GetOptionAsLimit("max_full_scans");
+}
+
+bool DwUseOptions::IsForce() {
+	return this->HasOption("force");
+}
+
+// sort(<varlist>), the parentheses are optional
+vector<string> DwUseOptions::Sort() {
+	string opt = replaceAll(replaceAll(this->GetOption("sort"), "(", " "), ")", " ");
+	vector<string> words = split(replaceAll(opt, ",", " "), ' ');
+	vector<string> names;
+	for( size_t i = 0; i < words.size(); i++ ) {
+		if( words[i] != "" )
+			names.push_back(words[i]);
+	}
+	return names;
+}
+
+bool DwUseOptions::IsDetail() {
+	return this->HasOption("detail");
+}
+
+bool DwUseOptions::IsMissing() {
+	return this->HasOption("missing");
+}
+
+bool DwUseOptions::IsFootprint() {
+	return this->HasOption("footprint");
+}
+
+bool DwUseOptions::IsDbConvert() {
+	return this->HasOption("db_convert");
+}
+
+// memory <MB>
+double DwUseOptions::MemoryBytes() {
+	double mb = this->GetOptionAsLimit("memory");
+	return mb >= 0 ? mb * 1024 * 1024 : -1;
+}
+
+bool DwUseOptions::IsEncode() {
+	return this->HasOption("encode"); 
+}
+
+set<string> DwUseOptions::Encode() {
+	vector<string> lst = this->GetOptionAsList("encode", true);
+	return set<string>(lst.begin(), lst.end());
+}
+
+int DwUseOptions::EncodeMax() {
+	int max = atoi(this->GetOption("encode_max").c_str());
+	return max > 0 ? max : DEFAULT_ENCODE_MAX;
+}
+
 int DwUseOptions::Limit() {
 	if(!this->HasOption("limit")) 
 		return 0;
@@ -183,12 +398,68 @@ int DwUseOptions::Limit() {
 	return atoi(limit.c_str());
 }
 
+string DwUseOptions::Keys() {
+	return this->GetOption("keys");
+}
+
+bool DwUseOptions::IsKeysInPlace() {
+	return this->HasOption("keys_inplace");
+}
+
+vector<string> DwUseOptions::Types() {
+	return this->GetOptionAsList("types");
+}
+
+bool DwUseOptions::IsCreateTable() {
+	return this->HasOption("create_table");
+}
+
+bool DwUseOptions::IsAppend() {
+	return this->HasOption("append");
+}
+
+int DwUseOptions::BatchSize() {
+	int size = atoi(this->GetOption("batch_size").c_str());
+	return size > 0 ? size : DEFAULT_BATCH_SIZE;
+}
+
 // for basic data and formatting we can use the macro variables but for labeling we can't
 bool DwUseOptions::IsLogCommands() {
 	return ALWAYS_LOG_COMMANDS 
 		|| this->HasOption("log_commands") 
 		|| this->IsLabelValues() 
-		|| this->IsLabelValues(); 
+		|| this->IsLabelValues()
+		|| this->IsEncode(); 
+}
+
+
+bool DwUseOptions::IsProfile() {
+	return this->HasOption("profile");
+}
+
+bool DwUseOptions::IsProfileColumns() {
+	return this->HasOption("profile_columns");
+}
+
+string DwUseOptions::Backend() {
+	string backend = lowerCase(this->GetOption("backend"));
+	return backend != "" ? backend : "oracle";
+}
+
+bool DwUseOptions::HasCredentials() {
+	if( this->Backend() != "oracle" )
+		return this->Database() != "";
+	return this->Database() != "" && this->Username() != "" && this->Password() != "";
+}
+
+// progress [<rows>], without it (or with 0) LOAD prints no messages
+int DwUseOptions::ProgressRows() {
+	if( !this->HasOption("progress") )
+		return 0;
+	string rows = this->GetOption("progress");
+	if( rows == "" )
+		return DEFAULT_PROGRESS_ROWS;
+	return max(atoi(rows.c_str()), 0);
 }
 
 
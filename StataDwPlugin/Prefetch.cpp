@@ -0,0 +1,189 @@
+#include "dwplugin.h"
+#include "strutils.h"
+#include <cstring>
+
+const int SPOOL_BATCH_ROWS = 10000; // rows handed over at once
+const int CANCEL_RETRY_MS = 100; // wait for the fetch to stop before cancelling again
+
+
+DwSpoolBatch::DwSpoolBatch(int width) {
+	this->width = width;
+	this->rows = 0;
+	// the empty string of the numbers and nulls
+	this->text.push_back('\0');
+}
+
+void DwSpoolBatch::AddNull() {
+	this->nulls.push_back(1);
+	this->numbers.push_back(0);
+	this->offsets.push_back(0);
+}
+
+void DwSpoolBatch::AddNumber(double number) {
+	this->nulls.push_back(0);
+	this->numbers.push_back(number);
+	this->offsets.push_back(0);
+}
+
+void DwSpoolBatch::AddString(const string& text) {
+	this->nulls.push_back(0);
+	this->numbers.push_back(0);
+	this->offsets.push_back(this->text.size());
+	this->text.insert(this->text.end(), text.begin(), text.end());
+	this->text.push_back('\0');
+}
+
+size_t DwSpoolBatch::Bytes() {
+	return this->nulls.capacity() + this->numbers.capacity() * sizeof(double)
+		   + this->offsets.capacity() * sizeof(size_t) + this->text.capacity();
+}
+
+
+// thrown on the thread to leave the fetch when the prefetch is freed early
+class DwSpoolStopped {
+};
+
+// copies the rows into batches and hands them over to the prefetch
+// Select takes a copy, so the batch being filled is kept by the caller
+class SpoolWriter {
+public:
+	SpoolWriter(DwPrefetch* prefetch, const vector<DwColumn*>& columns, int obsPosition, DwSpoolBatch*& batch)
+		: prefetch(prefetch), columns(columns), obsPosition(obsPosition), batch(batch) {
+	}
+	void operator()( DbRow* row ) {
+		if( this->batch == NULL )
+			this->batch = new DwSpoolBatch(this->columns.size() + (this->obsPosition > 0 ? 1 : 0));
+		for(size_t i = 0; i < this->columns.size(); i++)
+			this->columns[i]->CopyValue(row, this->batch);
+		if( this->obsPosition > 0 )
+			this->batch->AddNumber(row->GetInt(this->obsPosition));
+		if( ++this->batch->rows == SPOOL_BATCH_ROWS )
+			this->Flush();
+	}
+	// hand over what is in the batch so far
+	void Flush() {
+		if( this->batch != NULL ) {
+			DwSpoolBatch* full = this->batch;
+			this->batch = NULL;
+			this->prefetch->Put(full);
+		}
+	}
+	// free the batch if the fetch stopped half way
+	void Discard() {
+		if( this->batch != NULL )
+			delete this->batch;
+		this->batch = NULL;
+	}
+private:
+	DwPrefetch* prefetch;
+	const vector<DwColumn*>& columns;
+	int obsPosition;
+	DwSpoolBatch*& batch;
+};
+
+
+DwPrefetch::DwPrefetch(DbConnect* conn, string sql, const vector<DbParam>& params, const vector<DbFetchType>& fetchTypes,
+					   const vector<DwColumn*>& columns, int obsPosition, size_t maxBytes)
+	: conn(conn), sql(sql), params(params), fetchTypes(fetchTypes), columns(columns), obsPosition(obsPosition), maxBytes(maxBytes) {
+	this->readyBytes = 0;
+	this->done = false;
+	this->stopping = false;
+	this->failed = false;
+	this->errorCode = 0;
+	this->Start();
+}
+
+
+DwPrefetch::~DwPrefetch() {
+	{
+		DwLocked locked(&this->monitor);
+		this->stopping = true;
+		this->monitor.WakeAll();
+		// a fetch waiting for the server would only notice stopping after its round trip (e.g. after Break),
+		// the select is cancelled until the thread is out as it may not have been started at the first try
+		while( !this->done ) {
+			this->monitor.Unlock();
+			this->conn->Cancel();
+			this->monitor.Lock();
+			if( !this->done )
+				this->monitor.Wait(CANCEL_RETRY_MS);
+		}
+	}
+	this->Join();
+	for(size_t i = 0; i < this->ready.size(); i++)
+		delete this->ready[i];
+}
+
+
+// on the thread: run the query until the end, an error or being stopped
+void DwPrefetch::Run() {
+	DwSpoolBatch* batch = NULL;
+	SpoolWriter writer(this, this->columns, this->obsPosition, batch);
+	bool failed = false;
+	string error;
+	int errorCode = 0;
+	try {
+		this->conn->Select(writer, this->sql, this->params, this->fetchTypes);
+		writer.Flush();
+	} catch( const DwSpoolStopped& ) {
+	} catch( const DbException& ex ) {
+		failed = true;
+		error = ex.getMessage();
+		errorCode = ex.getErrorCode();
+	} catch( ... ) {
+		failed = true;
+		error = "An unexpected error occured while prefetching the rows.";
+	}
+	writer.Discard();
+	DwLocked locked(&this->monitor);
+	this->failed = failed;
+	this->error = error;
+	this->errorCode = errorCode;
+	this->done = true;
+	this->monitor.WakeAll();
+}
+
+
+// on the thread: hand over a batch, wait while the cap is reached
+void DwPrefetch::Put(DwSpoolBatch* batch) {
+	DwLocked locked(&this->monitor);
+	while( !this->stopping && this->readyBytes >= this->maxBytes && this->ready.size() > 0 )
+		this->monitor.Wait();
+	if( this->stopping ) {
+		delete batch;
+		throw DwSpoolStopped();
+	}
+	this->ready.push_back(batch);
+	this->readyBytes += batch->Bytes();
+	this->monitor.WakeAll();
+}
+
+
+DwSpoolBatch* DwPrefetch::Take() {
+	DwLocked locked(&this->monitor);
+	while( this->ready.size() == 0 && !this->done )
+		this->monitor.Wait();
+	if( this->ready.size() > 0 ) {
+		DwSpoolBatch* batch = this->ready.front();
+		this->ready.pop_front();
+		this->readyBytes -= batch->Bytes();
+		// there is room for the fetch again
+		this->monitor.WakeAll();
+		return batch;
+	}
+	// the rows before the error were loaded
+	if( this->failed )
+		throw DbException(this->error, this->errorCode);
+	return NULL;
+}
+
+
+void DwPrefetch::Release(DwSpoolBatch* batch) {
+	delete batch;
+}
+
+
+bool DwPrefetch::IsDone() {
+	DwLocked locked(&this->monitor);
+	return this->done;
+}
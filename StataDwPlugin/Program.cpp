@@ -2,6 +2,9 @@
 #include "dwplugin.h"
 #include "dwuse.h"
 #include "strutils.h"
+#include <algorithm>
+#include <cstdlib>
+#include <ctime>
 #include <iostream>
 #include <fstream>
 
@@ -9,33 +12,13 @@
 // variables that need to be remembered between calls
 DwUseOptions* defaultOptions = NULL;
 DwUseQuery* query = NULL;
+vector<DwMatrix> results; // of the last SUMMARIZE or TABULATE until RESULTS stores them
 const string COMMAND_LOG_FILE = "dwcommands.do";
 const bool WRITE_MACRO_VARIABLES = false; // use the log file
-
-// convert string to something STATA can print
-char* toStataString( string msg ) {
-	//return (char*) msg.c_str();
-
-	/*
-	vector<char> charr(msg.length() + 1);
-	copy(msg.begin(), msg.end(), charr.begin());
-	return &*charr.begin();
-	*/
-
-	// it seems the above calls lose their reference to the underlying string by the time 
-	// STATA can print the value, thus it only prints garbage. with this we should call delete[] charr;
-	char* charr = new char[msg.length()+1];
-	strcpy(charr, msg.c_str());
-	return charr;
-}
-
-
-// convert a string for STATA, print it, then free the array
-void stataDisplay( string msg ) {
-	char* charr = toStataString(msg);
-	SF_display(charr);
-	delete[] charr;
-}
+const int MACRO_BUFFER_SIZE = 4096; // longest macro value read for placeholders
+const int STRING_BUFFER_SIZE = 2046; // longest str# value read from the dataset
+const size_t LABEL_LINE_BYTES = 8192; // longest label define line of the do file, the rest of the set is added
+const size_t EXTRACT_BUFFER_MB = 8; // lines collected before a write of the console extractor
 
 
 class CommandPrinter {
@@ -56,12 +39,16 @@ public:
 			//stataDisplay(cmd);
 			//stataDisplay("\n");
 			// this->commandlog << cmd << endl;
+#ifdef _WIN32
 			// Now convert utf-8 back to ANSI:
 			wchar_t *wText = CodePageToUnicode(65001,cmd.c_str());
 			char *ansiText = UnicodeToCodePage(1252,wText);
 			fprintf(this->commandlog,"%s\n",ansiText);
 			delete [] ansiText;
 			delete [] wText;
+#else
+			fprintf(this->commandlog,"%s\n",cmd.c_str());
+#endif
 		}
     } 
 private:
@@ -72,6 +59,140 @@ private:
 
 
 
+// look up :name placeholders of the if expression in STATA
+// a scalar is bound as a number, a local or global macro as a string
+class StataParameterResolver : public ParameterResolver {
+public:
+	virtual DbParam Resolve(string name) {
+		double number;
+		char* scalarName = toStataString(name);
+		int rc = SF_scal_use(scalarName, &number);
+		delete[] scalarName;
+		if( rc == 0 ) {
+			if( SF_is_missing(number) )
+				throw DwUseException( "The scalar " + name + " used as :" + name + " is missing." );
+			return DbParam(number);
+		}
+		// locals are visible to plugins with an underscore prefix
+		string value = this->MacroValue("_" + name);
+		if( value == "" )
+			value = this->MacroValue(name);
+		if( value == "" )
+			throw DwUseException( "There is no scalar, local or global macro called " + name + " for :" + name + "." );
+		return DbParam(value);
+	}
+private:
+	string MacroValue(string name) {
+		char* macroName = toStataString(name);
+		vector<char> buffer(MACRO_BUFFER_SIZE, '\0');
+		int rc = SF_macro_use(macroName, &buffer[0], (int)buffer.size());
+		delete[] macroName;
+		return rc == 0 ? string(&buffer[0]) : "";
+	}
+};
+
+
+// read variables passed to the plugin call, e.g. the key variable for the keys option
+// plugin call DW_use firm_id, CREATE using tenytabla keys TORZSSZAM
+class StataDatasetReader : public DatasetReader {
+public:
+	virtual int Count() {
+		return SF_nobs();
+	}
+	virtual bool Read(int var, int obs, bool asNumber, double& number, string& text) {
+		if( SF_nvars() < var )
+			throw DwUseException( "Pass the variables to the plugin call, there are only " + toString(SF_nvars()) + "." );
+		if( asNumber ) {
+			if( SF_vdata(var, obs, &number) != 0 )
+				throw DwUseException( "Variable " + toString(var) + " of the plugin call must be numeric." );
+			return !SF_is_missing(number);
+		}
+		char buffer[STRING_BUFFER_SIZE];
+		buffer[0] = '\0';
+		if( SF_sdata(var, obs, buffer) != 0 )
+			throw DwUseException( "Variable " + toString(var) + " of the plugin call must be a string." );
+		text = buffer;
+		return text != "";
+	}
+};
+
+
+// save the timings and counters of the last call as STATA scalars and print them with the PROFILE option
+void publishStats( DwUseQuery* q ) {
+	DwStats* stats = q->Stats();
+	for(int i = 0; i < PHASE_COUNT; i++) {
+		DwPhase phase = (DwPhase)i;
+		char* name = toStataString("dw_t_" + DwStats::PhaseName(phase));
+		SF_scal_save(name, stats->Seconds(phase));
+		delete[] name;
+	}
+	SF_scal_save("dw_rows", stats->rows);
+	SF_scal_save("dw_cells", stats->cells);
+	SF_scal_save("dw_bytes", stats->bytes);
+	SF_scal_save("dw_roundtrips", stats->roundTrips);
+	SF_scal_save("dw_fetch_rows", stats->fetchRows);
+	if( q->IsProfile() ) {
+		vector<string> lines = stats->Summary();
+		for(size_t i = 0; i < lines.size(); i++)
+			stataDisplay(lines[i] + "\n");
+	}
+	if( stats->IsProfileColumns() && stats->rows > 0 ) {
+		vector<string> lines = stats->ColumnSummary();
+		for(size_t i = 0; i < lines.size(); i++)
+			stataDisplay(lines[i] + "\n");
+	}
+}
+
+
+// a label text as a compound quoted string of the do file, breaking the quotes inside it with a space
+// and escaping the macro characters, "$US" or "`x'" would be expanded (to nothing) otherwise
+string CompoundQuote( string text ) {
+	text = replaceAll(replaceAll(text, "\r", " "), "\n", " ");
+	text = replaceAll(replaceAll(text, "`\"", "` \""), "\"'", "\" '");
+	text = replaceAll(replaceAll(text, "`", "\\`"), "$", "\\$");
+	return "`\"" + text + "\"'";
+}
+
+
+// the label define commands of a value label set, STATA parses one huge line slowly (or not at all)
+// so large sets are split into lines adding to the set
+vector<string> LabelDefineCommands( string labelName, const map<string,string>& labels ) {
+	vector<string> commands;
+	string values;
+	for( map<string,string>::const_iterator ii = labels.begin(); ii != labels.end(); ++ii ) {
+		values += (*ii).first + " " + CompoundQuote((*ii).second) + " ";
+		if( values.size() >= LABEL_LINE_BYTES ) {
+			commands.push_back("label define " + labelName + " " + values + (commands.size() > 0 ? ", add" : ""));
+			values = "";
+		}
+	}
+	if( values != "" || commands.size() == 0 )
+		commands.push_back("label define " + labelName + " " + values + (commands.size() > 0 ? ", add" : ""));
+	return commands;
+}
+
+
+// the variables of the sort option separated by spaces
+string SortedBy( DwUseQuery* q ) {
+	string names;
+	vector<int> sorted = q->SortVariables();
+	for(size_t i = 0; i < sorted.size(); i++)
+		names += (i > 0 ? " " : "") + q->Columns()[sorted[i] - 1]->VariableName();
+	return names;
+}
+
+// whether the last LOAD filled the variables of the sort option, sorting by empty ones would shuffle the rows
+bool IsSortLoaded( DwUseQuery* q ) {
+	vector<int> loaded = q->LoadVariables();
+	vector<int> sorted = q->SortVariables();
+	for(size_t i = 0; i < sorted.size(); i++) {
+		if( find(loaded.begin(), loaded.end(), sorted[i]) == loaded.end() )
+			return false;
+	}
+	return true;
+}
+
+
 // following functions are called by stata_call function down below
 // start STATA with a start.bat file that adds the path to the Oracle client DLL-s first
 
@@ -96,18 +217,20 @@ int setDefaultOptions( vector<string> args ) {
 		delete parser;
 
 		// if the username and password is set, see if they work
-		if( defaultOptions->Username() != "" && defaultOptions->Password() != "" && defaultOptions->Database() != "" ) {
-			DbConnect* conn = new DbConnect( defaultOptions->Username(),
-										     defaultOptions->Password(),
-											 defaultOptions->Database() );
+		if( defaultOptions->HasCredentials() ) {
+			DbConnect* conn = DbConnect::Open( defaultOptions->Backend(),
+											   defaultOptions->Username(),
+										       defaultOptions->Password(),
+											   defaultOptions->Database(),
+											   defaultOptions->Daemon() );
 			delete conn;
 		}
 	}
-	catch( SQLException ex ) {
+	catch( const DbException& ex ) {
 		stataDisplay( "Error: " + ex.getMessage() + "\n" );
 	}
 	// show errors
-	catch( exception ex ) {
+	catch( const exception& ex ) {
 		string msg = string(ex.what());
 		stataDisplay( "Error: "+msg+"\n" );
 	}
@@ -142,14 +265,14 @@ int createDataSet( vector<string> args ) {
 		}
 
 		// some error checking
-		if(options->Database() == "" || options->Username() == "" || options->Password() == "") {
+		if( !options->HasCredentials() ) {
 			throw DwUseException( "Database credentials are missing!" ); 
 		}
-		if(options->Table().find(" ") != string::npos || options->Table() == "") {
+		if(options->Table() == "") {
 			throw DwUseException( "Could not parse the table name (found \"" + options->Table() 
 									+ "\"). Are you missing a using keyword or mis-typed the one after the table name?" ); 
 		}
-		// check non-sense
+		// check non-sense, including the joins after the table name
 		options->Validate();
 
 		// http://www.stata.com/support/faqs/data-management/using-plugin-to-connect-to-database/
@@ -165,10 +288,33 @@ int createDataSet( vector<string> args ) {
 			query = NULL;
 		}
 		// if there is anything wrong the query will raise exceptions
-		query = new DwUseQuery(options); // will free options on its own
+		StataParameterResolver resolver;
+		query = new DwUseQuery(options, &resolver); // will free options on its own
+
+		// semi-join with the keys of the dataset in memory
+		if( options->Keys() != "" ) {
+			StataDatasetReader keys;
+			int uploaded = query->UploadKeys(&keys);
+			stataDisplay("Uploaded " + toString(uploaded) + " keys to match with " + options->Keys() + ". \n");
+		}
+
+		// see what the query would cost before counting, encoding or loading anything
+		if( options->IsExplain() ) {
+			vector<string> lines = query->Preflight();
+			for(size_t i = 0; i < lines.size(); i++)
+				stataDisplay(lines[i] + "\n");
+		}
+
+		// string columns with few values become codes, their labels are printed below
+		if( options->IsEncode() ) {
+			int encoded = query->Encode();
+			stataDisplay("Encoded " + toString(encoded) + " string columns as numeric codes with value labels. \n");
+		}
 
 		// the NULLDATA option means we just want to put labels on an existing dataset
+		// placing rows by key adds variables to the dataset we already have
 		bool printDataCommands = !options->IsNullData();
+		bool printObsCommand = printDataCommands && !options->IsKeysInPlace();
 		bool printLabelCommands = true;
 
 		// will print STATA commands that can be executed later
@@ -177,11 +323,39 @@ int createDataSet( vector<string> args ) {
 
 		// count the rows, next time we shall run the query as well
 		stata_obs = toString(query->RowCount());
+
+		// see whether the dataset fits before an hour of LOAD finds out
 		if( printDataCommands ) {
+			double observations = options->IsKeysInPlace() ? SF_nobs() : query->LastRowCount();
+			double bytes = observations * query->ObservationWidth();
+			bool isOver = options->MemoryBytes() >= 0 && bytes > options->MemoryBytes();
+			vector<string> lines = query->Footprint(observations, options->IsFootprint() || isOver);
+			for(size_t i = 0; i < lines.size(); i++)
+				stataDisplay(lines[i] + "\n");
+			if( isOver ) {
+				string msg = "That is over memory " + toString(options->MemoryBytes() / 1048576) + " MB. Leave the widest variables out "
+							 "of the varlist, narrow the if condition, or encode strings with few values";
+				if( !options->IsForce() )
+					throw DwUseException( msg + ". Add force to create it anyway." );
+				stataDisplay("Warning: " + msg + ". \n");
+			}
+			// STATA itself knows how much it may use, max_memory is missing if there is no limit
+			char needed[32];
+			sprintf(needed, "%.0f", bytes);
+			printCommand("if c(memory) + " + string(needed) + " > c(max_memory) {");
+			printCommand("	display as error \"The dataset needs " + string(needed) + " bytes more memory than set max_memory allows.\"");
+			printCommand("	exit 909");
+			printCommand("}");
+		}
+		if( printObsCommand ) {
 			printCommand("set obs " + stata_obs);
 			printCommand("");
 		}
 
+		// what the value labels take in the do file
+		int labelSets = 0, labelLines = 0;
+		double labelCount = 0, labelBytes = 0, labelSeconds = 0;
+
 		// display labels
 		for( vector<DwColumn*>::const_iterator ii = query->Columns().begin(); ii != query->Columns().end(); ii++ ) {
 			stata_vars    += (*ii)->VariableName() + " "; // TODO: spaces in labels will not work with the default mysql style macro
@@ -206,31 +380,62 @@ int createDataSet( vector<string> args ) {
 				if( (*ii)->IsLabelVariable() ) {
 					// label variable REPRKOD6 "Almakompot"
 					string labelVar = "label variable " 
-						+ (*ii)->VariableName() + " \"" + (*ii)->ColumnLabel() + "\" ";
+						+ (*ii)->VariableName() + " " + CompoundQuote((*ii)->ColumnLabel());
 					printCommand(labelVar);
 				}
 				// instead of translating the column contents, print commands they can run to let STATA label them
 				if( (*ii)->IsLabelValues() ) {
 					// label define honap_label 1 "Janur" 2 "Februr"
 					// label values HONAP honap_label
-					string labelDef = "label define " + (*ii)->VariableName() + "_label ";
-					for( map<string,string>::const_iterator iil = (*ii)->ValueLabels().begin(); iil != (*ii)->ValueLabels().end(); ++iil ) {
-						labelDef +=  (*iil).first + " \"" + (*iil).second + "\" ";
-					}			
+					double labelStart = DwStats::Now();
+					vector<string> labelDefs = LabelDefineCommands((*ii)->VariableName() + "_label", (*ii)->ValueLabels());
 					string labelVals = "label values " + (*ii)->VariableName() + " " + (*ii)->VariableName() + "_label";
 					// Stata doesn't let us label string, but for debug we can print them in comments (otherwise they stop processing)
 					string toggle = (*ii)->IsNumeric() ? "" : "* "; 
-					printCommand(toggle+labelDef);
+					double bytes = 0;
+					for( size_t i = 0; i < labelDefs.size(); i++ ) {
+						printCommand(toggle+labelDefs[i]);
+						bytes += labelDefs[i].size() + 1;
+					}
 					printCommand(toggle+labelVals);
+					double seconds = DwStats::Now() - labelStart;
+					// the large sets are worth knowing about
+					if( labelDefs.size() > 1 || options->IsProfile() )
+						stataDisplay("Value labels of " + (*ii)->VariableName() + ": " + toString((*ii)->ValueLabels().size()) + " labels in " 
+									 + toString(labelDefs.size()) + " lines, " + toString((long)(bytes / 1024 + 0.5)) + " KB, " + toString(seconds) + " s. \n");
+					labelSets++;
+					labelLines += labelDefs.size();
+					labelCount += (*ii)->ValueLabels().size();
+					labelBytes += bytes;
+					labelSeconds += seconds;
 				}	
 				printCommand("");
 			}			
 		}
 
+		if( labelSets > 0 )
+			stataDisplay("Value labels: " + toString(labelSets) + " sets with " + toString((long)labelCount) + " labels in " + toString(labelLines) 
+						 + " lines of the do file, " + toString((long)(labelBytes / 1024 + 0.5)) + " KB written in " + toString(labelSeconds) 
+						 + " s, read from the database in " + toString(query->Stats()->Seconds(PHASE_LABELS)) + " s. \n");
+
+		// the plugin can't mark the dataset sorted, LOAD writes the sort for it into the do file
+		string stata_sortedby = SortedBy(query);
+		if( printDataCommands && stata_sortedby != "" ) {
+			printCommand("* the rows will come sorted by " + stata_sortedby + ", LOAD replaces this file with: sort " + stata_sortedby);
+			printCommand("");
+		}
+
 		// tell the user where to look for the .do file
 		if( options->IsLogCommands() ) {
 			stataDisplay("Saved commands needed to create the dataset into the file \""+COMMAND_LOG_FILE+"\" in the Stata directory. \n");
 		}
+		publishStats(query);
+
+		// fetch while the do file creates the variables, LOAD continues from there
+		if( options->IsPrefetch() && !options->IsNullData() ) {
+			query->StartPrefetch();
+			stataDisplay("Started fetching the rows in the background, LOAD will take them from memory. \n");
+		}
 
 		if( WRITE_MACRO_VARIABLES ) {
 			// Store variable names/types and observation number into Stata macro
@@ -238,13 +443,14 @@ int createDataSet( vector<string> args ) {
 			SF_macro_save("_types",   toStataString(stata_types));
 			SF_macro_save("_formats", toStataString(stata_formats));
 			SF_macro_save("_obs",     toStataString(stata_obs));
+			SF_macro_save("_sortedby", toStataString(stata_sortedby));
 
 			// print out for the users information
 			stataDisplay("Saved data size ("+stata_obs+" rows), column names, types ("+toString(query->Columns().size())+" cols) and suggested formats into marco variables called _obs, _vars, _types and _formats. \n");
 		}
 	} 
 	// show errors
-	catch( DwUseException ex ) { // for some reason catching the base exception class doesn't work while in STATA :(
+	catch( const DwUseException& ex ) { // for some reason catching the base exception class doesn't work while in STATA :(
 		string msg = ex.what();
 		stataDisplay( "Error: "+string(msg)+"\n" );
 	}
@@ -256,56 +462,95 @@ int createDataSet( vector<string> args ) {
 }
 
 
-// class to fill STATA
-class FillDataSet {
-public: 
-	// created with the columns that need to be filled
-	FillDataSet(const vector<DwColumn*>& cols) : columns(cols) {
-		row = 0;
-	}
-	// called with one row at a time
-    void operator()( oracle::occi::ResultSet* rs ) 
-    { 
-		row++; // from 1
-		for(size_t i=0; i < columns.size(); i++) {
-			if( !columns[i]->IsNull(rs) ) {
-				// STATA has separate storing functions for numbers and strings
-				// the dataset has to be created with the appropriate number of 
-				// columns and rows in a STATA macro before load is called
-				if(columns[i]->IsNumeric()) {
-					double val = columns[i]->AsNumber(rs);
-					// this did not work with SD_SAFEMODE enabled in stplugin.h
-					SF_vstore(i+1, row, val);
-				} else {
-					string val = columns[i]->AsString(rs);
-					SF_sstore(i+1, row, toStataString(val));
-				}
-			}
+// write the variables passed to the plugin call into a warehouse table
+int saveDataSet( vector<string> args ) {
+	DwExport* dwExport = NULL;
+	try {
+		// parse the options		
+		DwUseOptionParser* parser = new DwUseOptionParser();
+		DwUseOptions* options = parser->Parse( args );
+		delete parser;
+
+		// merge the parsed options with global defaults
+		if( defaultOptions != NULL )
+			options->AddDefaults(defaultOptions);
+
+		if( !options->HasCredentials() ) {
+			delete options;
+			throw DwUseException( "Database credentials are missing!" ); 
 		}
-    } 
-private:
-	int row;
-	const vector<DwColumn*>& columns;
-};
+		options->Validate();
+		// the names can't be read through the plugin interface, so they are listed after SAVE in the same order
+		if( (int)options->Variables().size() != SF_nvars() || options->Table() == "" ) {
+			delete options;
+			throw DwUseException( "List the variables of the plugin call after SAVE and give the table with using." ); 
+		}
+		string table = options->Table();
+
+		dwExport = new DwExport(options); // will free options on its own
+		StataDatasetReader reader;
+		int rows = dwExport->Save(&reader);
+		stataDisplay("Saved " + toString(rows) + " observations into " + table + ". \n");
+	}
+	// show errors
+	catch( const DwUseException& ex ) {
+		stataDisplay( "Error: "+string(ex.what())+"\n" );
+	}
+	// don't lett it bubble up to STATA because it crashes
+	catch( ... ) {
+		stataDisplay("An unexcpected error occured.");
+	}
+	if( dwExport != NULL )
+		delete dwExport;
+	return 0;
+}
 
 
-// fill the previously opened data set into STATA
-int loadDataSet() {
+// fill the previously opened data set into STATA, only the variables listed if there are any
+int loadDataSet( vector<string> args ) {
 	if( query != NULL ) {
 		// query and fill
 		try {
+			query->SelectVariables(args);
+			// the variables of CREATE are the first ones, or the last ones passed to the plugin call with keys_inplace
+			int varOffset = query->ObservationPosition() > 0 ? SF_nvars() - query->Columns().size() : 0;
+			vector<int> variables = query->LoadVariables();
+			for(size_t i = 0; i < variables.size(); i++)
+				variables[i] += varOffset;
 			// prepare the filler that will load a row into STATA
-			FillDataSet fds(query->Columns());
+			FillDataSet fds(query->LoadColumns(), query->Stats(), query->ObservationPosition(), 
+							query->LastRowCount(), query->ProgressRows(), variables);
 			try {
 				// run the query and pass the filler
 				query->QueryData(fds);
-			} catch( SQLException ex ) {
+			} catch( const DbException& ex ) {
 				throw DwUseException( "Error querying data with \n" 
 										+ query->QuerySQL()+ ": \n" + ex.getMessage() ); 
 			}
+			// values that appeared since CREATE have codes but no labels
+			for(size_t i = 0; i < query->LoadColumns().size(); i++) {
+				DwEncoder* encoder = query->LoadColumns()[i]->Encoder();
+				if( encoder != NULL && encoder->Added() > 0 )
+					stataDisplay("Warning: " + toString(encoder->Added()) + " values of " + query->LoadColumns()[i]->VariableName() 
+								 + " were not there at CREATE, their codes have no label. \n");
+			}
+			publishStats(query);
+			// the plugin can't mark the dataset sorted, sort in the do file does it and finds the rows in order
+			string sortedBy = SortedBy(query);
+			if( sortedBy != "" && IsSortLoaded(query) ) {
+				CommandPrinter printCommand(query->Options());
+				printCommand("sort " + sortedBy);
+				stataDisplay("The rows came sorted by " + sortedBy + ", run \"do " + COMMAND_LOG_FILE + "\" to mark the dataset sorted. \n");
+			}
+		}
+		// the rows loaded so far stay in the dataset
+		catch( const DwCancelled& ex ) {
+			stataDisplay( string(ex.what()) + " The dataset is incomplete. \n" );
+			publishStats(query);
+			return 1; // same as --Break--
 		}
 		// show errors
-		catch( DwUseException ex ) { // for some reason catching the base exception class doesn't work while in STATA :(
+		catch( const DwUseException& ex ) { // for some reason catching the base exception class doesn't work while in STATA :(
 			stataDisplay( "Error: "+string(ex.what())+"\n" );
 		}
 		// don't lett it bubble up to STATA because it crashes
@@ -319,6 +564,174 @@ int loadDataSet() {
 }
 
 
+// extract the tables of a job file into .dta files, a few at once
+int runBatch( vector<string> args ) {
+	DwUseOptions* options = NULL;
+	DwBatch* batch = NULL;
+	try {
+		if( args.size() == 0 )
+			throw DwUseException( "Give the job file after BATCH." ); 
+		string jobFile = replaceAll(args[0], "\"", "");
+		args.erase(args.begin());
+
+		// the rest are the credentials and options for every table
+		DwUseOptionParser* parser = new DwUseOptionParser();
+		options = parser->Parse( args );
+		delete parser;
+		if( defaultOptions != NULL )
+			options->AddDefaults(defaultOptions);
+		if( !options->HasCredentials() ) {
+			throw DwUseException( "Database credentials are missing!" ); 
+		}
+		options->Validate();
+
+		batch = new DwBatch(options);
+		batch->ReadJobs(jobFile);
+		int connections = batch->Start();
+		stataDisplay("Extracting " + toString(batch->JobCount()) + " tables on " + toString(connections) + " connections. \n");
+
+		// the workers can't call STATA, so the tables are reported here as they finish
+		DwBatchJob* job;
+		bool isStopped = false;
+		while( (job = batch->Next()) != NULL ) {
+			if( job->failed )
+				stataDisplay("Error in " + job->table + ": " + job->error + "\n");
+			else
+				stataDisplay("Saved " + toString((long)job->rows) + " rows of " + job->table + " into " + job->file + ". \n");
+			SF_poll();
+			if( SW_stopflag && !isStopped ) {
+				batch->Stop();
+				isStopped = true;
+				stataDisplay("Break: the tables being extracted are finished, the rest are skipped. \n");
+			}
+		}
+		vector<string> lines = batch->Summary();
+		for(size_t i = 0; i < lines.size(); i++)
+			stataDisplay(lines[i] + "\n");
+	}
+	// show errors
+	catch( const DwUseException& ex ) {
+		stataDisplay( "Error: "+string(ex.what())+"\n" );
+	}
+	// don't lett it bubble up to STATA because it crashes
+	catch( ... ) {
+		stataDisplay("An unexcpected error occured.");
+	}
+	// waits for the tables still running after an error
+	if( batch != NULL )
+		delete batch;
+	if( options != NULL )
+		delete options;
+	return 0;
+}
+
+
+// summarize or tabulate in the database, the do file creates the matrices for the results and calls RESULTS
+int summarizeDataSet( vector<string> args, bool isTabulate ) {
+	DwSummary* summary = NULL;
+	try {
+		DwUseOptionParser* parser = new DwUseOptionParser();
+		DwUseOptions* options = parser->Parse( args, true );
+		delete parser;
+		CommandPrinter printCommand(options);
+		if( defaultOptions != NULL )
+			options->AddDefaults(defaultOptions);
+		string table = options->Table();
+		try {
+			if( !options->HasCredentials() )
+				throw DwUseException( "Database credentials are missing!" ); 
+			if( table == "" )
+				throw DwUseException( "Could not parse the table name, give it with using <table>." ); 
+			options->Validate();
+			if( options->IsKeysInPlace() )
+				throw DwUseException( "keys_inplace places rows into the dataset, use keys to restrict the rows." ); 
+		} catch( ... ) {
+			delete options;
+			throw;
+		}
+		StataParameterResolver resolver;
+		summary = new DwSummary(options, &resolver); // will free options on its own
+		if( options->Keys() != "" ) {
+			StataDatasetReader keys;
+			int uploaded = summary->UploadKeys(&keys);
+			stataDisplay("Uploaded " + toString(uploaded) + " keys to match with " + options->Keys() + ". \n");
+		}
+		results.clear();
+		vector<string> lines = isTabulate ? summary->Tabulate() : summary->Summarize();
+		for(size_t i = 0; i < lines.size(); i++)
+			stataDisplay(lines[i] + "\n");
+
+		// the scalars can be saved right away
+		for(map<string,double>::const_iterator ii = summary->Scalars().begin(); ii != summary->Scalars().end(); ii++) {
+			char* name = toStataString("dw_r_" + ii->first);
+			SF_scal_save(name, ii->second);
+			delete[] name;
+		}
+
+		// the matrices have to exist before the plugin can store into them
+		printCommand("* use the following commands to store the results computed from " + table + " into matrices: ");
+		for(size_t i = 0; i < summary->Matrices().size(); i++) {
+			const DwMatrix& matrix = summary->Matrices()[i];
+			if( matrix.rows == 0 || matrix.cols == 0 )
+				continue;
+			printCommand("matrix " + matrix.name + " = J(" + toString(matrix.rows) + ", " + toString(matrix.cols) + ", .)");
+			string names;
+			for(size_t j = 0; j < matrix.rowNames.size() && !isTabulate; j++)
+				names += " " + matrix.rowNames[j];
+			if( names != "" )
+				printCommand("matrix rownames " + matrix.name + " =" + names);
+			names = "";
+			for(size_t j = 0; j < matrix.colNames.size() && !isTabulate; j++)
+				names += " " + matrix.colNames[j];
+			if( names != "" )
+				printCommand("matrix colnames " + matrix.name + " =" + names);
+			results.push_back(matrix);
+		}
+		for(map<string,string>::const_iterator ii = summary->Macros().begin(); ii != summary->Macros().end(); ii++)
+			printCommand("global " + ii->first + " " + ii->second);
+		printCommand("plugin call DW_use, RESULTS");
+		stataDisplay("Saved the results into dw_r_* scalars, run \"do " + COMMAND_LOG_FILE + "\" for the matrices. \n");
+	}
+	catch( const DwUseException& ex ) {
+		stataDisplay( "Error: "+string(ex.what())+"\n" );
+	}
+	catch( ... ) {
+		stataDisplay("An unexcpected error occured.");
+	}
+	if( summary != NULL )
+		delete summary;
+	return 0;
+}
+
+
+// fill the matrices the do file of SUMMARIZE or TABULATE created
+int storeResults() {
+	if( results.size() == 0 ) {
+		stataDisplay("First you have to SUMMARIZE or TABULATE. \n");
+		return 0;
+	}
+	string names;
+	for(size_t i = 0; i < results.size(); i++) {
+		const DwMatrix& matrix = results[i];
+		char* name = toStataString(matrix.name);
+		if( SF_row(name) != matrix.rows || SF_col(name) != matrix.cols ) {
+			delete[] name;
+			stataDisplay("Error: The matrix " + matrix.name + " should be " + toString(matrix.rows) + " x " + toString(matrix.cols) 
+						 + ", run the do file of the last SUMMARIZE or TABULATE. \n");
+			return 198;
+		}
+		for(int r = 0; r < matrix.rows; r++) {
+			for(int c = 0; c < matrix.cols; c++)
+				SF_mat_store(name, r + 1, c + 1, matrix.values[r * matrix.cols + c]);
+		}
+		delete[] name;
+		names += " " + matrix.name;
+	}
+	stataDisplay("Stored the results into" + names + ". \n");
+	return 0;
+}
+
+
 // Entry point of STATA plugin
 STDLL stata_call(int argc, char *argv[])
 {
@@ -330,10 +743,18 @@ STDLL stata_call(int argc, char *argv[])
 		SF_display("	plugin call DW_use, DEFAULTS username <user> password <pass> database <db> \n") ;
 		SF_display("1. Call the plugin in CREATE mode to read table definition and prepare a STATA command file to create the variables: \n");
 		SF_display("	plugin call DW_use, CREATE <table> \n") ;
-		SF_display("	plugin call DW_use, CREATE [<varlist>] [if <expr>] using <table> [nulldata] [lowercase|uppercase] [label_variable [<label_variable_varlist>]] [label_values [<label_values_varlist>]] username <user> password <pass> database <db> [limit <n>] \n") ;
+		SF_display("	plugin call DW_use, CREATE [<varlist>] [if <expr>] using <table> [join <table> on(<keys>)] [nulldata] [lowercase|uppercase] [label_variable [<label_variable_varlist>]] [label_values [<label_values_varlist>]] [translate [<translate_varlist>]] username <user> password <pass> database <db> [backend oracle|odbc|sqlite] [limit <n>] [progress [<n>]] [encode [<varlist>] [encode_max <n>]] [prefetch [<MB>]] [explain] [max_rows <n>] [max_mb <n>] [max_cost <n>] [max_full_scans <n>] [force] [footprint] [memory <MB>] [fetch_mb <MB>] [daemon <socket>] [sort(<varlist>)] [db_convert] \n") ;
+		SF_display("	plugin call DW_use <keyvar>, CREATE ... keys <column> [keys_inplace] \n") ;
 		SF_display("2. Execute the logged commands with \"do dwcommands.do\". \n");
 		SF_display("3. Call the plugin in LOAD mode to fill the dataset: \n");
-		SF_display("	plugin call DW_use, LOAD \n") ;
+		SF_display("	plugin call DW_use, LOAD [<varlist>] \n") ;
+		SF_display("4. Call the plugin in SAVE mode to insert variables of the dataset into a table: \n");
+		SF_display("	plugin call DW_use <varlist>, SAVE <varlist> using <table> [create_table types <types>] [append] [batch_size <n>] \n") ;
+		SF_display("5. Call the plugin in BATCH mode to extract the tables of a job file into .dta files, each line like the options of CREATE with saving <file.dta>: \n");
+		SF_display("	plugin call DW_use, BATCH <jobfile> [parallel <n>] \n") ;
+		SF_display("6. Call the plugin in SUMMARIZE or TABULATE mode to compute the statistics in the database, then run the do file to store them into matrices: \n");
+		SF_display("	plugin call DW_use, SUMMARIZE [<varlist>] [if <expr>] using <table> [detail] \n") ;
+		SF_display("	plugin call DW_use, TABULATE <var1> [<var2>] [if <expr>] using <table> [missing] \n") ;
 	} else {
 		// parse the options
 		string mode = upperCase(argv[0]);
@@ -356,9 +777,17 @@ STDLL stata_call(int argc, char *argv[])
 		} else if (mode == "CREATE") {
 			return createDataSet(args);
 		} else if (mode == "LOAD") {
-			return loadDataSet();
+			return loadDataSet(args);
+		} else if (mode == "SAVE") {
+			return saveDataSet(args);
+		} else if (mode == "BATCH") {
+			return runBatch(args);
+		} else if (mode == "SUMMARIZE" || mode == "TABULATE") {
+			return summarizeDataSet(args, mode == "TABULATE");
+		} else if (mode == "RESULTS") {
+			return storeResults();
 		} else {
-			stataDisplay("Unknown mode " + mode + ". Use DEFAULTS, CREATE or LOAD! \n");
+			stataDisplay("Unknown mode " + mode + ". Use DEFAULTS, CREATE, LOAD, SAVE, BATCH, SUMMARIZE, TABULATE or RESULTS! \n");
 		}
 	} 
     return 0;
@@ -367,125 +796,169 @@ STDLL stata_call(int argc, char *argv[])
 
 
 
-// below is for .exe console testing
+// below is the .exe console build, a command line extractor
 
 
-// process the query data and print it on the console
-class PrintQuery {
-public: 
-	PrintQuery(const vector<DwColumn*>& cols) : columns(cols) {
-	}
-    void operator()( oracle::occi::ResultSet* rs ) 
-    { 
-		for(size_t i=0; i < columns.size(); i++) {
-			if(i > 0) 
-				cout << ", ";
-			if(columns[i]->IsNumeric()) {
-				cout << columns[i]->AsNumber(rs);
-			} else {
-				cout << "\"" << columns[i]->AsString(rs) << "\"";
-			}
-		}
-		cout << endl;
-    } 
-private:
-	const vector<DwColumn*>& columns;
-};
+// the report goes to the standard error, the standard output may be the extract
+void consoleReport(const vector<string>& lines) {
+	for(size_t i = 0; i < lines.size(); i++)
+		cerr << lines[i] << "\n";
+}
+
+
+bool hasSuffix(const string& text, const string& suffix) {
+	return text.size() >= suffix.size() && text.compare(text.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
 
 
-// testing in command line
-// to start here change the configuration type to .exe but also the Linker / System / SubSystem to CONSOLE from WINDOWS 
+// extract a table without STATA, on a batch server for example. The options are the ones of CREATE and LOAD
+// (prefetch, fetch_mb, encode, translate, sort, explain and the limits), the rows go to the file of saving or
+// the standard output. The format follows the extension of the file (.csv, .tsv, .dta, and .gz to compress)
+// unless it is given. Nothing is asked, the exit code is 1 if the extract failed
+// to build it change the configuration type to .exe but also the Linker / System / SubSystem to CONSOLE from WINDOWS 
 int main(int argc, char *argv[])
 {
+	if( argc < 2 ) {
+		cerr << "usage: " << argv[0] << " [-format csv|tsv|dta] [-gzip] [-buffer_mb <n>] [-verbose] <options of CREATE and LOAD> [saving <file>]\n";
+		cerr << "example: " << argv[0] << " nem `Szuletesi_ido` if szam_002 \"<=\" 300 | szoveg == 'barack' using tenytabla database xe username usr password *** prefetch fetch_mb 64 saving tenyek.csv.gz\n";
+		return 2;
+	}
 
-	if(argc > 1) {  // not just exe
-		// parse the options
-		DwUseOptions* options = NULL;
-		DwUseQuery* query = NULL;
-		try 
-		{
-			// transform options to a list of strings
-			vector<string> args;
-			for(int i=1; i<argc; i++) { // first is the name of the .exe
-				string arg = string(argv[i]);
+	string format;
+	bool isCompressed = false;
+	bool isVerbose = false;
+	size_t bufferBytes = EXTRACT_BUFFER_MB * 1024 * 1024;
+	string fileName = "-";
+	bool isWriting = false;
+	DwUseOptions* options = NULL;
+	DwUseQuery* query = NULL;
+	int rc = 0;
+	try 
+	{
+		// the options of the extractor, the rest is parsed like a plugin call
+		vector<string> args;
+		for(int i=1; i<argc; i++) { // first is the name of the .exe
+			string arg = string(argv[i]);
+			if( arg == "-format" && i + 1 < argc ) {
+				format = lowerCase(argv[++i]);
+			} else if( arg == "-gzip" ) {
+				isCompressed = true;
+			} else if( arg == "-buffer_mb" && i + 1 < argc ) {
+				int mb = atoi(argv[++i]);
+				if( mb <= 0 )
+					throw DwUseException( "-buffer_mb needs a positive number of MB." );
+				bufferBytes = (size_t)mb * 1024 * 1024;
+			} else if( arg == "-verbose" ) {
+				isVerbose = true;
+			} else {
 				// some column names require " but that is not passed as it is part of command line syntax for multi word arguments. 
 				// as a workaround treate ` (AltGr+7) as "
 				// still, < in if expressions won't work unless put in ""
-				arg = replaceAll(arg, "`", "\"");
-				args.push_back( arg );
-			}
-
-			// parse the options		
-			DwUseOptionParser* parser = new DwUseOptionParser();
-			// don't use global options here, this is just the exe test
-			options = parser->Parse( args );
-			delete parser;
-
-			// print raw options
-			for( map<string,string>::const_iterator ii = options->Options().begin(); ii != options->Options().end(); ++ii ) {
-				string opt = ii->first + string(": ") + (*ii).second;
-				cout << opt << endl;
-			}
-			// print some of the parsed options
-			vector<string> vars = options->Variables();
-			cout << endl;
-			cout << "Variables: ";
-			for( vector<string>::const_iterator ii = vars.begin(); ii != vars.end(); ii++ ) {
-				cout << (*ii) << ", ";
-			}
-			cout << endl;
-			cout << "Casing: " << options->VariableCasing() << endl;
-			cout << "Table: " << options->Table() << endl;
-			cout << "Where: " << options->WhereSQL() << endl;
-
-			// some error checking
-			if(options->Database() == "" || options->Username() == "" || options->Password() == "") {
-				throw DwUseException( "Database credentials are missing!" ); 
-			}
-			if(options->Table().find(" ") != string::npos) {
-				throw DwUseException( "Could not parse the table name (found \"" + options->Table() 
-										+ "\"). Are you missing a 'using' keyword or mis-typed the one after the table name?" ); 
+				args.push_back( replaceAll(arg, "`", "\"") );
 			}
+		}
+		DwUseOptionParser parser;
+		options = parser.Parse( args );
+		if( isVerbose ) {
+			for( map<string,string>::const_iterator ii = options->Options().begin(); ii != options->Options().end(); ++ii )
+				cerr << ii->first << ": " << ii->second << "\n";
+		}
 
-			// use the database		
-			query = new DwUseQuery(options);
-		
-			//display labels
-			cout << "Variable labels and types: " << endl;
-			for( vector<DwColumn*>::const_iterator ii = query->Columns().begin(); ii != query->Columns().end(); ii++ ) {
-				cout << (*ii)->ColumnName() << " (" << (*ii)->VariableName() << "): " << (*ii)->StataDataType() << endl;
+		// some error checking
+		const map<string,string>& given = options->Options();
+		if( !options->HasCredentials() )
+			throw DwUseException( "Database credentials are missing!" ); 
+		if( given.find("keys") != given.end() || given.find("nulldata") != given.end() )
+			throw DwUseException( "keys and nulldata need the dataset in STATA, use CREATE and LOAD for them." );
+		// the table name and the joins after it
+		options->Validate();
+		if( given.find("saving") != given.end() )
+			fileName = options->Saving();
+		string name = lowerCase(fileName);
+		if( hasSuffix(name, ".gz") ) {
+			isCompressed = true;
+			name = name.substr(0, name.size() - 3);
+		}
+		if( format == "" )
+			format = hasSuffix(name, ".dta") ? "dta" : hasSuffix(name, ".tsv") || hasSuffix(name, ".tab") ? "tsv" : "csv";
+		if( format != "csv" && format != "tsv" && format != "dta" )
+			throw DwUseException( "Unknown format " + format + ", use csv, tsv or dta." );
+		// the number of observations is written at the end into the header
+		if( format == "dta" && (fileName == "-" || isCompressed) )
+			throw DwUseException( "A .dta file can only be written uncompressed with saving <file>." );
+
+		// use the database		
+		query = new DwUseQuery(options);
+		if( options->IsExplain() )
+			consoleReport(query->Preflight());
+		if( options->IsEncode() )
+			cerr << "Encoded " << query->Encode() << " string columns as numeric codes with value labels.\n";
+		if( isVerbose ) {
+			for( vector<DwColumn*>::const_iterator ii = query->Columns().begin(); ii != query->Columns().end(); ii++ )
+				cerr << (*ii)->ColumnName() << " (" << (*ii)->VariableName() << "): " << (*ii)->StataDataType() << "\n";
+			cerr << "Query: " << query->QuerySQL() << "\n";
+			for( size_t i = 0; i < query->Params().size(); i++ ) {
+				const DbParam& p = query->Params()[i];
+				cerr << "  :p" << (i+1) << " = " << (p.isNumber ? toString(p.number) : "'" + p.text + "'") << "\n";
 			}
+		}
 
-			// compile SQL
-			cout << "Query: " << query->QuerySQL() << endl;
-			cout << "Row count: " << query->RowCount() << endl;
-			cout << "Data: " << endl;
-
-			// run the query results
-			PrintQuery pq(query->Columns());
-			try {
-				query->QueryData(pq);
-			} catch( SQLException ex ) {
-				throw DwUseException( "Error querying data with \n" 
-										+ query->QuerySQL()+ ": \n" + ex.getMessage() ); 
+		// run the query into the file
+		if( options->IsPrefetch() )
+			query->StartPrefetch();
+		double start = DwStats::Now();
+		double rows = 0, written = 0;
+		try {
+			if( format == "dta" ) {
+				char stamp[18];
+				time_t now = time(NULL);
+				strftime(stamp, sizeof(stamp), "%d %b %Y %H:%M", localtime(&now));
+				isWriting = true;
+				DwDtaFile file(fileName, query->Columns(), options->Table(), stamp, query->SortVariables());
+				query->QueryData( WriteDataSet(&file, query->Stats()) );
+				file.Close();
+				rows = file.Rows();
+			} else {
+				isWriting = true;
+				DwExtractFile file(fileName, query->Columns(), format == "tsv" ? '\t' : ',', isCompressed, bufferBytes);
+				query->QueryData( WriteExtract(&file, query->Stats()) );
+				file.Close();
+				rows = file.Rows();
+				written = file.Bytes();
 			}
+		} catch( const DbException& ex ) {
+			throw DwUseException( "Error querying data with \n" 
+									+ query->QuerySQL()+ ": \n" + ex.getMessage() ); 
 		}
-		// show errors
-		catch( DwUseException ex ) {
-			cout << ex.what() << endl;
-		}
-		catch( exception ex ) {
-			cout << ex.what() << endl;
-		}
-		// not in plugin, so delete
-		if( query != NULL )		delete query; // deletes options too
-		else					delete options;
-	} else {
-		cout << "example usage: " << endl;
-		cout << "nem `Szuletesi_ido` if szam_002 \"<=\" 300 | szoveg == 'barack' using tenytabla label_variable label_values nem database xe username usr password *** limit 10" << endl;
+		isWriting = false;
+		double seconds = DwStats::Now() - start;
+		DwStats* stats = query->Stats();
+		cerr << (long)rows << " rows, " << (long)(stats->bytes / 1024 / 1024) << " MB received"
+			 << (written > 0 ? ", " + toString((long)(written / 1024 / 1024)) + " MB written" : "")
+			 << " into " << (fileName == "-" ? "the standard output" : fileName) << " in " << seconds << " s, "
+			 << (long)(seconds > 0 ? rows / seconds : rows) << " rows/s (fetch " << stats->Seconds(PHASE_FETCH)
+			 << " s, write " << stats->Seconds(PHASE_STORE) << " s).\n";
+		if( options->IsProfile() )
+			consoleReport(stats->Summary());
 	}
-
-	std::puts("Press any key to continue...");
-	std::getchar();
-	return 0;
+	// show errors
+	catch( const DwUseException& ex ) {
+		cerr << ex.what() << "\n";
+		rc = 1;
+	}
+	catch( const DbException& ex ) {
+		cerr << ex.getMessage() << "\n";
+		rc = 1;
+	}
+	catch( const exception& ex ) {
+		cerr << ex.what() << "\n";
+		rc = 1;
+	}
+	// a half written file is not left behind
+	if( isWriting && fileName != "-" )
+		remove(fileName.c_str());
+	// not in plugin, so delete
+	if( query != NULL )		delete query; // deletes options too
+	else					delete options;
+	return rc;
 }
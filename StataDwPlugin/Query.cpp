@@ -16,10 +16,10 @@ class EchoTranslator : public Translator {
 class DictAdapter {
 public :
 	DictAdapter( map<string,string>& m ) : dict(m) {}
-	void operator()( oracle::occi::ResultSet* rs ) 
+	void operator()( DbRow* row ) 
     { 
-		string key = rs->getString(1);
-		string value = rs->getString(2);
+		string key = row->GetString(1);
+		string value = row->GetString(2);
 		// store it
 		this->dict[key] = value;
     } 
@@ -36,10 +36,11 @@ public:
 	}
 	// translate a key  
 	virtual string Translate(string msg) {
-		string val = this->labels[msg];
-		if( val != "" )
-			return val;
-		if( val == "" && msg != "" && this->missingLabel != "" ) 
+		// find instead of [] so that misses don't add empty labels
+		map<string,string>::const_iterator ii = this->labels.find(msg);
+		if( ii != this->labels.end() && ii->second != "" )
+			return ii->second;
+		if( msg != "" && this->missingLabel != "" ) 
 			return this->missingLabel;
 		return msg;
 	}
@@ -82,11 +83,11 @@ class VariableTranslator : public DwTranslator {
 				   " where TENYTABLA = :p_table and STATUSZ = 'I'"
 			       " group by VALTOZO) ";
 		// select all and fill up mapping
-		vector<string> params;
+		vector<DbParam> params;
 		params.push_back(upperCase(table));
 		try {
 			conn->Select(this->Adapter(), sql, params);
-		} catch( SQLException ex ) {
+		} catch( const DbException& ex ) {
 			throw DwUseException( "Error querying variable labels for " 
 									+ table +" with \n"
 									+ sql +": \n" + ex.getMessage() ); 
@@ -116,12 +117,12 @@ class ValueTranslator : public DwTranslator {
 				  " where TENYTABLA = :p_table and VALTOZO = :p_column and STATUSZ = 'I'"
 			      " group by KOD) ";
 		// select all and fill up mapping
-		vector<string> params;
+		vector<DbParam> params;
 		params.push_back(upperCase(table));
 		params.push_back(upperCase(column));
 		try {
 			conn->Select(this->Adapter(), sql, params);
-		} catch( SQLException ex ) {
+		} catch( const DbException& ex ) {
 			throw DwUseException( "Error querying variable labels for " 
 									+ table + "." + column + " with \n"
 									+ sql +": \n" + ex.getMessage() ); 
@@ -139,88 +140,292 @@ void CheckLabels( set<string> selection, vector<string> valid, string option ) {
 }
 
 
-DwUseQuery::DwUseQuery(DwUseOptions* options) {
+// run a probe query that returns no rows to read its column definitions
+vector<DbColumnMetaData> DescribeSQL(DbConnect* conn, string sql, DwStats* stats) {
+	DwTimer timer(stats, PHASE_DESCRIBE);
+	try {
+		return conn->Describe(sql);
+	} catch( const DbException& ex ) {
+		throw DwUseException( "Error reading column definitions with \n" 
+								+ sql +": \n" + ex.getMessage() ); 
+	}
+}
+
+
+// position of a column by its uppercase name, -1 if the table doesn't have it
+int FindMetaData(const vector<DbColumnMetaData>& meta, string name) {
+	for(size_t i = 0; i < meta.size(); i++) {
+		if( upperCase(meta[i].name) == name )
+			return i;
+	}
+	return -1;
+}
+
+
+// column name to use in a joined query
+string QualifiedName(const DbColumnMetaData& md, string alias) {
+	string name = md.isQuoted ? "\"" + md.name + "\"" : md.name;
+	return alias != "" ? alias + "." + name : name;
+}
+
+
+DwUseQuery::DwUseQuery(DwUseOptions* options, ParameterResolver* resolver, DbConnect* conn) {
 	this->options = options;
+	this->isStringKey = false;
+	this->rowCount = -1;
+	this->prefetch = NULL;
+	this->loads = 0;
+	this->isOrdered = false;
+	this->fromSql = options->Table();
+	this->conn = conn;
+	this->ownsConnection = conn == NULL;
 	// create a database connection
-	try {
-		this->conn = new DbConnect( options->Username(),
-									options->Password(),
-									options->Database() );
-	} catch( SQLException ex ) {
-		throw DwUseException( "Error connecting to the database with " 
-								+ options->Username() +"/" + options->Password() + "@" + options->Database() +": \n"
-								+ ex.getMessage() ); 
-	}
-	// create variable translator for column
-	this->variableTranslator = new VariableTranslator(this->conn, this->options->Table());
-	// collect final list of variables
-	// if there are none in the options, read all from the database
-	// else read only the ones in the list
-	string probeSql = "select ";
-	// create a DwColumn for each column that we need (maybe leave out the technical cols)
+	if( this->conn == NULL ) {
+		try {
+			DwTimer timer(&this->stats, PHASE_CONNECT);
+			this->conn = DbConnect::Open( options->Backend(),
+										  options->Username(),
+										  options->Password(),
+										  options->Database(),
+										  options->Daemon() );
+		} catch( const DbException& ex ) {
+			throw DwUseException( "Error connecting to the database with " 
+									+ options->Username() +"/" + options->Password() + "@" + options->Database() +": \n"
+									+ ex.getMessage() ); 
+		}
+		this->conn->SetFetchBudget(options->FetchBytes());
+	}
+	// collect final list of variables from the main table and the joined tables
+	vector<DbColumnMetaData> colMeta;
+	vector<string> colTables;  // the table each selected column comes from, for labels
+	vector<string> colAliases; // how to qualify the column in the joined query
 	vector<string> cols = this->options->Variables();
-	if( cols.size() == 0 ) {
-		probeSql += "* "; // we'll check what kind of columns we see. I don't know the schema, or whether table is a view or synonym
+	vector<DwJoin> joins = this->options->Joins();
+	ExpressionCompiler compiler(resolver); // gets every column the if expression may refer to
+	if( joins.size() == 0 ) {
+		// if there are none in the options, read all from the database
+		// else read only the ones in the list
+		string probeSql = "select ";
+		// create a DwColumn for each column that we need (maybe leave out the technical cols)
+		if( cols.size() == 0 ) {
+			probeSql += "* "; // we'll check what kind of columns we see. I don't know the schema, or whether table is a view or synonym
+		} else {
+			for(size_t i = 0; i < cols.size(); i++) {
+				if( i > 0 ) 
+					probeSql += ", ";
+				probeSql += cols[i];
+			}
+		}
+		probeSql += " from " + this->options->Table() + " where 1=2 ";
+		// run the probe query and collect columns
+		colMeta = DescribeSQL(this->conn, probeSql, &this->stats);
+		// placing rows by key joins the key table, so the columns have to be qualified
+		string alias = this->options->IsKeysInPlace() ? "t0" : "";
+		if( alias != "" )
+			this->fromSql += " " + alias;
+		colTables.assign(colMeta.size(), this->options->Table());
+		colAliases.assign(colMeta.size(), alias);
+		this->tableAliases.push_back(alias);
+		// the filter and the key can use all columns of the table, not just the selected ones
+		if( this->options->Filter() != "" || this->options->Keys() != "" )
+			compiler.AddColumns( cols.size() > 0 ? DescribeSQL(this->conn, "select * from " + this->options->Table() + " where 1=2 ", &this->stats) : colMeta, 
+								 this->options->Table(), alias );
 	} else {
+		// describe each table on its own and generate a single query joining them on their keys
+		vector< vector<DbColumnMetaData> > tableMeta;
+		vector<string> tables, aliases;
+		tables.push_back(this->options->Table());
+		for(size_t j = 0; j < joins.size(); j++)
+			tables.push_back(joins[j].table);
+		for(size_t j = 0; j < tables.size(); j++) {
+			tableMeta.push_back( DescribeSQL(this->conn, "select * from " + tables[j] + " where 1=2 ", &this->stats) );
+			aliases.push_back( "t" + toString(j) );
+			compiler.AddColumns( tableMeta[j], tables[j], aliases[j] );
+		}
+		this->fromSql = tables[0] + " " + aliases[0];
+		this->tableAliases = aliases;
+		set<string> taken; // uppercase names already in the result, a STATA variable can only appear once
+		for(size_t j = 0; j < tables.size(); j++) {
+			set<string> keys;
+			if( j > 0 ) {
+				// the keys are matched with the first of the previous tables that has them
+				string on;
+				for(size_t k = 0; k < joins[j-1].keys.size(); k++) {
+					string key = upperCase(joins[j-1].keys[k]);
+					int dimPos = FindMetaData(tableMeta[j], key);
+					int prev = -1, prevPos = -1;
+					for(size_t p = 0; p < j && prev < 0; p++) {
+						prevPos = FindMetaData(tableMeta[p], key);
+						if( prevPos >= 0 ) prev = p;
+					}
+					if( dimPos < 0 || prev < 0 )
+						throw DwUseException( "The join key " + key + " of " + tables[j] + " must be a column of it and one of the tables before it." );
+					on += (k > 0 ? " and " : "") + QualifiedName(tableMeta[prev][prevPos], aliases[prev])
+						+ " = " + QualifiedName(tableMeta[j][dimPos], aliases[j]);
+					keys.insert(key);
+				}
+				this->fromSql += " join " + tables[j] + " " + aliases[j] + " on " + on;
+			}
+			// without a varlist take every column, skipping the keys and names repeated in the dimensions
+			for(size_t i = 0; i < tableMeta[j].size() && cols.size() == 0; i++) {
+				string name = upperCase(tableMeta[j][i].name);
+				if( keys.find(name) != keys.end() || taken.find(name) != taken.end() )
+					continue;
+				taken.insert(name);
+				colMeta.push_back(tableMeta[j][i]);
+				colTables.push_back(tables[j]);
+				colAliases.push_back(aliases[j]);
+			}
+		}
+		// with a varlist take each variable from the first table that has it, or the one it is qualified with
 		for(size_t i = 0; i < cols.size(); i++) {
-			if( i > 0 ) 
-				probeSql += ", ";
-			probeSql += cols[i];
+			string name = upperCase(cols[i]);
+			string qualifier = "";
+			size_t dot = name.rfind('.');
+			if( dot != string::npos ) {
+				qualifier = name.substr(0, dot);
+				name = name.substr(dot + 1);
+			}
+			bool found = false;
+			for(size_t j = 0; j < tables.size() && !found; j++) {
+				if( qualifier != "" && qualifier != upperCase(tables[j]) && qualifier != upperCase(aliases[j]) )
+					continue;
+				int pos = FindMetaData(tableMeta[j], replaceAll(name, "\"", ""));
+				if( pos >= 0 ) {
+					colMeta.push_back(tableMeta[j][pos]);
+					colTables.push_back(tables[j]);
+					colAliases.push_back(aliases[j]);
+					found = true;
+				}
+			}
+			if( !found )
+				throw DwUseException( "Variable " + cols[i] + " was not found in the joined tables." );
 		}
 	}
-	probeSql += " from " + this->options->Table() + " where 1=2 ";
-	// run the probe query and collect columns
-	vector<DbColumnMetaData> colMeta;
-	vector<string> colNames;
-	try {
-		colMeta = this->conn->Describe(probeSql);
-	} catch( SQLException ex ) {
-		string msg = ex.getMessage();
-		throw DwUseException( "Error reading column definitions with \n" 
-								+ probeSql +": \n" + msg ); 
+	// compile the filter now that we know the columns
+	string filter = this->options->Filter();
+	if( filter != "" ) {
+		this->whereSql = compiler.Compile(filter, this->params);
+	}
+	// restrict the rows to the keys uploaded from the STATA dataset
+	if( this->options->Keys() != "" ) {
+		string keyColumn = compiler.ColumnSQL(this->options->Keys(), this->isStringKey);
+		string keySql = this->isStringKey ? "KEY_STR" : "KEY_NUM";
+		if( this->options->IsKeysInPlace() ) {
+			// join to know which observation the row belongs to
+			this->fromSql += " join " + KEY_TABLE + " k on k." + keySql + " = " + keyColumn;
+		} else {
+			// semi-join, duplicate keys in STATA don't duplicate rows
+			this->whereSql = (this->whereSql != "" ? "(" + this->whereSql + ") and " : "") 
+				+ keyColumn + " in (select " + keySql + " from " + KEY_TABLE + ")";
+		}
 	}
 	// we'll need to know what to translate
 	set<string> transVars = this->options->LabelVariables();
 	set<string> transVals = this->options->LabelValues();
 	bool isTransAllVars   = this->options->IsLabelVariables() && transVars.size() == 0;
 	bool isTransAllVals   = this->options->IsLabelValues()    && transVals.size() == 0;
+	set<string> translateVals = this->options->Translate();
+	bool isTranslateAll   = this->options->IsTranslate() && translateVals.size() == 0;
+	set<string> encodeVars = this->options->Encode();
+	bool isEncodeAll = this->options->IsEncode() && encodeVars.size() == 0;
+	vector<string> colNames;
 	// create meta data holders
 	for(size_t i=0; i<colMeta.size(); i++) {
 		// get the column name so we can decide if it needs tranlation or not
 		string colName = colMeta[i].name; // not qouted
+		// when placing rows by key the key variable is already in the dataset
+		if( this->options->IsKeysInPlace() && QualifiedName(colMeta[i], colAliases[i]) == compiler.ColumnSQL(this->options->Keys(), this->isStringKey) )
+			continue;
+		// labels are looked up for the table the column comes from
+		bool isTransVar = isTransAllVars || transVars.find(upperCase(colName)) != transVars.end();
+		bool isTransVal = isTransAllVals || transVals.find(upperCase(colName)) != transVals.end();
+		bool isTranslate = isTranslateAll || translateVals.find(upperCase(colName)) != translateVals.end();
+		Translator* valueTranslator = NULL;
+		{
+			DwTimer timer(&this->stats, PHASE_LABELS);
+			if( isTransVar && this->variableTranslators.find(colTables[i]) == this->variableTranslators.end() )
+				this->variableTranslators[colTables[i]] = new VariableTranslator(this->conn, colTables[i]);
+			if( isTransVal || isTranslate )
+				valueTranslator = new ValueTranslator(this->conn, colTables[i], colName);
+		}
 		// translate or not?
 		DwColumn* dwCol = new DwColumn(
 			colMeta[i], 
-			i+1, // position in ResultSet
+			this->columns.size()+1, // position in the row
 			this->options->VariableCasing(),
-			(isTransAllVars || transVars.find(upperCase(colName)) != transVars.end()) ?
-				this->variableTranslator : NULL, 
-			(isTransAllVals || transVals.find(upperCase(colName)) != transVals.end()) ?
-				new ValueTranslator(this->conn, 
-									this->options->Table(),
-									colName) : NULL 
+			isTransVar ? this->variableTranslators[colTables[i]] : NULL, 
+			valueTranslator,
+			colAliases[i]
 			);
+		// put the labels into the dataset
+		if( isTranslate )
+			dwCol->TranslateContents();
+		if( this->options->IsDbConvert() )
+			dwCol->ConvertInDatabase(this->conn);
 		this->columns.push_back( dwCol );
 		colNames.push_back( upperCase(colName) ); // to test translations
+		// only strings are worth encoding
+		if( !dwCol->IsNumeric() && !dwCol->IsTranslated() && (isEncodeAll || encodeVars.find(upperCase(colName)) != encodeVars.end()) )
+			this->encodeColumns.push_back( dwCol );
 	}
 	// check that all the variables selected for labeling are valid column names
 	CheckLabels( transVars, colNames, "label_variable" );
 	CheckLabels( transVals, colNames, "label_values" );
+	CheckLabels( translateVals, colNames, "translate" );
+	CheckLabels( encodeVars, colNames, "encode" );
+	// the database sorts by the columns of the variables, so STATA would see the same order
+	vector<string> sortNames = this->options->Sort();
+	for(size_t i = 0; i < sortNames.size(); i++) {
+		DwColumn* found = NULL;
+		for(size_t j = 0; j < this->columns.size() && found == NULL; j++) {
+			if( upperCase(this->columns[j]->VariableName()) == upperCase(sortNames[i]) )
+				found = this->columns[j];
+		}
+		if( found == NULL )
+			throw DwUseException( "Invalid variable name in sort: " + sortNames[i] ); 
+		if( found->IsTranslated() )
+			throw DwUseException( "Can't sort by " + sortNames[i] + ", it is loaded as labels but the database has the codes" ); 
+		this->sortColumns.push_back(found);
+	}
+	// ties are broken by the row order, so partial LOADs fill the same observations as well
+	if( this->sortColumns.size() > 0 && this->RowOrderSQL() != "" )
+		this->isOrdered = true;
+	this->loadColumns = this->columns;
+	// attribute the load costs to the columns
+	this->ProfileColumns();
 };
 
 
+void DwUseQuery::ProfileColumns() {
+	if( this->options->IsProfileColumns() ) {
+		vector<string> names, types;
+		for(size_t i = 0; i < this->loadColumns.size(); i++) {
+			names.push_back(this->loadColumns[i]->VariableName());
+			types.push_back(this->loadColumns[i]->StataDataType());
+		}
+		this->stats.ProfileColumns(names, types);
+	}
+}
+
+
 DwUseQuery::~DwUseQuery(void) {
+	// the thread uses the connection
+	if(this->prefetch) {
+		delete this->prefetch;
+		this->prefetch = NULL;
+	}
 	if(this->options) {
 		delete this->options;
 		this->options = NULL;
 	}
-	if(this->conn) {
+	if(this->conn && this->ownsConnection) {
 		delete this->conn;
 		this->conn = NULL;
 	}
-	if(this->variableTranslator) {
-		delete this->variableTranslator;
-		this->variableTranslator = NULL;
+	// one variable translator for each source table
+	for(map<string,Translator*>::iterator ii = this->variableTranslators.begin(); ii != this->variableTranslators.end(); ii++) {
+		delete ii->second;
 	}
 	// fee all meta data 
 	for(size_t i=0; i<this->columns.size(); i++) {
@@ -230,42 +435,76 @@ DwUseQuery::~DwUseQuery(void) {
 
 
 string DwUseQuery::QuerySQL() {
+	return this->SelectSQL(true);
+}
+
+
+string DwUseQuery::SelectSQL(bool isSorted) {
 	string sql = "select ";
-	for(size_t i=0; i < this->columns.size(); i++) {
+	for(size_t i=0; i < this->loadColumns.size(); i++) {
 		if(i > 0) 
 			sql += ", ";
-		sql += this->columns[i]->ColumnName();
-	}
-	sql += " from " + this->options->Table();
-	// apply filters
-	string whereSql = this->options->WhereSQL();
-	if( this->options->Limit() > 0 ) {
-		if(whereSql != "")
-			whereSql = "(" + whereSql + ") and ";
-		whereSql += "rownum <= " + toString(this->options->Limit());
-	}
-	else if (this->options->IsNullData()) {
-		if (whereSql != "") {
-			whereSql = "(" + whereSql + ") and ";
-		}
-		whereSql += "rownum = 0";
+		sql += this->loadColumns[i]->SelectSQL();
+	}
+	// the observation the row goes to comes last
+	if( this->options->IsKeysInPlace() )
+		sql += ", k.OBS";
+	sql += " from " + this->fromSql;
+	string orderSql;
+	if( isSorted ) {
+		orderSql = this->SortSQL();
+		if( this->isOrdered )
+			orderSql += (orderSql != "" ? ", " : "") + this->RowOrderSQL();
 	}
-	if( whereSql != "" ) 
-		sql += " where " + whereSql;
+	// apply filters, limiting the rows is up to the database
+	if( this->options->Limit() > 0 )
+		return this->conn->LimitSQL(sql, this->whereSql, this->options->Limit(), orderSql);
+	else if (this->options->IsNullData())
+		return this->conn->LimitSQL(sql, this->whereSql, 0);
+	if( this->whereSql != "" ) 
+		sql += " where " + this->whereSql;
+	if( orderSql != "" )
+		sql += " order by " + orderSql;
 	return sql;
 }
 
 
+// an encoded string is sorted by its text, the codes follow the same order
+// STATA puts empty strings first and missing numbers last
+string DwUseQuery::SortSQL() {
+	string orderSql;
+	for(size_t i = 0; i < this->sortColumns.size(); i++) {
+		DwColumn* column = this->sortColumns[i];
+		bool isText = !column->IsNumeric() || column->Encoder() != NULL;
+		orderSql += (i > 0 ? ", " : "") + this->conn->SortSQL(column->ColumnName(), isText, !column->IsNumeric());
+	}
+	return orderSql;
+}
+
+
+// the rows of each joined table in the order the database keeps them
+string DwUseQuery::RowOrderSQL() {
+	string orderSql;
+	for(size_t i = 0; i < this->tableAliases.size(); i++) {
+		string column = this->conn->RowOrderSQL(this->tableAliases[i]);
+		if( column == "" )
+			return "";
+		orderSql += (i > 0 ? ", " : "") + column;
+	}
+	return orderSql;
+}
+
+
 // helper class to count rows
 class RowCounter {
 public: 
 	RowCounter(int& c) : cnt(c) {
 	}
 	// there will only be one row with one column
-    void operator()( oracle::occi::ResultSet* rs ) 
+    void operator()( DbRow* row ) 
     { 
-		if (!rs->isNull(1)) {
-			this->cnt = rs->getInt(1);
+		if (!row->IsNull(1)) {
+			this->cnt = row->GetInt(1);
 		} else {
 			this->cnt = 0;
 		}
@@ -276,20 +515,349 @@ private:
 
 
 int DwUseQuery::RowCount() {
-	string sql = "select count(1) from (" + this->QuerySQL() + ")";
+	string sql = "select count(1) from (" + this->SelectSQL(false) + ")";
 	int cnt = 0;
 	RowCounter rc(cnt);
-	vector<string> params;
+	DwTimer timer(&this->stats, PHASE_ROWCOUNT);
 	try {
-		this->conn->Select( rc, sql, params );
+		this->conn->Select( rc, sql, this->params );
+		this->rowCount = cnt;
 		return cnt;
-	} catch( SQLException ex ) {
+	} catch( const DbException& ex ) {
 		string msg = ex.getMessage();
 		throw DwUseException( "Error querying row count with \n" 
 								+ sql+ ": \n" + msg ); 
 	}
 }
 
+// an estimate of the plan or ? if it is not known
+string PlanNumber(double value) {
+	return value >= 0 ? toString((long)value) : "?";
+}
+
+
+vector<string> DwUseQuery::Preflight() {
+	string sql = this->QuerySQL();
+	DbPlan plan;
+	{
+		DwTimer timer(&this->stats, PHASE_DESCRIBE);
+		try {
+			plan = this->conn->Explain(sql, this->params);
+		} catch( const DbException& ex ) {
+			throw DwUseException( "Error explaining the plan of \n" 
+									+ sql + ": \n" + ex.getMessage() ); 
+		}
+	}
+	vector<string> lines;
+	if( !plan.isExplained ) {
+		lines.push_back("The " + this->options->Backend() + " backend can't explain the query, there are no estimates.");
+		return lines;
+	}
+	string scans;
+	for(size_t i = 0; i < plan.fullScans.size(); i++)
+		scans += (i > 0 ? ", " : "") + plan.fullScans[i];
+	lines.push_back("Plan: " + PlanNumber(plan.rows) + " rows, " + PlanNumber(plan.bytes >= 0 ? plan.bytes / 1048576 : -1) 
+					+ " MB, cost " + PlanNumber(plan.cost) + ", full scans: " + (scans != "" ? scans : "none"));
+	// an unknown estimate is not over the limit
+	string over;
+	if( this->options->MaxRows() >= 0 && plan.rows > this->options->MaxRows() )
+		over += ", max_rows " + PlanNumber(this->options->MaxRows());
+	if( this->options->MaxBytes() >= 0 && plan.bytes > this->options->MaxBytes() )
+		over += ", max_mb " + PlanNumber(this->options->MaxBytes() / 1048576);
+	if( this->options->MaxCost() >= 0 && plan.cost > this->options->MaxCost() )
+		over += ", max_cost " + PlanNumber(this->options->MaxCost());
+	if( this->options->MaxFullScans() >= 0 && (int)plan.fullScans.size() > this->options->MaxFullScans() )
+		over += ", max_full_scans " + toString(this->options->MaxFullScans());
+	if( over != "" ) {
+		over = "The plan is over " + over.substr(2) + ".";
+		if( !this->options->IsForce() ) {
+			string msg;
+			for(size_t i = 0; i < lines.size(); i++)
+				msg += lines[i] + "\n";
+			throw DwUseException( msg + over + " Narrow the filter, or add force to run it anyway." ); 
+		}
+		lines.push_back(over + " Running it because of force.");
+	}
+	return lines;
+}
+
+
+int DwUseQuery::ObservationWidth() {
+	int width = 0;
+	for(size_t i = 0; i < this->columns.size(); i++)
+		width += this->columns[i]->StataWidth();
+	return width;
+}
+
+
+// megabytes with one decimal
+string Megabytes(double bytes) {
+	return toString((long)(bytes / 104857.6 + 0.5) / 10.0);
+}
+
+
+// the widest variable first
+bool CompareWidth(DwColumn* a, DwColumn* b) {
+	return a->StataWidth() > b->StataWidth();
+}
+
+
+vector<string> DwUseQuery::Footprint(double observations, bool perVariable) {
+	int width = this->ObservationWidth();
+	vector<string> lines;
+	lines.push_back("The dataset will take " + Megabytes(observations * width) + " MB in STATA (" 
+					+ toString((long)observations) + " observations of " + toString(width) + " bytes).");
+	if( !perVariable || width == 0 )
+		return lines;
+	vector<DwColumn*> ranked = this->columns;
+	stable_sort(ranked.begin(), ranked.end(), CompareWidth);
+	lines.push_back(Cell("variable", 33) + Cell("type", 9) + Cell("bytes", 7) + Cell("MB", 12) + "share");
+	for(size_t i = 0; i < ranked.size(); i++) {
+		int w = ranked[i]->StataWidth();
+		lines.push_back(Cell(ranked[i]->VariableName(), 33) + Cell(ranked[i]->StataDataType(), 9) + Cell(toString(w), 7)
+						+ Cell(Megabytes(observations * w), 12) + toString((int)(100.0 * w / width + 0.5)) + "%");
+	}
+	return lines;
+}
+
+
+// one row with a count for each column
+class CountCollector {
+public:
+	CountCollector(vector<int>& counts) : counts(counts) {
+	}
+	void operator()( DbRow* row ) {
+		for(size_t i = 0; i < this->counts.size(); i++)
+			this->counts[i] = row->IsNull(i+1) ? 0 : row->GetInt(i+1);
+	}
+private:
+	vector<int>& counts;
+};
+
+// the values of the first column
+class ValueCollector {
+public:
+	ValueCollector(vector<string>& values) : values(values) {
+	}
+	void operator()( DbRow* row ) {
+		this->values.push_back( row->GetString(1) );
+	}
+private:
+	vector<string>& values;
+};
+
+
+int DwUseQuery::Encode() {
+	if( this->encodeColumns.size() == 0 || this->options->IsNullData() )
+		return 0;
+	string where = this->whereSql != "" ? " where " + this->whereSql : "";
+	DwTimer timer(&this->stats, PHASE_LABELS);
+	// count the distinct values of all candidates in one scan
+	string sql = "select ";
+	for(size_t i = 0; i < this->encodeColumns.size(); i++)
+		sql += (i > 0 ? ", " : "") + string("count(distinct ") + this->encodeColumns[i]->ColumnName() + ")";
+	sql += " from " + this->fromSql + where;
+	vector<int> counts(this->encodeColumns.size(), 0);
+	CountCollector cc(counts);
+	try {
+		this->conn->Select( cc, sql, this->params );
+	} catch( const DbException& ex ) {
+		throw DwUseException( "Error counting distinct values with \n" 
+								+ sql + ": \n" + ex.getMessage() ); 
+	}
+	// read the values of the columns that have few enough, the encoder numbers them in sorted order
+	int encoded = 0;
+	for(size_t i = 0; i < this->encodeColumns.size(); i++) {
+		if( counts[i] == 0 || counts[i] > this->options->EncodeMax() )
+			continue;
+		string column = this->encodeColumns[i]->ColumnName();
+		sql = "select distinct " + column + " from " + this->fromSql + where;
+		vector<string> values;
+		ValueCollector vc(values);
+		try {
+			this->conn->Select( vc, sql, this->params );
+		} catch( const DbException& ex ) {
+			throw DwUseException( "Error querying distinct values with \n" 
+									+ sql + ": \n" + ex.getMessage() ); 
+		}
+		this->encodeColumns[i]->SetEncoder( new DwEncoder(values, this->encodeColumns[i]->VariableName()) );
+		encoded++;
+	}
+	// the types changed
+	this->ProfileColumns();
+	return encoded;
+}
+
+// the numbers come converted by the server
+vector<DbFetchType> DwUseQuery::FetchTypes() {
+	vector<DbFetchType> fetchTypes;
+	for(size_t i = 0; i < this->loadColumns.size(); i++)
+		fetchTypes.push_back( this->loadColumns[i]->FetchType() );
+	if( this->options->IsKeysInPlace() )
+		fetchTypes.push_back( FETCH_INT );
+	return fetchTypes;
+}
+
+// the connection is left to the thread until LOAD has taken all rows
+void DwUseQuery::StartPrefetch() {
+	if( this->prefetch != NULL )
+		delete this->prefetch;
+	this->prefetch = NULL;
+	this->prefetch = new DwPrefetch(this->conn, this->QuerySQL(), this->params, this->FetchTypes(), 
+									this->loadColumns, this->ObservationPosition(), this->options->PrefetchBytes());
+}
+
 const vector<DwColumn*>& DwUseQuery::Columns() {
 	return this->columns;
 }
+
+
+// rows are numbered as they come, so the observations of a partial LOAD only match the ones before
+// if every LOAD reads the rows in the same order, a full LOAD that did not can't be continued
+void DwUseQuery::SelectVariables(const vector<string>& names) {
+	vector<DwColumn*> selected;
+	for(size_t i = 0; i < names.size(); i++) {
+		DwColumn* found = NULL;
+		for(size_t j = 0; j < this->columns.size() && found == NULL; j++) {
+			if( this->columns[j]->VariableName() == names[i] )
+				found = this->columns[j];
+		}
+		for(size_t j = 0; j < this->columns.size() && found == NULL; j++) {
+			if( upperCase(this->columns[j]->VariableName()) == upperCase(names[i]) )
+				found = this->columns[j];
+		}
+		if( found == NULL )
+			throw DwUseException( "Variable " + names[i] + " is not one of the variables of CREATE." ); 
+		if( std::find(selected.begin(), selected.end(), found) == selected.end() )
+			selected.push_back(found);
+	}
+	bool isPartial = selected.size() > 0 && selected.size() < this->columns.size();
+	if( !isPartial )
+		selected = this->columns;
+	if( isPartial && !this->options->IsKeysInPlace() ) {
+		if( this->RowOrderSQL() == "" )
+			throw DwUseException( "The " + this->options->Backend() + " backend has no stable order of the rows, "
+								  "LOAD all the variables at once or place the rows by key with keys_inplace." ); 
+		if( this->loads > 0 && !this->isOrdered )
+			throw DwUseException( "The previous LOAD took every variable in no particular order, so these would not "
+								  "go into the same observations. CREATE again and LOAD the variables in parts from the first LOAD." ); 
+		this->isOrdered = true;
+	}
+	// the rows prefetched since CREATE are not in order and have every column, with the observation after them
+	// freeing it joins the thread, so the positions are not changed under CopyValue
+	if( isPartial && this->prefetch != NULL ) {
+		delete this->prefetch;
+		this->prefetch = NULL;
+	}
+	this->loads++;
+	for(size_t i = 0; i < selected.size(); i++)
+		selected[i]->SetPosition(i + 1);
+	this->loadColumns = selected;
+	this->ProfileColumns();
+}
+
+vector<int> DwUseQuery::SortVariables() {
+	vector<int> variables;
+	for(size_t i = 0; i < this->sortColumns.size(); i++)
+		variables.push_back( std::find(this->columns.begin(), this->columns.end(), this->sortColumns[i]) - this->columns.begin() + 1 );
+	return variables;
+}
+
+const vector<DwColumn*>& DwUseQuery::LoadColumns() {
+	return this->loadColumns;
+}
+
+vector<int> DwUseQuery::LoadVariables() {
+	vector<int> variables;
+	for(size_t i = 0; i < this->loadColumns.size(); i++)
+		variables.push_back( std::find(this->columns.begin(), this->columns.end(), this->loadColumns[i]) - this->columns.begin() + 1 );
+	return variables;
+}
+
+const vector<DbParam>& DwUseQuery::Params() {
+	return this->params;
+}
+
+
+// fill the temporary table used by the keys option from the STATA dataset
+int DwUseQuery::UploadKeys(DatasetReader* reader) {
+	string sql = "insert into " + KEY_TABLE + " (OBS, " + (this->isStringKey ? "KEY_STR" : "KEY_NUM") + ") values (:1, :2)";
+	try {
+		// the table is private to the session, so a previous CREATE may have left rows in it
+		try {
+			this->conn->Execute("delete from " + KEY_TABLE);
+		} catch( const DbException& ex ) {
+			if( ex.getErrorCode() != 942 ) // table or view does not exist
+				throw;
+			this->conn->Execute("create global temporary table " + KEY_TABLE 
+								+ " (OBS number, KEY_NUM number, KEY_STR varchar2(" + toString(KEY_STRING_WIDTH - 1) + "))"
+								+ " on commit preserve rows");
+		}
+		// insert in batches with array binds
+		vector<DbArrayParam> arrays(2);
+		arrays[0].Reset(true, 0, KEY_BATCH_SIZE);
+		arrays[1].Reset(!this->isStringKey, KEY_STRING_WIDTH, KEY_BATCH_SIZE);
+		int uploaded = 0;
+		int rows = 0;
+		int nobs = reader->Count();
+		for(int obs = 1; obs <= nobs; obs++) {
+			double number = 0;
+			string text;
+			// missing keys cannot match anything
+			if( !reader->Read(1, obs, !this->isStringKey, number, text) )
+				continue;
+			arrays[0].SetNumber(rows, obs);
+			if( this->isStringKey )
+				arrays[1].SetString(rows, text);
+			else
+				arrays[1].SetNumber(rows, number);
+			rows++;
+			if( rows == KEY_BATCH_SIZE ) {
+				this->conn->ExecuteArray(sql, arrays, rows);
+				uploaded += rows;
+				rows = 0;
+			}
+		}
+		if( rows > 0 ) {
+			this->conn->ExecuteArray(sql, arrays, rows);
+			uploaded += rows;
+		}
+		this->conn->Commit();
+		return uploaded;
+	} catch( const DbException& ex ) {
+		throw DwUseException( "Error uploading keys into " + KEY_TABLE + " with \n"
+								+ sql + ": \n" + ex.getMessage() ); 
+	}
+}
+
+int DwUseQuery::ObservationPosition() {
+	return this->options->IsKeysInPlace() ? this->loadColumns.size() + 1 : 0;
+}
+
+DwStats* DwUseQuery::Stats() {
+	// the connection keeps count of the round trips, the prefetch updates them on its thread until it is done
+	if( this->prefetch != NULL && !this->prefetch->IsDone() )
+		return &this->stats;
+	this->stats.roundTrips = this->conn->RoundTrips();
+	this->stats.fetchReport = this->conn->FetchReport();
+	this->stats.fetchRows = this->conn->FetchRows();
+	return &this->stats;
+}
+
+bool DwUseQuery::IsProfile() {
+	return this->options->IsProfile();
+}
+
+
+int DwUseQuery::LastRowCount() {
+	return this->rowCount;
+}
+
+
+DwUseOptions* DwUseQuery::Options() {
+	return this->options;
+}
+
+int DwUseQuery::ProgressRows() {
+	return this->options->ProgressRows();
+}
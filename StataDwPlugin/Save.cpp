@@ -0,0 +1,126 @@
+#include "dwplugin.h"
+#include "strutils.h"
+
+
+// how a STATA value is turned into the column value, the text kinds are dates the database can't compute
+enum SaveKind { SAVE_NUMBER, SAVE_DATE, SAVE_TIMESTAMP, SAVE_STRING, SAVE_DATE_TEXT, SAVE_TIMESTAMP_TEXT };
+
+
+DwExport::DwExport(DwUseOptions* options) {
+	this->options = options;
+	try {
+		this->conn = DbConnect::Open( options->Backend(),
+									  options->Username(),
+									  options->Password(),
+									  options->Database(),
+									  options->Daemon() );
+	} catch( const DbException& ex ) {
+		throw DwUseException( "Error connecting to the database with " 
+								+ options->Username() + "@" + options->Database() +": \n"
+								+ ex.getMessage() ); 
+	}
+}
+
+
+DwExport::~DwExport(void) {
+	if(this->options) {
+		delete this->options;
+		this->options = NULL;
+	}
+	if(this->conn) {
+		delete this->conn;
+		this->conn = NULL;
+	}
+}
+
+
+int DwExport::Save(DatasetReader* reader) {
+	vector<string> vars = this->options->Variables();
+	vector<string> types = this->options->Types();
+	string table = this->options->Table();
+	string sql;
+	try {
+		// create the table from the STATA types
+		if( this->options->IsCreateTable() ) {
+			if( types.size() != vars.size() )
+				throw DwUseException( "Give a type for each of the " + toString(vars.size()) + " variables to create " + table + "." );
+			sql = "create table " + table + " (";
+			for(size_t i = 0; i < vars.size(); i++) {
+				sql += (i > 0 ? ", " : "") + vars[i] + " " + DwColumn::OracleDataType(types[i]);
+			}
+			sql += ")";
+			this->conn->Execute(sql);
+		}
+
+		// the table decides how the values are converted: dates are days and timestamps are milliseconds since 1960 in STATA
+		sql = "select ";
+		for(size_t i = 0; i < vars.size(); i++) {
+			sql += (i > 0 ? ", " : "") + vars[i];
+		}
+		sql += " from " + table + " where 1=2";
+		vector<DbColumnMetaData> meta = this->conn->Describe(sql);
+
+		vector<SaveKind> kinds;
+		vector<DbArrayParam> arrays(meta.size());
+		int batchSize = this->options->BatchSize();
+		string values;
+		for(size_t i = 0; i < meta.size(); i++) {
+			SaveKind kind = SAVE_NUMBER;
+			string value = ":" + toString(i+1);
+			int width = meta[i].size + 1;
+			if( meta[i].type == "DATE" || meta[i].type == "TIMESTAMP" ) {
+				bool isTimestamp = meta[i].type == "TIMESTAMP";
+				string converted = this->conn->DateTimeValueSQL(value, isTimestamp);
+				if( converted != "" ) {
+					kind = isTimestamp ? SAVE_TIMESTAMP : SAVE_DATE;
+					value = converted;
+				} else {
+					kind = isTimestamp ? SAVE_TIMESTAMP_TEXT : SAVE_DATE_TEXT;
+					width = (int)DbDateTimeText(0, isTimestamp).size() + 1;
+				}
+			} else if( ExpressionCompiler::IsStringType(meta[i].type) ) {
+				kind = SAVE_STRING;
+			}
+			kinds.push_back(kind);
+			values += (i > 0 ? ", " : "") + value;
+			arrays[i].Reset(kind == SAVE_NUMBER || kind == SAVE_DATE || kind == SAVE_TIMESTAMP, width, batchSize);
+		}
+		sql = string("insert ") + (this->options->IsAppend() ? "/*+ APPEND_VALUES */ " : "") 
+			+ "into " + table + " (";
+		for(size_t i = 0; i < vars.size(); i++) {
+			sql += (i > 0 ? ", " : "") + vars[i];
+		}
+		sql += ") values (" + values + ")";
+
+		// read the dataset in batches and insert each with one round trip
+		int nobs = reader->Count();
+		int rows = 0;
+		for(int obs = 1; obs <= nobs; obs++) {
+			for(size_t i = 0; i < kinds.size(); i++) {
+				double number = 0;
+				string text;
+				if( !reader->Read(i+1, obs, kinds[i] != SAVE_STRING, number, text) )
+					arrays[i].SetNull(rows);
+				else if( kinds[i] == SAVE_STRING )
+					arrays[i].SetString(rows, text);
+				else if( kinds[i] == SAVE_DATE_TEXT || kinds[i] == SAVE_TIMESTAMP_TEXT )
+					arrays[i].SetString(rows, DbDateTimeText(number, kinds[i] == SAVE_TIMESTAMP_TEXT));
+				else
+					arrays[i].SetNumber(rows, number);
+			}
+			rows++;
+			if( rows == batchSize || obs == nobs ) {
+				this->conn->ExecuteArray(sql, arrays, rows);
+				// a direct path insert has to be committed before the table can be modified again
+				if( this->options->IsAppend() )
+					this->conn->Commit();
+				rows = 0;
+			}
+		}
+		this->conn->Commit();
+		return nobs;
+	} catch( const DbException& ex ) {
+		throw DwUseException( "Error saving into " + table + " with \n"
+								+ sql + ": \n" + ex.getMessage() ); 
+	}
+}
@@ -0,0 +1,293 @@
+#include "dwuse.h"
+#include "strutils.h"
+
+#ifdef DW_WITH_SQLITE
+#include "sqlite3.h"
+#include <cstdio>
+#include <cstdlib>
+
+// width of text columns without a declared size
+const int SQLITE_STRING_SIZE = 244;
+// julian day number of 1960-01-01 00:00, SQLite dates stored as numbers are julian days
+const double SQLITE_JULIAN_1960 = 2436934.5;
+
+
+// the current row of a stepped statement
+// SQLite has no date type, dates are either ISO text or julian day numbers
+class SqliteRow : public DbRow {
+public:
+	SqliteRow(sqlite3_stmt* stmt) : stmt(stmt) {}
+	bool IsNull(int col) {
+		return sqlite3_column_type(stmt, col-1) == SQLITE_NULL;
+	}
+	double GetNumber(int col) {
+		return sqlite3_column_double(stmt, col-1);
+	}
+	int GetInt(int col) {
+		return sqlite3_column_int(stmt, col-1);
+	}
+	string GetString(int col) {
+		const unsigned char* text = sqlite3_column_text(stmt, col-1);
+		return text != NULL ? string((const char*)text, sqlite3_column_bytes(stmt, col-1)) : "";
+	}
+	double GetDate(int col) {
+		if( sqlite3_column_type(stmt, col-1) != SQLITE_TEXT )
+			return (double)(long)(sqlite3_column_double(stmt, col-1) - SQLITE_JULIAN_1960);
+		int year = 1960, month = 1, day = 1;
+		sscanf(this->GetString(col).c_str(), "%d-%d-%d", &year, &month, &day);
+		return DbDays(year, month, day);
+	}
+	double GetTimestamp(int col) {
+		if( sqlite3_column_type(stmt, col-1) != SQLITE_TEXT )
+			return (sqlite3_column_double(stmt, col-1) - SQLITE_JULIAN_1960) * 86400000;
+		int year = 1960, month = 1, day = 1, hour = 0, minute = 0;
+		double second = 0;
+		// YYYY-MM-DD HH:MM:SS.SSS, the T of ISO 8601 is also accepted
+		sscanf(this->GetString(col).c_str(), "%d-%d-%d%*c%d:%d:%lf", &year, &month, &day, &hour, &minute, &second);
+		return DbDays(year, month, day) * 86400000.0 + (hour * 3600 + minute * 60) * 1000.0 + second * 1000;
+	}
+private:
+	sqlite3_stmt* stmt;
+};
+
+
+// the declared type of a column mapped to the Oracle names DwColumn uses, like the affinity rules of SQLite
+DbColumnMetaData SqliteMetaData(string name, const char* declared) {
+	DbColumnMetaData md;
+	md.name = name;
+	md.isQuoted = md.name != upperCase(md.name);
+	md.size = 0;
+	md.precision = 0;
+	md.scale = 0;
+	string type = declared != NULL ? upperCase(declared) : "";
+	// VARCHAR(40) or DECIMAL(10,2)
+	int size = 0, scale = 0;
+	size_t open = type.find('(');
+	if( open != string::npos ) {
+		size = atoi(type.c_str() + open + 1);
+		size_t comma = type.find(',', open);
+		if( comma != string::npos )
+			scale = atoi(type.c_str() + comma + 1);
+	}
+	if( type.find("DATETIME") != string::npos || type.find("TIMESTAMP") != string::npos ) {
+		md.type = "TIMESTAMP";
+	} else if( type.find("DATE") != string::npos ) {
+		md.type = "DATE";
+	} else if( type.find("INT") != string::npos ) {
+		md.type = "NUMBER"; // 64 bit, so double in STATA
+		md.precision = 19;
+	} else if( type.find("CHAR") != string::npos || type.find("CLOB") != string::npos || type.find("TEXT") != string::npos ) {
+		md.type = "VARCHAR2";
+		md.size = size > 0 ? size : SQLITE_STRING_SIZE;
+	} else if( type.find("REAL") != string::npos || type.find("FLOA") != string::npos || type.find("DOUB") != string::npos ) {
+		md.type = "NUMBER"; // binary double like Oracle FLOAT
+		md.precision = 126;
+		md.scale = -127;
+	} else if( type == "" || type.find("BLOB") != string::npos ) {
+		md.type = "VARCHAR2"; // expressions have no declared type
+		md.size = SQLITE_STRING_SIZE;
+	} else {
+		md.type = "NUMBER"; // NUMERIC, DECIMAL
+		md.precision = size > 0 ? size : 38;
+		md.scale = scale;
+	}
+	return md;
+}
+
+
+SqliteConnect::SqliteConnect(string file) {
+	this->db = NULL;
+	if( sqlite3_open_v2(file.c_str(), &this->db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL) != SQLITE_OK ) {
+		string msg = this->db != NULL ? sqlite3_errmsg(this->db) : "out of memory";
+		sqlite3_close(this->db);
+		throw DbException( "Cannot open " + file + ": " + msg );
+	}
+}
+
+
+SqliteConnect::~SqliteConnect(void) {
+	sqlite3_close(this->db);
+}
+
+
+// prepare a statement or throw the error of the database
+sqlite3_stmt* SqlitePrepare(sqlite3* db, string sql) {
+	sqlite3_stmt* stmt = NULL;
+	if( sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, NULL) != SQLITE_OK )
+		throw DbException( sqlite3_errmsg(db), sqlite3_errcode(db) );
+	return stmt;
+}
+
+
+// preparing is enough to get the declared types
+vector<DbColumnMetaData> SqliteConnect::Describe(string sql) {
+	sqlite3_stmt* stmt = SqlitePrepare(this->db, sql);
+	this->roundTrips++;
+	vector<DbColumnMetaData> cols;
+	for(int i = 0; i < sqlite3_column_count(stmt); i++)
+		cols.push_back( SqliteMetaData(sqlite3_column_name(stmt, i), sqlite3_column_decltype(stmt, i)) );
+	sqlite3_finalize(stmt);
+	return cols;
+}
+
+
+// the values are binary in SQLite already, so the fetch types are not needed
+void SqliteConnect::Query(string sql, const vector<DbParam>& params, const vector<DbFetchType>& fetchTypes, DbRowProcessor* processor) {
+	sqlite3_stmt* stmt = SqlitePrepare(this->db, sql);
+	try {
+		for(size_t i = 0; i < params.size(); i++) {
+			int rc = params[i].isNumber
+					 ? sqlite3_bind_double(stmt, i+1, params[i].number)
+					 : sqlite3_bind_text(stmt, i+1, params[i].text.c_str(), -1, SQLITE_TRANSIENT);
+			if( rc != SQLITE_OK )
+				throw DbException( sqlite3_errmsg(this->db), sqlite3_errcode(this->db) );
+		}
+		this->roundTrips++;
+		vector<DbColumnMetaData> cols;
+		for(int i = 0; i < sqlite3_column_count(stmt); i++)
+			cols.push_back( SqliteMetaData(sqlite3_column_name(stmt, i), sqlite3_column_decltype(stmt, i)) );
+		processor->Columns(cols);
+		SqliteRow row(stmt);
+		int rc;
+		while( (rc = sqlite3_step(stmt)) == SQLITE_ROW )
+			processor->Process( &row );
+		if( rc != SQLITE_DONE )
+			throw DbException( sqlite3_errmsg(this->db), sqlite3_errcode(this->db) );
+	} catch( ... ) {
+		sqlite3_finalize(stmt);
+		throw;
+	}
+	sqlite3_finalize(stmt);
+}
+
+
+void SqliteConnect::Execute(string sql) {
+	char* error = NULL;
+	if( sqlite3_exec(this->db, sql.c_str(), NULL, NULL, &error) != SQLITE_OK ) {
+		string msg = error != NULL ? error : sqlite3_errmsg(this->db);
+		sqlite3_free(error);
+		throw DbException( msg, sqlite3_errcode(this->db) );
+	}
+	this->roundTrips++;
+}
+
+
+// one prepared insert stepped for each row, in a transaction that Commit ends
+void SqliteConnect::ExecuteArray(string sql, vector<DbArrayParam>& params, unsigned int rows) {
+	if( rows == 0 )
+		return;
+	if( sqlite3_get_autocommit(this->db) )
+		this->Execute("begin");
+	sqlite3_stmt* stmt = SqlitePrepare(this->db, sql);
+	try {
+		for(unsigned int r = 0; r < rows; r++) {
+			for(size_t i = 0; i < params.size(); i++) {
+				DbArrayParam& p = params[i];
+				int rc;
+				if( p.indicators[r] == -1 )
+					rc = sqlite3_bind_null(stmt, i+1);
+				else if( p.isNumber )
+					rc = sqlite3_bind_double(stmt, i+1, p.numbers[r]);
+				else
+					rc = sqlite3_bind_text(stmt, i+1, &p.strings[r * p.width], -1, SQLITE_STATIC);
+				if( rc != SQLITE_OK )
+					throw DbException( sqlite3_errmsg(this->db), sqlite3_errcode(this->db) );
+			}
+			if( sqlite3_step(stmt) != SQLITE_DONE )
+				throw DbException( sqlite3_errmsg(this->db), sqlite3_errcode(this->db) );
+			sqlite3_reset(stmt);
+		}
+		this->roundTrips++;
+	} catch( ... ) {
+		sqlite3_finalize(stmt);
+		throw;
+	}
+	sqlite3_finalize(stmt);
+}
+
+
+void SqliteConnect::Commit() {
+	if( !sqlite3_get_autocommit(this->db) )
+		this->Execute("commit");
+}
+
+
+// each step of the plan has a detail like SCAN t, SCAN TABLE t or SEARCH t USING INDEX i
+class SqlitePlanReader {
+public:
+	SqlitePlanReader(DbPlan& plan) : plan(plan) {}
+	void operator()( DbRow* row ) {
+		string detail = row->GetString(4);
+		if( detail.substr(0, 5) != "SCAN " )
+			return;
+		detail = detail.substr(5);
+		if( detail.substr(0, 6) == "TABLE " )
+			detail = detail.substr(6);
+		this->plan.fullScans.push_back( detail.substr(0, detail.find(' ')) );
+	}
+private:
+	DbPlan& plan;
+};
+
+
+// SQLite tells the steps but doesn't estimate rows or cost
+DbPlan SqliteConnect::Explain(string sql, const vector<DbParam>& params) {
+	DbPlan plan = DbConnect::Explain(sql, params);
+	plan.isExplained = true;
+	SqlitePlanReader reader(plan);
+	this->Select(reader, "explain query plan " + sql, params);
+	return plan;
+}
+
+
+// may be called from any thread, the step in progress fails with SQLITE_INTERRUPT
+void SqliteConnect::Cancel() {
+	sqlite3_interrupt(this->db);
+}
+
+
+string SqliteConnect::LimitSQL(string sql, string whereSql, int rows, string orderSql) {
+	if( rows == 0 )
+		whereSql = whereSql != "" ? "(" + whereSql + ") and 1=0" : "1=0";
+	if( whereSql != "" )
+		sql += " where " + whereSql;
+	if( orderSql != "" )
+		sql += " order by " + orderSql;
+	return rows > 0 ? sql + " limit " + toString(rows) : sql;
+}
+
+
+// there is no percentile aggregate built in
+string SqliteConnect::PercentileSQL(string column, double fraction) {
+	return "";
+}
+
+
+// stored as ISO text, the modifiers add whole milliseconds so the fraction doesn't drift
+string SqliteConnect::DateTimeValueSQL(string value, bool isTimestamp) {
+	if( !isTimestamp )
+		return "date('1960-01-01', " + value + " || ' days')";
+	return "strftime('%Y-%m-%d %H:%M:%f', '1960-01-01', (" + value + " / 1000.0) || ' seconds')";
+}
+
+
+// julianday reads both the text and the numbers GetDate and GetTimestamp take
+string SqliteConnect::DateTimeSQL(string column, bool isTimestamp) {
+	string days = "(julianday(" + column + ") - 2436934.5)"; // SQLITE_JULIAN_1960
+	return isTimestamp ? "round(" + days + " * 86400000)" : "cast(" + days + " as integer)";
+}
+
+
+// the length is in characters, but they are bytes unless the text has accents
+string SqliteConnect::TruncateSQL(string column, int bytes) {
+	return "substr(" + column + ", 1, " + toString(bytes) + ")";
+}
+
+
+// text is compared byte by byte unless the column says otherwise, nulls come first
+// nulls last needs SQLite 3.30, ordering by the null test works with any
+string SqliteConnect::SortSQL(string column, bool isText, bool isNullFirst) {
+	return isNullFirst ? column : column + " is null, " + column;
+}
+
+#endif
@@ -0,0 +1,146 @@
+#include "dwplugin.h"
+#include "strutils.h"
+#include <algorithm>
+
+
+DwStats::DwStats() {
+	this->Reset();
+}
+
+void DwStats::Reset() {
+	for(int i = 0; i < PHASE_COUNT; i++) {
+		this->seconds[i] = 0;
+		this->started[i] = 0;
+	}
+	this->rows = 0;
+	this->cells = 0;
+	this->bytes = 0;
+	this->roundTrips = 0;
+	this->fetchReport = "";
+	this->fetchRows = 0;
+	for(size_t i = 0; i < this->columns.size(); i++) {
+		this->columns[i].bytes = 0;
+		this->columns[i].convertSeconds = 0;
+		this->columns[i].storeSeconds = 0;
+	}
+}
+
+// wall clock time in seconds with sub-millisecond resolution
+double DwStats::Now() {
+	return DbClock();
+}
+
+void DwStats::Start(DwPhase phase) {
+	this->started[phase] = DwStats::Now();
+}
+
+void DwStats::Stop(DwPhase phase) {
+	this->seconds[phase] += DwStats::Now() - this->started[phase];
+}
+
+void DwStats::Add(DwPhase phase, double seconds) {
+	this->seconds[phase] += seconds;
+}
+
+double DwStats::Seconds(DwPhase phase) {
+	return this->seconds[phase];
+}
+
+double DwStats::TotalSeconds() {
+	double total = 0;
+	for(int i = 0; i < PHASE_COUNT; i++)
+		total += this->seconds[i];
+	return total;
+}
+
+string DwStats::PhaseName(DwPhase phase) {
+	switch(phase) {
+		case PHASE_CONNECT: return "connect";
+		case PHASE_DESCRIBE: return "describe";
+		case PHASE_LABELS: return "labels";
+		case PHASE_ROWCOUNT: return "rowcount";
+		case PHASE_FETCH: return "fetch";
+		case PHASE_STORE: return "store";
+		default: return "unknown";
+	}
+}
+
+// a table of the phases and counters for the PROFILE option
+vector<string> DwStats::Summary() {
+	vector<string> lines;
+	double total = this->TotalSeconds();
+	lines.push_back("phase            seconds       share");
+	for(int i = 0; i < PHASE_COUNT; i++) {
+		DwPhase phase = (DwPhase)i;
+		string name = DwStats::PhaseName(phase);
+		string secs = toString(this->seconds[i]);
+		string share = total > 0 ? toString((int)(100 * this->seconds[i] / total + 0.5)) + "%" : "";
+		lines.push_back(name + string(17 - name.size(), ' ') + secs + string(secs.size() < 14 ? 14 - secs.size() : 1, ' ') + share);
+	}
+	double transfer = this->seconds[PHASE_FETCH] + this->seconds[PHASE_STORE];
+	lines.push_back("rows: " + toString(this->rows) + ", cells: " + toString(this->cells) 
+					+ ", bytes: " + toString(this->bytes) + ", round trips: " + toString(this->roundTrips));
+	if( transfer > 0 )
+		lines.push_back("rows/s: " + toString((long)(this->rows / transfer)) 
+						+ ", bytes/s: " + toString((long)(this->bytes / transfer)));
+	if( this->fetchReport != "" )
+		lines.push_back(this->fetchReport);
+	return lines;
+}
+
+
+void DwStats::ProfileColumns(const vector<string>& names, const vector<string>& types) {
+	this->columns.clear();
+	for(size_t i = 0; i < names.size(); i++) {
+		DwColumnCost cost;
+		cost.name = names[i];
+		cost.type = types[i];
+		cost.bytes = 0;
+		cost.convertSeconds = 0;
+		cost.storeSeconds = 0;
+		this->columns.push_back(cost);
+	}
+}
+
+bool DwStats::IsProfileColumns() {
+	return this->columns.size() > 0;
+}
+
+void DwStats::AddColumn(size_t column, double bytes, double convertSeconds, double storeSeconds) {
+	DwColumnCost& cost = this->columns[column];
+	cost.bytes += bytes;
+	cost.convertSeconds += convertSeconds;
+	cost.storeSeconds += storeSeconds;
+}
+
+// most expensive first
+bool CompareColumnCost(const DwColumnCost& a, const DwColumnCost& b) {
+	return a.convertSeconds + a.storeSeconds > b.convertSeconds + b.storeSeconds;
+}
+
+// pad a value to a fixed width column of the report
+string Cell(string value, size_t width) {
+	return value.size() < width ? value + string(width - value.size(), ' ') : value + " ";
+}
+
+vector<string> DwStats::ColumnSummary() {
+	vector<DwColumnCost> ranked = this->columns;
+	sort(ranked.begin(), ranked.end(), CompareColumnCost);
+	double total = 0, totalBytes = 0;
+	for(size_t i = 0; i < ranked.size(); i++) {
+		total += ranked[i].convertSeconds + ranked[i].storeSeconds;
+		totalBytes += ranked[i].bytes;
+	}
+	vector<string> lines;
+	lines.push_back(Cell("variable", 33) + Cell("type", 9) + Cell("bytes", 14) + Cell("bytes%", 8) 
+					+ Cell("convert s", 12) + Cell("store s", 12) + "time%");
+	for(size_t i = 0; i < ranked.size(); i++) {
+		const DwColumnCost& c = ranked[i];
+		double seconds = c.convertSeconds + c.storeSeconds;
+		lines.push_back(Cell(c.name, 33) + Cell(c.type, 9) + Cell(toString((long)c.bytes), 14)
+						+ Cell(totalBytes > 0 ? toString((int)(100 * c.bytes / totalBytes + 0.5)) : "", 8)
+						+ Cell(toString(c.convertSeconds), 12) + Cell(toString(c.storeSeconds), 12)
+						+ (total > 0 ? toString((int)(100 * seconds / total + 0.5)) : ""));
+	}
+	return lines;
+}
@@ -0,0 +1,446 @@
+#include "dwplugin.h"
+#include "strutils.h"
+#include <cmath>
+#include <cstdio>
+
+const double MISSING = ldexp(1.0, 1023); // the . missing value of STATA
+const int PERCENTILE_COUNT = 9;
+const int PERCENTILES[PERCENTILE_COUNT] = { 1, 5, 10, 25, 50, 75, 90, 95, 99 };
+
+
+// the numbers of the first row, missing for nulls
+class NumberCollector {
+public:
+	NumberCollector(vector<double>& numbers) : numbers(numbers) {
+	}
+	void operator()( DbRow* row ) {
+		for(size_t i = 0; i < this->numbers.size(); i++)
+			this->numbers[i] = row->IsNull(i+1) ? MISSING : row->GetNumber(i+1);
+	}
+private:
+	vector<double>& numbers;
+};
+
+
+// the values of a column in order, the ones at the given positions are kept
+// Select copies the collector so the position is kept by the caller
+class OrderedCollector {
+public:
+	OrderedCollector(map<double,double>& values, double& position) : values(values), position(position) {
+	}
+	void operator()( DbRow* row ) {
+		map<double,double>::iterator ii = this->values.find(this->position++);
+		if( ii != this->values.end() )
+			ii->second = row->GetNumber(1);
+	}
+private:
+	map<double,double>& values;
+	double& position;
+};
+
+
+// the count of a value or a pair of values of tabulate
+struct DwTabulated {
+	double number[2];
+	string text[2];
+	double count;
+};
+
+// the rows of the group by, the variables are the first columns and the count comes last
+class TabulationCollector {
+public:
+	TabulationCollector(const vector<DwColumn*>& columns, vector<DwTabulated>& cells) : columns(columns), cells(cells) {
+	}
+	void operator()( DbRow* row ) {
+		DwTabulated cell;
+		for(size_t i = 0; i < this->columns.size(); i++) {
+			bool isNull = this->columns[i]->IsNull(row);
+			cell.number[i] = isNull || !this->columns[i]->IsNumeric() ? MISSING : this->columns[i]->AsNumber(row);
+			cell.text[i] = isNull || this->columns[i]->IsNumeric() ? "" : this->columns[i]->AsString(row);
+		}
+		cell.count = row->GetNumber(this->columns.size() + 1);
+		this->cells.push_back(cell);
+	}
+private:
+	const vector<DwColumn*>& columns;
+	vector<DwTabulated>& cells;
+};
+
+
+// the distinct values of a variable of tabulate in the order STATA shows them
+class DwTabulationAxis {
+public:
+	DwTabulationAxis(DwColumn* column, const vector<DwTabulated>& cells, int which) : column(column), which(which) {
+		for(size_t i = 0; i < cells.size(); i++) {
+			if( column->IsNumeric() )
+				this->numbers.insert( make_pair(cells[i].number[which], 0) );
+			else
+				this->texts.insert( make_pair(cells[i].text[which], 0) );
+		}
+		// numbered in the sorted order of the maps
+		size_t position = 0;
+		for(map<double,size_t>::iterator ii = this->numbers.begin(); ii != this->numbers.end(); ii++)
+			ii->second = position++;
+		for(map<string,size_t>::iterator ii = this->texts.begin(); ii != this->texts.end(); ii++)
+			ii->second = position++;
+	}
+	size_t Size() {
+		return this->column->IsNumeric() ? this->numbers.size() : this->texts.size();
+	}
+	size_t Position(const DwTabulated& cell) {
+		return this->column->IsNumeric() ? this->numbers[cell.number[this->which]] : this->texts[cell.text[this->which]];
+	}
+	// the values in order: numbers for a matrix, or the texts
+	vector<double> Numbers() {
+		vector<double> values;
+		for(map<double,size_t>::iterator ii = this->numbers.begin(); ii != this->numbers.end(); ii++)
+			values.push_back(ii->first);
+		return values;
+	}
+	vector<string> Labels() {
+		vector<string> labels;
+		for(map<double,size_t>::iterator ii = this->numbers.begin(); ii != this->numbers.end(); ii++)
+			labels.push_back(ii->first == MISSING ? "." : toString(ii->first));
+		for(map<string,size_t>::iterator ii = this->texts.begin(); ii != this->texts.end(); ii++)
+			labels.push_back(ii->first);
+		return labels;
+	}
+private:
+	DwColumn* column;
+	int which;
+	map<double,size_t> numbers;
+	map<string,size_t> texts;
+};
+
+
+// a number of a result table, . for missing
+string ResultCell(double value) {
+	return value == MISSING ? "." : toString(value);
+}
+
+// a number the database can read back exactly
+string NumberSQL(double value) {
+	char number[32];
+	sprintf(number, "%.17g", value);
+	return "(" + string(number) + ")";
+}
+
+
+DwSummary::DwSummary(DwUseOptions* options, ParameterResolver* resolver) {
+	this->options = options;
+	this->query = NULL;
+	try {
+		this->conn = DbConnect::Open( options->Backend(),
+									  options->Username(),
+									  options->Password(),
+									  options->Database(),
+									  options->Daemon() );
+	} catch( const DbException& ex ) {
+		string user = options->Username() + "@" + options->Database();
+		delete options;
+		throw DwUseException( "Error connecting to the database with " + user + ": \n" + ex.getMessage() );
+	}
+	try {
+		// the query describes the columns and compiles the filter the same way as for CREATE
+		this->query = new DwUseQuery(options, resolver, this->conn);
+	} catch( ... ) {
+		delete this->conn;
+		throw;
+	}
+}
+
+
+DwSummary::~DwSummary(void) {
+	// the query uses the connection
+	delete this->query;
+	delete this->conn;
+}
+
+
+int DwSummary::UploadKeys(DatasetReader* reader) {
+	return this->query->UploadKeys(reader);
+}
+
+
+vector<double> DwSummary::Aggregate(string selectSql, size_t count, string what) {
+	string sql = "select " + selectSql + " from (" + this->query->QuerySQL() + ") q";
+	vector<double> numbers(count, MISSING);
+	NumberCollector nc(numbers);
+	DwTimer timer(this->query->Stats(), PHASE_FETCH);
+	try {
+		this->conn->Select( nc, sql, this->query->Params() );
+	} catch( const DbException& ex ) {
+		throw DwUseException( "Error computing " + what + " with \n"
+								+ sql + ": \n" + ex.getMessage() );
+	}
+	return numbers;
+}
+
+
+// interpolated between the two values around (n-1) * fraction like percentile_cont, from one ordered pass
+vector<double> DwSummary::Percentiles(DwColumn* column, double n) {
+	map<double,double> values;
+	for(int p = 0; p < PERCENTILE_COUNT; p++) {
+		double at = (n - 1) * PERCENTILES[p] / 100.0;
+		values[floor(at)] = MISSING;
+		values[ceil(at)] = MISSING;
+	}
+	string name = column->ResultName();
+	string sql = "select " + name + " from (" + this->query->QuerySQL() + ") q where " + name + " is not null order by " + name;
+	double position = 0;
+	OrderedCollector oc(values, position);
+	{
+		DwTimer timer(this->query->Stats(), PHASE_FETCH);
+		try {
+			this->conn->Select( oc, sql, this->query->Params() );
+		} catch( const DbException& ex ) {
+			throw DwUseException( "Error computing the percentiles with \n"
+									+ sql + ": \n" + ex.getMessage() );
+		}
+	}
+	vector<double> percentiles(PERCENTILE_COUNT, MISSING);
+	for(int p = 0; p < PERCENTILE_COUNT; p++) {
+		double at = (n - 1) * PERCENTILES[p] / 100.0;
+		double low = values[floor(at)];
+		double high = values[ceil(at)];
+		// the rows may have changed since the count
+		if( low != MISSING && high != MISSING )
+			percentiles[p] = low + (at - floor(at)) * (high - low);
+	}
+	return percentiles;
+}
+
+
+// a scan for the sums, one for the deviations from the mean (adding up squares of the values loses precision),
+// and one for the percentiles, or an ordered select of each column if the database has no percentile aggregate
+// strings have no observations like in summarize, the database can't add up dates
+vector<string> DwSummary::Summarize() {
+	const vector<DwColumn*>& columns = this->query->Columns();
+	bool isDetail = this->options->IsDetail();
+	DwMatrix matrix;
+	matrix.name = "dw_summarize";
+	string names[] = { "N", "mean", "sd", "min", "max", "sum", "Var", "skewness", "kurtosis" };
+	matrix.colNames.assign(names, names + (isDetail ? 9 : 6));
+	for(int p = 0; isDetail && p < PERCENTILE_COUNT; p++)
+		matrix.colNames.push_back("p" + toString(PERCENTILES[p]));
+	matrix.rows = columns.size();
+	matrix.cols = matrix.colNames.size();
+	matrix.values.assign(matrix.rows * matrix.cols, MISSING);
+	vector<size_t> summed; // the columns the database adds up
+	string sql;
+	for(size_t i = 0; i < columns.size(); i++) {
+		matrix.rowNames.push_back(columns[i]->VariableName());
+		matrix.values[i * matrix.cols] = 0;
+		if( !columns[i]->IsNumeric() || columns[i]->IsDateTime() )
+			continue;
+		string name = columns[i]->ResultName();
+		sql += (summed.size() > 0 ? ", " : "") + string("count(") + name + "), sum(" + name + "), min(" + name + "), max(" + name + ")";
+		summed.push_back(i);
+	}
+	vector<double> sums;
+	if( summed.size() > 0 )
+		sums = this->Aggregate(sql, summed.size() * 4, "the sums");
+	// the deviations of the columns that have values
+	vector<size_t> spread;
+	sql = "";
+	for(size_t k = 0; k < summed.size(); k++) {
+		double* row = &matrix.values[summed[k] * matrix.cols];
+		double n = sums[k * 4];
+		row[0] = n;
+		if( n == 0 )
+			continue;
+		row[1] = sums[k * 4 + 1] / n;
+		row[3] = sums[k * 4 + 2];
+		row[4] = sums[k * 4 + 3];
+		row[5] = sums[k * 4 + 1];
+		string deviation = "(" + columns[summed[k]]->ResultName() + " - " + NumberSQL(row[1]) + ")";
+		sql += (spread.size() > 0 ? ", " : "") + string("sum(") + deviation + "*" + deviation + ")";
+		if( isDetail )
+			sql += ", sum(" + deviation + "*" + deviation + "*" + deviation + "), sum(" + deviation + "*" + deviation + "*" + deviation + "*" + deviation + ")";
+		spread.push_back(summed[k]);
+	}
+	int perColumn = isDetail ? 3 : 1;
+	vector<double> deviations;
+	if( spread.size() > 0 )
+		deviations = this->Aggregate(sql, spread.size() * perColumn, "the standard deviations");
+	for(size_t k = 0; k < spread.size(); k++) {
+		double* row = &matrix.values[spread[k] * matrix.cols];
+		double n = row[0];
+		double squares = deviations[k * perColumn];
+		if( n > 1 ) {
+			row[2] = sqrt(squares / (n - 1));
+			if( isDetail )
+				row[6] = squares / (n - 1);
+		}
+		// the moments about the mean
+		if( isDetail && squares > 0 ) {
+			double m2 = squares / n;
+			row[7] = deviations[k * perColumn + 1] / n / pow(m2, 1.5);
+			row[8] = deviations[k * perColumn + 2] / n / (m2 * m2);
+		}
+	}
+	if( isDetail && spread.size() > 0 && this->conn->PercentileSQL("x", 0.5) == "" ) {
+		for(size_t k = 0; k < spread.size(); k++) {
+			vector<double> percentiles = this->Percentiles(columns[spread[k]], matrix.values[spread[k] * matrix.cols]);
+			for(int p = 0; p < PERCENTILE_COUNT; p++)
+				matrix.values[spread[k] * matrix.cols + 9 + p] = percentiles[p];
+		}
+	} else if( isDetail && spread.size() > 0 ) {
+		sql = "";
+		for(size_t k = 0; k < spread.size(); k++) {
+			for(int p = 0; p < PERCENTILE_COUNT; p++)
+				sql += (k > 0 || p > 0 ? ", " : "") + this->conn->PercentileSQL(columns[spread[k]]->ResultName(), PERCENTILES[p] / 100.0);
+		}
+		vector<double> percentiles = this->Aggregate(sql, spread.size() * PERCENTILE_COUNT, "the percentiles");
+		for(size_t k = 0; k < spread.size(); k++) {
+			for(int p = 0; p < PERCENTILE_COUNT; p++)
+				matrix.values[spread[k] * matrix.cols + 9 + p] = percentiles[k * PERCENTILE_COUNT + p];
+		}
+	}
+	this->matrices.clear();
+	this->matrices.push_back(matrix);
+	// like r() the scalars are of the last variable
+	this->scalars.clear();
+	for(int j = 0; j < matrix.cols && matrix.rows > 0; j++)
+		this->scalars[matrix.colNames[j]] = matrix.values[(matrix.rows - 1) * matrix.cols + j];
+	// the table of summarize
+	vector<string> lines;
+	lines.push_back(Cell("Variable", 33) + Cell("Obs", 12) + Cell("Mean", 14) + Cell("Std. dev.", 14) + Cell("Min", 14) + "Max");
+	for(int i = 0; i < matrix.rows; i++) {
+		double* row = &matrix.values[i * matrix.cols];
+		lines.push_back(Cell(matrix.rowNames[i], 33) + Cell(ResultCell(row[0]), 12) + Cell(ResultCell(row[1]), 14)
+						+ Cell(ResultCell(row[2]), 14) + Cell(ResultCell(row[3]), 14) + ResultCell(row[4]));
+		if( !isDetail || row[0] == 0 )
+			continue;
+		string line = "    percentiles:";
+		for(int p = 0; p < PERCENTILE_COUNT; p++)
+			line += " " + toString(PERCENTILES[p]) + "% " + ResultCell(row[9 + p]);
+		lines.push_back(line);
+		lines.push_back("    variance " + ResultCell(row[6]) + ", skewness " + ResultCell(row[7]) + ", kurtosis " + ResultCell(row[8]));
+	}
+	return lines;
+}
+
+
+// the counts come grouped from the database, the table is laid out here in the order of the values
+vector<string> DwSummary::Tabulate() {
+	const vector<DwColumn*>& columns = this->query->Columns();
+	if( columns.size() < 1 || columns.size() > 2 )
+		throw DwUseException( "TABULATE takes one or two variables, list them before using." );
+	string names, where;
+	for(size_t i = 0; i < columns.size(); i++) {
+		// the values are read from the positions of the group by
+		columns[i]->SetPosition(i + 1);
+		names += (i > 0 ? ", " : "") + columns[i]->ResultName();
+		if( !this->options->IsMissing() )
+			where += (i > 0 ? " and " : " where ") + columns[i]->ResultName() + " is not null";
+	}
+	string sql = "select " + names + ", count(*) from (" + this->query->QuerySQL() + ") q" + where + " group by " + names;
+	vector<DwTabulated> cells;
+	TabulationCollector tc(columns, cells);
+	{
+		DwTimer timer(this->query->Stats(), PHASE_FETCH);
+		try {
+			this->conn->Select( tc, sql, this->query->Params() );
+		} catch( const DbException& ex ) {
+			throw DwUseException( "Error counting the values with \n"
+									+ sql + ": \n" + ex.getMessage() );
+		}
+	}
+	DwTabulationAxis rows(columns[0], cells, 0);
+	DwMatrix freq;
+	freq.name = "dw_freq";
+	freq.rows = rows.Size();
+	freq.cols = 1;
+	if( columns.size() == 2 ) {
+		DwTabulationAxis cols(columns[1], cells, 1);
+		freq.cols = cols.Size();
+		freq.values.assign(freq.rows * freq.cols, 0);
+		for(size_t i = 0; i < cells.size(); i++)
+			freq.values[rows.Position(cells[i]) * freq.cols + cols.Position(cells[i])] += cells[i].count;
+		freq.colNames = cols.Labels();
+	} else {
+		freq.values.assign(freq.rows, 0);
+		for(size_t i = 0; i < cells.size(); i++)
+			freq.values[rows.Position(cells[i])] += cells[i].count;
+	}
+	freq.rowNames = rows.Labels();
+	this->matrices.clear();
+	this->macros.clear();
+	this->matrices.push_back(freq);
+	// the values like the matrow and matcol options of tabulate, strings can only go into a macro
+	for(size_t i = 0; i < columns.size(); i++) {
+		string name = i == 0 ? "dw_row" : "dw_col";
+		DwTabulationAxis axis(columns[i], cells, i);
+		if( columns[i]->IsNumeric() ) {
+			DwMatrix values;
+			values.name = name;
+			values.values = axis.Numbers();
+			values.rows = i == 0 ? values.values.size() : 1;
+			values.cols = i == 0 ? 1 : values.values.size();
+			this->matrices.push_back(values);
+		} else {
+			vector<string> labels = axis.Labels();
+			string quoted;
+			for(size_t j = 0; j < labels.size(); j++)
+				quoted += (j > 0 ? " " : "") + string("`\"") + labels[j] + "\"'";
+			this->macros[name + "_values"] = quoted;
+		}
+	}
+	double total = 0;
+	for(size_t i = 0; i < cells.size(); i++)
+		total += cells[i].count;
+	this->scalars.clear();
+	this->scalars["N"] = total;
+	this->scalars["r"] = freq.rows;
+	if( columns.size() == 2 )
+		this->scalars["c"] = freq.cols;
+	// the table of tabulate, the shares only for one variable
+	vector<string> lines;
+	if( columns.size() == 1 ) {
+		lines.push_back(Cell(columns[0]->VariableName(), 33) + Cell("Freq.", 14) + Cell("Percent", 10) + "Cum.");
+		double cumulative = 0;
+		for(int i = 0; i < freq.rows; i++) {
+			cumulative += freq.values[i];
+			lines.push_back(Cell(freq.rowNames[i], 33) + Cell(toString(freq.values[i]), 14)
+							+ Cell(toString((long)(10000.0 * freq.values[i] / total + 0.5) / 100.0), 10)
+							+ toString((long)(10000.0 * cumulative / total + 0.5) / 100.0));
+		}
+		lines.push_back(Cell("Total", 33) + Cell(toString(total), 14) + "100");
+	} else {
+		string header = Cell(columns[0]->VariableName() + " \\ " + columns[1]->VariableName(), 33);
+		for(int j = 0; j < freq.cols; j++)
+			header += Cell(freq.colNames[j], 12);
+		lines.push_back(header + "Total");
+		vector<double> colTotals(freq.cols, 0);
+		for(int i = 0; i < freq.rows; i++) {
+			string line = Cell(freq.rowNames[i], 33);
+			double rowTotal = 0;
+			for(int j = 0; j < freq.cols; j++) {
+				double count = freq.values[i * freq.cols + j];
+				line += Cell(toString(count), 12);
+				rowTotal += count;
+				colTotals[j] += count;
+			}
+			lines.push_back(line + toString(rowTotal));
+		}
+		string line = Cell("Total", 33);
+		for(int j = 0; j < freq.cols; j++)
+			line += Cell(toString(colTotals[j]), 12);
+		lines.push_back(line + toString(total));
+	}
+	return lines;
+}
+
+
+const vector<DwMatrix>& DwSummary::Matrices() {
+	return this->matrices;
+}
+
+const map<string,double>& DwSummary::Scalars() {
+	return this->scalars;
+}
+
+const map<string,string>& DwSummary::Macros() {
+	return this->macros;
+}
@@ -0,0 +1,120 @@
+#include "dwplugin.h"
+#ifdef _WIN32
+#include <windows.h>
+#include <process.h>
+#else
+#include <pthread.h>
+#include <time.h>
+#endif
+
+
+// the platform parts: a lock, a condition to wait on and a thread
+#ifdef _WIN32
+typedef CRITICAL_SECTION DwLock;
+typedef CONDITION_VARIABLE DwCondition;
+
+DwMonitor::DwMonitor() {
+	this->lock = new DwLock;
+	InitializeCriticalSection((DwLock*)this->lock);
+	this->changed = new DwCondition;
+	InitializeConditionVariable((DwCondition*)this->changed);
+}
+
+DwMonitor::~DwMonitor() {
+	DeleteCriticalSection((DwLock*)this->lock);
+	delete (DwCondition*)this->changed;
+	delete (DwLock*)this->lock;
+}
+
+void DwMonitor::Lock() { EnterCriticalSection((DwLock*)this->lock); }
+void DwMonitor::Unlock() { LeaveCriticalSection((DwLock*)this->lock); }
+void DwMonitor::Wait() { SleepConditionVariableCS((DwCondition*)this->changed, (DwLock*)this->lock, INFINITE); }
+bool DwMonitor::Wait(int milliseconds) {
+	return SleepConditionVariableCS((DwCondition*)this->changed, (DwLock*)this->lock, milliseconds) != 0;
+}
+void DwMonitor::WakeAll() { WakeAllConditionVariable((DwCondition*)this->changed); }
+
+static unsigned __stdcall ThreadMain(void* thread) {
+	((DwThread*)thread)->Run();
+	return 0;
+}
+
+void DwThread::Start() {
+	uintptr_t handle = _beginthreadex(NULL, 0, ThreadMain, this, 0, NULL);
+	if( handle == 0 )
+		throw DwUseException( "Could not start a thread." );
+	this->thread = (void*)handle;
+}
+
+void DwThread::Join() {
+	if( this->thread == NULL )
+		return;
+	WaitForSingleObject((HANDLE)this->thread, INFINITE);
+	CloseHandle((HANDLE)this->thread);
+	this->thread = NULL;
+}
+#else
+typedef pthread_mutex_t DwLock;
+typedef pthread_cond_t DwCondition;
+
+DwMonitor::DwMonitor() {
+	this->lock = new DwLock;
+	pthread_mutex_init((DwLock*)this->lock, NULL);
+	this->changed = new DwCondition;
+	pthread_cond_init((DwCondition*)this->changed, NULL);
+}
+
+DwMonitor::~DwMonitor() {
+	pthread_cond_destroy((DwCondition*)this->changed);
+	pthread_mutex_destroy((DwLock*)this->lock);
+	delete (DwCondition*)this->changed;
+	delete (DwLock*)this->lock;
+}
+
+void DwMonitor::Lock() { pthread_mutex_lock((DwLock*)this->lock); }
+void DwMonitor::Unlock() { pthread_mutex_unlock((DwLock*)this->lock); }
+void DwMonitor::Wait() { pthread_cond_wait((DwCondition*)this->changed, (DwLock*)this->lock); }
+bool DwMonitor::Wait(int milliseconds) {
+	timespec until;
+	clock_gettime(CLOCK_REALTIME, &until);
+	until.tv_sec += milliseconds / 1000;
+	until.tv_nsec += (milliseconds % 1000) * 1000000L;
+	if( until.tv_nsec >= 1000000000L ) {
+		until.tv_sec++;
+		until.tv_nsec -= 1000000000L;
+	}
+	return pthread_cond_timedwait((DwCondition*)this->changed, (DwLock*)this->lock, &until) == 0;
+}
+void DwMonitor::WakeAll() { pthread_cond_broadcast((DwCondition*)this->changed); }
+
+static void* ThreadMain(void* thread) {
+	((DwThread*)thread)->Run();
+	return NULL;
+}
+
+void DwThread::Start() {
+	pthread_t* thread = new pthread_t;
+	if( pthread_create(thread, NULL, ThreadMain, this) != 0 ) {
+		delete thread;
+		throw DwUseException( "Could not start a thread." );
+	}
+	this->thread = thread;
+}
+
+void DwThread::Join() {
+	if( this->thread == NULL )
+		return;
+	pthread_join(*(pthread_t*)this->thread, NULL);
+	delete (pthread_t*)this->thread;
+	this->thread = NULL;
+}
+#endif
+
+
+DwThread::DwThread() {
+	this->thread = NULL;
+}
+
+// the subclass has to join, its members are gone by the time this runs
+DwThread::~DwThread() {
+}
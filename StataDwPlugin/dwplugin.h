@@ -6,6 +6,8 @@
 #define DllImport   __declspec( dllimport )
 #define DllExport   __declspec( dllexport )
 
+#include <cstdio>
+#include <deque>
 #include <map>
 #include <set>
 #include <vector>
@@ -32,16 +34,31 @@ private:
 class DwUseException : exception {
   public:
     DwUseException(string message) : msg(message) {}
-    const char* what() const {return this->msg.c_str();}
+    ~DwUseException() throw() {}
+    const char* what() const throw() {return this->msg.c_str();}
 
   private:
     string msg;
 };
 
 
+// the user pressed Break in STATA while the plugin was running
+class DwCancelled : public DwUseException {
+  public:
+    DwCancelled() : DwUseException("Cancelled by the user.") {}
+};
+
+
 enum VariableCasing { ORIGINAL, UPPERCASE, LOWERCASE };
 
 
+// using fact join dim1 on(k1) join dim2 on(k2 k3)
+struct DwJoin {
+	string table;
+	vector<string> keys; // columns with the same name in the dimension and a table before it
+};
+
+
 class DwUseOptions
 {
 public: 
@@ -54,16 +71,30 @@ public:
 	string Database();
 	// list of columns to fetch from the DB. fetch all from DB if this is empty
 	vector<string> Variables();
-	// the SQL filter to apply on the table
-	string WhereSQL();
+	// the STATA if expression to apply on the table, compiled to SQL by the query
+	string Filter();
 	// database table to query
 	string Table();
+	// dimension tables joined to the main table
+	vector<DwJoin> Joins();
 	// TODO: I don't understand what this should do
 	bool IsNullData();
 	// practical way to limit rows for debugging
 	int Limit();
+	// warehouse column matched with the first variable of the plugin call, empty if not used
+	string Keys();
+	// put each row to the observation with the matching key instead of creating a new dataset
+	bool IsKeysInPlace();
+	// STATA storage types of the variables for SAVE
+	vector<string> Types();
+	// SAVE creates the table before inserting
+	bool IsCreateTable();
+	// SAVE inserts with the APPEND_VALUES hint (direct path)
+	bool IsAppend();
+	// rows in one array insert of SAVE
+	int BatchSize();
 	// Upper, Lower or the original casing of variables
-	VariableCasing VariableCasing();
+	::VariableCasing VariableCasing();
 	// use the logical name of variables or their textual labels
 	bool IsLabelVariables();
 	// which variables to label if any. if empty and IsLabelVariables is true then all of them
@@ -72,9 +103,62 @@ public:
 	bool IsLabelValues();
 	// which variable values to label. if empty and IsLabelValues is true then all of them
 	set<string> LabelValues();
+	// load the labels instead of the values
+	bool IsTranslate();
+	// which variables to translate. if empty and IsTranslate is true then all of them
+	set<string> Translate();
+	// load string columns with few distinct values as numeric codes with value labels
+	bool IsEncode();
+	// which columns to encode. if empty and IsEncode is true then all string columns
+	set<string> Encode();
+	// columns with more distinct values than this are loaded as strings
+	int EncodeMax();
 
 	// the option to print STATA commands to a .do file
 	bool IsLogCommands();
+	// print a table of the time spent in each phase after CREATE and LOAD
+	bool IsProfile();
+	// print a ranked report of the cost of each column after LOAD
+	bool IsProfileColumns();
+	// which database client to use: oracle, odbc or sqlite
+	string Backend();
+	// whether there is enough to connect, SQLite and ODBC data sources only need the database
+	bool HasCredentials();
+	// rows between progress messages during LOAD, 0 for none
+	int ProgressRows();
+	// start fetching the rows at the end of CREATE
+	bool IsPrefetch();
+	// how much of them to keep in memory before LOAD takes them
+	size_t PrefetchBytes();
+	// how much of a select the fetch may hold on the client, it sizes the round trips by it
+	size_t FetchBytes();
+	// the socket of the dwused daemon to get the connection from
+	string Daemon();
+	// tables a BATCH extracts at once, each on its own connection
+	int Parallel();
+	// the .dta file a BATCH job writes the table to
+	string Saving();
+	// explain the query before counting or loading it
+	bool IsExplain();
+	// the most the plan may estimate or have, -1 if there is no limit
+	double MaxRows();
+	double MaxBytes();
+	double MaxCost();
+	int MaxFullScans();
+	// run the query even if the plan or the dataset is over the limits
+	bool IsForce();
+	// the variables the database sorts the rows by, empty to leave them in any order
+	vector<string> Sort();
+	// SUMMARIZE adds the variance, skewness, kurtosis and percentiles
+	bool IsDetail();
+	// TABULATE counts the missing values too
+	bool IsMissing();
+	// print the memory each variable takes at CREATE
+	bool IsFootprint();
+	// the database converts dates and timestamps to STATA numbers and cuts long strings in the select
+	bool IsDbConvert();
+	// the most memory the dataset may take, -1 if there is no limit
+	double MemoryBytes();
 
 	// the original options for debugging
 	const map<string,string>& Options();
@@ -84,9 +168,81 @@ private :
 	bool HasOption(string name);
 	string GetOption(string name);
 	vector<string> GetOptionAsList(string name, bool toUpperCase=false);
+	double GetOptionAsLimit(string name);
 	void ThrowIfHasValue(string name);
 };
 
+// phases of a CREATE and LOAD that are timed
+enum DwPhase { PHASE_CONNECT, PHASE_DESCRIBE, PHASE_LABELS, PHASE_ROWCOUNT, PHASE_FETCH, PHASE_STORE, PHASE_COUNT };
+
+
+// what loading a column costs, for the profile_columns option
+struct DwColumnCost {
+	string name;
+	string type;
+	double bytes;
+	double convertSeconds; // AsNumber or AsString
+	double storeSeconds; // SF_vstore or SF_sstore
+};
+
+
+// where the time goes and how much data was moved, published to STATA after each call
+class DwStats {
+public:
+	DwStats();
+	void Reset();
+	// accumulate the time between start and stop for the phase
+	void Start(DwPhase phase);
+	void Stop(DwPhase phase);
+	void Add(DwPhase phase, double seconds);
+	double Seconds(DwPhase phase);
+	double TotalSeconds();
+	// lines of a printable summary
+	vector<string> Summary();
+	// collect costs for each column, the names and types are used in the report
+	void ProfileColumns(const vector<string>& names, const vector<string>& types);
+	bool IsProfileColumns();
+	// add the costs of one cell
+	void AddColumn(size_t column, double bytes, double convertSeconds, double storeSeconds);
+	// lines of a report of the columns, the most expensive first
+	vector<string> ColumnSummary();
+	static string PhaseName(DwPhase phase);
+	// wall clock in seconds
+	static double Now();
+	// throughput counters
+	double rows;
+	double cells;
+	double bytes; // as received by the client: 8 for numbers, the length of strings
+	double roundTrips;
+	// how the round trips of the last select were sized, and the rows of its last one
+	string fetchReport;
+	double fetchRows;
+private:
+	double seconds[PHASE_COUNT];
+	double started[PHASE_COUNT];
+	vector<DwColumnCost> columns;
+};
+
+
+// pad a value to a fixed width column of a report
+string Cell(string value, size_t width);
+
+
+// time a phase until the end of the scope, also when an exception is thrown
+class DwTimer {
+public:
+	DwTimer(DwStats* stats, DwPhase phase) : stats(stats), phase(phase) {
+		this->stats->Start(phase);
+	}
+	~DwTimer() {
+		this->stats->Stop(this->phase);
+	}
+private:
+	DwStats* stats;
+	DwPhase phase;
+};
+
+
 // turn a list of command line arguments into a DwUseOption object we can use
 
 class DwUseOptionParser
@@ -96,7 +252,8 @@ public:
 	// plugin call DW_use, [<varlist>] [if <expr>] using <table> [nulldata] [lowercase|uppercase]
 	//						[label_variable [<label_variable_varlist>]] [label_values [<label_values_varlist>]]
 	//						username <user> password <pass> database <db>
-	DwUseOptions* Parse(vector<string> words);
+	// isSummary takes the options of SUMMARIZE and TABULATE as well
+	DwUseOptions* Parse(vector<string> words, bool isSummary = false);
 };
 
 
@@ -109,6 +266,98 @@ class Translator {
 };
 
 
+// labels looked up while loading, built once from the label query and not changed after that
+// integer codes that are small index an array, other keys go to an open addressing hash table
+// lookups don't allocate, the labels stay in the table until it is freed
+class DwLabelTable {
+public:
+	DwLabelTable(const map<string,string>& labels);
+	// the label of a key, NULL if it has none
+	const char* Find(const char* key, size_t length) const;
+	// the label of a numeric code
+	const char* Find(double code) const;
+	// whether the codes are small integers, so the column is best fetched as a number
+	bool IsDense() const;
+	// the longest label in bytes
+	size_t MaxLength() const;
+private:
+	struct Slot {
+		size_t key; // offset into text, 0 for an empty slot
+		size_t label;
+		size_t keyLength;
+	};
+	static size_t Hash(const char* key, size_t length);
+	vector<char> text; // the keys and labels, each terminated by a zero
+	vector<Slot> slots; // a power of two of them
+	vector<size_t> dense; // label offset by code, empty unless IsDense
+	size_t mask;
+	size_t maxLength;
+};
+
+
+// numeric codes of a string column with few distinct values, numbered from 1 in the order of the values
+class DwEncoder {
+public:
+	// the variable is named in the error when the codes outgrow the storage type
+	DwEncoder(const vector<string>& values, string variable);
+	// the code of a value, values not seen at CREATE get the next code without a label
+	// throws when there are more than the storage type of CREATE holds
+	int Code(const string& value);
+	// number of codes, including the ones added while loading
+	int Count();
+	// the largest code the storage type chosen at CREATE holds: 100, 32740 or the limit of long
+	int MaxCode();
+	// code -> value for label define
+	const map<string,string>& Labels();
+	// values that were not there at CREATE
+	int Added();
+private:
+	map<string,int> codes;
+	map<string,string> labels;
+	int added;
+	int maxCode;
+	string variable;
+};
+
+
+// rows copied out of a result set to be loaded later, each cell is either a number or a string
+class DwSpoolBatch {
+public:
+	DwSpoolBatch(int width);
+	void AddNull();
+	void AddNumber(double number);
+	void AddString(const string& text);
+	// memory held by the values
+	size_t Bytes();
+	int width; // cells in a row
+	int rows; // complete rows
+	vector<char> nulls;
+	vector<double> numbers;
+	vector<size_t> offsets; // where the string of a cell starts in text, it ends with a zero
+	vector<char> text;
+};
+
+// a row of a spool batch seen through the interface of the result sets
+class DwSpoolRow : public DbRow {
+public:
+	DwSpoolRow() : batch(NULL), first(0) {}
+	void Set(DwSpoolBatch* batch, int row) {
+		this->batch = batch;
+		this->first = row * batch->width;
+	}
+	bool IsNull(int col) { return batch->nulls[first + col - 1] != 0; }
+	double GetNumber(int col) { return batch->numbers[first + col - 1]; }
+	int GetInt(int col) { return (int)batch->numbers[first + col - 1]; }
+	string GetString(int col) { return &batch->text[batch->offsets[first + col - 1]]; }
+	// dates and timestamps were converted when they were copied
+	double GetDate(int col) { return batch->numbers[first + col - 1]; }
+	double GetTimestamp(int col) { return batch->numbers[first + col - 1]; }
+private:
+	DwSpoolBatch* batch;
+	int first; // the cell of the first column
+};
+
+
 // hold the processing instructions for a given column
 class DwColumn {
 public :
@@ -116,11 +365,14 @@ public :
 			  int position,
 			  VariableCasing variableCasing,
 			  Translator* variableTranslator, 
-			  Translator* valueTranslator );
+			  Translator* valueTranslator,
+			  string tableAlias = "" );
 	// free pointers
 	~DwColumn(void);
-	// the column name in the database
+	// the column name in the database, qualified with the table alias in joins
 	string ColumnName();
+	// the column name in the result of the query, without the alias
+	string ResultName();
 	// the column label in STATA
 	string ColumnLabel();
 	// the final variable name that will appear in STATA
@@ -133,23 +385,55 @@ public :
 	const map<string,string>& ValueLabels();
 	// the appropriate STATA datatype
 	string StataDataType();
+	// bytes of the STATA datatype
+	int StataWidth();
+	// the Oracle type to create for a STATA storage type, the reverse of StataDataType
+	// date and datetime stand for %td and %tc values
+	static string OracleDataType(string stataType);
 	// the format mask to show friendly values for dates
 	string StataFormat();
 	// STATA can store either double or string
 	// I will use rs->getDouble for numeric and rs->getString for the rest
 	bool IsNumeric();
+	// dates and timestamps are numbers in STATA only
+	bool IsDateTime();
+	// the binary type the database should send the column in, by the STATA storage type
+	DbFetchType FetchType();
 	// if there is no data we must not give STATA anything
-	bool IsNull(ResultSet* rs);
+	bool IsNull(DbRow* row);
 	// retrieve the column value from a record as number
-	double AsNumber(ResultSet* rs);
+	double AsNumber(DbRow* row);
 	// retrieve the column value from a record as a (translated) string
-	string AsString(ResultSet* rs);
+	string AsString(DbRow* row);
+	// replace the values with their labels while loading instead of labeling them in STATA
+	void TranslateContents();
+	bool IsTranslated();
+	// the label of the value in a record, buffer holds it if it is not in the label table
+	const char* AsLabel(DbRow* row, string& buffer);
+	// copy the value the way AsNumber, AsString and AsLabel will read it, for replaying it later
+	void CopyValue(DbRow* row, DwSpoolBatch* batch);
+	// load the strings as codes from now on, the column frees the encoder
+	void SetEncoder(DwEncoder* encoder);
+	// NULL unless the column is encoded
+	DwEncoder* Encoder();
+	// where the column is in the result set of the next select, when only some of the columns are loaded
+	void SetPosition(int position);
+	// let the database turn dates into STATA numbers and cut long strings in the select if it can
+	// translated and encoded columns are left as they are
+	void ConvertInDatabase(DbConnect* conn);
+	// the column in the select, a converted one is named like the column
+	string SelectSQL();
 private :
 	DbColumnMetaData metaData; // to access name, type
 	int position; // which column is it
 	VariableCasing variableCasing;
 	Translator* variableTranslator; // what to put into variable name
 	Translator* valueTranslator; // what to put into column values
+	DwEncoder* encoder; // strings loaded as codes
+	DwLabelTable* labelTable; // for translating the contents
+	string tableAlias; // empty unless tables are joined
+	// string width of the translated values
+	int TranslatedWidth();
 	// Method which prints the data type http://docs.oracle.com/cd/B10500_01/appdev.920/a96583/cciaadem.htm
 	string printType (int type);
 	// speed up type checking
@@ -157,38 +441,469 @@ private :
 	bool isDate;
 	bool isTime;
 	bool translateContents;
+	string convertSql; // the expression the database converts the column with, empty if it is selected as it is
+	bool isConverted; // the dates come as STATA numbers
+};
+
+
+// supply the values of :name placeholders in the if expression
+class ParameterResolver {
+public:
+	virtual DbParam Resolve(string name) = 0;
+};
+
+
+// read variables of the STATA dataset, for the keys option and for SAVE
+class DatasetReader {
+public:
+	// number of observations
+	virtual int Count() = 0;
+	// read a variable (from 1) of an observation (from 1), return false if it is missing
+	virtual bool Read(int var, int obs, bool asNumber, double& number, string& text) = 0;
+};
+
+
+// session private table the keys are uploaded to, it is created on first use
+const string KEY_TABLE = "DWUSE_KEYS";
+const int KEY_BATCH_SIZE = 10000; // rows in one array insert
+const int KEY_STRING_WIDTH = 2001; // longest string key including the terminating zero
+
+
+// a column the if expression can refer to
+struct FilterColumn {
+	DbColumnMetaData metaData;
+	string alias; // table alias in joined queries
+};
+
+
+// compile a STATA if expression into an SQL condition
+// literals become bind variables, so filters of the same shape share one cursor on the server
+// comparisons follow SQL null semantics, use missing() or x == . to test for missing values
+class ExpressionCompiler {
+public:
+	// where to look up placeholders (can be NULL)
+	ExpressionCompiler(ParameterResolver* resolver = NULL);
+	// add the columns of a table the expression may refer to, qualified with the alias in joins
+	void AddColumns(const vector<DbColumnMetaData>& columns, string table, string alias);
+	// return the SQL condition and append the literal values to params
+	string Compile(string expr, vector<DbParam>& params);
+	// the SQL for a column, throws if the column is unknown
+	string ColumnSQL(string name, bool& isString);
+	// whether a database type is compared as a string
+	static bool IsStringType(string type);
+private:
+	map<string,FilterColumn> columns; // by uppercase name
+	ParameterResolver* resolver;
+};
+
+
+// write variables of the STATA dataset into a warehouse table with array inserts
+class DwExport
+{
+public:
+	// connect to the database, options are freed with the export
+	DwExport(DwUseOptions* options);
+	~DwExport(void);
+	// create the table if asked, insert every observation and return the number of rows
+	int Save(DatasetReader* reader);
+private:
+	DwUseOptions* options;
+	DbConnect* conn;
+};
+
+
+// runs the Run method of a subclass on a thread of its own
+class DwThread {
+public:
+	DwThread();
+	virtual ~DwThread();
+	virtual void Run() = 0;
+protected:
+	// throws DwUseException if the thread could not be started
+	void Start();
+	// wait for Run to return, the subclass has to do it before its members are freed
+	void Join();
+private:
+	void* thread;
 };
 
 
 // process the options, connect to the DWH, create translators, perform the query
+// runs the query on a thread right after CREATE and keeps the rows in memory until LOAD takes them
+// when the cap is reached the fetch waits, and continues on the open cursor while LOAD drains the batches
+class DwPrefetch : public DwThread {
+public:
+	// the connection is used by the thread until the prefetch is freed
+	DwPrefetch(DbConnect* conn, string sql, const vector<DbParam>& params, const vector<DbFetchType>& fetchTypes, 
+			   const vector<DwColumn*>& columns, int obsPosition, size_t maxBytes);
+	// stops the fetch if it is still running (cancelling the select on the server) and waits for the thread
+	~DwPrefetch();
+	// the next batch, waits for it if there is none yet, NULL after the last one
+	// an error of the fetch is thrown here as DbException
+	DwSpoolBatch* Take();
+	// free a batch that was taken
+	void Release(DwSpoolBatch* batch);
+	// the fetch has finished, the connection is not used by the thread any more
+	bool IsDone();
+	// called on the thread
+	void Run();
+	void Put(DwSpoolBatch* batch);
+private:
+	DbConnect* conn;
+	string sql;
+	vector<DbParam> params;
+	vector<DbFetchType> fetchTypes;
+	vector<DwColumn*> columns;
+	int obsPosition;
+	size_t maxBytes;
+	deque<DwSpoolBatch*> ready; // fetched but not taken yet
+	size_t readyBytes;
+	bool done; // the thread has finished
+	bool stopping; // the thread should finish
+	bool failed;
+	string error;
+	int errorCode;
+	DwMonitor monitor; // guards the fields above
+};
+
+
 class DwUseQuery
 {
 public:
-	DwUseQuery(DwUseOptions* options);
+	// the resolver supplies :name placeholders of the if expression, it is not freed
+	// without a connection the query opens its own, one that is passed in is used but not freed
+	DwUseQuery(DwUseOptions* options, ParameterResolver* resolver = NULL, DbConnect* conn = NULL);
 	~DwUseQuery(void);
 	// compile the SQL statement
 	string QuerySQL();
 	// run a count on the query to know how big STATA dataset to create
 	int RowCount();
+	// the result of the last RowCount, -1 if it was not called
+	int LastRowCount();
 	// provide access to column definitions for creation of macro variables
 	const vector<DwColumn*>& Columns();
+	// LOAD only the variables with the given names (all of them if there are none) into the same observations
+	// as the previous LOADs: selecting some of the columns orders the rows, unless keys_inplace places them
+	void SelectVariables(const vector<string>& names);
+	// the columns the next select fetches, all of them unless SelectVariables was given names
+	const vector<DwColumn*>& LoadColumns();
+	// the position of each of the load columns among the columns, from 1
+	vector<int> LoadVariables();
+	// the positions of the columns the rows are sorted by, from 1, empty without the sort option
+	vector<int> SortVariables();
+	// the values bound to the compiled filter
+	const vector<DbParam>& Params();
+	// upload the keys from STATA before counting or loading rows with the keys option, return the number of keys
+	int UploadKeys(DatasetReader* reader);
+	// with the encode option load the string columns with few distinct values as codes, return how many
+	// the values are counted in the filtered rows, so it comes after the keys are uploaded
+	int Encode();
+	// with explain or a limit on the plan: the estimates of the optimizer before the query is run
+	// returns the lines to show, throws with them if the plan is over a limit and force was not given
+	vector<string> Preflight();
+	// bytes of an observation of the loaded variables
+	int ObservationWidth();
+	// what the variables take for the observations, with a line for each one (the widest first) if asked
+	vector<string> Footprint(double observations, bool perVariable);
+	// with keys_inplace the position of the observation number in the result set, 0 otherwise
+	int ObservationPosition();
+	// timings and counters of CREATE and LOAD
+	DwStats* Stats();
+	// whether PROFILE was asked for
+	bool IsProfile();
+	// the options of CREATE, freed with the query
+	DwUseOptions* Options();
+	// rows between progress messages
+	int ProgressRows();
+	// start fetching the rows on a thread, so LOAD can take them from memory
+	void StartPrefetch();
 	// accept a result set processor that fills data into STATA
 	template< typename F > 
 	void QueryData(F processor);
 private:
 	DwUseOptions* options;
 	DbConnect* conn;
-	Translator* variableTranslator;
+	bool ownsConnection; // false when the connection was passed in
+	map<string,Translator*> variableTranslators; // by source table
 	vector<DwColumn*> columns;
+	vector<DwColumn*> loadColumns; // the ones LOAD fetches
+	vector<DwColumn*> sortColumns; // the ones the database sorts the rows by
+	vector<string> tableAliases; // of the tables in fromSql, for the row order
+	int loads; // LOAD calls since CREATE
+	bool isOrdered; // since a LOAD took only some of the variables the rows come in a stable order
+	string fromSql; // the table or the joined tables
+	string whereSql; // compiled if expression
+	vector<DbParam> params; // bind values of the where clause
+	bool isStringKey; // whether the keys are uploaded as strings
+	int rowCount; // cached for the progress of LOAD
+	vector<DwColumn*> encodeColumns; // string columns the encode option asked for
+	DwPrefetch* prefetch; // rows fetched since CREATE, NULL without the prefetch option
+	DwStats stats;
+	// register the columns for profile_columns
+	void ProfileColumns();
+	// how each result column should be fetched
+	vector<DbFetchType> FetchTypes();
+	// the stable order of the rows of the tables, empty if the database has none
+	string RowOrderSQL();
+	// the order by list of the sort option
+	string SortSQL();
+	// the select of the rows, a count does not need them sorted
+	string SelectSQL(bool isSorted);
 };
 
 
 // template function so needs to be in the header
 template< typename F > 
 void DwUseQuery::QueryData(F processor) {
+	// the rows fetched since CREATE are loaded on this thread, STATA can't be called from another one
+	if( this->prefetch != NULL ) {
+		DwSpoolBatch* batch = NULL;
+		try {
+			DwSpoolRow row;
+			while( (batch = this->prefetch->Take()) != NULL ) {
+				for(int i = 0; i < batch->rows; i++) {
+					row.Set(batch, i);
+					processor( &row );
+				}
+				this->prefetch->Release(batch);
+				batch = NULL;
+			}
+		} catch( ... ) {
+			if( batch != NULL )
+				this->prefetch->Release(batch);
+			delete this->prefetch;
+			this->prefetch = NULL;
+			throw;
+		}
+		delete this->prefetch;
+		this->prefetch = NULL;
+		return;
+	}
 	string sql = this->QuerySQL();
-	vector<string> params;
-	this->conn->Select(processor, sql, params);
+	// numbers come converted by the server
+	this->conn->Select(processor, sql, this->params, this->FetchTypes());
+};
+
+// fill rows of a query into the STATA dataset, passed to DwUseQuery::QueryData
+class FillDataSet {
+public: 
+	// created with the columns that need to be filled
+	// every progressRows rows it prints how far it got of the expected rows (if known, i.e. not negative)
+	// the columns go into the given STATA variables, or the first ones (the last ones with obsPos) in order
+	FillDataSet(const vector<DwColumn*>& cols, DwStats* stats, int obsPos = 0, int expectedRows = -1, int progressRows = 0,
+				const vector<int>& variables = vector<int>());
+	// called with one row at a time
+	void operator()( DbRow* record );
+private:
+	void PrintProgress();
+
+	const vector<DwColumn*>& columns;
+	DwStats* stats;
+	int obsPosition; // where the observation number is in the result set, 0 to number rows as they come
+	int expectedRows;
+	int progressRows;
+	int row;
+	int loaded; // rows processed so far
+	double started; // when the first row was asked for
+	bool profileColumns; // attribute the costs to columns
+	double lastReturn; // when the previous row was stored
+	vector<int> variables; // the STATA variable of each column
+	string text; // holds translated values that are not in the label table
+};
+
+
+// a dataset written straight into a Stata .dta file (format 115, Stata 12 and later can read it)
+// without going through the STATA dataset, so it can be done on any thread
+class DwDtaFile {
+public:
+	// create the file and write the header, the number of observations is filled in by Close
+	// sortedBy are the positions of the variables the rows come sorted by, from 1
+	DwDtaFile(string fileName, const vector<DwColumn*>& columns, string dataLabel, string timeStamp,
+			  const vector<int>& sortedBy = vector<int>());
+	// closes the file if Close was not called, it is left incomplete
+	~DwDtaFile(void);
+	// add an observation, returns the bytes of the values as received
+	size_t Write(DbRow* row);
+	// write the value labels and the number of observations
+	void Close();
+	int Rows();
+	int Variables();
+private:
+	string fileName;
+	FILE* file;
+	const vector<DwColumn*>& columns;
+	vector<int> types; // 251-255 for byte, int, long, float and double, the width for strings
+	vector<char> record; // one observation
+	int rows;
+	string text; // holds translated values that are not in the label table
+	void Put(const void* data, size_t size);
+	void PutText(const string& text, size_t width);
+	void PutLabels(string name, const map<string,string>& labels);
+};
+
+// write rows of a query into a .dta file, passed to DwUseQuery::QueryData
+class WriteDataSet {
+public:
+	WriteDataSet(DwDtaFile* file, DwStats* stats);
+	void operator()( DbRow* record );
+private:
+	DwDtaFile* file;
+	DwStats* stats;
+	double lastReturn; // when the previous row was written
+};
+
+
+// rows of a query as delimited text for the console extractor: CSV quoted where needed, or TSV
+// the lines are collected in a large buffer and written in blocks, gzip compressed with DW_WITH_ZLIB
+class DwExtractFile {
+public:
+	// "-" is the standard output, the header line with the variable names is written here
+	DwExtractFile(string fileName, const vector<DwColumn*>& columns, char separator, bool isCompressed, size_t bufferSize);
+	// closes the file if Close was not called, it is left incomplete
+	~DwExtractFile(void);
+	// add a line, returns the bytes of the values as received
+	size_t Write(DbRow* row);
+	// write what is left in the buffer
+	void Close();
+	double Rows();
+	int Variables();
+	// written into the file, before compression
+	double Bytes();
+private:
+	string fileName;
+	FILE* file;
+	void* gz; // gzFile, zlib.h is only needed in Extract.cpp
+	const vector<DwColumn*>& columns;
+	char separator; // ',' for CSV, '\t' for TSV
+	vector<char> buffer;
+	size_t used;
+	double rows;
+	double bytes;
+	string text; // holds translated values that are not in the label table
+	string cleaned; // a TSV value with its tabs and line breaks replaced
+	void Put(const char* data, size_t size);
+	void PutText(const char* value, size_t length);
+	void PutNumber(double value);
+	void Flush();
+	void WriteBlock(const char* data, size_t size);
+};
+
+// write rows of a query into an extract, passed to DwUseQuery::QueryData
+class WriteExtract {
+public:
+	WriteExtract(DwExtractFile* file, DwStats* stats);
+	void operator()( DbRow* record );
+private:
+	DwExtractFile* file;
+	DwStats* stats;
+	double lastReturn; // when the previous row was written
+};
+
+
+// one table of a BATCH: the options of a line of the job file and how it went
+struct DwBatchJob {
+	string line; // as in the job file, for errors
+	string table;
+	string file; // the .dta to write
+	DwUseOptions* options; // passed on to the query, which frees it
+	bool done; // skipped after Break if not
+	bool failed;
+	string error;
+	double rows;
+	double bytes;
+	double describeSeconds;
+	double fetchSeconds;
+	double writeSeconds;
+	double seconds; // from taking the job until the file was closed
 };
 
+// extract the tables of a job file into .dta files, a few at once over a pool of connections
+// every table of the batch uses the same credentials, each connection is taken by a worker thread for
+// one table after the other. STATA is only called on the thread that waits for the tables to finish
+class DwBatch {
+public:
+	// the options hold the credentials, parallel and options for every job, they are not freed
+	DwBatch(DwUseOptions* options);
+	// waits for the workers and closes the connections
+	~DwBatch(void);
+	// one table per line with the options of CREATE and saving <file.dta>, * starts a comment
+	void ReadJobs(string fileName);
+	int JobCount();
+	// connect and start the workers, returns the number of connections
+	int Start();
+	// wait for the next table to finish, NULL when all of them have
+	DwBatchJob* Next();
+	// don't start any more tables, the ones running are finished
+	void Stop();
+	// a table of the time spent on each table
+	vector<string> Summary();
+	// on the workers: run jobs until there are none left
+	void Work(DbConnect* conn);
+private:
+	DwUseOptions* options;
+	vector<DwBatchJob*> jobs;
+	vector<DbConnect*> connections; // the pool, one for each worker
+	vector<DwThread*> workers;
+	string timeStamp; // of the .dta files
+	double started;
+	double connectSeconds;
+	// guarded by the monitor
+	DwMonitor monitor;
+	size_t nextJob;
+	deque<DwBatchJob*> finished; // not returned by Next yet
+	int running; // workers that have not returned
+	bool stopping;
+	// extract a table with a connection of the pool
+	void RunJob(DwBatchJob* job, DbConnect* conn);
+};
+
+
+// a STATA matrix of results, the do file creates it and RESULTS fills it, the plugin can't create one
+struct DwMatrix {
+	string name;
+	int rows;
+	int cols;
+	vector<string> rowNames; // empty for the default r1, r2...
+	vector<string> colNames;
+	vector<double> values; // by rows
+};
+
+// summarize and tabulate computed by the database on the rows CREATE would load, only the results come back
+class DwSummary {
+public:
+	// the same options as CREATE, they are freed with the summary
+	DwSummary(DwUseOptions* options, ParameterResolver* resolver = NULL);
+	~DwSummary(void);
+	// with the keys option: restrict the rows to the keys of the dataset in memory
+	int UploadKeys(DatasetReader* reader);
+	// the number of values, mean, sd, min, max and sum of each variable, with detail the variance, skewness, kurtosis 
+	// and percentiles too, returns the table to print
+	vector<string> Summarize();
+	// the frequencies of the values of one variable, or of the pairs of values of two, returns the table to print
+	vector<string> Tabulate();
+	// the results for the matrices of the do file
+	const vector<DwMatrix>& Matrices();
+	// the results like r() of summarize and tabulate, saved as dw_r_<name> scalars
+	const map<string,double>& Scalars();
+	// the values of string variables of tabulate in order, for global macros
+	const map<string,string>& Macros();
+private:
+	DwUseOptions* options; // freed by the query
+	DbConnect* conn;
+	DwUseQuery* query;
+	vector<DwMatrix> matrices;
+	map<string,double> scalars;
+	map<string,string> macros;
+	// the first row of a select of count aggregates over the rows of the query
+	vector<double> Aggregate(string selectSql, size_t count, string what);
+	// the percentiles of a numeric column with n values, read from its values in order
+	vector<double> Percentiles(DwColumn* column, double n);
+};
+
+
+// convert string to something STATA can print, the caller frees it
+char* toStataString( string msg );
+// print a message in STATA
+void stataDisplay( string msg );
+
 #endif
\ No newline at end of file
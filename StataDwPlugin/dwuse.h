@@ -3,9 +3,14 @@
 #ifndef DWUSE_H
 #define DWUSE_H
 
+#ifndef DW_NO_OCCI
 #include "occi.h"
+#endif
+#include <string>
 #include <vector>
 #include <iostream>
+#include <cstring>
+#include <exception>
 
 
 // http://www.tidytutorials.com/2009/08/oracle-c-occi-database-example.html
@@ -29,7 +34,42 @@
 
 
 using namespace std;
+#ifndef DW_NO_OCCI
 using namespace oracle::occi; 
+#endif
+
+
+// a lock with a condition to wait on, the platform types are only needed in Thread.cpp
+class DwMonitor {
+public:
+	DwMonitor();
+	~DwMonitor();
+	void Lock();
+	void Unlock();
+	// while locked: let go of the lock until another thread wakes this one
+	void Wait();
+	// the same for at most the given time, false if nobody woke this one
+	bool Wait(int milliseconds);
+	void WakeAll();
+private:
+	void* lock;
+	void* changed;
+};
+
+// lock for the rest of the scope
+class DwLocked {
+public:
+	DwLocked(DwMonitor* monitor) : monitor(monitor) { this->monitor->Lock(); }
+	~DwLocked() { this->monitor->Unlock(); }
+private:
+	DwMonitor* monitor;
+};
+
+
+// backends, besides Oracle through OCCI (leave it out with DW_NO_OCCI):
+// DW_WITH_ODBC for any ODBC data source, link odbc32.lib on Windows or -lodbc with unixODBC
+// DW_WITH_SQLITE for a local database file, link sqlite3
+// DW_WITH_DAEMON for the dwused daemon on the host (not on Windows), see daemon/Daemon.cpp
 
 // copy the needed fields from MetaData for later use
 // the MetaData would become inaccessible once the ResultSet is closed
@@ -43,69 +83,473 @@ struct DbColumnMetaData {
 	int scale;
 };
 
+// value of a bind variable, the position in the parameter list gives the bind position
+// strings and numbers are bound with their own type so the statement text can stay constant
+struct DbParam {
+	DbParam(string text) : isNumber(false), text(text), number(0) {}
+	DbParam(const char* text) : isNumber(false), text(text), number(0) {}
+	DbParam(double number) : isNumber(true), text(""), number(number) {}
+	bool isNumber;
+	string text;
+	double number;
+};
+
+
+// a column of values bound to an array insert, one element for each row of the batch
+struct DbArrayParam {
+	bool isNumber;
+	int width; // bytes for each string including the terminating zero
+	vector<double> numbers;
+	vector<char> strings; // rows * width
+	vector<short> indicators; // -1 for null
+	vector<unsigned short> lengths;
+
+	void Reset(bool isNumber, int width, int rows) {
+		this->isNumber = isNumber;
+		this->width = isNumber ? sizeof(double) : width;
+		this->numbers.assign(isNumber ? rows : 0, 0.0);
+		this->strings.assign(isNumber ? 0 : rows * width, '\0');
+		this->indicators.assign(rows, -1);
+		this->lengths.assign(rows, 0);
+	}
+	void SetNull(int row) {
+		this->indicators[row] = -1;
+	}
+	void SetNumber(int row, double value) {
+		this->numbers[row] = value;
+		this->indicators[row] = 0;
+		this->lengths[row] = sizeof(double);
+	}
+	void SetString(int row, const string& value) {
+		size_t len = value.size() < (size_t)this->width ? value.size() : this->width - 1; // truncate to the column width
+		memcpy(&this->strings[row * this->width], value.c_str(), len);
+		this->strings[row * this->width + len] = '\0';
+		this->indicators[row] = len > 0 ? 0 : -1; // empty string is null in Oracle
+		this->lengths[row] = (unsigned short)(len + 1);
+	}
+};
+
+
+// an error reported by the database, whichever backend it came from
+class DbException : public exception {
+public:
+	DbException(string message, int code = 0) : message(message), code(code) {}
+	~DbException() throw() {}
+	const char* what() const throw() { return this->message.c_str(); }
+	string getMessage() const { return this->message; }
+	// the native error number, e.g. 942 for ORA-00942
+	int getErrorCode() const { return this->code; }
+private:
+	string message;
+	int code;
+};
+
+
+// the current row of a select, columns are numbered from 1
+// dates and timestamps come as days and milliseconds since 1960-01-01, the values of %td and %tc in STATA
+class DbRow {
+public:
+	virtual bool IsNull(int col) = 0;
+	virtual double GetNumber(int col) = 0;
+	virtual int GetInt(int col) = 0;
+	virtual string GetString(int col) = 0;
+	virtual double GetDate(int col) = 0;
+	virtual double GetTimestamp(int col) = 0;
+};
+
+// how a column should come from the server, FETCH_DEFAULT leaves it to the Get method called
+// the binary types are converted by the database, so the client only copies them (where the backend can do that)
+enum DbFetchType {
+	FETCH_DEFAULT,
+	FETCH_INT, // 32 bit integer, for byte, int and long variables
+	FETCH_DOUBLE // binary double, for float and double variables
+};
+
+// what the optimizer expects of a select, the numbers are -1 where it doesn't say
+struct DbPlan {
+	bool isExplained; // false if the backend has no way to explain
+	double rows;
+	double bytes;
+	double cost; // in the units of the database
+	vector<string> fullScans; // tables read from start to end
+};
+
+// days since 1960-01-01 of a calendar date, for the backends that get dates in parts
+int DbDays(int year, int month, int day);
+// days or milliseconds since 1960-01-01 as YYYY-MM-DD or YYYY-MM-DD HH:MM:SS.FFF, the format ODBC converts
+string DbDateTimeText(double value, bool isTimestamp);
 
+// wall clock in seconds, for timing round trips
+double DbClock();
+
+
+// receives the rows of a select one by one
+class DbRowProcessor {
+public:
+	virtual void Process(DbRow* row) = 0;
+	// the columns of the result, before the first row
+	virtual void Columns(const vector<DbColumnMetaData>& columns) {}
+};
+
+// let any functor taking a DbRow* be passed to Select
+template< typename F > 
+class DbFunctorProcessor : public DbRowProcessor {
+public:
+	DbFunctorProcessor(F& processor) : processor(processor) {}
+	virtual void Process(DbRow* row) {
+		processor( row );
+	}
+private:
+	F& processor;
+};
+
+
+// statements kept open on the client, so repeated texts (e.g. the value label query for each column) are not parsed again
+const unsigned int STATEMENT_CACHE_SIZE = 20;
+// rows fetched in one round trip: what fits into the fetch budget, between these
+const unsigned int FETCH_MIN_ROWS = 10;
+const unsigned int FETCH_START_ROWS = 1000; // the first round trips, the sizer grows it from there
+const unsigned int FETCH_MAX_ROWS = 100000;
+const size_t DEFAULT_FETCH_BUDGET = 16 << 20; // bytes of rows on the client for one select
+
+// picks the rows of each round trip of a select, starting from what fits into the budget
+// it doubles them while the rows come faster for each second spent waiting on the server,
+// and halves them when a round trip takes so long that progress and Break would lag
+class DbFetchSizer {
+public:
+	DbFetchSizer(size_t budget = DEFAULT_FETCH_BUDGET, size_t rowBytes = 0);
+	// rows to ask for in the next round trip
+	unsigned int Rows();
+	// the most it will ask for, what array buffers have to hold
+	unsigned int MaxRows();
+	// after a round trip that brought the rows asked for, seconds is the time waited for it
+	void Measure(unsigned int rows, double seconds);
+	// the sizes it went through, for the profile
+	string Report();
+private:
+	size_t budget;
+	size_t rowBytes;
+	unsigned int rows, firstRows, maxRows, smallest, largest;
+	int roundTrips, changes;
+	bool isGrowing;
+	double lastRate; // rows per second waited, -1 before the first round trip
+	double settledRate; // where growing stopped
+};
+
+// the backends implement connecting, describing, fetching and binding
 class DbConnect
 {
 public:
-	// connect to the database
-	DbConnect(string user, string password, string db);
+	// connect to the database with a backend: oracle (the default), odbc or sqlite
+	// db is the tnsnames alias, the ODBC data source (or a connection string) or the SQLite file
+	// with the socket of a daemon the connection is one of its pool on the host, opened with the same arguments
+	static DbConnect* Open(string backend, string user, string password, string db, string daemon = "");
 	// disconnect
-	~DbConnect(void);
+	virtual ~DbConnect(void);
 
 	// run a select and feed the rows to the processor function
 	template< typename F > 
-	void Select(F processor, string sql, vector<string> params);
+	void Select(F processor, string sql, vector<DbParam> params);
+	// the same with the fetch type of each result column, missing ones are FETCH_DEFAULT
+	template< typename F > 
+	void Select(F processor, string sql, vector<DbParam> params, const vector<DbFetchType>& fetchTypes);
+	// the same with a processor that is told the columns of the result too
+	void SelectRows(DbRowProcessor* processor, string sql, const vector<DbParam>& params, const vector<DbFetchType>& fetchTypes);
 
 	// get a list of columns from a query
+	virtual vector<DbColumnMetaData> Describe(string sql) = 0;
+
+	// run a statement that returns no rows, e.g. DDL
+	virtual void Execute(string sql) = 0;
+
+	// run an insert once for each row in the arrays, the arrays are bound by position
+	virtual void ExecuteArray(string sql, vector<DbArrayParam>& params, unsigned int rows) = 0;
+
+	// commit the transaction
+	virtual void Commit() = 0;
+
+	// restrict a select to its first rows, whereSql is the condition already in it (or empty)
+	// and orderSql the list to order them by (or empty)
+	virtual string LimitSQL(string sql, string whereSql, int rows, string orderSql = "");
+
+	// an order of the rows of a table that stays the same between selects, empty if the database has none
+	virtual string RowOrderSQL(string alias);
+
+	// order by a column the way STATA sorts: text in byte order, nulls first for strings and last for numbers
+	virtual string SortSQL(string column, bool isText, bool isNullFirst);
+
+	// the aggregate of the given percentile of a numeric column (fraction from 0 to 1), empty if the database has none
+	virtual string PercentileSQL(string column, double fraction);
+
+	// a date column as days since 1960 or a timestamp as milliseconds since then, the way GetDate and GetTimestamp
+	// read them, empty if the database can't compute it
+	virtual string DateTimeSQL(string column, bool isTimestamp);
+	// the other way for an insert: a date or timestamp from a parameter of days or milliseconds since 1960
+	// empty if the database can't compute it, then the parameter is bound as the text of DbDateTimeText
+	virtual string DateTimeValueSQL(string value, bool isTimestamp);
+
+	// the first bytes of a text column, empty if the database can't cut it
+	virtual string TruncateSQL(string column, int bytes);
+
+	// the plan of a select without running it
+	virtual DbPlan Explain(string sql, const vector<DbParam>& params);
+
+	// stop the select running on another thread, it ends with an error; nothing if the database can't
+	virtual void Cancel();
+
+	// number of round trips to the server so far, fetches are estimated from the prefetch size
+	int RoundTrips();
+
+	// bytes of fetched rows a select may keep on the client
+	void SetFetchBudget(size_t bytes);
+	// how the last select that fetched in round trips sized them, empty if none did
+	string FetchReport();
+	// rows of its last round trip
+	unsigned int FetchRows();
+
+protected:
+	DbConnect(void);
+
+	// run a select and pass each row to the processor
+	// if the processor throws, the statement has to be closed before the exception is passed on
+	virtual void Query(string sql, const vector<DbParam>& params, const vector<DbFetchType>& fetchTypes, DbRowProcessor* processor) = 0;
+
+	int roundTrips;
+	size_t fetchBudget;
+	DbFetchSizer lastFetch;
+	bool isFetchSized; // whether a select used lastFetch yet
+};
+
+// include the cpp as it contains the template implementation
+// #include "DbConnect.cpp"  or define it here
+template< typename F > 
+void DbConnect::Select(F processor, string sql, vector<DbParam> params) {
+	// call a functor object with each row (http://ubuntuforums.org/showthread.php?t=901695)
+	DbFunctorProcessor<F> adapter(processor);
+	this->Query(sql, params, vector<DbFetchType>(), &adapter);
+}
+
+template< typename F > 
+void DbConnect::Select(F processor, string sql, vector<DbParam> params, const vector<DbFetchType>& fetchTypes) {
+	DbFunctorProcessor<F> adapter(processor);
+	this->Query(sql, params, fetchTypes, &adapter);
+}
+
+
+#ifndef DW_NO_OCCI
+// Oracle through OCCI
+class OcciConnect : public DbConnect
+{
+public:
+	OcciConnect(string user, string password, string db);
+	~OcciConnect(void);
 	vector<DbColumnMetaData> Describe(string sql);
+	void Execute(string sql);
+	void ExecuteArray(string sql, vector<DbArrayParam>& params, unsigned int rows);
+	void Commit();
+	DbPlan Explain(string sql, const vector<DbParam>& params);
+	void Cancel();
+
+protected:
+	void Query(string sql, const vector<DbParam>& params, const vector<DbFetchType>& fetchTypes, DbRowProcessor* processor);
 
 private:
 	// OCCI connection
 	Environment *env; 
 	Connection  *conn;
 
+	// stop a statement that failed or was given up half way and free it
+	void Abandon(Statement* stmt, ResultSet* rs);
+
 	// connection properties
 	string user; 
 	string password; 
 	string db; // tnsnames alias
 };
+#endif
 
-// include the cpp as it contains the template implementation
-// #include "DbConnect.cpp"  or define it here
-template< typename F > 
-void DbConnect::Select(F processor, string sql, vector<string> params) {
-	Statement *stmt = NULL; 
-	ResultSet *rs = NULL; 
-	//try { 
-		stmt = this->conn->createStatement(sql); 
-	//} 
-	//catch (SQLException& ex) { 
-	//	cout << ex.getMessage(); 
-	//}
-	if (stmt) { 
-		//try {		  
-			stmt->setPrefetchRowCount(10);
-			// set parameters (for now use only strings)
-			for(size_t i = 0; i < params.size(); i++) {
-				stmt->setString(i+1, params[i]); // even if we bound it by name it would only look at the position
-			}
-			// execute
-			rs = stmt->executeQuery(); 
-		//} 
-		//catch (SQLException& ex) { 
-		//	cout << ex.getMessage(); 
-		//}
-		// iterate resultset and return rows
-		if (rs) { 
-			while (rs->next()) { 
-				// call a functor object with each row (http://ubuntuforums.org/showthread.php?t=901695)
-				processor( rs );
-			}
-			stmt->closeResultSet(rs); 
-		}
-		// close the statement
-		this->conn->terminateStatement(stmt); 
-	} 
-}
+
+#ifdef DW_WITH_ODBC
+// any ODBC data source, the rows are fetched into arrays bound to the columns
+class OdbcConnect : public DbConnect
+{
+public:
+	OdbcConnect(string user, string password, string db);
+	~OdbcConnect(void);
+	vector<DbColumnMetaData> Describe(string sql);
+	void Execute(string sql);
+	void ExecuteArray(string sql, vector<DbArrayParam>& params, unsigned int rows);
+	void Commit();
+	string LimitSQL(string sql, string whereSql, int rows, string orderSql = "");
+	string RowOrderSQL(string alias);
+	string SortSQL(string column, bool isText, bool isNullFirst);
+	string PercentileSQL(string column, double fraction);
+	string DateTimeSQL(string column, bool isTimestamp);
+	string DateTimeValueSQL(string value, bool isTimestamp);
+	string TruncateSQL(string column, int bytes);
+	void Cancel();
+
+protected:
+	void Query(string sql, const vector<DbParam>& params, const vector<DbFetchType>& fetchTypes, DbRowProcessor* processor);
+
+private:
+	// SQLHENV and SQLHDBC, kept as void* so sql.h is only needed in OdbcConnect.cpp
+	void* env;
+	void* dbc;
+	// the SQLHSTMT of the select in Query, NULL between them, guarded by running for Cancel on another thread
+	void* runningStmt;
+	DwMonitor running;
+	void SetRunning(void* stmt);
+};
+#endif
+
+
+#ifdef DW_WITH_DAEMON
+// the messages between DaemonConnect and dwused, each answered by OK, TEXT, COLUMNS or PLAN, or ERROR
+// a QUERY is answered by COLUMNS, then ROWS until END or ERROR
+enum DbWireType {
+	WIRE_HELLO = 1, // backend, user, password, database, answered with the number of the session
+	WIRE_DESCRIBE, // sql
+	WIRE_QUERY, // sql, params, fetch types
+	WIRE_EXECUTE, // sql
+	WIRE_EXECUTE_ARRAY, // sql, rows, the arrays
+	WIRE_COMMIT,
+	WIRE_LIMIT, // sql, where, rows, order
+	WIRE_EXPLAIN, // sql, params
+	WIRE_ROW_ORDER, // alias
+	WIRE_SORT, // column, text, null first
+	WIRE_PERCENTILE, // column, fraction
+	WIRE_DATETIME, // column, timestamp
+	WIRE_TRUNCATE, // column, bytes
+	WIRE_DATETIME_VALUE, // value, timestamp
+	WIRE_CANCEL, // backend, user, password, database, session, on a socket of its own
+	WIRE_OK = 64,
+	WIRE_ERROR, // message, code
+	WIRE_TEXT,
+	WIRE_COLUMNS,
+	WIRE_ROWS, // rows, columns, then a tag and a value for each cell
+	WIRE_END,
+	WIRE_PLAN
+};
+
+// how a cell of ROWS is sent, the daemon picks it from the type of the column
+enum DbWireCell {
+	CELL_NULL,
+	CELL_NUMBER, // 8 bytes, dates and timestamps as days and milliseconds since 1960
+	CELL_STRING // length and bytes
+};
+
+// a message being built or read, numbers are in the byte order of the host as both ends are on it
+class DbWire {
+public:
+	DbWire(int type = 0);
+	int Type();
+	void PutByte(int value);
+	void PutInt(int value);
+	void PutDouble(double value);
+	void PutString(const string& value);
+	void PutColumns(const vector<DbColumnMetaData>& columns);
+	void PutParams(const vector<DbParam>& params);
+	void PutPlan(const DbPlan& plan);
+	int GetByte();
+	int GetInt();
+	double GetDouble();
+	string GetString();
+	// a string without copying it, valid until the message is read again
+	const char* GetBytes(size_t& length);
+	vector<DbColumnMetaData> GetColumns();
+	vector<DbParam> GetParams();
+	DbPlan GetPlan();
+	size_t Size();
+	// add the data of another message
+	void Append(const DbWire& other);
+	// throw DbException when the socket fails
+	void Send(int socket);
+	// false if the other end closed the socket before a message
+	bool Receive(int socket);
+	// throw the error the message carries if it is one, or complain if it is not the expected type
+	void Expect(int type);
+private:
+	int type;
+	string data;
+	size_t position;
+	void Need(size_t bytes);
+};
+
+// a connection lent by the dwused daemon, which keeps the real ones in a pool with their metadata and results
+class DaemonConnect : public DbConnect
+{
+public:
+	DaemonConnect(string socketPath, string backend, string user, string password, string db);
+	~DaemonConnect(void);
+	vector<DbColumnMetaData> Describe(string sql);
+	void Execute(string sql);
+	void ExecuteArray(string sql, vector<DbArrayParam>& params, unsigned int rows);
+	void Commit();
+	string LimitSQL(string sql, string whereSql, int rows, string orderSql = "");
+	string RowOrderSQL(string alias);
+	string SortSQL(string column, bool isText, bool isNullFirst);
+	string PercentileSQL(string column, double fraction);
+	string DateTimeSQL(string column, bool isTimestamp);
+	string DateTimeValueSQL(string value, bool isTimestamp);
+	string TruncateSQL(string column, int bytes);
+	DbPlan Explain(string sql, const vector<DbParam>& params);
+	void Cancel();
+
+protected:
+	void Query(string sql, const vector<DbParam>& params, const vector<DbFetchType>& fetchTypes, DbRowProcessor* processor);
+
+private:
+	// a new socket connected to the daemon
+	int Open();
+	// connect and say hello if the socket was closed
+	void Connect();
+	void Disconnect();
+	// send a request and read the answer of the given type
+	DbWire Call(DbWire& request, int answer);
+
+	int socket; // -1 if not connected
+	int session; // the number the daemon gave it, 0 before the hello
+	// the session wrote into the database (the keys of its temporary table, rows not committed yet),
+	// a new session of the daemon would not have them, so it is not reconnected
+	bool isStateful;
+	string socketPath;
+	string backend;
+	string user;
+	string password;
+	string db;
+};
+#endif
+
+
+#ifdef DW_WITH_SQLITE
+struct sqlite3;
+
+// a local SQLite database file
+class SqliteConnect : public DbConnect
+{
+public:
+	SqliteConnect(string file);
+	~SqliteConnect(void);
+	vector<DbColumnMetaData> Describe(string sql);
+	void Execute(string sql);
+	void ExecuteArray(string sql, vector<DbArrayParam>& params, unsigned int rows);
+	void Commit();
+	string LimitSQL(string sql, string whereSql, int rows, string orderSql = "");
+	string SortSQL(string column, bool isText, bool isNullFirst);
+	string PercentileSQL(string column, double fraction);
+	string DateTimeSQL(string column, bool isTimestamp);
+	string DateTimeValueSQL(string value, bool isTimestamp);
+	string TruncateSQL(string column, int bytes);
+	DbPlan Explain(string sql, const vector<DbParam>& params);
+	void Cancel();
+
+protected:
+	void Query(string sql, const vector<DbParam>& params, const vector<DbFetchType>& fetchTypes, DbRowProcessor* processor);
+
+private:
+	sqlite3* db;
+};
+#endif
 
 #endif
\ No newline at end of file
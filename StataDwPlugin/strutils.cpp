@@ -2,7 +2,9 @@
 #include <string>
 #include <vector>
 #include <sstream>
+#ifdef _WIN32
 #include <windows.h>
+#endif
 
 using namespace std;
 
@@ -47,6 +49,7 @@ string lowerCase(string strToConvert)
 
 
 // http://www.chilkatsoft.com/p/p_348.asp
+#ifdef _WIN32
 
 char *UnicodeToCodePage(int codePage, const wchar_t *src) {
     if (!src) return 0;
@@ -109,6 +112,7 @@ wchar_t *CodePageToUnicode(int codePage, const char *src) {
     }
     return w;
 }
+#endif
 
 
 /*
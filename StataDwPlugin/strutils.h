@@ -29,7 +29,9 @@ string toString(T i) // convert number to string
 }
 
 
+#ifdef _WIN32
 char *UnicodeToCodePage(int codePage, const wchar_t *src);
 wchar_t *CodePageToUnicode(int codePage, const char *src);
+#endif
 
 #endif
\ No newline at end of file
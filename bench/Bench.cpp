@@ -0,0 +1,196 @@
+#include "dwplugin.h"
+#include "strutils.h"
+#include "FakeStata.h"
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+// LOAD without Oracle and STATA: the plugin code fills the in-memory dataset from the synthetic table
+// usage: dwbench [-rows <n>] [-columns <nnidts>] [-width <n>] [-nulls <percent>] [-repeat <n>]
+
+
+// count the allocations of every phase
+long allocations = 0;
+long allocatedBytes = 0;
+
+void* operator new(size_t size) {
+	allocations++;
+	allocatedBytes += size;
+	void* p = malloc(size > 0 ? size : 1);
+	if( p == NULL )
+		throw std::bad_alloc();
+	return p;
+}
+
+void* operator new[](size_t size) {
+	return operator new(size);
+}
+
+void operator delete(void* p) {
+	free(p);
+}
+
+void operator delete[](void* p) {
+	free(p);
+}
+
+
+// only iterates the rows, to see what the source costs
+class SkipRows {
+public:
+    void operator()( DbRow* row ) {
+	}
+};
+
+
+// reads the values without storing them, bytes are counted like in FillDataSet
+class ConvertRows {
+public:
+	ConvertRows(const vector<DwColumn*>& cols, double& bytes) : columns(cols), bytes(bytes) {
+	}
+    void operator()( DbRow* row ) {
+		for(size_t i=0; i < columns.size(); i++) {
+			if( !columns[i]->IsNull(row) ) {
+				if(columns[i]->IsNumeric()) {
+					columns[i]->AsNumber(row);
+					bytes += sizeof(double);
+				} else {
+					bytes += columns[i]->AsString(row).size();
+				}
+			}
+		}
+	}
+private:
+	const vector<DwColumn*>& columns;
+	double& bytes;
+};
+
+
+// the result of the fastest run of a phase
+struct PhaseResult {
+	string name;
+	double seconds;
+	long rows;
+	double bytes;
+	long allocations;
+	long allocatedBytes;
+};
+
+
+// print a row of the report, the columns padded to a fixed width
+void printResult(const PhaseResult& r) {
+	double seconds = r.seconds > 0 ? r.seconds : 1e-9;
+	printf("%-10s %10.4f %14.0f %12.2f %12ld %12.2f %14ld\n", r.name.c_str(), r.seconds,
+		r.rows / seconds, r.bytes / seconds / 1e6, r.allocations,
+		r.rows > 0 ? (double)r.allocations / r.rows : 0.0, r.allocatedBytes);
+}
+
+
+int usage() {
+	printf("usage: dwbench [-rows <n>] [-columns <nnidts>] [-width <n>] [-nulls <percent>] [-repeat <n>]\n");
+	printf("  columns: one letter for each column, n number, i integer, d date, t timestamp, s string\n");
+	return 1;
+}
+
+
+int main(int argc, char *argv[]) {
+	syntheticTable.rows = 1000000;
+	syntheticTable.columns = "nnnniidtss";
+	syntheticTable.width = 20;
+	syntheticTable.nullPercent = 5;
+	int repeat = 3;
+	for(int i = 1; i < argc; i++) {
+		string arg = argv[i];
+		if( i + 1 >= argc )
+			return usage();
+		string value = argv[++i];
+		if( arg == "-rows" ) syntheticTable.rows = atoi(value.c_str());
+		else if( arg == "-columns" ) syntheticTable.columns = lowerCase(value);
+		else if( arg == "-width" ) syntheticTable.width = atoi(value.c_str());
+		else if( arg == "-nulls" ) syntheticTable.nullPercent = atoi(value.c_str());
+		else if( arg == "-repeat" ) repeat = atoi(value.c_str());
+		else return usage();
+	}
+	if( syntheticTable.rows < 1 || syntheticTable.columns.empty() || repeat < 1 )
+		return usage();
+	printf("rows: %d, columns: %s, string width: %d, nulls: %d%%, best of %d\n\n", syntheticTable.rows,
+		syntheticTable.columns.c_str(), syntheticTable.width, syntheticTable.nullPercent, repeat);
+
+	try {
+		vector<PhaseResult> results;
+		vector<DbParam> params;
+		string sql = "select * from synthetic";
+
+		// connect and describe like CREATE does
+		long allocs = allocations, allocBytes = allocatedBytes;
+		double start = DwStats::Now();
+		DbConnect* conn = DbConnect::Open("oracle", "bench", "bench", "synthetic");
+		vector<DbColumnMetaData> meta = conn->Describe(sql);
+		vector<DwColumn*> columns;
+		vector<int> widths;
+		vector<DbFetchType> fetchTypes; // like DwUseQuery::QueryData
+		for(size_t i = 0; i < meta.size(); i++) {
+			DwColumn* col = new DwColumn(meta[i], i+1, ORIGINAL, NULL, NULL);
+			columns.push_back(col);
+			fetchTypes.push_back(col->FetchType());
+			string type = col->StataDataType();
+			widths.push_back(type.substr(0,3) == "str" ? atoi(type.substr(3).c_str()) : 0);
+		}
+		PhaseResult describe = { "describe", DwStats::Now() - start, 0, 0,
+								 allocations - allocs, allocatedBytes - allocBytes };
+		results.push_back(describe);
+
+		double bytes = 0;
+		DwStats stats;
+		for(int phase = 0; phase < 3; phase++) {
+			PhaseResult best;
+			for(int run = 0; run < repeat; run++) {
+				if( phase == 2 )
+					FakeStataOpen(syntheticTable.rows, widths, true);
+				stats.Reset();
+				bytes = 0;
+				allocs = allocations;
+				allocBytes = allocatedBytes;
+				start = DwStats::Now();
+				if( phase == 0 ) {
+					conn->Select(SkipRows(), sql, params, fetchTypes);
+				} else if( phase == 1 ) {
+					conn->Select(ConvertRows(columns, bytes), sql, params, fetchTypes);
+				} else {
+					conn->Select(FillDataSet(columns, &stats, 0, syntheticTable.rows, 0), sql, params, fetchTypes);
+					bytes = stats.bytes;
+				}
+				PhaseResult r = { phase == 0 ? "fetch" : phase == 1 ? "convert" : "load", DwStats::Now() - start,
+								  syntheticTable.rows, bytes, allocations - allocs, allocatedBytes - allocBytes };
+				if( run == 0 || r.seconds < best.seconds )
+					best = r;
+			}
+			// the source produces the same bytes as the values read from it
+			if( phase == 1 )
+				results.back().bytes = best.bytes;
+			results.push_back(best);
+		}
+
+		printf("%-10s %10s %14s %12s %12s %12s %14s\n", "phase", "seconds", "rows/s", "MB/s", "allocs", "allocs/row", "alloc bytes");
+		for(size_t i = 0; i < results.size(); i++)
+			printResult(results[i]);
+		// where the time of the last load went
+		printf("\n");
+		stats.fetchReport = conn->FetchReport();
+		vector<string> lines = stats.Summary();
+		for(size_t i = 0; i < lines.size(); i++)
+			printf("%s\n", lines[i].c_str());
+
+		for(size_t i = 0; i < columns.size(); i++)
+			delete columns[i];
+		delete conn;
+		FakeStataClose();
+	} catch( const DwUseException& ex ) {
+		printf("Error: %s\n", ex.what());
+		return 2;
+	} catch( const DbException& ex ) {
+		printf("Error: %s\n", ex.what());
+		return 2;
+	}
+	return 0;
+}
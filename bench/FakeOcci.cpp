@@ -0,0 +1,135 @@
+#include "occi.h"
+#include <sstream>
+#include <cctype>
+
+using namespace std;
+using namespace oracle::occi;
+
+SyntheticTable syntheticTable;
+
+const int STRING_POOL_SIZE = 1024; // distinct values of a string column
+
+
+// days since 1960-01-01 of a calendar date
+int daysSince1960(int year, unsigned int month, unsigned int day) {
+	// shift the year to start in March so the leap day is the last one
+	int y = year - (month <= 2 ? 1 : 0);
+	int era = (y >= 0 ? y : y - 399) / 400;
+	int yoe = y - era * 400;
+	int doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+	int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	return era * 146097 + doe - 719468 + 3653; // 1970-01-01 is day 719468, 3653 days after 1960-01-01
+}
+
+
+void Date::setDate(int year, unsigned int month, unsigned int day,
+				   unsigned int hour, unsigned int minute, unsigned int seconds) {
+	this->days = daysSince1960(year, month, day);
+}
+
+
+void Timestamp::setDate(int year, unsigned int month, unsigned int day) {
+	double time = this->seconds - 86400.0 * (long)(this->seconds / 86400);
+	this->seconds = 86400.0 * daysSince1960(year, month, day) + time;
+}
+
+void Timestamp::setTime(unsigned int hour, unsigned int minute, unsigned int second, unsigned int fs) {
+	double date = 86400.0 * (long)(this->seconds / 86400);
+	this->seconds = date + hour * 3600 + minute * 60 + second;
+}
+
+IntervalDS Timestamp::subDS(const Timestamp& other) const {
+	long diff = (long)(this->seconds - other.seconds);
+	return IntervalDS(diff / 86400, diff % 86400 / 3600, diff % 3600 / 60, diff % 60);
+}
+
+
+int MetaData::getInt(AttrId id) const {
+	switch(id) {
+		case ATTR_DATA_TYPE: return this->type;
+		case ATTR_DATA_SIZE: return this->size;
+		case ATTR_PRECISION: return this->precision;
+		case ATTR_SCALE: return this->scale;
+		default: return 0;
+	}
+}
+
+
+ResultSet::ResultSet(const SyntheticTable& table) : table(table), row(0) {
+	// strings of the given width that differ in their first and last characters
+	for(int i = 0; i < STRING_POOL_SIZE; i++) {
+		string s(table.width, 'a' + i % 26);
+		if( table.width > 0 )
+			s[table.width - 1] = 'A' + i / 26 % 26;
+		this->strings.push_back(s);
+	}
+}
+
+ResultSet::Status ResultSet::next() {
+	if( ++this->row > this->table.rows )
+		return END_OF_FETCH;
+	for(size_t i = 0; i < this->defines.size(); i++) {
+		Define& d = this->defines[i];
+		bool null = this->isNull(d.col);
+		if( d.ind != 0 )
+			*d.ind = null ? -1 : 0;
+		if( null )
+			continue;
+		if( d.type == OCCIINT )
+			*(int*)d.buffer = (int)this->getDouble(d.col);
+		else
+			*(double*)d.buffer = this->getDouble(d.col);
+	}
+	return DATA_AVAILABLE;
+}
+
+void ResultSet::setDataBuffer(unsigned int col, void* buffer, Type type, sb4 size, ub2* length, sb2* ind, ub2* rc) {
+	Define d = { col, buffer, type, ind };
+	this->defines.push_back(d);
+}
+
+// spread the nulls with a hash of the cell
+bool ResultSet::isNull(unsigned int col) const {
+	unsigned int h = (unsigned int)this->row * 2654435761u + col * 40503u;
+	return (int)(h >> 16) % 100 < this->table.nullPercent;
+}
+
+double ResultSet::getDouble(unsigned int col) {
+	if( this->table.columns[col - 1] == 'i' )
+		return this->row % 100000;
+	return this->row * 0.25 + col;
+}
+
+int ResultSet::getInt(unsigned int col) {
+	return this->row;
+}
+
+string ResultSet::getString(unsigned int col) {
+	return this->strings[(this->row + col) % STRING_POOL_SIZE];
+}
+
+// from 1960 on for about 50 years
+Date ResultSet::getDate(unsigned int col) {
+	return Date(this->row % 18000);
+}
+
+Timestamp ResultSet::getTimestamp(unsigned int col) {
+	return Timestamp(this->row * 1000.5);
+}
+
+vector<MetaData> ResultSet::getColumnListMetaData() const {
+	vector<MetaData> meta;
+	for(size_t i = 0; i < this->table.columns.size(); i++) {
+		char kind = this->table.columns[i];
+		stringstream name;
+		name << (char)toupper(kind) << (i+1);
+		switch(kind) {
+			case 'n': meta.push_back(MetaData(name.str(), OCCI_SQLT_NUM, 22, 12, 2)); break;
+			case 'i': meta.push_back(MetaData(name.str(), OCCI_SQLT_NUM, 22, 9, 0)); break;
+			case 'd': meta.push_back(MetaData(name.str(), OCCI_SQLT_DAT, 7, 0, 0)); break;
+			case 't': meta.push_back(MetaData(name.str(), OCCI_SQLT_TIMESTAMP, 11, 0, 6)); break;
+			default: meta.push_back(MetaData(name.str(), OCCI_SQLT_CHR, this->table.width, 0, 0)); break;
+		}
+	}
+	return meta;
+}
@@ -0,0 +1,173 @@
+#include "stplugin.h"
+#include "FakeStata.h"
+#include <map>
+#include <cstdio>
+#include <cstring>
+
+const double MISSING = 8.988465674311579e+307; // the . missing value of STATA
+
+// the dataset in columns, strings in blocks of width+1 bytes
+struct FakeDataset {
+	int nobs;
+	vector<int> widths;
+	vector< vector<double> > numbers;
+	vector< vector<char> > strings;
+	map<string,string> macros;
+	map<string,double> scalars;
+	bool quiet;
+};
+
+FakeDataset* dataset = NULL;
+ST_plugin plugin;
+ST_int stopflag = 0;
+
+
+ST_int display(char* msg) {
+	if( !dataset->quiet )
+		fputs(msg, stdout);
+	return 0;
+}
+
+ST_int poll() {
+	return 0;
+}
+
+ST_int first() {
+	return 1;
+}
+
+ST_int nobs() {
+	return dataset->nobs;
+}
+
+ST_int nvars() {
+	return (ST_int)dataset->widths.size();
+}
+
+ST_int store(ST_int var, ST_int obs, ST_double value) {
+	if( var < 1 || var > nvars() || obs < 1 || obs > dataset->nobs || dataset->widths[var-1] > 0 )
+		return 498;
+	dataset->numbers[var-1][obs-1] = value;
+	return 0;
+}
+
+ST_int vdata(ST_int var, ST_int obs, ST_double* value) {
+	if( var < 1 || var > nvars() || obs < 1 || obs > dataset->nobs || dataset->widths[var-1] > 0 )
+		return 498;
+	*value = dataset->numbers[var-1][obs-1];
+	return 0;
+}
+
+// longer strings are truncated like in STATA
+ST_int sstore(ST_int var, ST_int obs, char* value) {
+	if( var < 1 || var > nvars() || obs < 1 || obs > dataset->nobs || dataset->widths[var-1] == 0 )
+		return 498;
+	int width = dataset->widths[var-1];
+	char* cell = &dataset->strings[var-1][(obs-1) * (width+1)];
+	strncpy(cell, value, width);
+	cell[width] = '\0';
+	return 0;
+}
+
+ST_int sdata(ST_int var, ST_int obs, char* value) {
+	if( var < 1 || var > nvars() || obs < 1 || obs > dataset->nobs || dataset->widths[var-1] == 0 )
+		return 498;
+	int width = dataset->widths[var-1];
+	strcpy(value, &dataset->strings[var-1][(obs-1) * (width+1)]);
+	return 0;
+}
+
+ST_boolean ismissing(ST_double value) {
+	return value >= MISSING;
+}
+
+ST_int macsave(char* name, char* value) {
+	dataset->macros[name] = value;
+	return 0;
+}
+
+ST_int macuse(char* name, char* value, ST_int size) {
+	map<string,string>::iterator it = dataset->macros.find(name);
+	if( it == dataset->macros.end() )
+		return 198;
+	strncpy(value, it->second.c_str(), size - 1);
+	value[size - 1] = '\0';
+	return 0;
+}
+
+ST_int scalsave(char* name, ST_double value) {
+	dataset->scalars[name] = value;
+	return 0;
+}
+
+ST_int scaluse(char* name, ST_double* value) {
+	map<string,double>::iterator it = dataset->scalars.find(name);
+	if( it == dataset->scalars.end() )
+		return 198;
+	*value = it->second;
+	return 0;
+}
+
+
+void FakeStataOpen(int observations, const vector<int>& stringWidths, bool quiet) {
+	FakeStataClose();
+	dataset = new FakeDataset();
+	dataset->nobs = observations;
+	dataset->widths = stringWidths;
+	dataset->quiet = quiet;
+	for(size_t i = 0; i < stringWidths.size(); i++) {
+		int width = stringWidths[i];
+		dataset->numbers.push_back(vector<double>(width > 0 ? 0 : observations, MISSING));
+		dataset->strings.push_back(vector<char>(width > 0 ? observations * (width+1) : 0, '\0'));
+	}
+	// only what the plugin uses, the rest stays NULL
+	memset(&plugin, 0, sizeof(plugin));
+	plugin.spoutsml = display;
+	plugin.spouterr = display;
+	plugin.pollstd = poll;
+	plugin.pollnow = poll;
+	plugin.stopflag = &stopflag;
+	plugin.nobs = nobs;
+	plugin.nobs1 = first;
+	plugin.nobs2 = nobs;
+	plugin.nvar = nvars;
+	plugin.nvars = nvars;
+	plugin.store = store;
+	plugin.safestore = store;
+	plugin.vdata = vdata;
+	plugin.safevdata = vdata;
+	plugin.sstore = sstore;
+	plugin.sdata = sdata;
+	plugin.missval = MISSING;
+	plugin.ismissing = ismissing;
+	plugin.macresave = macsave;
+	plugin.macuse = macuse;
+	plugin.scalsave = scalsave;
+	plugin.scalaruse = scaluse;
+	pginit(&plugin);
+}
+
+void FakeStataClose() {
+	if( dataset != NULL ) {
+		delete dataset;
+		dataset = NULL;
+	}
+}
+
+double FakeStataNumber(int var, int obs) {
+	double value = MISSING;
+	vdata(var, obs, &value);
+	return value;
+}
+
+string FakeStataString(int var, int obs) {
+	if( dataset->widths[var-1] == 0 )
+		return "";
+	return string(&dataset->strings[var-1][(obs-1) * (dataset->widths[var-1]+1)]);
+}
+
+double FakeStataScalar(string name) {
+	double value = MISSING;
+	scaluse((char*)name.c_str(), &value);
+	return value;
+}
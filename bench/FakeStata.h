@@ -0,0 +1,24 @@
+#pragma once // VC++
+
+#ifndef FAKESTATA_H
+#define FAKESTATA_H
+
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// an in-memory STATA host for running the plugin code outside STATA
+// the dataset has fixed width storage like STATA, so storing values does not allocate
+
+// create an empty dataset and hand the function table to the plugin, widths of 0 are numeric variables
+void FakeStataOpen(int observations, const vector<int>& stringWidths, bool quiet);
+// free the dataset
+void FakeStataClose();
+// read back what the plugin stored, obs and var from 1
+double FakeStataNumber(int var, int obs);
+string FakeStataString(int var, int obs);
+// what the plugin saved with SF_scal_save
+double FakeStataScalar(string name);
+
+#endif
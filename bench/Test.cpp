@@ -0,0 +1,394 @@
+#include "dwplugin.h"
+#include "strutils.h"
+#include "FakeStata.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+
+// checks of the plugin code without Oracle and STATA: the if expressions, the .dta files of BATCH and
+// the codes and labels, against a small table in an in-memory SQLite database
+// usage: dwtest, the exit code is 1 if a check failed
+
+
+int checks = 0;
+int failures = 0;
+
+void Check(bool isTrue, string what) {
+	checks++;
+	if( !isTrue ) {
+		failures++;
+		printf("FAILED %s\n", what.c_str());
+	}
+}
+
+void CheckEqual(string found, string expected, string what) {
+	Check(found == expected, what + ": \"" + found + "\" instead of \"" + expected + "\"");
+}
+
+void CheckEqual(const char* found, string expected, string what) {
+	CheckEqual(string(found != NULL ? found : "(none)"), expected, what);
+}
+
+void CheckEqual(double found, double expected, string what) {
+	Check(found == expected, what + ": " + toString(found) + " instead of " + toString(expected));
+}
+
+
+// id, x and s with a missing number, a zero and a missing string, the test cases refer to the ids
+DbConnect* OpenTestTable() {
+	DbConnect* conn = DbConnect::Open("sqlite", "", "", ":memory:");
+	conn->Execute("create table t (id integer, x real, s varchar(20))");
+	conn->Execute("insert into t values (1, 1.5, 'apple')");
+	conn->Execute("insert into t values (2, 0, 'pear')");
+	conn->Execute("insert into t values (3, null, 'apple')");
+	conn->Execute("insert into t values (4, -2, null)");
+	conn->Execute("insert into t values (5, 10, 'plum')");
+	conn->Commit();
+	return conn;
+}
+
+
+// the ids of the rows a select returns, separated by spaces
+class CollectIds {
+public:
+	CollectIds(string& ids) : ids(ids) {
+	}
+	void operator()( DbRow* row ) {
+		ids += (ids != "" ? " " : "") + toString(row->GetInt(1));
+	}
+private:
+	string& ids;
+};
+
+
+// the values of the placeholders like STATA locals
+class MapResolver : public ParameterResolver {
+public:
+	map<string,DbParam> values;
+	DbParam Resolve(string name) {
+		if( this->values.find(name) == this->values.end() )
+			throw DwUseException( "No value for :" + name );
+		return this->values.find(name)->second;
+	}
+};
+
+
+// the ids of the rows matching a STATA if expression
+string Filter(DbConnect* conn, string expr, ParameterResolver* resolver = NULL) {
+	ExpressionCompiler compiler(resolver);
+	compiler.AddColumns(conn->Describe("select * from t"), "t", "");
+	vector<DbParam> params;
+	string sql = compiler.Compile(expr, params);
+	string ids;
+	conn->Select(CollectIds(ids), "select id from t where " + sql + " order by id", params);
+	return ids;
+}
+
+
+// whether compiling the expression is refused
+bool IsRefused(DbConnect* conn, string expr) {
+	try {
+		Filter(conn, expr);
+	} catch( const DwUseException& ) {
+		return true;
+	}
+	return false;
+}
+
+
+// missing is larger than any number and true as a condition, like in STATA
+void TestExpressions(DbConnect* conn) {
+	CheckEqual(Filter(conn, "x > 1"), "1 3 5", "missing compares larger");
+	CheckEqual(Filter(conn, "x < 1"), "2 4", "missing is not smaller");
+	CheckEqual(Filter(conn, "x"), "1 3 4 5", "a number as condition");
+	CheckEqual(Filter(conn, "!x == 1"), "2", "not before a comparison");
+	CheckEqual(Filter(conn, "missing(x)"), "3", "missing()");
+	CheckEqual(Filter(conn, "x == ."), "3", "equal to missing");
+	CheckEqual(Filter(conn, "!missing(x) & x"), "1 4 5", "and of conditions");
+	CheckEqual(Filter(conn, "s == \"apple\" | id >= 5"), "1 3 5", "or of conditions");
+	CheckEqual(Filter(conn, "s == \"\""), "4", "missing string is empty");
+	CheckEqual(Filter(conn, "(id > 1) + (id > 3) == 1"), "2 3", "conditions as 0/1 values");
+	CheckEqual(Filter(conn, "id * 2 - 1 == 5"), "3", "arithmetic");
+	CheckEqual(Filter(conn, "x != 0"), "1 3 4 5", "missing is not equal to a number");
+	CheckEqual(Filter(conn, "x >= id"), "1 3 5", "missing is larger than a column");
+	CheckEqual(Filter(conn, "x + 1 > 2"), "1 3 5", "arithmetic with missing is missing");
+	CheckEqual(Filter(conn, "x * 2 == x * 2"), "1 2 3 4 5", "missing equals missing");
+	CheckEqual(Filter(conn, "s < \"b\""), "1 3 4", "the empty string is smaller");
+	CheckEqual(Filter(conn, "s != \"apple\""), "2 4 5", "the empty string is not equal to a string");
+	Check(IsRefused(conn, "nosuchcolumn > 1"), "an unknown column is refused");
+	Check(IsRefused(conn, "x > "), "an incomplete expression is refused");
+
+	// the literals are bound, so the statement text stays the same
+	ExpressionCompiler compiler;
+	compiler.AddColumns(conn->Describe("select * from t"), "t", "");
+	vector<DbParam> params;
+	string sql = compiler.Compile("s == \"plum\" & id > 4", params);
+	Check(sql.find("plum") == string::npos, "a string literal is bound: " + sql);
+	CheckEqual((double)params.size(), 2, "bound literals");
+
+	MapResolver resolver;
+	resolver.values.insert(make_pair(string("fruit"), DbParam(string("pear"))));
+	resolver.values.insert(make_pair(string("limit"), DbParam(3.0)));
+	CheckEqual(Filter(conn, "s == :fruit | id > :limit", &resolver), "2 4 5", "placeholders");
+}
+
+
+// the .dta file of a query like BATCH writes it, read back by the layout of format 115
+class DtaReader {
+public:
+	DtaReader(string fileName) : position(0) {
+		FILE* file = fopen(fileName.c_str(), "rb");
+		if( file == NULL )
+			throw DwUseException( "Could not open " + fileName );
+		char buffer[4096];
+		size_t n;
+		while( (n = fread(buffer, 1, sizeof(buffer), file)) > 0 )
+			this->data.append(buffer, n);
+		fclose(file);
+	}
+	int Byte() {
+		return (unsigned char)this->data.at(this->position++);
+	}
+	template< typename T > T Get() {
+		T value;
+		memcpy(&value, this->data.data() + this->position, sizeof(T));
+		this->position += sizeof(T);
+		return value;
+	}
+	// a zero terminated text in a field of the width
+	string Text(size_t width) {
+		string text = this->data.substr(this->position, width);
+		this->position += width;
+		return text.substr(0, text.find('\0'));
+	}
+	bool IsAtEnd() {
+		return this->position == this->data.size();
+	}
+	string data;
+	size_t position;
+};
+
+
+// a value of a variable of the record in the storage type, as a double
+double DtaValue(DtaReader& dta, int type, bool& isMissing) {
+	double value;
+	switch( type ) {
+		case 251: value = dta.Get<signed char>(); isMissing = value > 100; break;
+		case 252: value = dta.Get<short>(); isMissing = value > 32740; break;
+		case 253: value = dta.Get<int>(); isMissing = value > 2147483620; break;
+		case 254: value = dta.Get<float>(); isMissing = value >= ldexp(1.0, 127); break;
+		default: value = dta.Get<double>(); isMissing = value >= ldexp(1.0, 1023);
+	}
+	return value;
+}
+
+
+// write the table with the options of a BATCH line and read the file back
+void WriteDta(DbConnect* conn, string line, string fileName) {
+	DwUseOptionParser parser;
+	DwUseOptions* options = parser.Parse(split(line, ' '));
+	options->Validate();
+	DwUseQuery query(options, NULL, conn);
+	if( options->IsEncode() )
+		query.Encode();
+	DwDtaFile file(fileName, query.Columns(), "t", "18 Oct 2026 12:00", query.SortVariables());
+	query.QueryData( WriteDataSet(&file, query.Stats()) );
+	file.Close();
+}
+
+
+void TestDta(DbConnect* conn) {
+	string fileName = "dwtest.dta";
+	WriteDta(conn, "id x s using t sort(id)", fileName);
+	DtaReader dta(fileName);
+	remove(fileName.c_str());
+	CheckEqual(dta.Byte(), 115, "dta format");
+	int byteOrder = dta.Byte();
+	int one = 1;
+	CheckEqual(byteOrder, *(char*)&one == 1 ? 2 : 1, "dta byte order");
+	dta.Byte();
+	dta.Byte();
+	int nvar = dta.Get<short>();
+	int nobs = dta.Get<int>();
+	CheckEqual(nvar, 3, "dta variables");
+	CheckEqual(nobs, 5, "dta observations");
+	CheckEqual(dta.Text(81), "t", "dta data label");
+	CheckEqual(dta.Text(18), "18 Oct 2026 12:00", "dta time stamp");
+	vector<int> types;
+	for(int i = 0; i < nvar; i++)
+		types.push_back(dta.Byte());
+	Check(types[0] >= 251 && types[1] >= 251, "numeric storage types");
+	Check(types[2] >= 5 && types[2] <= 244, "string storage type holds the values, str" + toString(types[2]));
+	CheckEqual(dta.Text(33), "id", "first variable");
+	CheckEqual(dta.Text(33), "x", "second variable");
+	CheckEqual(dta.Text(33), "s", "third variable");
+	CheckEqual(dta.Get<short>(), 1, "sorted by the first variable");
+	for(int i = 0; i < nvar; i++)
+		dta.Get<short>();
+	for(int i = 0; i < nvar; i++)
+		Check(dta.Text(49)[0] == '%', "display format");
+	dta.position += nvar * 33 + nvar * 81 + 5; // value label names, variable labels, expansion fields
+
+	double ids[] = { 1, 2, 3, 4, 5 };
+	double xs[] = { 1.5, 0, -1, -2, 10 }; // -1 stands for missing
+	const char* ss[] = { "apple", "pear", "apple", "", "plum" };
+	for(int obs = 0; obs < nobs; obs++) {
+		string where = " of observation " + toString(obs + 1);
+		bool isMissing;
+		CheckEqual(DtaValue(dta, types[0], isMissing), ids[obs], "id" + where);
+		double x = DtaValue(dta, types[1], isMissing);
+		if( xs[obs] == -1 )
+			Check(isMissing, "null x is missing" + where);
+		else
+			CheckEqual(x, xs[obs], "x" + where);
+		CheckEqual(dta.Text(types[2]), ss[obs], "s" + where);
+	}
+	Check(dta.IsAtEnd(), "no value labels after the data");
+}
+
+
+void TestEncode(DbConnect* conn) {
+	string fileName = "dwtest_encode.dta";
+	WriteDta(conn, "id s using t encode s sort(id)", fileName);
+	DtaReader dta(fileName);
+	remove(fileName.c_str());
+	dta.position = 4;
+	int nvar = dta.Get<short>();
+	int nobs = dta.Get<int>();
+	dta.position += 81 + 18;
+	int idType = dta.Byte();
+	int sType = dta.Byte();
+	Check(sType >= 251, "an encoded string is numeric");
+	dta.position += nvar * 33 + (nvar + 1) * 2 + nvar * 49;
+	dta.Text(33);
+	CheckEqual(dta.Text(33), "s_label", "value label of the encoded variable");
+	dta.position += nvar * 81 + 5;
+
+	// the codes follow the order of the values
+	double codes[] = { 1, 2, 1, -1, 3 };
+	for(int obs = 0; obs < nobs; obs++) {
+		bool isMissing;
+		DtaValue(dta, idType, isMissing);
+		double code = DtaValue(dta, sType, isMissing);
+		if( codes[obs] == -1 )
+			Check(isMissing, "a null string has no code");
+		else
+			CheckEqual(code, codes[obs], "code of observation " + toString(obs + 1));
+	}
+
+	// the value label table: its length, name, padding, then the offsets, values and texts
+	int length = dta.Get<int>();
+	CheckEqual(dta.Text(33), "s_label", "name of the value label");
+	dta.position += 3;
+	size_t tableStart = dta.position;
+	int n = dta.Get<int>();
+	int textLength = dta.Get<int>();
+	CheckEqual(n, 3, "labels");
+	vector<int> offsets, values;
+	for(int i = 0; i < n; i++)
+		offsets.push_back(dta.Get<int>());
+	for(int i = 0; i < n; i++)
+		values.push_back(dta.Get<int>());
+	string text = dta.data.substr(dta.position, textLength);
+	dta.position += textLength;
+	const char* labels[] = { "apple", "pear", "plum" };
+	for(int i = 0; i < n && i < 3; i++) {
+		CheckEqual(values[i], i + 1, "labelled code");
+		CheckEqual(string(text.c_str() + offsets[i]), labels[i], "label of code " + toString(i + 1));
+	}
+	CheckEqual((double)(dta.position - tableStart), length, "length of the value label table");
+	Check(dta.IsAtEnd(), "the file ends after the value labels");
+
+	// values that come after CREATE get new codes without labels, the storage type limits them
+	vector<string> atCreate;
+	atCreate.push_back("b");
+	atCreate.push_back("a");
+	atCreate.push_back("");
+	DwEncoder encoder(atCreate, "v");
+	CheckEqual(encoder.Code("a"), 1, "code of the first value");
+	CheckEqual(encoder.Code("b"), 2, "code of the second value");
+	CheckEqual(encoder.Count(), 2, "a null gets no code");
+	CheckEqual(encoder.Code("c"), 3, "code of a new value");
+	CheckEqual(encoder.Code("c"), 3, "a new value keeps its code");
+	CheckEqual(encoder.Added(), 1, "new values");
+	CheckEqual((double)encoder.Labels().size(), 2, "only the values of CREATE are labelled");
+	CheckEqual(encoder.MaxCode(), 100, "a few values fit a byte");
+	bool isFull = false;
+	try {
+		for(int i = 0; i < 200; i++)
+			encoder.Code("new" + toString(i));
+	} catch( const DwUseException& ) {
+		isFull = true;
+	}
+	Check(isFull, "codes beyond the storage type are refused");
+
+	// above encode_max the column stays a string
+	DwUseOptionParser parser;
+	DwUseOptions* options = parser.Parse(split("id s using t encode s encode_max 2", ' '));
+	DwUseQuery query(options, NULL, conn);
+	CheckEqual(query.Encode(), 0, "too many distinct values to encode");
+	Check(!query.Columns()[1]->IsNumeric(), "the column stays a string");
+}
+
+
+// the dictionaries of translate: small integer codes index an array, the rest are hashed
+void TestLabelTable() {
+	map<string,string> dense;
+	dense["1"] = "one";
+	dense["2"] = "two";
+	dense["10"] = "ten";
+	DwLabelTable table(dense);
+	Check(table.IsDense(), "small codes are dense");
+	CheckEqual(table.Find(2.0), "two", "a dense code");
+	Check(table.Find(3.0) == NULL, "a code without a label");
+	Check(table.Find(2.5) == NULL, "a fraction has no label");
+	Check(table.Find(-1.0) == NULL, "a negative code has no label");
+	CheckEqual(table.Find("10", 2), "ten", "a dense code as text");
+	CheckEqual((double)table.MaxLength(), 3, "the longest label");
+
+	map<string,string> sparse;
+	sparse["A"] = "alpha";
+	sparse["1000000"] = "million";
+	sparse["01"] = "zero one";
+	for(int i = 0; i < 100; i++)
+		sparse["K" + toString(i)] = "key " + toString(i);
+	DwLabelTable hashed(sparse);
+	Check(!hashed.IsDense(), "text codes are hashed");
+	CheckEqual(hashed.Find("A", 1), "alpha", "a text code");
+	CheckEqual(hashed.Find(1000000.0), "million", "a large numeric code");
+	CheckEqual(hashed.Find("01", 2), "zero one", "a code with a leading zero");
+	Check(hashed.Find(1.0) == NULL, "1 is not 01");
+	Check(hashed.Find("B", 1) == NULL, "a missing text code");
+	Check(hashed.Find("K1", 1) == NULL, "a prefix of a code");
+	int found = 0;
+	for(int i = 0; i < 100; i++) {
+		string key = "K" + toString(i);
+		const char* label = hashed.Find(key.c_str(), key.size());
+		found += label != NULL && string(label) == "key " + toString(i);
+	}
+	CheckEqual(found, 100, "every hashed code");
+	CheckEqual((double)hashed.MaxLength(), 8, "the longest hashed label");
+}
+
+
+int main(int argc, char* argv[]) {
+	FakeStataOpen(0, vector<int>(), true);
+	DbConnect* conn = NULL;
+	try {
+		conn = OpenTestTable();
+		TestExpressions(conn);
+		TestDta(conn);
+		TestEncode(conn);
+		TestLabelTable();
+	} catch( const DwUseException& ex ) {
+		Check(false, string("with an error: ") + ex.what());
+	} catch( const DbException& ex ) {
+		Check(false, "with a database error: " + ex.getMessage());
+	}
+	if( conn != NULL )
+		delete conn;
+	FakeStataClose();
+	printf("%d checks, %d failed\n", checks, failures);
+	return failures > 0 ? 1 : 0;
+}
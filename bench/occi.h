@@ -0,0 +1,170 @@
+#pragma once // VC++
+
+#ifndef OCCI_H
+#define OCCI_H
+
+// in-memory stand-in for Oracle OCCI so the plugin sources can be benchmarked without a database
+// it only has what DbConnect and DwColumn use, and every query returns the rows of the synthetic table
+
+#include <string>
+#include <vector>
+#include <exception>
+
+typedef short sb2;
+typedef unsigned short ub2;
+typedef int sb4;
+typedef unsigned int ub4;
+
+
+// what the synthetic queries return, set by the benchmark before connecting
+struct SyntheticTable {
+	std::string columns; // one letter for each column: n number, i integer, d date, t timestamp, s string
+	int rows;
+	int width; // length of the strings
+	int nullPercent; // share of null cells
+};
+
+extern SyntheticTable syntheticTable;
+
+
+namespace oracle { namespace occi {
+
+enum Type {
+	OCCI_SQLT_CHR = 1, OCCI_SQLT_NUM = 2, OCCIINT = 3, OCCIFLOAT = 4, OCCI_SQLT_STR = 5, OCCI_SQLT_VNU = 6,
+	OCCI_SQLT_LNG = 8, OCCI_SQLT_VCS = 9, OCCI_SQLT_RID = 11, OCCI_SQLT_DAT = 12, OCCI_SQLT_VBI = 15,
+	OCCIBFLOAT = 21, OCCIBDOUBLE = 22, OCCI_SQLT_BIN = 23, OCCI_SQLT_LBI = 24, OCCIUNSIGNED_INT = 68,
+	OCCI_SQLT_LVC = 94, OCCI_SQLT_LVB = 95, OCCI_SQLT_AFC = 96, OCCI_SQLT_AVC = 97, OCCI_SQLT_RDD = 104,
+	OCCI_SQLT_NTY = 108, OCCI_SQLT_REF = 110, OCCI_SQLT_CLOB = 112, OCCI_SQLT_BLOB = 113, OCCI_SQLT_FILE = 114,
+	OCCI_SQLT_TIMESTAMP = 187
+};
+
+
+class SQLException : public std::exception {
+public:
+	SQLException(std::string message) : message(message) {}
+	~SQLException() throw() {}
+	const char* what() const throw() { return this->message.c_str(); }
+	std::string getMessage() const { return this->message; }
+	int getErrorCode() const { return 0; }
+private:
+	std::string message;
+};
+
+
+class IntervalDS {
+public:
+	IntervalDS(int day = 0, int hour = 0, int minute = 0, int second = 0)
+		: day(day), hour(hour), minute(minute), second(second) {}
+	int getDay() const { return this->day; }
+	int getHour() const { return this->hour; }
+	int getMinute() const { return this->minute; }
+	int getSecond() const { return this->second; }
+private:
+	int day, hour, minute, second;
+};
+
+
+// days since 1960-01-01
+class Date {
+public:
+	Date(int days = 0) : days(days) {}
+	void setDate(int year, unsigned int month, unsigned int day,
+				 unsigned int hour = 0, unsigned int minute = 0, unsigned int seconds = 0);
+	IntervalDS daysBetween(const Date& other) const { return IntervalDS(this->days - other.days); }
+	bool isNull() const { return false; }
+private:
+	int days;
+};
+
+
+// seconds since 1960-01-01
+class Timestamp {
+public:
+	Timestamp(double seconds = 0) : seconds(seconds) {}
+	void setDate(int year, unsigned int month, unsigned int day);
+	void setTime(unsigned int hour, unsigned int minute, unsigned int second, unsigned int fs);
+	IntervalDS subDS(const Timestamp& other) const;
+private:
+	double seconds;
+};
+
+
+class MetaData {
+public:
+	enum AttrId { ATTR_NAME, ATTR_DATA_TYPE, ATTR_DATA_SIZE, ATTR_PRECISION, ATTR_SCALE };
+	MetaData(std::string name, int type, int size, int precision, int scale)
+		: name(name), type(type), size(size), precision(precision), scale(scale) {}
+	std::string getString(AttrId id) const { return this->name; }
+	int getInt(AttrId id) const;
+private:
+	std::string name;
+	int type, size, precision, scale;
+};
+
+
+// generates the rows of the synthetic table, the values only depend on the row and the column
+class ResultSet {
+public:
+	enum Status { END_OF_FETCH = 0, DATA_AVAILABLE };
+	ResultSet(const SyntheticTable& table);
+	Status next();
+	bool isNull(unsigned int col) const;
+	double getDouble(unsigned int col);
+	int getInt(unsigned int col);
+	std::string getString(unsigned int col);
+	Date getDate(unsigned int col);
+	Timestamp getTimestamp(unsigned int col);
+	std::vector<MetaData> getColumnListMetaData() const;
+	// next() writes the value of the column into the buffer, only OCCIINT and OCCIBDOUBLE
+	void setDataBuffer(unsigned int col, void* buffer, Type type, sb4 size, ub2* length, sb2* ind = 0, ub2* rc = 0);
+private:
+	// a column defined with setDataBuffer
+	struct Define {
+		unsigned int col;
+		void* buffer;
+		Type type;
+		sb2* ind;
+	};
+	SyntheticTable table;
+	int row;
+	std::vector<Define> defines;
+	std::vector<std::string> strings; // values to pick from for string columns
+};
+
+
+class Statement {
+public:
+	void setPrefetchRowCount(unsigned int rows) {}
+	void setPrefetchMemorySize(unsigned int bytes) {}
+	void setDouble(unsigned int position, double value) {}
+	void setString(unsigned int position, const std::string& value) {}
+	void setDataBuffer(unsigned int position, void* buffer, Type type, sb4 size, ub2* length, sb2* ind = 0, ub2* rc = 0) {}
+	ResultSet* executeQuery() { return new ResultSet(syntheticTable); }
+	unsigned int executeUpdate() { return 0; }
+	void executeArrayUpdate(unsigned int rows) {}
+	void closeResultSet(ResultSet* rs) { delete rs; }
+};
+
+
+class Connection {
+public:
+	Statement* createStatement(std::string sql) { return new Statement(); }
+	void terminateStatement(Statement* stmt) { delete stmt; }
+	void setStmtCacheSize(unsigned int size) {}
+	void commit() {}
+	void cancel() {}
+};
+
+
+class Environment {
+public:
+	enum Mode { DEFAULT, THREADED_MUTEXED };
+	static Environment* createEnvironment(std::string charset, std::string ncharset, Mode mode) { return new Environment(); }
+	static void terminateEnvironment(Environment* env) { delete env; }
+	Connection* createConnection(std::string user, std::string password, std::string db) { return new Connection(); }
+	void terminateConnection(Connection* conn) { delete conn; }
+};
+
+}}
+
+#endif
@@ -0,0 +1,642 @@
+// dwused: one process on a host keeps the database connections of all the STATA sessions on it
+// the plugin connects through the socket given in its daemon option and gets a connection of the pool
+// for as long as it keeps the socket open, the daemon remembers the columns and the results of the selects,
+// so the label queries and repeated extracts are answered from memory
+//   dwused /tmp/dwused.sock [-cache_mb 256] [-ttl 600] [-idle 4]
+
+#include "dwplugin.h"
+#include "strutils.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cerrno>
+#include <csignal>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+const size_t WIRE_ROWS_BYTES = 1 << 16; // a ROWS message is sent when it gets this big
+const int DEFAULT_CACHE_MB = 256; // results kept in memory
+const int DEFAULT_TTL = 600; // seconds a cached column list or result is used
+const int DEFAULT_IDLE = 4; // idle connections kept for the same credentials
+
+
+// how the daemon reads a column to send it, the plugin asks for it with any of the get methods
+enum DwReadAs {
+	READ_INT,
+	READ_NUMBER,
+	READ_DATE,
+	READ_TIMESTAMP,
+	READ_STRING
+};
+
+DwReadAs ReadAs(const DbColumnMetaData& column, DbFetchType fetchType) {
+	if( column.type == "DATE" )
+		return READ_DATE;
+	if( column.type == "TIMESTAMP" )
+		return READ_TIMESTAMP;
+	if( column.type == "NUMBER" || column.type == "INTEGER" || column.type == "FLOAT"
+		|| column.type == "VARNUM" || column.type == "UNSIGNED INT" )
+		return fetchType == FETCH_INT ? READ_INT : READ_NUMBER;
+	return READ_STRING;
+}
+
+
+// a select answered before, the messages are sent again as they are
+struct DwCachedResult {
+	vector<DbWire> messages;
+	size_t bytes;
+	double created;
+	double used;
+};
+
+struct DwCachedColumns {
+	vector<DbColumnMetaData> columns;
+	double created;
+};
+
+
+// the state shared by the sessions
+class DwDaemon {
+public:
+	DwDaemon(size_t cacheBytes, double ttl, size_t idle) : cacheBytes(cacheBytes), ttl(ttl), idle(idle) {
+		this->cachedBytes = 0;
+		this->hits = 0;
+		this->misses = 0;
+	}
+	~DwDaemon() {
+		for(map<string, vector<DbConnect*> >::iterator ii = this->pool.begin(); ii != this->pool.end(); ii++)
+			for(size_t i = 0; i < ii->second.size(); i++)
+				delete ii->second[i];
+		for(map<string, DwCachedResult*>::iterator ii = this->results.begin(); ii != this->results.end(); ii++)
+			delete ii->second;
+	}
+
+	// an idle connection with the credentials, or a new one
+	DbConnect* Checkout(const string& key, string backend, string user, string password, string db) {
+		{
+			DwLocked locked(&this->monitor);
+			vector<DbConnect*>& idle = this->pool[key];
+			if( idle.size() > 0 ) {
+				DbConnect* conn = idle.back();
+				idle.pop_back();
+				return conn;
+			}
+		}
+		return DbConnect::Open(backend, user, password, db);
+	}
+
+	// back into the pool if there is room for it
+	void Checkin(const string& key, DbConnect* conn) {
+		{
+			DwLocked locked(&this->monitor);
+			vector<DbConnect*>& idle = this->pool[key];
+			if( idle.size() < this->idle ) {
+				idle.push_back(conn);
+				return;
+			}
+		}
+		delete conn;
+	}
+
+	// the connection of a session is known while it has one, so a cancel coming on another socket finds it
+	void Register(int session, const string& key, DbConnect* conn) {
+		DwLocked locked(&this->monitor);
+		this->connected[session] = make_pair(key, conn);
+	}
+
+	void Unregister(int session) {
+		DwLocked locked(&this->monitor);
+		this->connected.erase(session);
+	}
+
+	// cancel the statement of a session opened with the same credentials, false if there is none
+	bool Cancel(int session, const string& key) {
+		DwLocked locked(&this->monitor);
+		map<int, pair<string, DbConnect*> >::iterator ii = this->connected.find(session);
+		if( ii == this->connected.end() || ii->second.first != key )
+			return false;
+		ii->second.second->Cancel();
+		return true;
+	}
+
+	bool FindColumns(const string& key, vector<DbColumnMetaData>& columns) {
+		DwLocked locked(&this->monitor);
+		map<string, DwCachedColumns>::iterator ii = this->columns.find(key);
+		if( ii == this->columns.end() || DbClock() - ii->second.created > this->ttl )
+			return false;
+		columns = ii->second.columns;
+		return true;
+	}
+
+	void StoreColumns(const string& key, const vector<DbColumnMetaData>& columns) {
+		DwLocked locked(&this->monitor);
+		DwCachedColumns& cached = this->columns[key];
+		cached.columns = columns;
+		cached.created = DbClock();
+	}
+
+	// a copy of the messages, the lock is not held while they are sent
+	bool FindResult(const string& key, vector<DbWire>& messages) {
+		DwLocked locked(&this->monitor);
+		map<string, DwCachedResult*>::iterator ii = this->results.find(key);
+		if( ii == this->results.end() || DbClock() - ii->second->created > this->ttl ) {
+			this->misses++;
+			return false;
+		}
+		this->hits++;
+		ii->second->used = DbClock();
+		messages = ii->second->messages;
+		return true;
+	}
+
+	// the least recently used ones make room
+	void StoreResult(const string& key, const vector<DbWire>& messages, size_t bytes) {
+		DwLocked locked(&this->monitor);
+		this->Forget(key);
+		while( this->cachedBytes + bytes > this->cacheBytes && this->results.size() > 0 ) {
+			map<string, DwCachedResult*>::iterator oldest = this->results.begin();
+			for(map<string, DwCachedResult*>::iterator ii = this->results.begin(); ii != this->results.end(); ii++)
+				if( ii->second->used < oldest->second->used )
+					oldest = ii;
+			this->Forget(oldest->first);
+		}
+		DwCachedResult* result = new DwCachedResult();
+		result->messages = messages;
+		result->bytes = bytes;
+		result->created = DbClock();
+		result->used = result->created;
+		this->results[key] = result;
+		this->cachedBytes += bytes;
+	}
+
+	// the biggest result worth keeping
+	size_t MaxResultBytes() {
+		return this->cacheBytes / 4;
+	}
+
+	string Summary() {
+		DwLocked locked(&this->monitor);
+		return toString((long)this->results.size()) + " results in " + toString((double)this->cachedBytes / 1048576) + " MB, "
+				+ toString(this->hits) + " hits, " + toString(this->misses) + " misses";
+	}
+
+private:
+	// while locked
+	void Forget(const string& key) {
+		map<string, DwCachedResult*>::iterator ii = this->results.find(key);
+		if( ii == this->results.end() )
+			return;
+		this->cachedBytes -= ii->second->bytes;
+		delete ii->second;
+		this->results.erase(ii);
+	}
+
+	size_t cacheBytes;
+	double ttl;
+	size_t idle;
+	map<string, vector<DbConnect*> > pool; // idle connections by credentials
+	map<int, pair<string, DbConnect*> > connected; // the credentials and the connection of the sessions by number
+	map<string, DwCachedColumns> columns; // by credentials and sql
+	map<string, DwCachedResult*> results; // by credentials, sql, params and fetch types
+	size_t cachedBytes;
+	int hits;
+	int misses;
+	DwMonitor monitor; // guards the fields above
+};
+
+
+// thrown when the plugin went away, the session ends without an answer
+class DwWireClosed {
+};
+
+// sends the rows of a select in ROWS messages, and keeps them for the cache while they fit
+class DwRowSender : public DbRowProcessor {
+public:
+	DwRowSender(int socket, const vector<DbFetchType>& fetchTypes, size_t maxBytes)
+		: socket(socket), fetchTypes(fetchTypes), maxBytes(maxBytes), rows(0), bytes(0), isCaching(maxBytes > 0) {
+	}
+	void Columns(const vector<DbColumnMetaData>& columns) {
+		this->readAs.clear();
+		for(size_t i = 0; i < columns.size(); i++)
+			this->readAs.push_back( ReadAs(columns[i], i < this->fetchTypes.size() ? this->fetchTypes[i] : FETCH_DEFAULT) );
+		DbWire answer(WIRE_COLUMNS);
+		answer.PutColumns(columns);
+		this->Send(answer);
+	}
+	void Process(DbRow* row) {
+		for(size_t i = 0; i < this->readAs.size(); i++) {
+			int col = i + 1;
+			if( row->IsNull(col) ) {
+				this->cells.PutByte(CELL_NULL);
+				continue;
+			}
+			switch( this->readAs[i] ) {
+				case READ_INT: this->PutNumber(row->GetInt(col)); break;
+				case READ_NUMBER: this->PutNumber(row->GetNumber(col)); break;
+				case READ_DATE: this->PutNumber(row->GetDate(col)); break;
+				case READ_TIMESTAMP: this->PutNumber(row->GetTimestamp(col)); break;
+				default:
+					this->cells.PutByte(CELL_STRING);
+					this->cells.PutString(row->GetString(col));
+			}
+		}
+		this->rows++;
+		if( this->cells.Size() >= WIRE_ROWS_BYTES )
+			this->Flush();
+	}
+	// send the rows collected so far
+	void Flush() {
+		if( this->rows == 0 )
+			return;
+		DbWire message(WIRE_ROWS);
+		message.PutInt(this->rows);
+		message.PutInt((int)this->readAs.size());
+		// the cells follow the counts
+		DbWire cells;
+		swap(cells, this->cells);
+		this->rows = 0;
+		this->Send(message, &cells);
+	}
+	void End() {
+		this->Flush();
+		DbWire end(WIRE_END);
+		this->Send(end);
+	}
+	// whether all the messages were kept
+	bool IsComplete() {
+		return this->isCaching;
+	}
+	const vector<DbWire>& Messages() {
+		return this->messages;
+	}
+	size_t Bytes() {
+		return this->bytes;
+	}
+private:
+	void PutNumber(double value) {
+		this->cells.PutByte(CELL_NUMBER);
+		this->cells.PutDouble(value);
+	}
+	void Send(DbWire& message, DbWire* cells = NULL) {
+		if( cells != NULL )
+			message.Append(*cells);
+		try {
+			message.Send(this->socket);
+		} catch( const DbException& ) {
+			throw DwWireClosed();
+		}
+		if( this->isCaching ) {
+			this->bytes += message.Size();
+			if( this->bytes > this->maxBytes ) {
+				this->isCaching = false;
+				this->messages.clear();
+			} else {
+				this->messages.push_back(message);
+			}
+		}
+	}
+
+	int socket;
+	vector<DbFetchType> fetchTypes;
+	vector<DwReadAs> readAs;
+	size_t maxBytes;
+	int rows;
+	size_t bytes;
+	bool isCaching;
+	DbWire cells; // of the rows since the last message
+	vector<DbWire> messages;
+};
+
+
+// the requests of one plugin, on a thread of its own
+class DwSession : public DwThread {
+public:
+	DwSession(DwDaemon* daemon, int socket, int number) : daemon(daemon), socket(socket), number(number), conn(NULL) {
+		this->isDirty = false;
+		this->isDone = false;
+		this->Start();
+	}
+	~DwSession() {
+		this->Join();
+	}
+	bool IsDone() {
+		DwLocked locked(&this->monitor);
+		return this->isDone;
+	}
+	void Run() {
+		try {
+			this->Serve();
+		} catch( const DwWireClosed& ) {
+		} catch( const DbException& ex ) {
+			this->Log("ended: " + ex.getMessage());
+		} catch( ... ) {
+			this->Log("ended with an unexpected error");
+		}
+		close(this->socket);
+		if( this->conn != NULL )
+			this->daemon->Unregister(this->number);
+		// the temporary tables and the rows not committed of a session must not reach the next one
+		if( this->conn != NULL && this->isDirty ) {
+			this->Log("closed its connection, it wrote into the database");
+			delete this->conn;
+		} else if( this->conn != NULL ) {
+			this->daemon->Checkin(this->key, this->conn);
+		}
+		DwLocked locked(&this->monitor);
+		this->isDone = true;
+	}
+
+private:
+	void Log(string line) {
+		printf("session %d: %s\n", this->number, line.c_str());
+		fflush(stdout);
+	}
+
+	void Answer(DbWire& answer) {
+		try {
+			answer.Send(this->socket);
+		} catch( const DbException& ) {
+			throw DwWireClosed();
+		}
+	}
+
+	void Fail(const DbException& ex) {
+		DbWire error(WIRE_ERROR);
+		error.PutString(ex.getMessage());
+		error.PutInt(ex.getErrorCode());
+		this->Answer(error);
+	}
+
+	void Serve() {
+		DbWire request;
+		while( request.Receive(this->socket) ) {
+			try {
+				if( request.Type() == WIRE_HELLO )
+					this->Hello(request);
+				else if( request.Type() == WIRE_CANCEL )
+					this->Cancel(request);
+				else if( this->conn == NULL )
+					throw DbException( "Say hello to the daemon first." );
+				else if( request.Type() == WIRE_QUERY )
+					this->Query(request);
+				else
+					this->Handle(request);
+			} catch( const DbException& ex ) {
+				this->Fail(ex);
+			}
+		}
+	}
+
+	void Hello(DbWire& request) {
+		if( this->conn != NULL )
+			throw DbException( "The session is connected already." );
+		string backend = request.GetString();
+		string user = request.GetString();
+		string password = request.GetString();
+		string db = request.GetString();
+		this->key = Key(backend, user, password, db);
+		this->conn = this->daemon->Checkout(this->key, backend, user, password, db);
+		this->daemon->Register(this->number, this->key, this->conn);
+		this->Log("connected to " + (user != "" ? user + "@" : "") + db);
+		DbWire ok(WIRE_OK);
+		ok.PutInt(this->number);
+		this->Answer(ok);
+	}
+
+	// the plugin of another session waits for its rows and asks on this socket to stop them
+	void Cancel(DbWire& request) {
+		string backend = request.GetString();
+		string user = request.GetString();
+		string password = request.GetString();
+		string db = request.GetString();
+		int session = request.GetInt();
+		if( !this->daemon->Cancel(session, Key(backend, user, password, db)) )
+			throw DbException( "There is no session " + toString(session) + " of the login to cancel." );
+		this->Log("cancelled the statement of session " + toString(session));
+		DbWire ok(WIRE_OK);
+		this->Answer(ok);
+	}
+
+	// the password is part of the key, so a connection is only lent to (or cancelled by) those who could open it
+	static string Key(string backend, string user, string password, string db) {
+		return lowerCase(backend) + "\n" + user + "\n" + password + "\n" + db;
+	}
+
+	// everything but the rows of a select
+	void Handle(DbWire& request) {
+		DbWire answer(WIRE_OK);
+		string sql = request.GetString();
+		switch( request.Type() ) {
+			case WIRE_DESCRIBE: {
+				vector<DbColumnMetaData> columns;
+				string key = this->key + "\n" + sql;
+				if( !this->daemon->FindColumns(key, columns) ) {
+					columns = this->conn->Describe(sql);
+					this->daemon->StoreColumns(key, columns);
+				}
+				answer = DbWire(WIRE_COLUMNS);
+				answer.PutColumns(columns);
+				break;
+			}
+			case WIRE_EXECUTE:
+				this->isDirty = true;
+				this->conn->Execute(sql);
+				break;
+			case WIRE_EXECUTE_ARRAY: {
+				this->isDirty = true;
+				unsigned int rows = request.GetInt();
+				vector<DbArrayParam> params(request.GetInt());
+				for(size_t i = 0; i < params.size(); i++) {
+					bool isNumber = request.GetByte() != 0;
+					params[i].Reset(isNumber, request.GetInt(), rows);
+					for(unsigned int r = 0; r < rows; r++) {
+						int cell = request.GetByte();
+						if( cell == CELL_NUMBER )
+							params[i].SetNumber(r, request.GetDouble());
+						else if( cell == CELL_STRING )
+							params[i].SetString(r, request.GetString());
+					}
+				}
+				this->conn->ExecuteArray(sql, params, rows);
+				break;
+			}
+			case WIRE_COMMIT:
+				this->conn->Commit();
+				break;
+			case WIRE_LIMIT: {
+				string whereSql = request.GetString();
+				int rows = request.GetInt();
+				string orderSql = request.GetString();
+				answer = DbWire(WIRE_TEXT);
+				answer.PutString(this->conn->LimitSQL(sql, whereSql, rows, orderSql));
+				break;
+			}
+			case WIRE_ROW_ORDER:
+				answer = DbWire(WIRE_TEXT);
+				answer.PutString(this->conn->RowOrderSQL(sql));
+				break;
+			case WIRE_PERCENTILE: {
+				double fraction = request.GetDouble();
+				answer = DbWire(WIRE_TEXT);
+				answer.PutString(this->conn->PercentileSQL(sql, fraction));
+				break;
+			}
+			case WIRE_DATETIME: {
+				bool isTimestamp = request.GetByte() != 0;
+				answer = DbWire(WIRE_TEXT);
+				answer.PutString(this->conn->DateTimeSQL(sql, isTimestamp));
+				break;
+			}
+			case WIRE_DATETIME_VALUE: {
+				bool isTimestamp = request.GetByte() != 0;
+				answer = DbWire(WIRE_TEXT);
+				answer.PutString(this->conn->DateTimeValueSQL(sql, isTimestamp));
+				break;
+			}
+			case WIRE_TRUNCATE: {
+				int bytes = request.GetInt();
+				answer = DbWire(WIRE_TEXT);
+				answer.PutString(this->conn->TruncateSQL(sql, bytes));
+				break;
+			}
+			case WIRE_SORT: {
+				bool isText = request.GetByte() != 0;
+				bool isNullFirst = request.GetByte() != 0;
+				answer = DbWire(WIRE_TEXT);
+				answer.PutString(this->conn->SortSQL(sql, isText, isNullFirst));
+				break;
+			}
+			case WIRE_EXPLAIN:
+				answer = DbWire(WIRE_PLAN);
+				answer.PutPlan(this->conn->Explain(sql, request.GetParams()));
+				break;
+			default:
+				throw DbException( "Unknown request " + toString(request.Type()) + "." );
+		}
+		this->Answer(answer);
+	}
+
+	// after the session wrote anything its selects may read its own rows (e.g. the uploaded keys), so they are not cached
+	void Query(DbWire& request) {
+		double start = DbClock();
+		string sql = request.GetString();
+		vector<DbParam> params = request.GetParams();
+		vector<DbFetchType> fetchTypes(request.GetInt());
+		string key = this->key + "\n" + sql;
+		for(size_t i = 0; i < params.size(); i++) {
+			char number[32];
+			sprintf(number, "%.17g", params[i].number);
+			key += params[i].isNumber ? "\nn" + string(number) : "\ns" + params[i].text;
+		}
+		key += "\n";
+		for(size_t i = 0; i < fetchTypes.size(); i++) {
+			fetchTypes[i] = (DbFetchType)request.GetByte();
+			key += toString((int)fetchTypes[i]);
+		}
+		vector<DbWire> messages;
+		if( !this->isDirty && this->daemon->FindResult(key, messages) ) {
+			for(size_t i = 0; i < messages.size(); i++)
+				this->Answer(messages[i]);
+			this->Log("cached " + toString(DbClock() - start) + " s: " + sql.substr(0, 80));
+			return;
+		}
+		DwRowSender sender(this->socket, fetchTypes, this->isDirty ? 0 : this->daemon->MaxResultBytes());
+		try {
+			this->conn->SelectRows(&sender, sql, params, fetchTypes);
+		} catch( const DbException& ex ) {
+			// an error before the columns were sent answers the query, after them it ends the rows
+			this->Fail(ex);
+			return;
+		}
+		sender.End();
+		if( sender.IsComplete() )
+			this->daemon->StoreResult(key, sender.Messages(), sender.Bytes());
+		this->Log("queried " + toString(DbClock() - start) + " s: " + sql.substr(0, 80));
+	}
+
+	DwDaemon* daemon;
+	int socket;
+	int number;
+	string key; // the credentials
+	DbConnect* conn; // from the pool, NULL before hello
+	bool isDirty; // the session changed something in the database
+	bool isDone;
+	DwMonitor monitor;
+};
+
+
+// listen on the socket until killed, the finished sessions are freed when the next one comes
+int main(int argc, char* argv[]) {
+	if( argc < 2 ) {
+		printf("usage: dwused <socket> [-cache_mb %d] [-ttl %d] [-idle %d]\n", DEFAULT_CACHE_MB, DEFAULT_TTL, DEFAULT_IDLE);
+		return 1;
+	}
+	string path = argv[1];
+	int cacheMb = DEFAULT_CACHE_MB, ttl = DEFAULT_TTL, idle = DEFAULT_IDLE;
+	for(int i = 2; i + 1 < argc; i += 2) {
+		string arg = argv[i];
+		if( arg == "-cache_mb" ) cacheMb = atoi(argv[i+1]);
+		else if( arg == "-ttl" ) ttl = atoi(argv[i+1]);
+		else if( arg == "-idle" ) idle = atoi(argv[i+1]);
+		else {
+			printf("unknown option %s\n", argv[i]);
+			return 1;
+		}
+	}
+	// a plugin going away must not kill the daemon
+	signal(SIGPIPE, SIG_IGN);
+
+	struct sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if( path.size() >= sizeof(address.sun_path) ) {
+		printf("the socket path is too long\n");
+		return 1;
+	}
+	strcpy(address.sun_path, path.c_str());
+	int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	// the socket of a daemon that was killed is left behind
+	unlink(path.c_str());
+	if( listener < 0 || bind(listener, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(listener, 64) != 0 ) {
+		printf("could not listen on %s: %s\n", path.c_str(), strerror(errno));
+		return 1;
+	}
+	// every user of the host may connect, the database still asks for their own password
+	chmod(path.c_str(), 0777);
+	printf("dwused listening on %s, cache %d MB for %d s, %d idle connections for each login\n", path.c_str(), cacheMb, ttl, idle);
+	fflush(stdout);
+
+	DwDaemon daemon((size_t)cacheMb * 1024 * 1024, ttl, idle);
+	vector<DwSession*> sessions;
+	int number = 0;
+	while( true ) {
+		int client = accept(listener, NULL, NULL);
+		if( client < 0 ) {
+			if( errno == EINTR )
+				continue;
+			printf("accept failed: %s\n", strerror(errno));
+			break;
+		}
+		for(size_t i = 0; i < sessions.size(); ) {
+			if( sessions[i]->IsDone() ) {
+				delete sessions[i];
+				sessions.erase(sessions.begin() + i);
+			} else {
+				i++;
+			}
+		}
+		try {
+			sessions.push_back( new DwSession(&daemon, client, ++number) );
+		} catch( const DwUseException& ex ) {
+			printf("%s\n", ex.what());
+			close(client);
+		}
+		printf("%d sessions, %s\n", (int)sessions.size(), daemon.Summary().c_str());
+		fflush(stdout);
+	}
+	for(size_t i = 0; i < sessions.size(); i++)
+		delete sessions[i];
+	close(listener);
+	return 0;
+}